@@ -148,6 +148,10 @@ gboolean              glnx_set_object  (GObject **object_ptr,
 #define G_PID_FORMAT "i"
 #endif
 
+#ifndef G_SOURCE_FUNC  /* added in 2.58 */
+#define G_SOURCE_FUNC(f) ((GSourceFunc) (void (*) (void)) (f))
+#endif
+
 #if !GLIB_CHECK_VERSION(2, 60, 0)
 #define g_strv_equal _glnx_strv_equal
 gboolean _glnx_strv_equal (const gchar * const *strv1,
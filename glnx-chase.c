@@ -9,7 +9,10 @@
 #include "libglnx-config.h"
 
 #include <fcntl.h>
+#include <limits.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/mount.h>
 #include <sys/statfs.h>
 #include <sys/syscall.h>
@@ -46,60 +49,111 @@
 #define GLNX_CHASE_ALL_FLAGS \
   (GLNX_CHASE_ALL_DEBUG_FLAGS | GLNX_CHASE_ALL_REGULAR_FLAGS)
 
-typedef GQueue GlnxStatxQueue;
+/* The parts of a statx result which identify a directory on a mount, which
+ * is all we need to remember about the directories we walked through */
+typedef struct
+{
+  guint32 mode;
+  guint32 dev_major;
+  guint32 dev_minor;
+  guint64 ino;
+  guint64 mnt_id;
+} GlnxChaseInode;
 
 static void
-glnx_statx_queue_push (GlnxStatxQueue          *queue,
+glnx_chase_inode_init (GlnxChaseInode          *inode,
                        const struct glnx_statx *st)
 {
-  struct glnx_statx *copy;
+  g_assert ((st->stx_mask & (GLNX_STATX_TYPE | GLNX_STATX_INO)) ==
+            (GLNX_STATX_TYPE | GLNX_STATX_INO));
+  g_assert ((st->stx_mask & (GLNX_STATX_MNT_ID | GLNX_STATX_MNT_ID_UNIQUE)) != 0);
 
-  copy = g_memdup2 (st, sizeof (*st));
-  g_queue_push_tail (queue, copy);
+  inode->mode = st->stx_mode;
+  inode->dev_major = st->stx_dev_major;
+  inode->dev_minor = st->stx_dev_minor;
+  inode->ino = st->stx_ino;
+  inode->mnt_id = st->stx_mnt_id;
 }
 
-static void
-glnx_statx_queue_free_element (gpointer element,
-                               G_GNUC_UNUSED gpointer userdata)
+static gboolean
+glnx_chase_inode_same (const GlnxChaseInode *a,
+                       const GlnxChaseInode *b)
 {
-  g_free (element);
+  return ((a->mode ^ b->mode) & S_IFMT) == 0 &&
+         a->dev_major == b->dev_major &&
+         a->dev_minor == b->dev_minor &&
+         a->ino == b->ino;
 }
 
-static void
-glnx_statx_queue_free (GlnxStatxQueue *squeue)
+static gboolean
+glnx_chase_mount_same (const GlnxChaseInode *a,
+                       const GlnxChaseInode *b)
 {
-  GQueue *queue = (GQueue *) squeue;
+  return a->mnt_id == b->mnt_id;
+}
+
+/* Paths deeper than this (after resolving "..") spill to the heap */
+#define GLNX_CHASE_INODE_STACK_INLINE 64
+
+/* The directories from the chase root down to where we currently are */
+typedef struct
+{
+  guint len;
+  guint allocated;
+  GlnxChaseInode *heap;
+  GlnxChaseInode inline_items[GLNX_CHASE_INODE_STACK_INLINE];
+} GlnxChaseInodeStack;
+
+#define GLNX_CHASE_INODE_STACK_INIT { 0, GLNX_CHASE_INODE_STACK_INLINE, NULL, { { 0, }, } }
 
-  /* Same as g_queue_clear_full (queue, g_free), but works for <2.60 */
-  g_queue_foreach (queue, glnx_statx_queue_free_element, NULL);
-  g_queue_clear (queue);
+static void
+glnx_chase_inode_stack_clear (GlnxChaseInodeStack *stack)
+{
+  g_clear_pointer (&stack->heap, g_free);
+  stack->len = 0;
+  stack->allocated = GLNX_CHASE_INODE_STACK_INLINE;
 }
 
-G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(GlnxStatxQueue, glnx_statx_queue_free)
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(GlnxChaseInodeStack, glnx_chase_inode_stack_clear)
 
-static gboolean
-glnx_statx_inode_same (const struct glnx_statx *a,
-                       const struct glnx_statx *b)
+static GlnxChaseInode *
+glnx_chase_inode_stack_items (GlnxChaseInodeStack *stack)
 {
-  g_assert ((a->stx_mask & (GLNX_STATX_TYPE | GLNX_STATX_INO)) ==
-            (GLNX_STATX_TYPE | GLNX_STATX_INO));
-  g_assert ((b->stx_mask & (GLNX_STATX_TYPE | GLNX_STATX_INO)) ==
-            (GLNX_STATX_TYPE | GLNX_STATX_INO));
+  return stack->heap != NULL ? stack->heap : stack->inline_items;
+}
 
-  return ((a->stx_mode ^ b->stx_mode) & S_IFMT) == 0 &&
-         a->stx_dev_major == b->stx_dev_major &&
-         a->stx_dev_minor == b->stx_dev_minor &&
-         a->stx_ino == b->stx_ino;
+static void
+glnx_chase_inode_stack_push (GlnxChaseInodeStack  *stack,
+                             const GlnxChaseInode *inode)
+{
+  if (stack->len == stack->allocated)
+    {
+      if (stack->heap == NULL)
+        {
+          stack->heap = g_new (GlnxChaseInode, stack->allocated * 2);
+          memcpy (stack->heap, stack->inline_items, sizeof (stack->inline_items));
+        }
+      else
+        {
+          stack->heap = g_renew (GlnxChaseInode, stack->heap, stack->allocated * 2);
+        }
+      stack->allocated *= 2;
+    }
+
+  glnx_chase_inode_stack_items (stack)[stack->len++] = *inode;
 }
 
-static gboolean
-glnx_statx_mount_same (const struct glnx_statx *a,
-                       const struct glnx_statx *b)
+/* Returns the new top of the stack, or %NULL if it's empty */
+static const GlnxChaseInode *
+glnx_chase_inode_stack_pop (GlnxChaseInodeStack *stack)
 {
-  g_assert ((a->stx_mask & (GLNX_STATX_MNT_ID | GLNX_STATX_MNT_ID_UNIQUE)) != 0);
-  g_assert ((b->stx_mask & (GLNX_STATX_MNT_ID | GLNX_STATX_MNT_ID_UNIQUE)) != 0);
+  if (stack->len > 0)
+    stack->len--;
+
+  if (stack->len == 0)
+    return NULL;
 
-  return a->stx_mnt_id == b->stx_mnt_id;
+  return &glnx_chase_inode_stack_items (stack)[stack->len - 1];
 }
 
 static gboolean
@@ -128,6 +182,209 @@ glnx_chase_statx (int                 dfd,
   return TRUE;
 }
 
+/* The flags which influence how a path prefix resolves */
+#define GLNX_CHASE_CACHE_KEY_FLAGS \
+  (GLNX_CHASE_NO_AUTOMOUNT | \
+   GLNX_CHASE_RESOLVE_BENEATH | \
+   GLNX_CHASE_RESOLVE_IN_ROOT | \
+   GLNX_CHASE_RESOLVE_NO_SYMLINKS)
+
+/* Every cached directory keeps a file descriptor open, so forget
+ * everything once the cache gets this big */
+#define GLNX_CHASE_CACHE_MAX 128
+
+/* A directory which a path prefix has been resolved to */
+typedef struct
+{
+  GlnxChaseFlags flags;
+  const char *prefix;  /* Points to owned_prefix, except for lookup keys */
+  gsize len;
+  char *owned_prefix;
+  int fd;
+  /* The directories from the root down to and including this one, for
+   * checking ".." */
+  guint n_stack;
+  GlnxChaseInode *stack;
+} GlnxChaseCacheEntry;
+
+struct _GlnxChaseContext
+{
+  int dirfd;
+  int cwd_fd;
+  int root_fd;
+  GHashTable *cache;  /* set of GlnxChaseCacheEntry */
+};
+
+static guint
+glnx_chase_cache_entry_hash (gconstpointer v)
+{
+  const GlnxChaseCacheEntry *entry = v;
+  guint h = 5381 ^ entry->flags;
+
+  for (gsize i = 0; i < entry->len; i++)
+    h = (h << 5) + h + (guchar) entry->prefix[i];
+
+  return h;
+}
+
+static gboolean
+glnx_chase_cache_entry_equal (gconstpointer a,
+                              gconstpointer b)
+{
+  const GlnxChaseCacheEntry *entry_a = a;
+  const GlnxChaseCacheEntry *entry_b = b;
+
+  return entry_a->flags == entry_b->flags &&
+         entry_a->len == entry_b->len &&
+         memcmp (entry_a->prefix, entry_b->prefix, entry_a->len) == 0;
+}
+
+static void
+glnx_chase_cache_entry_free (GlnxChaseCacheEntry *entry)
+{
+  glnx_close_fd (&entry->fd);
+  g_free (entry->owned_prefix);
+  g_free (entry->stack);
+  g_free (entry);
+}
+
+static inline gboolean
+segment_is_dot_dot (const char *segment,
+                    gsize       len)
+{
+  return len == 2 && segment[0] == '.' && segment[1] == '.';
+}
+
+/* Remember that @prefix (the first @len bytes of a path, with no symlinks
+ * or ".." segments) resolved to the directory @fd.  @path_st describes the
+ * directories from the root down to @fd. */
+static void
+glnx_chase_cache_insert (GlnxChaseContext *ctx,
+                         GlnxChaseFlags    flags,
+                         const char       *prefix,
+                         gsize             len,
+                         int               fd,
+                         GlnxChaseInodeStack *path_st)
+{
+  GlnxChaseCacheEntry *entry;
+  int fd_copy;
+
+  if (g_hash_table_size (ctx->cache) >= GLNX_CHASE_CACHE_MAX)
+    g_hash_table_remove_all (ctx->cache);
+
+  fd_copy = fcntl (fd, F_DUPFD_CLOEXEC, 3);
+  if (fd_copy < 0)
+    {
+      /* It's just a cache, so don't fail the lookup; but if we're out of
+       * file descriptors, give back the ones the cache holds rather than
+       * leaving the caller short of them. */
+      if (errno == EMFILE || errno == ENFILE)
+        g_hash_table_remove_all (ctx->cache);
+      return;
+    }
+
+  entry = g_new0 (GlnxChaseCacheEntry, 1);
+  entry->flags = flags & GLNX_CHASE_CACHE_KEY_FLAGS;
+  entry->owned_prefix = g_strndup (prefix, len);
+  entry->prefix = entry->owned_prefix;
+  entry->len = len;
+  entry->fd = fd_copy;
+  entry->n_stack = path_st->len;
+  entry->stack = g_memdup2 (glnx_chase_inode_stack_items (path_st),
+                            sizeof (GlnxChaseInode) * path_st->len);
+
+  g_hash_table_replace (ctx->cache, entry, entry);
+}
+
+/* Find the longest prefix of @path which is cached and still resolves to
+ * the same directory (same inode on the same mount) when looked up from
+ * @root_fd.  Each segment is checked without following symlinks, relative
+ * to the cached directory of the previous one, so that a symlink swapped
+ * in for any of them can't take us outside of @root_fd.  Stale entries are
+ * dropped. */
+static GlnxChaseCacheEntry *
+glnx_chase_cache_lookup (GlnxChaseContext *ctx,
+                         int               root_fd,
+                         const char       *path,
+                         GlnxChaseFlags    flags)
+{
+  int no_automount = (flags & GLNX_CHASE_NO_AUTOMOUNT) != 0 ? AT_NO_AUTOMOUNT : 0;
+  GlnxChaseCacheEntry *found = NULL;
+  int parent_fd = root_fd;
+  gsize limit = strlen (path);
+  gsize pos = 0;
+
+  if (ctx == NULL || g_hash_table_size (ctx->cache) == 0)
+    return NULL;
+
+  /* Only directories get cached, so the last segment never is */
+  while (limit > 0 && !G_IS_DIR_SEPARATOR (path[limit - 1]))
+    limit--;
+  while (limit > 0 && G_IS_DIR_SEPARATOR (path[limit - 1]))
+    limit--;
+
+  while (pos < limit)
+    {
+      GlnxChaseCacheEntry key = { 0, };
+      GlnxChaseCacheEntry *entry;
+      const char *segment;
+      gsize segment_len;
+      char name[NAME_MAX + 1];
+      const GlnxChaseInode *cached_inode;
+      struct glnx_statx st;
+      GlnxChaseInode inode;
+
+      while (pos < limit && G_IS_DIR_SEPARATOR (path[pos]))
+        pos++;
+      segment = path + pos;
+      while (pos < limit && !G_IS_DIR_SEPARATOR (path[pos]))
+        pos++;
+      segment_len = path + pos - segment;
+
+      if (segment_len == 0 || (segment_len == 1 && segment[0] == '.'))
+        continue;
+      /* Nothing past a ".." gets cached */
+      if (segment_len > NAME_MAX || segment_is_dot_dot (segment, segment_len))
+        break;
+
+      key.flags = flags & GLNX_CHASE_CACHE_KEY_FLAGS;
+      key.prefix = path;
+      key.len = pos;
+      entry = g_hash_table_lookup (ctx->cache, &key);
+      if (entry == NULL)
+        break;
+
+      memcpy (name, segment, segment_len);
+      name[segment_len] = '\0';
+      cached_inode = &entry->stack[entry->n_stack - 1];
+
+      if (!glnx_statx (parent_fd, name, AT_SYMLINK_NOFOLLOW | no_automount,
+                       GLNX_STATX_TYPE | GLNX_STATX_INO |
+                       GLNX_STATX_MNT_ID | GLNX_STATX_MNT_ID_UNIQUE,
+                       &st, NULL) ||
+          (st.stx_mask & (GLNX_STATX_TYPE | GLNX_STATX_INO)) !=
+            (GLNX_STATX_TYPE | GLNX_STATX_INO) ||
+          (st.stx_mask & (GLNX_STATX_MNT_ID | GLNX_STATX_MNT_ID_UNIQUE)) == 0)
+        {
+          g_hash_table_remove (ctx->cache, entry);
+          break;
+        }
+
+      glnx_chase_inode_init (&inode, &st);
+      if (!glnx_chase_inode_same (&inode, cached_inode) ||
+          !glnx_chase_mount_same (&inode, cached_inode))
+        {
+          g_hash_table_remove (ctx->cache, entry);
+          break;
+        }
+
+      found = entry;
+      parent_fd = entry->fd;
+    }
+
+  return found;
+}
+
 /* TODO: procfs magiclinks handling */
 
 /* open_tree subset which transparently falls back to openat.
@@ -283,7 +540,8 @@ open_root (GlnxChaseFlags   flags,
 }
 
 /* This returns the next segment of a path and tells us if it is the last
- * segment.
+ * segment. The segment is not copied: it points into *remaining and is
+ * @out_len bytes long.
  *
  * Importantly, a segment is anything after a "/", even if it is empty  or ".".
  *
@@ -297,13 +555,13 @@ open_root (GlnxChaseFlags   flags,
  *   "///foo//bar/" -> "foo", "bar", ""
  *   "///foo//bar/." -> "foo", "bar", "."
  */
-static char *
+static const char *
 extract_next_segment (const char **remaining,
+                      gsize       *out_len,
                       gboolean    *is_last)
 {
   const char *r = *remaining;
   const char *s;
-  size_t len = 0;
 
   while (r[0] != '\0' && G_IS_DIR_SEPARATOR (r[0]))
     r++;
@@ -311,14 +569,12 @@ extract_next_segment (const char **remaining,
   s = r;
 
   while (r[0] != '\0' && !G_IS_DIR_SEPARATOR (r[0]))
-    {
-      r++;
-      len++;
-    }
+    r++;
 
+  *out_len = r - s;
   *is_last = (r[0] == '\0');
   *remaining = r;
-  return g_strndup (s, len);
+  return s;
 }
 
 /* This iterates over the segments of path and opens the corresponding
@@ -326,12 +582,17 @@ extract_next_segment (const char **remaining,
  * like RESOLVE_ semantics, without actually needing openat2.
  * It also allows us to implement features which openat2 does not have because
  * we're in full control over the resolving.
+ *
+ * Unless a symlink has to be followed, this doesn't allocate: segments are
+ * walked in place, and the directories we passed through are kept on a
+ * stack which only spills to the heap for very deep paths.
  */
 static int
-chase_manual (int              dirfd,
-              const char      *path,
-              GlnxChaseFlags   flags,
-              GError         **error)
+chase_manual (GlnxChaseContext  *ctx,
+              int                dirfd,
+              const char        *path,
+              GlnxChaseFlags     flags,
+              GError           **error)
 {
   gboolean is_absolute;
   g_autofree char *buffer = NULL;
@@ -342,8 +603,13 @@ chase_manual (int              dirfd,
   int fd;
   int remaining_follows = GLNX_CHASE_MAX;
   struct glnx_statx st;
-  g_auto(GlnxStatxQueue) path_st = G_QUEUE_INIT;
+  GlnxChaseInode inode;
+  g_auto(GlnxChaseInodeStack) path_st = GLNX_CHASE_INODE_STACK_INIT;
   int no_automount;
+  GlnxChaseCacheEntry *cached;
+  /* Whether the path walked so far is a prefix of @path without any ".."
+   * or symlinks, so that it can be cached */
+  gboolean literal = ctx != NULL;
 
   /* Take a shortcut if
    * - none of the resolve flags are set (they would require work here)
@@ -383,11 +649,17 @@ chase_manual (int              dirfd,
        * and a relative path is always relative. */
 
       /* In both cases we use dirfd as our chase root */
-      if (dirfd == AT_FDCWD)
+      if (dirfd == AT_FDCWD && ctx != NULL && ctx->cwd_fd >= 0)
+        {
+          root_fd = ctx->cwd_fd;
+        }
+      else if (dirfd == AT_FDCWD)
         {
           owned_root_fd = root_fd = open_cwd (flags, error);
           if (root_fd < 0)
             return -1;
+          if (ctx != NULL)
+            ctx->cwd_fd = g_steal_fd (&owned_root_fd);
         }
       else
         {
@@ -400,9 +672,18 @@ chase_manual (int              dirfd,
        * chase root */
       g_assert (is_absolute);
 
-      owned_root_fd = root_fd = open_root (flags, error);
-      if (root_fd < 0)
-        return -1;
+      if (ctx != NULL && ctx->root_fd >= 0)
+        {
+          root_fd = ctx->root_fd;
+        }
+      else
+        {
+          owned_root_fd = root_fd = open_root (flags, error);
+          if (root_fd < 0)
+            return -1;
+          if (ctx != NULL)
+            ctx->root_fd = g_steal_fd (&owned_root_fd);
+        }
     }
 
   /* At this point, we always have (a relative) path, relative to root_fd */
@@ -413,45 +694,71 @@ chase_manual (int              dirfd,
   if (!glnx_chase_statx (root_fd, no_automount, &st, error))
     return -1;
 
-  glnx_statx_queue_push (&path_st, &st);
+  glnx_chase_inode_init (&inode, &st);
+  glnx_chase_inode_stack_push (&path_st, &inode);
 
-  /* Let's start walking the path! */
-  buffer = g_strdup (path);
-  remaining = buffer;
+  /* Let's start walking the path! We only need our own copy of it once a
+   * symlink gets spliced in. */
+  remaining = path;
   fd = root_fd;
 
+  /* ...or skip ahead, if we've already been somewhere along it */
+  cached = glnx_chase_cache_lookup (ctx, root_fd, path, flags);
+  if (cached != NULL)
+    {
+      path_st.len = 0;
+      for (guint i = 0; i < cached->n_stack; i++)
+        glnx_chase_inode_stack_push (&path_st, &cached->stack[i]);
+
+      fd = cached->fd;
+      remaining = path + cached->len;
+    }
+
   for (;;)
     {
-      g_autofree char *segment = NULL;
+      const char *segment;
+      gsize segment_len;
+      char name[NAME_MAX + 1];
       gboolean is_last;
+      gboolean is_dot_dot;
       glnx_autofd int next_fd = -1;
 
-      segment = extract_next_segment (&remaining, &is_last);
+      segment = extract_next_segment (&remaining, &segment_len, &is_last);
 
       /* If we encounter an empty segment ("", "."), we stay where we are and
        * ignore the segment, or just exit if it is the last segment. */
-      if (g_strcmp0 (segment, "") == 0 || g_strcmp0 (segment, ".") == 0)
+      if (segment_len == 0 || (segment_len == 1 && segment[0] == '.'))
         {
           if (is_last)
             break;
           continue;
         }
 
+      if (segment_len > NAME_MAX)
+        {
+          errno = ENAMETOOLONG;
+          return glnx_fd_throw_errno_prefix (error, "path segment too long");
+        }
+
+      memcpy (name, segment, segment_len);
+      name[segment_len] = '\0';
+      is_dot_dot = segment_is_dot_dot (segment, segment_len);
+
       /* Special handling for going down the tree with RESOLVE_ flags */
-      if (g_strcmp0 (segment, "..") == 0)
+      if (is_dot_dot)
         {
           /* path_st contains the stat of the root if we're at root, so the
            * length is 1 in that case, and going lower than the root is not
            * allowed here! */
 
-          if (path_st.length <= 1 && (flags & GLNX_CHASE_RESOLVE_BENEATH) != 0)
+          if (path_st.len <= 1 && (flags & GLNX_CHASE_RESOLVE_BENEATH) != 0)
             {
               /* With RESOLVE_BENEATH, error out if we would end up above the
                * root fd */
               errno = EXDEV;
               return glnx_fd_throw_errno_prefix (error, "attempted to traverse above root path via \"..\"");
             }
-          else if (path_st.length <= 1 && (flags & GLNX_CHASE_RESOLVE_IN_ROOT) != 0)
+          else if (path_st.len <= 1 && (flags & GLNX_CHASE_RESOLVE_IN_ROOT) != 0)
             {
               /* With RESOLVE_IN_ROOT, we pretend that we hit the real root,
                * and stay there, just like the kernel does. */
@@ -467,7 +774,7 @@ chase_manual (int              dirfd,
           GLNX_CHASE_NOFOLLOW |
           (flags & (GLNX_CHASE_NO_AUTOMOUNT | GLNX_CHASE_ALL_DEBUG_FLAGS));
 
-        next_fd = chase_open_tree (fd, segment, open_tree_flags, error);
+        next_fd = chase_open_tree (fd, name, open_tree_flags, error);
         if (next_fd < 0)
           return -1;
       }
@@ -483,6 +790,8 @@ chase_manual (int              dirfd,
           g_autofree char *link = NULL;
           g_autofree char *new_buffer = NULL;
 
+          literal = FALSE;
+
           /* ...however, we do not resolve symlinks with NO_SYMLINKS, and use
            * remaining_follows to ensure we don't loop forever. */
           if ((flags & GLNX_CHASE_RESOLVE_NO_SYMLINKS) != 0 ||
@@ -508,7 +817,7 @@ chase_manual (int              dirfd,
            * dirfd. The path *remains* and absolute path internally, but that is
            * okay because we always interpret any path (even absolute ones) as
            * being relative to the dirfd */
-          new_buffer = g_strdup_printf ("%s/%s", link, remaining);
+          new_buffer = g_strconcat (link, "/", remaining, NULL);
           g_clear_pointer (&buffer, g_free);
           buffer = g_steal_pointer (&new_buffer);
           remaining = buffer;
@@ -538,9 +847,9 @@ chase_manual (int              dirfd,
               if (!glnx_chase_statx (fd, no_automount, &st, error))
                 return -1;
 
-              glnx_statx_queue_free (&path_st);
-              g_queue_init (&path_st);
-              glnx_statx_queue_push (&path_st, &st);
+              glnx_chase_inode_init (&inode, &st);
+              path_st.len = 0;
+              glnx_chase_inode_stack_push (&path_st, &inode);
             }
 
           continue;
@@ -549,17 +858,17 @@ chase_manual (int              dirfd,
       /* Either adds an element to path_st or removes one if we got down the
        * tree. This also checks that going down the tree ends up at the inode
        * we saw before (if we saw it before). */
-      if (g_strcmp0 (segment, "..") == 0)
+      glnx_chase_inode_init (&inode, &st);
+      if (is_dot_dot)
         {
-          g_autofree struct glnx_statx *old_tail = NULL;
-          struct glnx_statx *lower_st;
+          const GlnxChaseInode *lower;
 
-          old_tail = g_queue_pop_tail (&path_st);
+          literal = FALSE;
 
-          lower_st = g_queue_peek_tail (&path_st);
-          if (lower_st &&
-              (!glnx_statx_mount_same (&st, lower_st) ||
-               !glnx_statx_inode_same (&st, lower_st)))
+          lower = glnx_chase_inode_stack_pop (&path_st);
+          if (lower &&
+              (!glnx_chase_mount_same (&inode, lower) ||
+               !glnx_chase_inode_same (&inode, lower)))
             {
               errno = EXDEV;
               return glnx_fd_throw_errno_prefix (error, "a parent directory changed while traversing");
@@ -567,7 +876,7 @@ chase_manual (int              dirfd,
         }
       else
         {
-          glnx_statx_queue_push (&path_st, &st);
+          glnx_chase_inode_stack_push (&path_st, &inode);
         }
 
       /* There is still another path component, but the next fd is not a
@@ -582,6 +891,9 @@ chase_manual (int              dirfd,
       g_clear_fd (&owned_fd, NULL);
       fd = owned_fd = g_steal_fd (&next_fd);
 
+      if (literal && S_ISDIR (st.stx_mode))
+        glnx_chase_cache_insert (ctx, flags, path, remaining - path, fd, &path_st);
+
       if (is_last)
         break;
     }
@@ -602,32 +914,20 @@ chase_manual (int              dirfd,
   return g_steal_fd (&owned_fd);
 }
 
-/**
- * glnx_chaseat:
- * @dirfd: a directory file descriptor
- * @path: a path
- * @flags: combination of GlnxChaseFlags flags
- * @error: a #GError
- *
- * Behaves similar to openat, but with a number of differences:
- *
- * - All file descriptors which get returned are O_PATH and O_CLOEXEC. If you
- *   want to actually open the file for reading or writing, use glnx_fd_reopen,
- *   openat, or other at-style functions.
- * - By default, automounts get triggered and the O_PATH fd will point to inodes
- *   in the newly mounted filesystem if an automount is encountered. This can be
- *   turned off with GLNX_CHASE_NO_AUTOMOUNT.
- * - The GLNX_CHASE_RESOLVE_ flags can be used to safely deal with symlinks.
- *
- * Returns: the chased file, or -1 with @error set on error
- */
-int
-glnx_chaseat (int              dirfd,
-              const char      *path,
-              GlnxChaseFlags   flags,
-              GError         **error)
+/* How often openat2 with RESOLVE_CACHED could resolve a path from the dcache
+ * alone, and how often it had to fall back to a full lookup */
+static guint64 resolve_cached_hits;
+static guint64 resolve_cached_misses;
+
+static int
+chaseat_internal (GlnxChaseContext  *ctx,
+                  int                dirfd,
+                  const char        *path,
+                  GlnxChaseFlags     flags,
+                  GError           **error)
 {
   static gboolean can_openat2 = TRUE;
+  static gboolean can_resolve_cached = TRUE;
   glnx_autofd int fd = -1;
 
   g_return_val_if_fail (dirfd >= 0 || dirfd == AT_FDCWD, -1);
@@ -675,7 +975,27 @@ glnx_chaseat (int              dirfd,
         .resolve = openat2_resolve,
       };
 
-      fd = openat2 (dirfd, path, &how, sizeof (how));
+      /* Try to get away with only looking at the dcache first, which never
+       * blocks on I/O. RESOLVE_CACHED is Linux 5.12+, and older kernels
+       * reject it with EINVAL. */
+      if (can_resolve_cached)
+        {
+          how.resolve = openat2_resolve | RESOLVE_CACHED;
+          fd = openat2 (dirfd, path, &how, sizeof (how));
+          if (fd >= 0)
+            __atomic_add_fetch (&resolve_cached_hits, 1, __ATOMIC_RELAXED);
+          else if (errno == EAGAIN)
+            __atomic_add_fetch (&resolve_cached_misses, 1, __ATOMIC_RELAXED);
+          else if (errno == EINVAL)
+            can_resolve_cached = FALSE;
+          else if (!G_IN_SET (errno, ENOSYS, EPERM))
+            return glnx_fd_throw_errno (error);
+
+          how.resolve = openat2_resolve;
+        }
+
+      if (fd < 0)
+        fd = openat2 (dirfd, path, &how, sizeof (how));
       if (fd < 0)
         {
           /* If the syscall is not implemented (ENOSYS) or blocked by
@@ -690,7 +1010,7 @@ glnx_chaseat (int              dirfd,
 
   if (fd < 0)
     {
-      fd = chase_manual (dirfd, path, flags, error);
+      fd = chase_manual (ctx, dirfd, path, flags, error);
       if (fd < 0)
         return -1;
     }
@@ -744,6 +1064,227 @@ glnx_chaseat (int              dirfd,
   return g_steal_fd (&fd);
 }
 
+/**
+ * glnx_chaseat:
+ * @dirfd: a directory file descriptor
+ * @path: a path
+ * @flags: combination of GlnxChaseFlags flags
+ * @error: a #GError
+ *
+ * Behaves similar to openat, but with a number of differences:
+ *
+ * - All file descriptors which get returned are O_PATH and O_CLOEXEC. If you
+ *   want to actually open the file for reading or writing, use glnx_fd_reopen,
+ *   openat, or other at-style functions.
+ * - By default, automounts get triggered and the O_PATH fd will point to inodes
+ *   in the newly mounted filesystem if an automount is encountered. This can be
+ *   turned off with GLNX_CHASE_NO_AUTOMOUNT.
+ * - The GLNX_CHASE_RESOLVE_ flags can be used to safely deal with symlinks.
+ *
+ * Returns: the chased file, or -1 with @error set on error
+ */
+int
+glnx_chaseat (int              dirfd,
+              const char      *path,
+              GlnxChaseFlags   flags,
+              GError         **error)
+{
+  return chaseat_internal (NULL, dirfd, path, flags, error);
+}
+
+/**
+ * glnx_chase_context_new:
+ * @dirfd: a directory file descriptor
+ *
+ * Creates a resolver for paths relative to @dirfd, which must stay open for
+ * as long as the context is used.  Use glnx_chase_context_chaseat() to
+ * resolve paths with it.
+ *
+ * The context remembers the directories which path prefixes have resolved
+ * to, so that resolving many paths below the same directories doesn't walk
+ * the shared prefixes over and over again.  A remembered directory is only
+ * reused if looking up the prefix again still leads to the same inode on
+ * the same mount.  Each remembered directory keeps a file descriptor open,
+ * up to a small fixed number (currently 128) per context; they are closed
+ * by glnx_chase_context_free().
+ *
+ * If @dirfd is `AT_FDCWD`, it refers to the working directory at the time
+ * the context is first used.
+ *
+ * A context must not be used from several threads at the same time.
+ *
+ * Returns: (transfer full): a new #GlnxChaseContext
+ * Since: UNRELEASED
+ */
+GlnxChaseContext *
+glnx_chase_context_new (int dirfd)
+{
+  GlnxChaseContext *ctx;
+
+  g_return_val_if_fail (dirfd >= 0 || dirfd == AT_FDCWD, NULL);
+
+  ctx = g_new0 (GlnxChaseContext, 1);
+  ctx->dirfd = dirfd;
+  ctx->cwd_fd = -1;
+  ctx->root_fd = -1;
+  ctx->cache = g_hash_table_new_full (glnx_chase_cache_entry_hash,
+                                      glnx_chase_cache_entry_equal,
+                                      NULL,
+                                      (GDestroyNotify) glnx_chase_cache_entry_free);
+
+  return ctx;
+}
+
+/**
+ * glnx_chase_context_free:
+ * @ctx: (nullable): a #GlnxChaseContext
+ *
+ * Frees @ctx, and closes all file descriptors it holds.
+ *
+ * Since: UNRELEASED
+ */
+void
+glnx_chase_context_free (GlnxChaseContext *ctx)
+{
+  if (ctx == NULL)
+    return;
+
+  g_hash_table_unref (ctx->cache);
+  glnx_close_fd (&ctx->cwd_fd);
+  glnx_close_fd (&ctx->root_fd);
+  g_free (ctx);
+}
+
+/**
+ * glnx_chase_context_chaseat:
+ * @ctx: a #GlnxChaseContext
+ * @path: a path
+ * @flags: combination of GlnxChaseFlags flags
+ * @error: a #GError
+ *
+ * Like glnx_chaseat() on the directory @ctx was created for, but reusing
+ * directories found by previous calls where possible.
+ *
+ * Where openat2() can be used, the kernel resolves the whole path in one
+ * go, and the cache is not needed; it comes into play with
+ * %GLNX_CHASE_NO_AUTOMOUNT or on older kernels.
+ *
+ * Returns: the chased file, or -1 with @error set on error
+ * Since: UNRELEASED
+ */
+int
+glnx_chase_context_chaseat (GlnxChaseContext  *ctx,
+                            const char        *path,
+                            GlnxChaseFlags     flags,
+                            GError           **error)
+{
+  g_return_val_if_fail (ctx != NULL, -1);
+
+  return chaseat_internal (ctx, ctx->dirfd, path, flags, error);
+}
+
+typedef struct
+{
+  const char *path;
+  gsize idx;
+} GlnxChasePathEntry;
+
+static int
+chase_path_entry_compare (const void *a,
+                          const void *b)
+{
+  const GlnxChasePathEntry *entry_a = a;
+  const GlnxChasePathEntry *entry_b = b;
+
+  return strcmp (entry_a->path, entry_b->path);
+}
+
+/**
+ * glnx_chaseat_many:
+ * @dirfd: a directory file descriptor
+ * @paths: (array length=n_paths): paths to resolve
+ * @n_paths: number of elements in @paths
+ * @flags: combination of GlnxChaseFlags flags
+ * @out_fds: (out caller-allocates) (array length=n_paths): the chased files
+ * @error: a #GError
+ *
+ * Resolves each of @paths as with glnx_chaseat(), storing the resulting
+ * file descriptors in the corresponding elements of @out_fds.  The paths
+ * are resolved in sorted order through a shared #GlnxChaseContext, so
+ * common prefixes are only walked once.
+ *
+ * If any path fails to resolve, all file descriptors opened so far are
+ * closed, every element of @out_fds is set to -1, and %FALSE is returned.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_chaseat_many (int                  dirfd,
+                   const char * const  *paths,
+                   gsize                n_paths,
+                   GlnxChaseFlags       flags,
+                   int                 *out_fds,
+                   GError             **error)
+{
+  g_autoptr(GlnxChaseContext) ctx = NULL;
+  g_autofree GlnxChasePathEntry *sorted = NULL;
+
+  g_return_val_if_fail (paths != NULL || n_paths == 0, FALSE);
+  g_return_val_if_fail (out_fds != NULL || n_paths == 0, FALSE);
+
+  ctx = glnx_chase_context_new (dirfd);
+  if (ctx == NULL)
+    return FALSE;
+
+  sorted = g_new (GlnxChasePathEntry, n_paths);
+  for (gsize i = 0; i < n_paths; i++)
+    {
+      sorted[i].path = paths[i];
+      sorted[i].idx = i;
+      out_fds[i] = -1;
+    }
+  qsort (sorted, n_paths, sizeof (*sorted), chase_path_entry_compare);
+
+  for (gsize i = 0; i < n_paths; i++)
+    {
+      int fd = chaseat_internal (ctx, dirfd, sorted[i].path, flags, error);
+
+      if (fd < 0)
+        {
+          for (gsize j = 0; j < n_paths; j++)
+            glnx_close_fd (&out_fds[j]);
+          return glnx_prefix_error (error, "chasing %s", sorted[i].path);
+        }
+
+      out_fds[sorted[i].idx] = fd;
+    }
+
+  return TRUE;
+}
+
+/**
+ * glnx_chase_get_resolve_cached_stats:
+ * @out_hits: (out) (optional): number of paths resolved from the dcache
+ * @out_misses: (out) (optional): number of paths which needed a full lookup
+ *
+ * Where openat2() is available, glnx_chaseat() first tries to resolve paths
+ * with `RESOLVE_CACHED`, which only succeeds if everything needed is in the
+ * kernel's dentry cache, and otherwise falls back to a full lookup.  This
+ * returns how often each happened in this process so far.
+ *
+ * Since: UNRELEASED
+ */
+void
+glnx_chase_get_resolve_cached_stats (guint64 *out_hits,
+                                     guint64 *out_misses)
+{
+  if (out_hits)
+    *out_hits = __atomic_load_n (&resolve_cached_hits, __ATOMIC_RELAXED);
+  if (out_misses)
+    *out_misses = __atomic_load_n (&resolve_cached_misses, __ATOMIC_RELAXED);
+}
+
 /**
  * glnx_chase_and_statxat:
  * @dirfd: a directory file descriptor
@@ -787,3 +1328,294 @@ glnx_chase_and_statxat (int                 dirfd,
 
   return g_steal_fd (&fd);
 }
+
+/* Resolving can block for a long time on automounts or hung network
+ * filesystems, so async calls get their own pool rather than tying up
+ * GLib's shared one, and at most this many of them are in flight */
+#define GLNX_CHASE_ASYNC_MAX_THREADS 8
+
+typedef struct
+{
+  int dirfd;
+  char *path;
+  GlnxChaseFlags flags;
+  gboolean want_statx;
+  unsigned int mask;
+  struct glnx_statx statbuf;
+  GSource *cancel_source;
+  /* Set by whichever of the worker or the cancellation comes first, which
+   * then gets to return the task */
+  int completed;
+} GlnxChaseAsyncData;
+
+static void
+glnx_chase_async_data_free (GlnxChaseAsyncData *data)
+{
+  if (data->dirfd != AT_FDCWD)
+    glnx_close_fd (&data->dirfd);
+  g_free (data->path);
+  if (data->cancel_source)
+    {
+      g_source_destroy (data->cancel_source);
+      g_source_unref (data->cancel_source);
+    }
+  g_free (data);
+}
+
+static gboolean
+glnx_chase_async_try_complete (GlnxChaseAsyncData *data)
+{
+  int expected = FALSE;
+
+  return __atomic_compare_exchange_n (&data->completed, &expected, TRUE, FALSE,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static gboolean
+glnx_chase_async_cancelled (G_GNUC_UNUSED GCancellable *cancellable,
+                            gpointer                    user_data)
+{
+  GTask *task = user_data;
+  GlnxChaseAsyncData *data = g_task_get_task_data (task);
+
+  /* Don't wait for the worker, which may be stuck in the kernel; it will
+   * notice that it lost, and clean up after itself */
+  if (glnx_chase_async_try_complete (data))
+    g_task_return_error_if_cancelled (task);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+glnx_chase_async_worker (gpointer               task_ptr,
+                         G_GNUC_UNUSED gpointer user_data)
+{
+  g_autoptr(GTask) task = task_ptr;
+  GlnxChaseAsyncData *data = g_task_get_task_data (task);
+  GCancellable *cancellable = g_task_get_cancellable (task);
+  g_autoptr(GError) local_error = NULL;
+  glnx_autofd int fd = -1;
+
+  if (!g_cancellable_set_error_if_cancelled (cancellable, &local_error))
+    {
+      if (data->want_statx)
+        fd = glnx_chase_and_statxat (data->dirfd, data->path, data->flags,
+                                     data->mask, &data->statbuf, &local_error);
+      else
+        fd = glnx_chaseat (data->dirfd, data->path, data->flags, &local_error);
+    }
+
+  if (fd >= 0 && g_cancellable_set_error_if_cancelled (cancellable, &local_error))
+    glnx_close_fd (&fd);
+
+  if (data->cancel_source)
+    g_source_destroy (data->cancel_source);
+
+  if (!glnx_chase_async_try_complete (data))
+    return;
+
+  if (fd < 0)
+    g_task_return_error (task, g_steal_pointer (&local_error));
+  else
+    g_task_return_int (task, g_steal_fd (&fd));
+}
+
+static GThreadPool *
+glnx_chase_async_get_pool (void)
+{
+  static gsize initialized = 0;
+  static GThreadPool *pool = NULL;
+
+  if (g_once_init_enter (&initialized))
+    {
+      /* Can't fail with exclusive = FALSE */
+      pool = g_thread_pool_new (glnx_chase_async_worker, NULL,
+                                GLNX_CHASE_ASYNC_MAX_THREADS, FALSE, NULL);
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return pool;
+}
+
+static void
+chaseat_async_internal (int                  dirfd,
+                        const char          *path,
+                        GlnxChaseFlags       flags,
+                        gboolean             want_statx,
+                        unsigned int         mask,
+                        GCancellable        *cancellable,
+                        GAsyncReadyCallback  callback,
+                        gpointer             user_data,
+                        gpointer             source_tag)
+{
+  g_autoptr(GTask) task = NULL;
+  GlnxChaseAsyncData *data;
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, source_tag);
+  /* Cancellation is dealt with by us, so a result which made it in before
+   * the cancellation is never thrown away (and leaked) */
+  g_task_set_check_cancellable (task, FALSE);
+
+  data = g_new0 (GlnxChaseAsyncData, 1);
+  data->dirfd = AT_FDCWD;
+  data->path = g_strdup (path);
+  data->flags = flags;
+  data->want_statx = want_statx;
+  data->mask = mask;
+  g_task_set_task_data (task, data, (GDestroyNotify) glnx_chase_async_data_free);
+
+  /* The caller is free to close dirfd once it got a result, which can be
+   * before the worker is done with it if it's cancelled */
+  if (dirfd != AT_FDCWD)
+    {
+      data->dirfd = fcntl (dirfd, F_DUPFD_CLOEXEC, 3);
+      if (data->dirfd < 0)
+        {
+          g_autoptr(GError) local_error = NULL;
+
+          data->dirfd = AT_FDCWD;
+          glnx_throw_errno_prefix (&local_error, "fcntl(F_DUPFD_CLOEXEC)");
+          g_task_return_error (task, g_steal_pointer (&local_error));
+          return;
+        }
+    }
+
+  if (cancellable != NULL)
+    {
+      data->cancel_source = g_cancellable_source_new (cancellable);
+      g_source_set_priority (data->cancel_source, g_task_get_priority (task));
+      g_source_set_callback (data->cancel_source,
+                             G_SOURCE_FUNC (glnx_chase_async_cancelled),
+                             g_object_ref (task), g_object_unref);
+      g_source_attach (data->cancel_source, g_task_get_context (task));
+    }
+
+  g_thread_pool_push (glnx_chase_async_get_pool (), g_steal_pointer (&task), NULL);
+}
+
+/**
+ * glnx_chaseat_async:
+ * @dirfd: a directory file descriptor
+ * @path: a path
+ * @flags: combination of GlnxChaseFlags flags
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback
+ * @user_data: data for @callback
+ *
+ * Asynchronous version of glnx_chaseat().  The path is resolved on a
+ * thread pool dedicated to this, which has a limited number of threads, so
+ * that lookups which hang (for example on an unresponsive network
+ * filesystem) don't hold up anything else.
+ *
+ * Cancelling @cancellable completes the operation with
+ * %G_IO_ERROR_CANCELLED right away, even if the lookup itself is still
+ * blocked.
+ *
+ * @dirfd is duplicated, and doesn't need to be kept open.
+ *
+ * Since: UNRELEASED
+ */
+void
+glnx_chaseat_async (int                  dirfd,
+                    const char          *path,
+                    GlnxChaseFlags       flags,
+                    GCancellable        *cancellable,
+                    GAsyncReadyCallback  callback,
+                    gpointer             user_data)
+{
+  g_return_if_fail (dirfd >= 0 || dirfd == AT_FDCWD);
+  g_return_if_fail (path != NULL);
+  g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+  chaseat_async_internal (dirfd, path, flags, FALSE, 0,
+                          cancellable, callback, user_data,
+                          glnx_chaseat_async);
+}
+
+/**
+ * glnx_chaseat_finish:
+ * @result: a #GAsyncResult
+ * @error: a #GError
+ *
+ * Finishes an operation started with glnx_chaseat_async().
+ *
+ * Returns: the chased file, or -1 with @error set on error
+ *
+ * Since: UNRELEASED
+ */
+int
+glnx_chaseat_finish (GAsyncResult  *result,
+                     GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), -1);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) == glnx_chaseat_async, -1);
+
+  return g_task_propagate_int (G_TASK (result), error);
+}
+
+/**
+ * glnx_chase_and_statxat_async:
+ * @dirfd: a directory file descriptor
+ * @path: a path
+ * @flags: combination of GlnxChaseFlags flags
+ * @mask: combination of GLNX_STATX_ flags
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback
+ * @user_data: data for @callback
+ *
+ * Asynchronous version of glnx_chase_and_statxat(), which otherwise
+ * behaves like glnx_chaseat_async().
+ *
+ * Since: UNRELEASED
+ */
+void
+glnx_chase_and_statxat_async (int                  dirfd,
+                              const char          *path,
+                              GlnxChaseFlags       flags,
+                              unsigned int         mask,
+                              GCancellable        *cancellable,
+                              GAsyncReadyCallback  callback,
+                              gpointer             user_data)
+{
+  g_return_if_fail (dirfd >= 0 || dirfd == AT_FDCWD);
+  g_return_if_fail (path != NULL);
+  g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+  chaseat_async_internal (dirfd, path, flags, TRUE, mask,
+                          cancellable, callback, user_data,
+                          glnx_chase_and_statxat_async);
+}
+
+/**
+ * glnx_chase_and_statxat_finish:
+ * @result: a #GAsyncResult
+ * @statbuf: a pointer to a struct glnx_statx which will be filled out
+ * @error: a #GError
+ *
+ * Finishes an operation started with glnx_chase_and_statxat_async().
+ *
+ * Returns: the chased file, or -1 with @error set on error
+ *
+ * Since: UNRELEASED
+ */
+int
+glnx_chase_and_statxat_finish (GAsyncResult       *result,
+                               struct glnx_statx  *statbuf,
+                               GError            **error)
+{
+  GlnxChaseAsyncData *data;
+  int fd;
+
+  g_return_val_if_fail (g_task_is_valid (result, NULL), -1);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) == glnx_chase_and_statxat_async, -1);
+  g_return_val_if_fail (statbuf != NULL, -1);
+
+  fd = g_task_propagate_int (G_TASK (result), error);
+  if (fd < 0)
+    return -1;
+
+  data = g_task_get_task_data (G_TASK (result));
+  *statbuf = data->statbuf;
+  return fd;
+}
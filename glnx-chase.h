@@ -7,6 +7,7 @@
 #pragma once
 
 #include <glib.h>
+#include <gio/gio.h>
 
 #include <glnx-missing.h>
 
@@ -43,6 +44,29 @@ int glnx_chaseat (int              dirfd,
                   GlnxChaseFlags   flags,
                   GError         **error);
 
+typedef struct _GlnxChaseContext GlnxChaseContext;
+
+GlnxChaseContext *glnx_chase_context_new (int dirfd);
+
+void glnx_chase_context_free (GlnxChaseContext *ctx);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GlnxChaseContext, glnx_chase_context_free)
+
+int glnx_chase_context_chaseat (GlnxChaseContext  *ctx,
+                                const char        *path,
+                                GlnxChaseFlags     flags,
+                                GError           **error);
+
+gboolean glnx_chaseat_many (int                  dirfd,
+                            const char * const  *paths,
+                            gsize                n_paths,
+                            GlnxChaseFlags       flags,
+                            int                 *out_fds,
+                            GError             **error);
+
+void glnx_chase_get_resolve_cached_stats (guint64 *out_hits,
+                                          guint64 *out_misses);
+
 int glnx_chase_and_statxat (int                 dirfd,
                             const char         *path,
                             GlnxChaseFlags      flags,
@@ -50,4 +74,26 @@ int glnx_chase_and_statxat (int                 dirfd,
                             struct glnx_statx  *statbuf,
                             GError            **error);
 
+void glnx_chaseat_async (int                  dirfd,
+                         const char          *path,
+                         GlnxChaseFlags       flags,
+                         GCancellable        *cancellable,
+                         GAsyncReadyCallback  callback,
+                         gpointer             user_data);
+
+int glnx_chaseat_finish (GAsyncResult  *result,
+                         GError       **error);
+
+void glnx_chase_and_statxat_async (int                  dirfd,
+                                   const char          *path,
+                                   GlnxChaseFlags       flags,
+                                   unsigned int         mask,
+                                   GCancellable        *cancellable,
+                                   GAsyncReadyCallback  callback,
+                                   gpointer             user_data);
+
+int glnx_chase_and_statxat_finish (GAsyncResult       *result,
+                                   struct glnx_statx  *statbuf,
+                                   GError            **error);
+
 G_END_DECLS
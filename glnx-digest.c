@@ -0,0 +1,350 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include "libglnx-config.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_SSE42 1
+#elif defined(__aarch64__) && defined(__GNUC__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define HAVE_CRC32C_ARM64 1
+#endif
+
+#include <glnx-digest.h>
+
+/* Reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82F63B78U
+
+/* Tables for the portable implementation, which processes 8 bytes at a
+ * time ("slicing-by-8") */
+static guint32 crc32c_table[8][256];
+
+static void
+crc32c_init_table (void)
+{
+  for (guint i = 0; i < 256; i++)
+    {
+      guint32 crc = i;
+
+      for (guint j = 0; j < 8; j++)
+        crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+      crc32c_table[0][i] = crc;
+    }
+
+  for (guint i = 0; i < 256; i++)
+    for (guint k = 1; k < 8; k++)
+      crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^
+                           crc32c_table[0][crc32c_table[k - 1][i] & 0xff];
+}
+
+static guint32
+crc32c_sw (guint32       crc,
+           const guint8 *p,
+           gsize         len)
+{
+  while (len > 0 && ((guintptr) p & 7) != 0)
+    {
+      crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+      len--;
+    }
+
+  while (len >= 8)
+    {
+      guint64 v;
+
+      memcpy (&v, p, sizeof (v));
+      v = GUINT64_TO_LE (v) ^ crc;
+      crc = crc32c_table[7][v & 0xff] ^
+            crc32c_table[6][(v >> 8) & 0xff] ^
+            crc32c_table[5][(v >> 16) & 0xff] ^
+            crc32c_table[4][(v >> 24) & 0xff] ^
+            crc32c_table[3][(v >> 32) & 0xff] ^
+            crc32c_table[2][(v >> 40) & 0xff] ^
+            crc32c_table[1][(v >> 48) & 0xff] ^
+            crc32c_table[0][v >> 56];
+      p += 8;
+      len -= 8;
+    }
+
+  while (len > 0)
+    {
+      crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+      len--;
+    }
+
+  return crc;
+}
+
+#if defined(HAVE_CRC32C_SSE42)
+__attribute__((target ("sse4.2")))
+static guint32
+crc32c_hw (guint32       crc,
+           const guint8 *p,
+           gsize         len)
+{
+  guint64 crc64;
+
+  while (len > 0 && ((guintptr) p & 7) != 0)
+    {
+      crc = _mm_crc32_u8 (crc, *p++);
+      len--;
+    }
+
+  crc64 = crc;
+  while (len >= 8)
+    {
+      guint64 v;
+
+      memcpy (&v, p, sizeof (v));
+      crc64 = _mm_crc32_u64 (crc64, v);
+      p += 8;
+      len -= 8;
+    }
+  crc = (guint32) crc64;
+
+  while (len > 0)
+    {
+      crc = _mm_crc32_u8 (crc, *p++);
+      len--;
+    }
+
+  return crc;
+}
+
+static gboolean
+crc32c_hw_supported (void)
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("sse4.2");
+}
+#elif defined(HAVE_CRC32C_ARM64)
+__attribute__((target ("+crc")))
+static guint32
+crc32c_hw (guint32       crc,
+           const guint8 *p,
+           gsize         len)
+{
+  while (len > 0 && ((guintptr) p & 7) != 0)
+    {
+      crc = __crc32cb (crc, *p++);
+      len--;
+    }
+
+  while (len >= 8)
+    {
+      guint64 v;
+
+      memcpy (&v, p, sizeof (v));
+      crc = __crc32cd (crc, v);
+      p += 8;
+      len -= 8;
+    }
+
+  while (len > 0)
+    {
+      crc = __crc32cb (crc, *p++);
+      len--;
+    }
+
+  return crc;
+}
+
+static gboolean
+crc32c_hw_supported (void)
+{
+  return (getauxval (AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+/**
+ * glnx_crc32c:
+ * @crc: The checksum of the preceding data, or 0 to start
+ * @buf: (array length=len): Data
+ * @len: Length of @buf
+ *
+ * Compute the CRC-32C (Castagnoli) checksum of @buf, continuing from @crc,
+ * like zlib's crc32() does for the IEEE polynomial.  The CPU's CRC
+ * instructions are used if available (SSE 4.2 on x86-64, the CRC
+ * extension on AArch64).
+ *
+ * Returns: The updated checksum
+ * Since: UNRELEASED
+ */
+guint32
+glnx_crc32c (guint32     crc,
+             const void *buf,
+             gsize       len)
+{
+  static gsize initialized = 0;
+  static gboolean use_hw = FALSE;
+
+  if (g_once_init_enter (&initialized))
+    {
+#if defined(HAVE_CRC32C_SSE42) || defined(HAVE_CRC32C_ARM64)
+      use_hw = crc32c_hw_supported ();
+#endif
+      if (!use_hw)
+        crc32c_init_table ();
+      g_once_init_leave (&initialized, 1);
+    }
+
+#if defined(HAVE_CRC32C_SSE42) || defined(HAVE_CRC32C_ARM64)
+  if (use_hw)
+    return ~crc32c_hw (~crc, buf, len);
+#endif
+
+  return ~crc32c_sw (~crc, buf, len);
+}
+
+/**
+ * glnx_digest_init:
+ * @digest: A #GLnxDigest
+ * @types: Which digests to compute
+ *
+ * Initialize @digest to compute @types over the data passed to
+ * glnx_digest_update().  The size of the data is always counted.
+ *
+ * Since: UNRELEASED
+ */
+void
+glnx_digest_init (GLnxDigest      *digest,
+                  GLnxDigestTypes  types)
+{
+  memset (digest, 0, sizeof (*digest));
+  digest->initialized = TRUE;
+  digest->types = types;
+  if (types & GLNX_DIGEST_SHA256)
+    digest->sha256 = g_checksum_new (G_CHECKSUM_SHA256);
+}
+
+/**
+ * glnx_digest_update:
+ * @digest: A #GLnxDigest
+ * @buf: (array length=len): Data
+ * @len: Length of @buf
+ *
+ * Feed @buf into all the digests of @digest.  This must not be called
+ * once a digest has been retrieved.
+ *
+ * Since: UNRELEASED
+ */
+void
+glnx_digest_update (GLnxDigest *digest,
+                    const void *buf,
+                    gsize       len)
+{
+  g_return_if_fail (digest->initialized);
+
+  if (digest->sha256 != NULL)
+    {
+      const guint8 *p = buf;
+      gsize remaining = len;
+
+      /* g_checksum_update() takes a gssize */
+      while (remaining > 0)
+        {
+          gsize n = MIN (remaining, G_MAXSSIZE);
+
+          g_checksum_update (digest->sha256, p, n);
+          p += n;
+          remaining -= n;
+        }
+    }
+  if (digest->types & GLNX_DIGEST_CRC32C)
+    digest->crc32c = glnx_crc32c (digest->crc32c, buf, len);
+  digest->size += len;
+}
+
+/**
+ * glnx_digest_clear:
+ * @digest: A #GLnxDigest
+ *
+ * Free the resources held by @digest.  It may be initialized again after
+ * this.  Clearing a zero-filled #GLnxDigest is allowed.
+ *
+ * Since: UNRELEASED
+ */
+void
+glnx_digest_clear (GLnxDigest *digest)
+{
+  if (!digest->initialized)
+    return;
+
+  g_clear_pointer (&digest->sha256, g_checksum_free);
+  digest->initialized = FALSE;
+}
+
+/**
+ * glnx_digest_get_size:
+ * @digest: A #GLnxDigest
+ *
+ * Returns: The number of bytes passed to glnx_digest_update() so far
+ * Since: UNRELEASED
+ */
+guint64
+glnx_digest_get_size (GLnxDigest *digest)
+{
+  return digest->size;
+}
+
+/**
+ * glnx_digest_get_sha256:
+ * @digest: A #GLnxDigest initialized with %GLNX_DIGEST_SHA256
+ * @out_buf: (out caller-allocates) (array fixed-size=32): Return location
+ *   for the %GLNX_DIGEST_SHA256_LEN bytes of the digest
+ *
+ * Get the SHA-256 digest of the data so far.
+ *
+ * Since: UNRELEASED
+ */
+void
+glnx_digest_get_sha256 (GLnxDigest *digest,
+                        guint8     *out_buf)
+{
+  gsize len = GLNX_DIGEST_SHA256_LEN;
+
+  g_return_if_fail (digest->sha256 != NULL);
+
+  g_checksum_get_digest (digest->sha256, out_buf, &len);
+  g_assert (len == GLNX_DIGEST_SHA256_LEN);
+}
+
+/**
+ * glnx_digest_get_sha256_string:
+ * @digest: A #GLnxDigest initialized with %GLNX_DIGEST_SHA256
+ *
+ * Get the SHA-256 digest of the data so far, in hexadecimal.
+ *
+ * Returns: (transfer none): The digest, owned by @digest
+ * Since: UNRELEASED
+ */
+const char *
+glnx_digest_get_sha256_string (GLnxDigest *digest)
+{
+  g_return_val_if_fail (digest->sha256 != NULL, NULL);
+
+  return g_checksum_get_string (digest->sha256);
+}
+
+/**
+ * glnx_digest_get_crc32c:
+ * @digest: A #GLnxDigest initialized with %GLNX_DIGEST_CRC32C
+ *
+ * Returns: The CRC-32C checksum of the data so far
+ * Since: UNRELEASED
+ */
+guint32
+glnx_digest_get_crc32c (GLnxDigest *digest)
+{
+  g_return_val_if_fail (digest->types & GLNX_DIGEST_CRC32C, 0);
+
+  return digest->crc32c;
+}
@@ -0,0 +1,70 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include <glnx-backport-autocleanups.h>
+#include <glnx-macros.h>
+
+G_BEGIN_DECLS
+
+/**
+ * GLnxDigestTypes:
+ * @GLNX_DIGEST_NONE: Only count the size
+ * @GLNX_DIGEST_SHA256: Compute a SHA-256 digest
+ * @GLNX_DIGEST_CRC32C: Compute a CRC-32C (Castagnoli) checksum
+ *
+ * The digests a #GLnxDigest computes.
+ */
+typedef enum {
+  GLNX_DIGEST_NONE = 0,
+  GLNX_DIGEST_SHA256 = (1 << 0),
+  GLNX_DIGEST_CRC32C = (1 << 1),
+} GLnxDigestTypes;
+
+#define GLNX_DIGEST_SHA256_LEN 32
+
+/**
+ * GLnxDigest:
+ *
+ * Computes one or more digests of a stream of data in a single pass.
+ * Initialize with glnx_digest_init(), and clear with glnx_digest_clear(),
+ * or use `g_auto(GLnxDigest)`.
+ */
+typedef struct {
+  /*< private >*/
+  gboolean initialized;
+  GLnxDigestTypes types;
+  GChecksum *sha256;
+  guint32 crc32c;
+  guint64 size;
+} GLnxDigest;
+
+void glnx_digest_init (GLnxDigest      *digest,
+                       GLnxDigestTypes  types);
+
+void glnx_digest_update (GLnxDigest *digest,
+                         const void *buf,
+                         gsize       len);
+
+void glnx_digest_clear (GLnxDigest *digest);
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (GLnxDigest, glnx_digest_clear)
+
+guint64 glnx_digest_get_size (GLnxDigest *digest);
+
+void glnx_digest_get_sha256 (GLnxDigest *digest,
+                             guint8     *out_buf);
+
+const char *glnx_digest_get_sha256_string (GLnxDigest *digest);
+
+guint32 glnx_digest_get_crc32c (GLnxDigest *digest);
+
+guint32 glnx_crc32c (guint32     crc,
+                     const void *buf,
+                     gsize       len);
+
+G_END_DECLS
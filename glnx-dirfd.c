@@ -21,7 +21,11 @@
 
 #include "libglnx-config.h"
 
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include <glnx-dirfd.h>
 #include <glnx-fdio.h>
@@ -75,13 +79,33 @@ glnx_opendirat (int             dfd,
   return TRUE;
 }
 
+/* Directory contents buffered for GLNX_DIRFD_ITERATOR_FLAGS_SORT_BY_INODE */
+typedef struct
+{
+  struct dirent **entries;
+  guint n_entries;
+  guint next;
+  guint8 *storage;
+} GLnxDirfdSortedEntries;
+
 struct GLnxRealDirfdIterator
 {
   gboolean initialized;
   int fd;
   DIR *d;
+  GLnxDirFdIteratorFlags flags;
+  GLnxDirfdSortedEntries *sorted;
 };
 typedef struct GLnxRealDirfdIterator GLnxRealDirfdIterator;
+G_STATIC_ASSERT (sizeof (GLnxRealDirfdIterator) <= sizeof (GLnxDirFdIterator));
+
+static void
+glnx_dirfd_sorted_entries_free (GLnxDirfdSortedEntries *sorted)
+{
+  g_free (sorted->entries);
+  g_free (sorted->storage);
+  g_free (sorted);
+}
 
 /**
  * glnx_dirfd_iterator_init_at:
@@ -131,11 +155,103 @@ glnx_dirfd_iterator_init_take_fd (int               *dfd,
 
   real_dfd_iter->fd = g_steal_fd (dfd);
   real_dfd_iter->d = d;
+  real_dfd_iter->flags = GLNX_DIRFD_ITERATOR_FLAGS_NONE;
+  real_dfd_iter->sorted = NULL;
   real_dfd_iter->initialized = TRUE;
 
   return TRUE;
 }
 
+/**
+ * glnx_dirfd_iterator_set_flags:
+ * @dfd_iter: A directory iterator
+ * @flags: Flags
+ *
+ * Change how @dfd_iter behaves.  This must be called before reading any
+ * entries, or right after glnx_dirfd_iterator_rewind().
+ *
+ * Since: UNRELEASED
+ */
+void
+glnx_dirfd_iterator_set_flags (GLnxDirFdIterator      *dfd_iter,
+                               GLnxDirFdIteratorFlags  flags)
+{
+  GLnxRealDirfdIterator *real_dfd_iter = (GLnxRealDirfdIterator*) dfd_iter;
+
+  g_return_if_fail (dfd_iter->initialized);
+  g_return_if_fail (real_dfd_iter->sorted == NULL);
+
+  real_dfd_iter->flags = flags;
+}
+
+static int
+compare_dirent_ino (const void *a,
+                    const void *b)
+{
+  const struct dirent *dent_a = *(const struct dirent **) a;
+  const struct dirent *dent_b = *(const struct dirent **) b;
+
+  if (dent_a->d_ino < dent_b->d_ino)
+    return -1;
+  return dent_a->d_ino > dent_b->d_ino;
+}
+
+/* Read the rest of the directory, and sort it by inode number */
+static gboolean
+dirfd_iterator_load_sorted (GLnxRealDirfdIterator  *real_dfd_iter,
+                            GCancellable           *cancellable,
+                            GError                **error)
+{
+  const gsize buf_size = 32 * 1024;
+  g_autofree char *buf = g_malloc (buf_size);
+  g_autoptr(GByteArray) storage = g_byte_array_new ();
+  g_autoptr(GArray) offsets = g_array_new (FALSE, FALSE, sizeof (gsize));
+  GLnxDirfdSortedEntries *sorted;
+
+  while (TRUE)
+    {
+      GLnxDirent64 *dent64;
+      gsize len;
+      gsize offset = 0;
+
+      if (!glnx_dirfd_iterator_next_batch ((GLnxDirFdIterator *) real_dfd_iter,
+                                           buf, buf_size, &len, cancellable, error))
+        return FALSE;
+      if (len == 0)
+        break;
+
+      while ((dent64 = glnx_dirent64_batch_next (buf, len, &offset)) != NULL)
+        {
+          gsize namelen = strlen (dent64->d_name);
+          /* Only as long as needed for the name, like readdir() does */
+          gsize reclen = (offsetof (struct dirent, d_name) + namelen + 1 + 7) & ~((gsize) 7);
+          gsize pos = storage->len;
+          struct dirent *dent;
+
+          g_byte_array_set_size (storage, pos + reclen);
+          dent = (struct dirent *) (storage->data + pos);
+          dent->d_ino = dent64->d_ino;
+          dent->d_off = dent64->d_off;
+          dent->d_reclen = reclen;
+          dent->d_type = dent64->d_type;
+          memcpy (dent->d_name, dent64->d_name, namelen + 1);
+
+          g_array_append_val (offsets, pos);
+        }
+    }
+
+  sorted = g_new0 (GLnxDirfdSortedEntries, 1);
+  sorted->n_entries = offsets->len;
+  sorted->storage = g_byte_array_free (g_steal_pointer (&storage), FALSE);
+  sorted->entries = g_new (struct dirent *, MAX (sorted->n_entries, 1));
+  for (guint i = 0; i < sorted->n_entries; i++)
+    sorted->entries[i] = (struct dirent *) (sorted->storage + g_array_index (offsets, gsize, i));
+  qsort (sorted->entries, sorted->n_entries, sizeof (struct dirent *), compare_dirent_ino);
+
+  real_dfd_iter->sorted = sorted;
+  return TRUE;
+}
+
 /**
  * glnx_dirfd_iterator_next_dent:
  * @dfd_iter: A directory iterator
@@ -161,6 +277,23 @@ glnx_dirfd_iterator_next_dent (GLnxDirFdIterator  *dfd_iter,
   if (g_cancellable_set_error_if_cancelled (cancellable, error))
     return FALSE;
 
+  if (real_dfd_iter->flags & GLNX_DIRFD_ITERATOR_FLAGS_SORT_BY_INODE)
+    {
+      GLnxDirfdSortedEntries *sorted;
+
+      if (real_dfd_iter->sorted == NULL &&
+          !dirfd_iterator_load_sorted (real_dfd_iter, cancellable, error))
+        return FALSE;
+
+      sorted = real_dfd_iter->sorted;
+      if (sorted->next < sorted->n_entries)
+        *out_dent = sorted->entries[sorted->next++];
+      else
+        *out_dent = NULL;
+
+      return TRUE;
+    }
+
   do
     {
       errno = 0;
@@ -189,9 +322,79 @@ glnx_dirfd_iterator_rewind (GLnxDirFdIterator  *dfd_iter)
 
   g_return_if_fail (dfd_iter->initialized);
 
+  g_clear_pointer (&real_dfd_iter->sorted, glnx_dirfd_sorted_entries_free);
   rewinddir (real_dfd_iter->d);
 }
 
+/**
+ * glnx_dirfd_iterator_next_batch:
+ * @dfd_iter: A directory iterator
+ * @buf: (out caller-allocates): Buffer to fill with directory entries,
+ *   aligned to 8 bytes
+ * @buf_size: Size of @buf; should be at least a few kilobytes, and larger
+ *   buffers mean fewer system calls for large directories
+ * @out_len: (out): Number of bytes of @buf that were filled in
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Read as many directory entries as fit in @buf with a single `getdents64`
+ * system call, bypassing the libc `readdir()` buffer.  Use
+ * glnx_dirent64_batch_next() to iterate over the #GLnxDirent64 records in
+ * the result, which also skips `.` and `..`.  If end of stream is reached,
+ * @out_len will be set to 0 and %TRUE will be returned.
+ *
+ * The records contain 64-bit fields, so @buf must be 8-byte aligned, as
+ * memory from g_malloc() or an array of #guint64 is; a plain `char` array
+ * may not be.
+ *
+ * The contents of @buf are not modified until the next call.  This must
+ * not be mixed with glnx_dirfd_iterator_next_dent() on the same iterator,
+ * except by calling glnx_dirfd_iterator_rewind() in between.
+ *
+ * ```
+ * guint64 buf[4096 / sizeof (guint64)];
+ * gsize len, offset = 0;
+ * GLnxDirent64 *dent;
+ *
+ * if (!glnx_dirfd_iterator_next_batch (&dfd_iter, buf, sizeof (buf), &len,
+ *                                      cancellable, error))
+ *   return FALSE;
+ * while ((dent = glnx_dirent64_batch_next (buf, len, &offset)) != NULL)
+ *   ...
+ * ```
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_dirfd_iterator_next_batch (GLnxDirFdIterator  *dfd_iter,
+                                void               *buf,
+                                gsize               buf_size,
+                                gsize              *out_len,
+                                GCancellable       *cancellable,
+                                GError            **error)
+{
+  ssize_t n;
+
+  g_return_val_if_fail (dfd_iter->initialized, FALSE);
+  g_return_val_if_fail (buf != NULL, FALSE);
+  g_return_val_if_fail (((guintptr) buf & 7) == 0, FALSE);
+  g_return_val_if_fail (out_len != NULL, FALSE);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  /* The kernel API takes an unsigned int */
+  buf_size = MIN (buf_size, G_MAXINT);
+
+  n = TEMP_FAILURE_RETRY (syscall (SYS_getdents64, dfd_iter->fd, buf, buf_size));
+  if (n < 0)
+    return glnx_throw_errno_prefix (error, "getdents64");
+
+  *out_len = n;
+  return TRUE;
+}
+
 /**
  * glnx_dirfd_iterator_next_dent_ensure_dtype:
  * @dfd_iter: A directory iterator
@@ -244,6 +447,7 @@ glnx_dirfd_iterator_clear (GLnxDirFdIterator *dfd_iter)
   /* fd is owned by dfd_iter */
   if (!real_dfd_iter->initialized)
     return;
+  g_clear_pointer (&real_dfd_iter->sorted, glnx_dirfd_sorted_entries_free);
   (void) closedir (real_dfd_iter->d);
   real_dfd_iter->initialized = FALSE;
 }
@@ -270,6 +474,25 @@ glnx_fdrel_abspath (int         dfd,
   return g_strdup_printf ("/proc/self/fd/%d/%s", dfd, path);
 }
 
+/* Per-thread state of glnx_gen_temp_name() */
+typedef struct
+{
+  guint64 seed;
+  guint64 counter;
+} GLnxTempNameState;
+
+static GPrivate temp_name_key = G_PRIVATE_INIT (g_free);
+
+/* The finalizer of SplitMix64, which turns a counter into a well-mixed
+ * sequence that doesn't repeat within 2^64 steps */
+static inline guint64
+temp_name_mix (guint64 x)
+{
+  x = (x ^ (x >> 30)) * G_GUINT64_CONSTANT (0xbf58476d1ce4e5b9);
+  x = (x ^ (x >> 27)) * G_GUINT64_CONSTANT (0x94d049bb133111eb);
+  return x ^ (x >> 31);
+}
+
 /**
  * glnx_gen_temp_name:
  * @tmpl: (type filename): template directory name, the last 6 characters will be replaced
@@ -277,6 +500,11 @@ glnx_fdrel_abspath (int         dfd,
  * Replace the last 6 characters of @tmpl with random ASCII.  You must
  * use this in combination with a mechanism to ensure race-free file
  * creation such as `O_EXCL`.
+ *
+ * The names come from a per-thread counter, mixed with a per-thread random
+ * seed and the pid, so that many threads and processes can create
+ * temporary files in the same directory without taking a global lock or
+ * retrying the same names as each other.
  */
 void
 glnx_gen_temp_name (gchar *tmpl)
@@ -289,9 +517,27 @@ glnx_gen_temp_name (gchar *tmpl)
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
   static const int NLETTERS = sizeof (letters) - 1;
 
+  GLnxTempNameState *state = g_private_get (&temp_name_key);
+  if (state == NULL)
+    {
+      state = g_new0 (GLnxTempNameState, 1);
+      /* The only use of the global generator in this thread */
+      state->seed = ((guint64) g_random_int () << 32 | g_random_int ()) ^
+                    (guint64) g_get_monotonic_time () ^ (guintptr) state;
+      g_private_set (&temp_name_key, state);
+    }
+
+  /* After a fork(), the child continues with the same state as the
+   * parent, so the pid has to be mixed into every name */
+  guint64 v = temp_name_mix (state->seed + state->counter++ * G_GUINT64_CONSTANT (0x9e3779b97f4a7c15));
+  v = temp_name_mix (v ^ (guint64) getpid ());
+
   char *XXXXXX = tmpl + (len - 6);
   for (int i = 0; i < 6; i++)
-    XXXXXX[i] = letters[g_random_int_range(0, NLETTERS)];
+    {
+      XXXXXX[i] = letters[v % NLETTERS];
+      v /= NLETTERS;
+    }
 }
 
 /**
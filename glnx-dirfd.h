@@ -55,6 +55,21 @@ struct GLnxDirFdIterator {
 };
 
 typedef struct GLnxDirFdIterator GLnxDirFdIterator;
+
+/**
+ * GLnxDirFdIteratorFlags:
+ * @GLNX_DIRFD_ITERATOR_FLAGS_NONE: Return entries in the order the filesystem does
+ * @GLNX_DIRFD_ITERATOR_FLAGS_SORT_BY_INODE: Read the whole directory up front, and
+ *   return its entries in order of increasing inode number.  On filesystems such
+ *   as ext4 and XFS this makes a subsequent stat, open or unlink of each entry
+ *   access the inode table sequentially, which is much faster on a cold cache,
+ *   at the cost of buffering the directory in memory.
+ */
+typedef enum {
+  GLNX_DIRFD_ITERATOR_FLAGS_NONE = 0,
+  GLNX_DIRFD_ITERATOR_FLAGS_SORT_BY_INODE = (1 << 0),
+} GLnxDirFdIteratorFlags;
+
 gboolean glnx_dirfd_iterator_init_at (int dfd, const char *path,
                                     gboolean follow,
                                     GLnxDirFdIterator *dfd_iter, GError **error);
@@ -68,6 +83,71 @@ gboolean glnx_dirfd_iterator_next_dent_ensure_dtype (GLnxDirFdIterator  *dfd_ite
                                                      GCancellable       *cancellable,
                                                      GError            **error);
 void glnx_dirfd_iterator_rewind (GLnxDirFdIterator  *dfd_iter);
+void glnx_dirfd_iterator_set_flags (GLnxDirFdIterator      *dfd_iter,
+                                    GLnxDirFdIteratorFlags  flags);
+
+/**
+ * GLnxDirent64:
+ * @d_ino: Inode number
+ * @d_off: Opaque offset of the next entry
+ * @d_reclen: Length of this record, including padding
+ * @d_type: File type, as in `struct dirent`
+ * @d_name: Nul-terminated file name
+ *
+ * A directory entry as returned by the `getdents64` system call
+ * (`struct linux_dirent64`).  Records are variable-length; use
+ * glnx_dirent64_batch_next() to step through a batch.
+ */
+typedef struct {
+  guint64 d_ino;
+  gint64 d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+} GLnxDirent64;
+
+gboolean glnx_dirfd_iterator_next_batch (GLnxDirFdIterator  *dfd_iter,
+                                         void               *buf,
+                                         gsize               buf_size,
+                                         gsize              *out_len,
+                                         GCancellable       *cancellable,
+                                         GError            **error);
+
+/**
+ * glnx_dirent64_batch_next:
+ * @buf: A buffer filled by glnx_dirfd_iterator_next_batch(), which must be
+ *   8-byte aligned
+ * @len: The length returned by glnx_dirfd_iterator_next_batch()
+ * @inout_offset: (inout): Offset of the next record in @buf; start at 0
+ *
+ * Returns the next record in a batch of directory entries, skipping
+ * `.` and `..`, or %NULL once the batch has been exhausted.
+ *
+ * Returns: (transfer none) (nullable): A directory entry within @buf
+ */
+static inline GLnxDirent64 *
+glnx_dirent64_batch_next (void   *buf,
+                          gsize   len,
+                          gsize  *inout_offset)
+{
+  g_return_val_if_fail (((guintptr) buf & 7) == 0, NULL);
+
+  while (*inout_offset < len)
+    {
+      GLnxDirent64 *dent = (GLnxDirent64 *) ((char *) buf + *inout_offset);
+      const char *name = dent->d_name;
+
+      *inout_offset += dent->d_reclen;
+
+      if (G_UNLIKELY (name[0] == '.' &&
+                      (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))))
+        continue;
+
+      return dent;
+    }
+
+  return NULL;
+}
 void glnx_dirfd_iterator_clear (GLnxDirFdIterator *dfd_iter);
 
 G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(GLnxDirFdIterator, glnx_dirfd_iterator_clear)
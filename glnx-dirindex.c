@@ -0,0 +1,599 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include "libglnx-config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+
+#include <glnx-dirfd.h>
+#include <glnx-dirindex.h>
+#include <glnx-errors.h>
+#include <glnx-fdio.h>
+#include <glnx-local-alloc.h>
+#include <glnx-missing.h>
+
+/* An index, whether built in memory or loaded from a file, is laid out as
+ * the header, followed by the entries sorted by name, followed by the
+ * nul-terminated names.  Everything is in host byte order. */
+
+#define GLNX_DIR_INDEX_MAGIC "GLNXDIX1"
+#define GLNX_DIR_INDEX_BYTE_ORDER 0x01020304
+
+/* Internal header flag: the directory was changed so shortly before it
+ * was read that a later change might not move its timestamps, so the next
+ * refresh must read it again regardless */
+#define GLNX_DIR_INDEX_HEADER_RACY (1U << 31)
+
+#define GLNX_DIR_INDEX_STATX_MASK \
+  (GLNX_STATX_TYPE | GLNX_STATX_MODE | GLNX_STATX_INO | \
+   GLNX_STATX_SIZE | GLNX_STATX_MTIME | GLNX_STATX_CTIME)
+
+typedef struct
+{
+  char magic[8];
+  guint32 byte_order;
+  guint32 flags;
+  guint32 n_entries;
+  guint32 names_size;
+  /* The directory itself, when it was read */
+  guint32 dir_dev_major;
+  guint32 dir_dev_minor;
+  guint64 dir_ino;
+  gint64 dir_mtime_sec;
+  gint64 dir_ctime_sec;
+  guint32 dir_mtime_nsec;
+  guint32 dir_ctime_nsec;
+} GLnxDirIndexHeader;
+
+G_STATIC_ASSERT (sizeof (GLnxDirIndexHeader) == 64);
+G_STATIC_ASSERT (sizeof (GLnxDirIndexEntry) == 56);
+
+struct _GLnxDirIndex
+{
+  GBytes *data;
+  const GLnxDirIndexHeader *header;
+  const GLnxDirIndexEntry *entries;
+  const char *names;
+};
+
+static void
+dir_index_set_data (GLnxDirIndex *index,
+                    GBytes       *data)
+{
+  const guint8 *p = g_bytes_get_data (data, NULL);
+
+  g_clear_pointer (&index->data, g_bytes_unref);
+  index->data = data;
+  index->header = (const GLnxDirIndexHeader *) p;
+  index->entries = (const GLnxDirIndexEntry *) (p + sizeof (GLnxDirIndexHeader));
+  index->names = (const char *) (index->entries + index->header->n_entries);
+}
+
+static int
+compare_entries_by_name (gconstpointer a,
+                         gconstpointer b,
+                         gpointer      names)
+{
+  const GLnxDirIndexEntry *entry_a = a;
+  const GLnxDirIndexEntry *entry_b = b;
+
+  return strcmp ((const char *) names + entry_a->name_offset,
+                 (const char *) names + entry_b->name_offset);
+}
+
+static void
+entry_set_statx (GLnxDirIndexEntry       *entry,
+                 const struct glnx_statx *stbuf)
+{
+  entry->ino = stbuf->stx_ino;
+  entry->size = stbuf->stx_size;
+  entry->mtime_sec = stbuf->stx_mtime.tv_sec;
+  entry->mtime_nsec = stbuf->stx_mtime.tv_nsec;
+  entry->ctime_sec = stbuf->stx_ctime.tv_sec;
+  entry->ctime_nsec = stbuf->stx_ctime.tv_nsec;
+  entry->mode = stbuf->stx_mode;
+  entry->d_type = IFTODT (stbuf->stx_mode);
+}
+
+/* Reads the directory at @dfd/@path into a new index blob.  If @old is
+ * given, entries which still have the same name and inode keep their stat
+ * data from it rather than being stat'ed again. */
+static GBytes *
+dir_index_scan (int                 dfd,
+                const char         *path,
+                GLnxDirIndexFlags   flags,
+                GLnxDirIndex       *old,
+                GCancellable       *cancellable,
+                GError            **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  g_autoptr(GArray) entries = g_array_new (FALSE, TRUE, sizeof (GLnxDirIndexEntry));
+  g_autoptr(GString) names = g_string_new (NULL);
+  g_autofree char *buf = NULL;
+  const gsize buf_size = 64 * 1024;
+  GLnxDirIndexHeader header = { { 0, }, };
+  struct glnx_statx dir_stbuf;
+  GByteArray *blob;
+  gint64 now_sec;
+
+  if (!glnx_dirfd_iterator_init_at (dfd, path, TRUE, &dfd_iter, error))
+    return NULL;
+
+  /* Get the directory's timestamps before reading it, so that a change
+   * which happens while we read is seen by the next refresh */
+  if (!glnx_statx (dfd_iter.fd, "", AT_EMPTY_PATH,
+                   GLNX_STATX_INO | GLNX_STATX_MTIME | GLNX_STATX_CTIME,
+                   &dir_stbuf, error))
+    return NULL;
+
+  buf = g_malloc (buf_size);
+  for (;;)
+    {
+      GLnxDirent64 *dent;
+      gsize len;
+      gsize offset = 0;
+
+      if (!glnx_dirfd_iterator_next_batch (&dfd_iter, buf, buf_size, &len,
+                                           cancellable, error))
+        return NULL;
+      if (len == 0)
+        break;
+
+      while ((dent = glnx_dirent64_batch_next (buf, len, &offset)) != NULL)
+        {
+          GLnxDirIndexEntry entry = { 0, };
+
+          if (names->len > G_MAXUINT32 - NAME_MAX - 1)
+            {
+              errno = EFBIG;
+              return glnx_null_throw_errno_prefix (error, "Indexing directory");
+            }
+
+          entry.ino = dent->d_ino;
+          entry.d_type = dent->d_type;
+          entry.name_offset = names->len;
+          g_string_append_len (names, dent->d_name, strlen (dent->d_name) + 1);
+          g_array_append_val (entries, entry);
+        }
+    }
+
+  if ((flags & GLNX_DIR_INDEX_FLAGS_STAT) != 0)
+    {
+      g_autoptr(GPtrArray) to_stat = g_ptr_array_new ();
+      g_autoptr(GArray) to_stat_idx = g_array_new (FALSE, FALSE, sizeof (guint));
+      g_autofree struct glnx_statx *stbufs = NULL;
+      g_autofree int *errnos = NULL;
+      guint n_remaining = 0;
+
+      for (guint i = 0; i < entries->len; i++)
+        {
+          GLnxDirIndexEntry *entry = &g_array_index (entries, GLnxDirIndexEntry, i);
+          const char *name = names->str + entry->name_offset;
+          const GLnxDirIndexEntry *old_entry = NULL;
+
+          if (old != NULL)
+            old_entry = glnx_dir_index_lookup (old, name);
+
+          if (old_entry != NULL && old_entry->mode != 0 && old_entry->ino == entry->ino)
+            {
+              guint32 name_offset = entry->name_offset;
+
+              *entry = *old_entry;
+              entry->name_offset = name_offset;
+            }
+          else
+            {
+              g_ptr_array_add (to_stat, (char *) name);
+              g_array_append_val (to_stat_idx, i);
+            }
+        }
+
+      stbufs = g_new (struct glnx_statx, to_stat->len);
+      errnos = g_new (int, to_stat->len);
+      if (!glnx_statx_many (dfd_iter.fd, (const char * const *) to_stat->pdata, to_stat->len,
+                            AT_SYMLINK_NOFOLLOW, GLNX_DIR_INDEX_STATX_MASK,
+                            stbufs, errnos, cancellable, error))
+        return NULL;
+
+      for (guint i = 0; i < to_stat->len; i++)
+        {
+          GLnxDirIndexEntry *entry =
+            &g_array_index (entries, GLnxDirIndexEntry, g_array_index (to_stat_idx, guint, i));
+
+          if (errnos[i] == ENOENT)
+            {
+              /* Deleted since we read the directory; leave it out */
+              entry->ino = 0;
+              entry->mode = 0;
+            }
+          else if (errnos[i] != 0)
+            {
+              errno = errnos[i];
+              return glnx_null_throw_errno_prefix (error, "statx(%s)",
+                                                   (const char *) to_stat->pdata[i]);
+            }
+          else
+            {
+              entry_set_statx (entry, &stbufs[i]);
+            }
+        }
+
+      /* Squeeze out the deleted entries */
+      for (guint i = 0; i < entries->len; i++)
+        {
+          const GLnxDirIndexEntry *entry = &g_array_index (entries, GLnxDirIndexEntry, i);
+
+          if (entry->mode != 0)
+            g_array_index (entries, GLnxDirIndexEntry, n_remaining++) = *entry;
+        }
+      g_array_set_size (entries, n_remaining);
+    }
+
+  g_array_sort_with_data (entries, compare_entries_by_name, names->str);
+
+  memcpy (header.magic, GLNX_DIR_INDEX_MAGIC, sizeof (header.magic));
+  header.byte_order = GLNX_DIR_INDEX_BYTE_ORDER;
+  header.flags = flags;
+  header.n_entries = entries->len;
+  header.names_size = names->len;
+  header.dir_dev_major = dir_stbuf.stx_dev_major;
+  header.dir_dev_minor = dir_stbuf.stx_dev_minor;
+  header.dir_ino = dir_stbuf.stx_ino;
+  header.dir_mtime_sec = dir_stbuf.stx_mtime.tv_sec;
+  header.dir_mtime_nsec = dir_stbuf.stx_mtime.tv_nsec;
+  header.dir_ctime_sec = dir_stbuf.stx_ctime.tv_sec;
+  header.dir_ctime_nsec = dir_stbuf.stx_ctime.tv_nsec;
+
+  /* Timestamps can be as coarse as the kernel's tick, or a second on some
+   * filesystems: if the directory changed that recently, another change in
+   * the same tick wouldn't be noticed. */
+  now_sec = g_get_real_time () / G_USEC_PER_SEC;
+  if (header.dir_ctime_sec >= now_sec - 1 || header.dir_mtime_sec >= now_sec - 1)
+    header.flags |= GLNX_DIR_INDEX_HEADER_RACY;
+
+  blob = g_byte_array_sized_new (sizeof (header) +
+                                 entries->len * sizeof (GLnxDirIndexEntry) +
+                                 names->len);
+  g_byte_array_append (blob, (const guint8 *) &header, sizeof (header));
+  g_byte_array_append (blob, (const guint8 *) entries->data,
+                       entries->len * sizeof (GLnxDirIndexEntry));
+  g_byte_array_append (blob, (const guint8 *) names->str, names->len);
+
+  return g_byte_array_free_to_bytes (blob);
+}
+
+/**
+ * glnx_dir_index_new_at:
+ * @dfd: Directory FD
+ * @path: Path to the directory to index, relative to @dfd
+ * @flags: Flags
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Reads the directory at @path once, and builds a compact index of its
+ * entries, sorted by name.  With %GLNX_DIR_INDEX_FLAGS_STAT, each entry is
+ * also stat'ed (in bulk, see glnx_statx_many()).
+ *
+ * The index can be kept up to date with glnx_dir_index_refresh_at(), and
+ * saved with glnx_dir_index_save_at() so that it can be loaded again
+ * without reading the directory.
+ *
+ * Returns: (transfer full): A new index, or %NULL on error
+ * Since: UNRELEASED
+ */
+GLnxDirIndex *
+glnx_dir_index_new_at (int                 dfd,
+                       const char         *path,
+                       GLnxDirIndexFlags   flags,
+                       GCancellable       *cancellable,
+                       GError            **error)
+{
+  g_autoptr(GLnxDirIndex) index = g_new0 (GLnxDirIndex, 1);
+  GBytes *data;
+
+  data = dir_index_scan (dfd, path, flags, NULL, cancellable, error);
+  if (data == NULL)
+    return NULL;
+
+  dir_index_set_data (index, data);
+  return g_steal_pointer (&index);
+}
+
+/**
+ * glnx_dir_index_load_at:
+ * @dfd: Directory FD
+ * @path: Path to a file written by glnx_dir_index_save_at()
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Loads an index saved by glnx_dir_index_save_at().  Large indexes are
+ * mapped rather than read, so loading is cheap however many entries there
+ * are.  The file is checked for consistency, and %G_IO_ERROR_INVALID_DATA
+ * is returned if it's damaged or was written on a host with a different
+ * byte order; the directory should be indexed afresh in that case.
+ *
+ * The index describes the directory as it was when it was last read;
+ * use glnx_dir_index_refresh_at() to bring it up to date.
+ *
+ * Returns: (transfer full): The loaded index, or %NULL on error
+ * Since: UNRELEASED
+ */
+GLnxDirIndex *
+glnx_dir_index_load_at (int            dfd,
+                        const char    *path,
+                        GCancellable  *cancellable,
+                        GError       **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Loading directory index", error);
+  g_autoptr(GLnxDirIndex) index = NULL;
+  g_autoptr(GBytes) data = NULL;
+  glnx_autofd int fd = -1;
+  const GLnxDirIndexHeader *header;
+  const GLnxDirIndexEntry *entries;
+  const char *names;
+  gsize size;
+
+  if (!glnx_openat_rdonly (dfd, path, TRUE, &fd, error))
+    return NULL;
+
+  data = glnx_fd_map_bytes (fd, cancellable, error);
+  if (data == NULL)
+    return NULL;
+
+  header = g_bytes_get_data (data, &size);
+  if (size < sizeof (*header) ||
+      memcmp (header->magic, GLNX_DIR_INDEX_MAGIC, sizeof (header->magic)) != 0 ||
+      header->byte_order != GLNX_DIR_INDEX_BYTE_ORDER ||
+      (guint64) size != sizeof (*header) +
+                        (guint64) header->n_entries * sizeof (GLnxDirIndexEntry) +
+                        header->names_size ||
+      (header->names_size > 0 &&
+       ((const char *) header)[size - 1] != '\0'))
+    goto invalid;
+
+  entries = (const GLnxDirIndexEntry *) (header + 1);
+  names = (const char *) (entries + header->n_entries);
+  for (guint i = 0; i < header->n_entries; i++)
+    {
+      if (entries[i].name_offset >= header->names_size)
+        goto invalid;
+      /* Lookups rely on the entries being sorted */
+      if (i > 0 && strcmp (names + entries[i - 1].name_offset,
+                           names + entries[i].name_offset) >= 0)
+        goto invalid;
+    }
+
+  index = g_new0 (GLnxDirIndex, 1);
+  dir_index_set_data (index, g_steal_pointer (&data));
+  return g_steal_pointer (&index);
+
+ invalid:
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+               "Invalid or corrupt index file");
+  return NULL;
+}
+
+/**
+ * glnx_dir_index_save_at:
+ * @index: A #GLnxDirIndex
+ * @dfd: Directory FD
+ * @path: Path to write to, relative to @dfd
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Atomically replaces the file at @path with @index, so that it can later
+ * be loaded with glnx_dir_index_load_at().  The file isn't synced to disk;
+ * if a crash leaves it truncated or empty, loading it fails, and the
+ * directory just needs to be indexed again.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_dir_index_save_at (GLnxDirIndex  *index,
+                        int            dfd,
+                        const char    *path,
+                        GCancellable  *cancellable,
+                        GError       **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Saving directory index", error);
+  gsize size;
+  const guint8 *data = g_bytes_get_data (index->data, &size);
+
+  return glnx_file_replace_contents_at (dfd, path, data, size,
+                                        GLNX_FILE_REPLACE_NODATASYNC,
+                                        cancellable, error);
+}
+
+/**
+ * glnx_dir_index_refresh_at:
+ * @index: A #GLnxDirIndex
+ * @dfd: Directory FD
+ * @path: Path to the directory, relative to @dfd
+ * @out_changed: (out) (optional): Whether any names, inode numbers or types
+ *   changed
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Brings @index up to date with the directory at @path.  If the
+ * directory's modification and status change times are the same as when
+ * it was last read, nothing needs to be done.  Otherwise, it is read again,
+ * but only entries which are new or have a different inode number since
+ * then are stat'ed.
+ *
+ * Note that modifying a file doesn't change the timestamps of the
+ * directory containing it, so the stat data of entries can be out of date;
+ * only the set of entries is guaranteed to be current.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_dir_index_refresh_at (GLnxDirIndex  *index,
+                           int            dfd,
+                           const char    *path,
+                           gboolean      *out_changed,
+                           GCancellable  *cancellable,
+                           GError       **error)
+{
+  const GLnxDirIndexHeader *header = index->header;
+  const GLnxDirIndexHeader *new_header;
+  struct glnx_statx dir_stbuf;
+  GBytes *data;
+  gboolean changed;
+
+  if (!glnx_statx (dfd, path, 0,
+                   GLNX_STATX_INO | GLNX_STATX_MTIME | GLNX_STATX_CTIME,
+                   &dir_stbuf, error))
+    return FALSE;
+
+  if ((header->flags & GLNX_DIR_INDEX_HEADER_RACY) == 0 &&
+      dir_stbuf.stx_dev_major == header->dir_dev_major &&
+      dir_stbuf.stx_dev_minor == header->dir_dev_minor &&
+      dir_stbuf.stx_ino == header->dir_ino &&
+      dir_stbuf.stx_mtime.tv_sec == header->dir_mtime_sec &&
+      dir_stbuf.stx_mtime.tv_nsec == header->dir_mtime_nsec &&
+      dir_stbuf.stx_ctime.tv_sec == header->dir_ctime_sec &&
+      dir_stbuf.stx_ctime.tv_nsec == header->dir_ctime_nsec)
+    {
+      if (out_changed)
+        *out_changed = FALSE;
+      return TRUE;
+    }
+
+  /* Stat data is only worth keeping if it's the same directory */
+  data = dir_index_scan (dfd, path,
+                         header->flags & ~GLNX_DIR_INDEX_HEADER_RACY,
+                         (dir_stbuf.stx_dev_major == header->dir_dev_major &&
+                          dir_stbuf.stx_dev_minor == header->dir_dev_minor &&
+                          dir_stbuf.stx_ino == header->dir_ino) ? index : NULL,
+                         cancellable, error);
+  if (data == NULL)
+    return FALSE;
+
+  new_header = g_bytes_get_data (data, NULL);
+  changed = new_header->n_entries != header->n_entries;
+  if (!changed)
+    {
+      const GLnxDirIndexEntry *new_entries = (const GLnxDirIndexEntry *) (new_header + 1);
+      const char *new_names = (const char *) (new_entries + new_header->n_entries);
+
+      for (guint i = 0; i < header->n_entries && !changed; i++)
+        {
+          changed = index->entries[i].ino != new_entries[i].ino ||
+                    index->entries[i].d_type != new_entries[i].d_type ||
+                    strcmp (index->names + index->entries[i].name_offset,
+                            new_names + new_entries[i].name_offset) != 0;
+        }
+    }
+
+  dir_index_set_data (index, data);
+
+  if (out_changed)
+    *out_changed = changed;
+  return TRUE;
+}
+
+/**
+ * glnx_dir_index_free:
+ * @index: (nullable): A #GLnxDirIndex
+ *
+ * Frees @index.
+ *
+ * Since: UNRELEASED
+ */
+void
+glnx_dir_index_free (GLnxDirIndex *index)
+{
+  if (index == NULL)
+    return;
+
+  g_clear_pointer (&index->data, g_bytes_unref);
+  g_free (index);
+}
+
+/**
+ * glnx_dir_index_get_n_entries:
+ * @index: A #GLnxDirIndex
+ *
+ * Returns: The number of entries in @index
+ * Since: UNRELEASED
+ */
+guint
+glnx_dir_index_get_n_entries (GLnxDirIndex *index)
+{
+  return index->header->n_entries;
+}
+
+/**
+ * glnx_dir_index_get_entry:
+ * @index: A #GLnxDirIndex
+ * @i: An index less than glnx_dir_index_get_n_entries()
+ *
+ * Entries are sorted by name, in strcmp() order.  They remain valid until
+ * @index is refreshed or freed.
+ *
+ * Returns: (transfer none): The @i'th entry
+ * Since: UNRELEASED
+ */
+const GLnxDirIndexEntry *
+glnx_dir_index_get_entry (GLnxDirIndex *index,
+                          guint         i)
+{
+  g_return_val_if_fail (i < index->header->n_entries, NULL);
+
+  return &index->entries[i];
+}
+
+/**
+ * glnx_dir_index_entry_get_name:
+ * @index: A #GLnxDirIndex
+ * @entry: An entry of @index
+ *
+ * Returns: (transfer none): The name of @entry
+ * Since: UNRELEASED
+ */
+const char *
+glnx_dir_index_entry_get_name (GLnxDirIndex            *index,
+                               const GLnxDirIndexEntry *entry)
+{
+  return index->names + entry->name_offset;
+}
+
+/**
+ * glnx_dir_index_lookup:
+ * @index: A #GLnxDirIndex
+ * @name: A file name
+ *
+ * Finds the entry for @name with a binary search.
+ *
+ * Returns: (transfer none) (nullable): The entry, or %NULL if there is none
+ * Since: UNRELEASED
+ */
+const GLnxDirIndexEntry *
+glnx_dir_index_lookup (GLnxDirIndex *index,
+                       const char   *name)
+{
+  guint lo = 0;
+  guint hi = index->header->n_entries;
+
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+      int cmp = strcmp (name, index->names + index->entries[mid].name_offset);
+
+      if (cmp == 0)
+        return &index->entries[mid];
+      else if (cmp < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+  return NULL;
+}
@@ -0,0 +1,97 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include <glnx-backport-autocleanups.h>
+#include <glnx-errors.h>
+#include <glnx-macros.h>
+
+G_BEGIN_DECLS
+
+/**
+ * GLnxDirIndexFlags:
+ * @GLNX_DIR_INDEX_FLAGS_NONE: Only record names, inode numbers and types
+ * @GLNX_DIR_INDEX_FLAGS_STAT: Also record mode, size, mtime and ctime of
+ *   each entry, and fill in the type where the filesystem doesn't provide it
+ */
+typedef enum {
+  GLNX_DIR_INDEX_FLAGS_NONE = 0,
+  GLNX_DIR_INDEX_FLAGS_STAT = (1 << 0),
+} GLnxDirIndexFlags;
+
+/**
+ * GLnxDirIndexEntry:
+ * @ino: Inode number
+ * @size: Size in bytes, if stat'ed
+ * @mtime_sec: Modification time, if stat'ed
+ * @ctime_sec: Status change time, if stat'ed
+ * @mtime_nsec: Nanoseconds of @mtime_sec
+ * @ctime_nsec: Nanoseconds of @ctime_sec
+ * @name_offset: Private; use glnx_dir_index_entry_get_name()
+ * @mode: `st_mode`, or 0 if the entry hasn't been stat'ed
+ * @d_type: File type, as in `struct dirent`; may be `DT_UNKNOWN` if the
+ *   entry hasn't been stat'ed
+ *
+ * An entry of a #GLnxDirIndex.  This is also its on-disk format, so it has
+ * a fixed layout.
+ */
+typedef struct {
+  guint64 ino;
+  guint64 size;
+  gint64 mtime_sec;
+  gint64 ctime_sec;
+  guint32 mtime_nsec;
+  guint32 ctime_nsec;
+  guint32 name_offset;
+  guint32 mode;
+  guint8 d_type;
+  /*< private >*/
+  guint8 reserved[7];
+} GLnxDirIndexEntry;
+
+typedef struct _GLnxDirIndex GLnxDirIndex;
+
+GLnxDirIndex *glnx_dir_index_new_at (int                 dfd,
+                                     const char         *path,
+                                     GLnxDirIndexFlags   flags,
+                                     GCancellable       *cancellable,
+                                     GError            **error);
+
+GLnxDirIndex *glnx_dir_index_load_at (int            dfd,
+                                      const char    *path,
+                                      GCancellable  *cancellable,
+                                      GError       **error);
+
+gboolean glnx_dir_index_save_at (GLnxDirIndex  *index,
+                                 int            dfd,
+                                 const char    *path,
+                                 GCancellable  *cancellable,
+                                 GError       **error);
+
+gboolean glnx_dir_index_refresh_at (GLnxDirIndex  *index,
+                                    int            dfd,
+                                    const char    *path,
+                                    gboolean      *out_changed,
+                                    GCancellable  *cancellable,
+                                    GError       **error);
+
+void glnx_dir_index_free (GLnxDirIndex *index);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GLnxDirIndex, glnx_dir_index_free)
+
+guint glnx_dir_index_get_n_entries (GLnxDirIndex *index);
+
+const GLnxDirIndexEntry *glnx_dir_index_get_entry (GLnxDirIndex *index,
+                                                   guint         i);
+
+const char *glnx_dir_index_entry_get_name (GLnxDirIndex            *index,
+                                           const GLnxDirIndexEntry *entry);
+
+const GLnxDirIndexEntry *glnx_dir_index_lookup (GLnxDirIndex *index,
+                                                const char   *name);
+
+G_END_DECLS
@@ -0,0 +1,463 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include "libglnx-config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/statfs.h>
+
+#include <glnx-dirfd.h>
+#include <glnx-dirwatch.h>
+#include <glnx-errors.h>
+#include <glnx-fdio.h>
+#include <glnx-local-alloc.h>
+
+/* Older kernel headers don't have reporting of directory handles and names,
+ * which arrived in Linux 5.9 */
+#ifndef FAN_REPORT_DIR_FID
+#define FAN_REPORT_DIR_FID 0x00000400
+#endif
+#ifndef FAN_REPORT_NAME
+#define FAN_REPORT_NAME 0x00000800
+#endif
+#ifndef FAN_EVENT_INFO_TYPE_DFID_NAME
+#define FAN_EVENT_INFO_TYPE_DFID_NAME 2
+#endif
+#ifndef FAN_EVENT_INFO_TYPE_DFID
+#define FAN_EVENT_INFO_TYPE_DFID 3
+#endif
+
+#define GLNX_DIR_WATCH_FANOTIFY_MASK \
+  (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | \
+   FAN_DELETE_SELF | FAN_ONDIR)
+#define GLNX_DIR_WATCH_INOTIFY_MASK \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+   IN_DELETE_SELF | IN_ONLYDIR)
+
+#define GLNX_DIR_WATCH_BUF_SIZE (64 * 1024)
+
+struct _GLnxDirWatch
+{
+  int fd;
+  gboolean fanotify;
+  guint last_dir_id;
+  /* For fanotify, the filesystem ID and handle of each directory, as in
+   * the events; for inotify, the watch descriptor */
+  GHashTable *dirs;
+};
+
+/* How a directory is identified in fanotify events: the fsid, followed by
+ * the handle type and the handle itself */
+static GBytes *
+fanotify_dir_key_new (const fsid_t             *fsid,
+                      const struct file_handle *handle)
+{
+  gsize handle_size = sizeof (handle->handle_type) + handle->handle_bytes;
+  guint8 *key = g_malloc (sizeof (*fsid) + handle_size);
+
+  memcpy (key, fsid, sizeof (*fsid));
+  memcpy (key + sizeof (*fsid), &handle->handle_type, handle_size);
+  return g_bytes_new_take (key, sizeof (*fsid) + handle_size);
+}
+
+/**
+ * glnx_dir_watch_new:
+ * @flags: Flags
+ * @error: Return location for a #GError, or %NULL
+ *
+ * Create a watch that reports names created, deleted or renamed in the
+ * directories added to it with glnx_dir_watch_add(), so that a consumer
+ * that keeps its own view of those directories (for example from
+ * #GLnxDirFdIterator) only needs to look at what changed instead of
+ * reading them all again.
+ *
+ * fanotify is used if the kernel supports reporting directory handles and
+ * names to this process, since it doesn't count towards the inotify watch
+ * limit and reports merged events more compactly; otherwise inotify is used.
+ * Either way, only direct children of the added directories are reported.
+ * Pass %GLNX_DIR_WATCH_FLAGS_INOTIFY to always use inotify.
+ *
+ * Returns: (transfer full): A new watch, or %NULL on error
+ * Since: UNRELEASED
+ */
+GLnxDirWatch *
+glnx_dir_watch_new (GLnxDirWatchFlags   flags,
+                    GError            **error)
+{
+  g_autoptr(GLnxDirWatch) watch = g_new0 (GLnxDirWatch, 1);
+
+  watch->fd = -1;
+
+  if (!(flags & GLNX_DIR_WATCH_FLAGS_INOTIFY))
+    {
+      /* Unprivileged processes may do this since Linux 5.13; older kernels
+       * fail with EPERM, or EINVAL if they lack the reporting flags */
+      watch->fd = fanotify_init (FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK |
+                                 FAN_REPORT_DIR_FID | FAN_REPORT_NAME,
+                                 O_RDONLY | O_CLOEXEC);
+      if (watch->fd < 0 && !G_IN_SET (errno, EPERM, EINVAL, ENOSYS))
+        return glnx_null_throw_errno_prefix (error, "fanotify_init");
+    }
+
+  if (watch->fd >= 0)
+    {
+      watch->fanotify = TRUE;
+      watch->dirs = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+                                           (GDestroyNotify) g_bytes_unref, NULL);
+    }
+  else
+    {
+      watch->fd = inotify_init1 (IN_CLOEXEC | IN_NONBLOCK);
+      if (watch->fd < 0)
+        return glnx_null_throw_errno_prefix (error, "inotify_init1");
+      watch->dirs = g_hash_table_new (NULL, NULL);
+    }
+
+  return g_steal_pointer (&watch);
+}
+
+/**
+ * glnx_dir_watch_free:
+ * @watch: A #GLnxDirWatch
+ *
+ * Stop watching all directories of @watch and free it.
+ *
+ * Since: UNRELEASED
+ */
+void
+glnx_dir_watch_free (GLnxDirWatch *watch)
+{
+  glnx_close_fd (&watch->fd);
+  g_clear_pointer (&watch->dirs, g_hash_table_unref);
+  g_free (watch);
+}
+
+/**
+ * glnx_dir_watch_add:
+ * @watch: A #GLnxDirWatch
+ * @dfd: Directory file descriptor
+ * @path: Path to a directory, relative to @dfd
+ * @out_dir_id: (out): Return location for the ID of the directory in changes
+ * @error: Return location for a #GError, or %NULL
+ *
+ * Start reporting changes to the directory at @path.  Adding the same
+ * directory again returns the same ID.  The directory stays watched until
+ * @watch is freed, or %GLNX_DIR_WATCH_CHANGE_DIR_GONE is reported for it.
+ *
+ * Changes are only reported from the time this returns, so a consumer
+ * should add the directory before reading it.
+ *
+ * fanotify can only watch directories on filesystems that support file
+ * handles and have a filesystem ID, which rules out some FUSE and network
+ * filesystems.  On those this fails with %G_IO_ERROR_NOT_SUPPORTED when
+ * the watch uses fanotify; create a separate watch with
+ * %GLNX_DIR_WATCH_FLAGS_INOTIFY for them.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_dir_watch_add (GLnxDirWatch  *watch,
+                    int            dfd,
+                    const char    *path,
+                    guint         *out_dir_id,
+                    GError       **error)
+{
+  glnx_autofd int dir_fd = -1;
+  gpointer key;
+  gpointer value;
+
+  if (!glnx_opendirat (dfd, path, TRUE, &dir_fd, error))
+    return FALSE;
+
+  if (watch->fanotify)
+    {
+      g_autofree struct file_handle *handle = NULL;
+      g_autoptr(GBytes) dir_key = NULL;
+      struct statfs stfsbuf;
+
+      if (!glnx_name_to_handle_at (dir_fd, "", AT_EMPTY_PATH, &handle, NULL, error))
+        return glnx_prefix_error (error, "Getting handle of %s", path);
+      if (TEMP_FAILURE_RETRY (fstatfs (dir_fd, &stfsbuf)) < 0)
+        return glnx_throw_errno_prefix (error, "fstatfs(%s)", path);
+
+      if (fanotify_mark (watch->fd, FAN_MARK_ADD, GLNX_DIR_WATCH_FANOTIFY_MASK,
+                         dir_fd, NULL) < 0)
+        {
+          /* The filesystem has no (or no unique) filesystem ID, or its
+           * handles can't be decoded */
+          if (G_IN_SET (errno, ENODEV, EXDEV, EOPNOTSUPP))
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           "fanotify can't watch %s on this filesystem", path);
+              return FALSE;
+            }
+          return glnx_throw_errno_prefix (error, "fanotify_mark(%s)", path);
+        }
+
+      dir_key = fanotify_dir_key_new (&stfsbuf.f_fsid, handle);
+      if (g_hash_table_lookup_extended (watch->dirs, dir_key, NULL, &value))
+        {
+          *out_dir_id = GPOINTER_TO_UINT (value);
+          return TRUE;
+        }
+      key = g_steal_pointer (&dir_key);
+    }
+  else
+    {
+      g_autofree char *proc_path = glnx_fdrel_abspath (dir_fd, ".");
+      int wd;
+
+      wd = inotify_add_watch (watch->fd, proc_path, GLNX_DIR_WATCH_INOTIFY_MASK);
+      if (wd < 0)
+        return glnx_throw_errno_prefix (error, "inotify_add_watch(%s)", path);
+
+      key = GINT_TO_POINTER (wd);
+      if (g_hash_table_lookup_extended (watch->dirs, key, NULL, &value))
+        {
+          *out_dir_id = GPOINTER_TO_UINT (value);
+          return TRUE;
+        }
+    }
+
+  watch->last_dir_id++;
+  g_hash_table_insert (watch->dirs, key, GUINT_TO_POINTER (watch->last_dir_id));
+  *out_dir_id = watch->last_dir_id;
+  return TRUE;
+}
+
+/**
+ * glnx_dir_watch_get_fd:
+ * @watch: A #GLnxDirWatch
+ *
+ * Get a file descriptor that becomes readable when there are changes,
+ * for use with poll() or g_unix_fd_add().  Don't read from it directly;
+ * use glnx_dir_watch_read_changes().
+ *
+ * Returns: The file descriptor, owned by @watch
+ * Since: UNRELEASED
+ */
+int
+glnx_dir_watch_get_fd (GLnxDirWatch *watch)
+{
+  return watch->fd;
+}
+
+/**
+ * glnx_dir_watch_get_uses_fanotify:
+ * @watch: A #GLnxDirWatch
+ *
+ * Returns: %TRUE if @watch uses fanotify, %FALSE if it uses inotify
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_dir_watch_get_uses_fanotify (GLnxDirWatch *watch)
+{
+  return watch->fanotify;
+}
+
+static void
+dir_watch_change_clear (gpointer data)
+{
+  GLnxDirWatchChange *change = data;
+
+  g_free (change->name);
+}
+
+static void
+append_change (GArray                 *changes,
+               GLnxDirWatchChangeType  type,
+               guint                   dir_id,
+               gboolean                is_dir,
+               const char             *name)
+{
+  GLnxDirWatchChange change = { type, dir_id, is_dir, g_strdup (name) };
+
+  g_array_append_val (changes, change);
+}
+
+static void
+append_fanotify_event (GLnxDirWatch                         *watch,
+                       const struct fanotify_event_metadata *event,
+                       GArray                               *changes)
+{
+  const guint8 *p = (const guint8 *) event + event->metadata_len;
+  const guint8 *end = (const guint8 *) event + event->event_len;
+  guint32 entry_mask = event->mask & (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO);
+  gboolean is_dir = (event->mask & FAN_ONDIR) != 0;
+
+  if (event->fd >= 0)
+    (void) close (event->fd);
+
+  if (event->mask & FAN_Q_OVERFLOW)
+    {
+      append_change (changes, GLNX_DIR_WATCH_CHANGE_OVERFLOW, 0, FALSE, NULL);
+      return;
+    }
+
+  while (p + sizeof (struct fanotify_event_info_header) <= end)
+    {
+      const struct fanotify_event_info_header *header = (const void *) p;
+      const struct file_handle *handle;
+      const fsid_t *fsid;
+      g_autoptr(GBytes) dir_key = NULL;
+      const char *name = NULL;
+      gpointer value;
+      guint dir_id;
+
+      if (header->len < sizeof (*header) || p + header->len > end)
+        break;
+      p += header->len;
+
+      if (header->info_type != FAN_EVENT_INFO_TYPE_DFID_NAME &&
+          header->info_type != FAN_EVENT_INFO_TYPE_DFID)
+        continue;
+
+      fsid = (const fsid_t *) (header + 1);
+      handle = (const struct file_handle *) (fsid + 1);
+      if (header->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+        name = (const char *) handle->f_handle + handle->handle_bytes;
+
+      dir_key = fanotify_dir_key_new (fsid, handle);
+      if (!g_hash_table_lookup_extended (watch->dirs, dir_key, NULL, &value))
+        continue;
+      dir_id = GPOINTER_TO_UINT (value);
+
+      if (event->mask & FAN_DELETE_SELF)
+        {
+          /* The mark goes away with the inode */
+          g_hash_table_remove (watch->dirs, dir_key);
+          append_change (changes, GLNX_DIR_WATCH_CHANGE_DIR_GONE, dir_id, FALSE, NULL);
+        }
+      else if (name == NULL || entry_mask == 0)
+        continue;
+      else if (entry_mask == FAN_CREATE)
+        append_change (changes, GLNX_DIR_WATCH_CHANGE_CREATED, dir_id, is_dir, name);
+      else if (entry_mask == FAN_DELETE)
+        append_change (changes, GLNX_DIR_WATCH_CHANGE_DELETED, dir_id, is_dir, name);
+      else if (entry_mask == FAN_MOVED_FROM)
+        append_change (changes, GLNX_DIR_WATCH_CHANGE_MOVED_FROM, dir_id, is_dir, name);
+      else if (entry_mask == FAN_MOVED_TO)
+        append_change (changes, GLNX_DIR_WATCH_CHANGE_MOVED_TO, dir_id, is_dir, name);
+      else
+        append_change (changes, GLNX_DIR_WATCH_CHANGE_CHANGED, dir_id, is_dir, name);
+
+      /* There is only one directory record in the events we ask for */
+      break;
+    }
+}
+
+static void
+append_inotify_event (GLnxDirWatch               *watch,
+                      const struct inotify_event *event,
+                      GArray                     *changes)
+{
+  gboolean is_dir = (event->mask & IN_ISDIR) != 0;
+  gpointer key = GINT_TO_POINTER (event->wd);
+  gpointer value;
+  guint dir_id;
+
+  if (event->mask & IN_Q_OVERFLOW)
+    {
+      append_change (changes, GLNX_DIR_WATCH_CHANGE_OVERFLOW, 0, FALSE, NULL);
+      return;
+    }
+
+  if (!g_hash_table_lookup_extended (watch->dirs, key, NULL, &value))
+    return;
+  dir_id = GPOINTER_TO_UINT (value);
+
+  if (event->mask & IN_IGNORED)
+    {
+      /* The watch is gone; this follows IN_DELETE_SELF or IN_UNMOUNT, which
+       * were already reported */
+      g_hash_table_remove (watch->dirs, key);
+    }
+  else if (event->mask & (IN_DELETE_SELF | IN_UNMOUNT))
+    append_change (changes, GLNX_DIR_WATCH_CHANGE_DIR_GONE, dir_id, FALSE, NULL);
+  else if (event->len == 0)
+    return;
+  else if (event->mask & IN_CREATE)
+    append_change (changes, GLNX_DIR_WATCH_CHANGE_CREATED, dir_id, is_dir, event->name);
+  else if (event->mask & IN_DELETE)
+    append_change (changes, GLNX_DIR_WATCH_CHANGE_DELETED, dir_id, is_dir, event->name);
+  else if (event->mask & IN_MOVED_FROM)
+    append_change (changes, GLNX_DIR_WATCH_CHANGE_MOVED_FROM, dir_id, is_dir, event->name);
+  else if (event->mask & IN_MOVED_TO)
+    append_change (changes, GLNX_DIR_WATCH_CHANGE_MOVED_TO, dir_id, is_dir, event->name);
+}
+
+/**
+ * glnx_dir_watch_read_changes:
+ * @watch: A #GLnxDirWatch
+ * @error: Return location for a #GError, or %NULL
+ *
+ * Read all changes that are queued, without blocking.  Changes are returned
+ * in the order they happened, except that the kernel may merge several
+ * changes to the same name (see %GLNX_DIR_WATCH_CHANGE_CHANGED).  A rename
+ * within a watched directory, or between two of them, is reported as
+ * %GLNX_DIR_WATCH_CHANGE_MOVED_FROM followed by
+ * %GLNX_DIR_WATCH_CHANGE_MOVED_TO.
+ *
+ * If %GLNX_DIR_WATCH_CHANGE_OVERFLOW is reported, changes were lost and
+ * the consumer has to fall back to reading the directories again.
+ *
+ * Returns: (transfer full) (element-type GLnxDirWatchChange): The changes,
+ *   possibly none, or %NULL on error
+ * Since: UNRELEASED
+ */
+GArray *
+glnx_dir_watch_read_changes (GLnxDirWatch  *watch,
+                             GError       **error)
+{
+  g_autoptr(GArray) changes = g_array_new (FALSE, FALSE, sizeof (GLnxDirWatchChange));
+  g_autofree guint8 *buf = g_malloc (GLNX_DIR_WATCH_BUF_SIZE);
+
+  g_array_set_clear_func (changes, dir_watch_change_clear);
+
+  while (TRUE)
+    {
+      ssize_t n = TEMP_FAILURE_RETRY (read (watch->fd, buf, GLNX_DIR_WATCH_BUF_SIZE));
+
+      if (n < 0)
+        {
+          if (errno == EAGAIN)
+            break;
+          return glnx_null_throw_errno_prefix (error, "Reading directory changes");
+        }
+      if (n == 0)
+        break;
+
+      if (watch->fanotify)
+        {
+          const struct fanotify_event_metadata *event = (const void *) buf;
+          int len = n;
+
+          for (; FAN_EVENT_OK (event, len); event = FAN_EVENT_NEXT (event, len))
+            {
+              if (event->vers != FANOTIFY_METADATA_VERSION)
+                return glnx_null_throw (error, "Unexpected fanotify metadata version %u",
+                                        event->vers);
+              append_fanotify_event (watch, event, changes);
+            }
+        }
+      else
+        {
+          for (gsize offset = 0; offset + sizeof (struct inotify_event) <= (gsize) n;)
+            {
+              const struct inotify_event *event = (const void *) (buf + offset);
+
+              append_inotify_event (watch, event, changes);
+              offset += sizeof (struct inotify_event) + event->len;
+            }
+        }
+    }
+
+  return g_steal_pointer (&changes);
+}
@@ -0,0 +1,91 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include <glnx-backport-autocleanups.h>
+#include <glnx-errors.h>
+#include <glnx-macros.h>
+
+G_BEGIN_DECLS
+
+/**
+ * GLnxDirWatchFlags:
+ * @GLNX_DIR_WATCH_FLAGS_NONE: No flags
+ * @GLNX_DIR_WATCH_FLAGS_INOTIFY: Always use inotify, for directories on
+ *   filesystems that fanotify can't watch
+ */
+typedef enum {
+  GLNX_DIR_WATCH_FLAGS_NONE = 0,
+  GLNX_DIR_WATCH_FLAGS_INOTIFY = (1 << 0),
+} GLnxDirWatchFlags;
+
+/**
+ * GLnxDirWatchChangeType:
+ * @GLNX_DIR_WATCH_CHANGE_CREATED: @name was created
+ * @GLNX_DIR_WATCH_CHANGE_DELETED: @name was deleted
+ * @GLNX_DIR_WATCH_CHANGE_MOVED_FROM: @name was renamed to something else,
+ *   possibly in another directory
+ * @GLNX_DIR_WATCH_CHANGE_MOVED_TO: Something was renamed to @name,
+ *   possibly from another directory
+ * @GLNX_DIR_WATCH_CHANGE_CHANGED: The kernel merged several of the above for
+ *   @name and their order is lost; look at what is there now
+ * @GLNX_DIR_WATCH_CHANGE_DIR_GONE: The watched directory itself was deleted
+ *   or its filesystem unmounted, and it won't report anything further
+ * @GLNX_DIR_WATCH_CHANGE_OVERFLOW: The kernel queue overflowed and changes
+ *   were lost, for all directories of the watch; rescan them
+ */
+typedef enum {
+  GLNX_DIR_WATCH_CHANGE_CREATED,
+  GLNX_DIR_WATCH_CHANGE_DELETED,
+  GLNX_DIR_WATCH_CHANGE_MOVED_FROM,
+  GLNX_DIR_WATCH_CHANGE_MOVED_TO,
+  GLNX_DIR_WATCH_CHANGE_CHANGED,
+  GLNX_DIR_WATCH_CHANGE_DIR_GONE,
+  GLNX_DIR_WATCH_CHANGE_OVERFLOW,
+} GLnxDirWatchChangeType;
+
+/**
+ * GLnxDirWatchChange:
+ * @type: What happened
+ * @dir_id: The directory it happened in, as returned by glnx_dir_watch_add();
+ *   0 for %GLNX_DIR_WATCH_CHANGE_OVERFLOW
+ * @is_dir: Whether @name is (or was) a directory
+ * @name: The name in the directory, or %NULL for
+ *   %GLNX_DIR_WATCH_CHANGE_DIR_GONE and %GLNX_DIR_WATCH_CHANGE_OVERFLOW
+ *
+ * One entry of the change log returned by glnx_dir_watch_read_changes().
+ */
+typedef struct {
+  GLnxDirWatchChangeType type;
+  guint dir_id;
+  gboolean is_dir;
+  char *name;
+} GLnxDirWatchChange;
+
+typedef struct _GLnxDirWatch GLnxDirWatch;
+
+GLnxDirWatch *glnx_dir_watch_new (GLnxDirWatchFlags   flags,
+                                  GError            **error);
+
+void glnx_dir_watch_free (GLnxDirWatch *watch);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GLnxDirWatch, glnx_dir_watch_free)
+
+gboolean glnx_dir_watch_add (GLnxDirWatch  *watch,
+                             int            dfd,
+                             const char    *path,
+                             guint         *out_dir_id,
+                             GError       **error);
+
+int glnx_dir_watch_get_fd (GLnxDirWatch *watch);
+
+gboolean glnx_dir_watch_get_uses_fanotify (GLnxDirWatch *watch);
+
+GArray *glnx_dir_watch_read_changes (GLnxDirWatch  *watch,
+                                     GError       **error);
+
+G_END_DECLS
@@ -30,7 +30,9 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/sendfile.h>
+#include <sys/utsname.h>
 #include <errno.h>
 
 #include <glnx-chase.h>
@@ -42,6 +44,7 @@
 #include <glnx-backports.h>
 #include <glnx-local-alloc.h>
 #include <glnx-missing.h>
+#include <glnx-uring.h>
 
 /* From systemd mountpoint-util.c at d2b27a7:
  * This is the original MAX_HANDLE_SZ definition from the kernel, when the API
@@ -60,6 +63,19 @@
 #define FICLONE _IOW(0x94, 9, int)
 #endif
 
+/* The standardized version of BTRFS_IOC_CLONE_RANGE; same layout as
+ * struct file_clone_range from linux/fs.h */
+struct glnx_file_clone_range
+{
+  gint64 src_fd;
+  guint64 src_offset;
+  guint64 src_length;
+  guint64 dest_offset;
+};
+#ifndef FICLONERANGE
+#define FICLONERANGE _IOW(0x94, 13, struct glnx_file_clone_range)
+#endif
+
 /* Returns the number of chars needed to format variables of the
  * specified type as a decimal string. Adds in extra space for a
  * negative '-' prefix (hence works correctly on signed
@@ -198,6 +214,7 @@ glnx_tmpfile_clear (GLnxTmpfile *tmpf)
       g_free (tmpf->path);
     }
   tmpf->initialized = FALSE;
+  tmpf->linked = FALSE;
 }
 
 static gboolean
@@ -336,6 +353,46 @@ glnx_open_anonymous_tmpfile (int          flags,
 
 static const char proc_self_fd_slash[] = "/proc/self/fd/";
 
+/* Whether linkat() with AT_EMPTY_PATH works for us: it needs
+ * CAP_DAC_READ_SEARCH, or a kernel that allows it for files opened with
+ * the same credentials.  0 if not known yet, 1 if it does, -1 if not. */
+static gint linkat_empty_path_state = 0;
+
+/* Give the O_TMPFILE file @fd the name @target, preferably without going
+ * through /proc, which also works if that isn't mounted.  Returns -1 and
+ * sets errno on error, like linkat(). */
+static int
+link_tmpfile_fd_at (int         fd,
+                    int         target_dfd,
+                    const char *target)
+{
+  const gint state = g_atomic_int_get (&linkat_empty_path_state);
+
+  if (state >= 0)
+    {
+      if (linkat (fd, "", target_dfd, target, AT_EMPTY_PATH) == 0)
+        {
+          if (state == 0)
+            g_atomic_int_set (&linkat_empty_path_state, 1);
+          return 0;
+        }
+      /* Without the capability, this fails with ENOENT */
+      if (!G_IN_SET (errno, ENOENT, EPERM, EINVAL))
+        return -1;
+    }
+
+  char proc_fd_path[sizeof (proc_self_fd_slash) + DECIMAL_STR_MAX(fd)];
+  snprintf (proc_fd_path, sizeof (proc_fd_path), "%s%i", proc_self_fd_slash, fd);
+
+  if (linkat (AT_FDCWD, proc_fd_path, target_dfd, target, AT_SYMLINK_FOLLOW) < 0)
+    return -1;
+
+  /* The error wasn't about @target, so don't try AT_EMPTY_PATH again */
+  if (state >= 0)
+    g_atomic_int_set (&linkat_empty_path_state, -1);
+  return 0;
+}
+
 /* Use this after calling glnx_open_tmpfile_linkable_at() to give
  * the file its final name (link into place).
  */
@@ -381,21 +438,23 @@ glnx_link_tmpfile_at (GLnxTmpfile *tmpf,
     }
   else
     {
-      /* This case we have O_TMPFILE, so our reference to it is via /proc/self/fd */
-      char proc_fd_path[sizeof (proc_self_fd_slash) + DECIMAL_STR_MAX(tmpf->fd)];
-      snprintf (proc_fd_path, sizeof (proc_fd_path), "%s%i", proc_self_fd_slash, tmpf->fd);
-
+      /* This case we have O_TMPFILE, so we link the fd itself.  Even if
+       * that fails, a name may briefly have existed. */
+      tmpf->linked = TRUE;
       if (replace)
         {
           /* In this case, we had our temp file atomically hidden, but now
            * we need to make it visible in the FS so we can do a rename.
            * Ideally, linkat() would gain AT_REPLACE or so.
            */
-          /* TODO - avoid double alloca, we can just alloca a copy of
-           * the pathname plus space for tmp.XXXXX */
-          char *dnbuf = strdupa (target);
-          const char *dn = dirname (dnbuf);
-          char *tmpname_buf = glnx_strjoina (dn, "/tmp.XXXXXX");
+          static const char tmpname_base[] = "tmp.XXXXXX";
+          const char *slash = strrchr (target, '/');
+          const gsize dirname_len = slash ? (slash - target) + 1 : 0;
+          char *tmpname_buf = g_alloca (dirname_len + sizeof (tmpname_base));
+
+          /* The temporary name is in the same directory as @target */
+          memcpy (tmpname_buf, target, dirname_len);
+          memcpy (tmpname_buf + dirname_len, tmpname_base, sizeof (tmpname_base));
 
           const guint count_max = 100;
           guint count;
@@ -403,7 +462,7 @@ glnx_link_tmpfile_at (GLnxTmpfile *tmpf,
             {
               glnx_gen_temp_name (tmpname_buf);
 
-              if (linkat (AT_FDCWD, proc_fd_path, target_dfd, tmpname_buf, AT_SYMLINK_FOLLOW) < 0)
+              if (link_tmpfile_fd_at (tmpf->fd, target_dfd, tmpname_buf) < 0)
                 {
                   if (errno == EEXIST)
                     continue;
@@ -430,7 +489,7 @@ glnx_link_tmpfile_at (GLnxTmpfile *tmpf,
         }
       else
         {
-          if (linkat (AT_FDCWD, proc_fd_path, target_dfd, target, AT_SYMLINK_FOLLOW) < 0)
+          if (link_tmpfile_fd_at (tmpf->fd, target_dfd, target) < 0)
             {
               if (errno == EEXIST && mode == GLNX_LINK_TMPFILE_NOREPLACE_IGNORE_EXIST)
                 ;
@@ -443,6 +502,531 @@ glnx_link_tmpfile_at (GLnxTmpfile *tmpf,
   return TRUE;
 }
 
+struct _GLnxDirSyncSet
+{
+  /* "dfd/path" strings that were already added, so adding the same path
+   * again costs no system calls */
+  GHashTable *paths;
+  /* Device and inode numbers of the directories, as GBytes */
+  GHashTable *dir_ids;
+  /* An open fd for each directory, to fsync at flush time */
+  GArray *fds;
+};
+
+static void
+dir_sync_set_reset (GLnxDirSyncSet *set)
+{
+  for (guint i = 0; i < set->fds->len; i++)
+    glnx_close_fd (&g_array_index (set->fds, int, i));
+  g_array_set_size (set->fds, 0);
+  g_hash_table_remove_all (set->paths);
+  g_hash_table_remove_all (set->dir_ids);
+}
+
+/**
+ * glnx_dir_sync_set_new:
+ *
+ * Create a set of directories to fsync.  Durable updates need the
+ * directory of each renamed or linked file to be fsynced, but when many
+ * files go into the same few directories, doing that per file is mostly
+ * redundant.  Instead, register each directory here, and call
+ * glnx_dir_sync_set_flush() once at the end, which fsyncs each distinct
+ * directory once.
+ *
+ * Returns: (transfer full): A new, empty set
+ * Since: UNRELEASED
+ */
+GLnxDirSyncSet *
+glnx_dir_sync_set_new (void)
+{
+  GLnxDirSyncSet *set = g_new0 (GLnxDirSyncSet, 1);
+
+  set->paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  set->dir_ids = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+                                        (GDestroyNotify) g_bytes_unref, NULL);
+  set->fds = g_array_new (FALSE, FALSE, sizeof (int));
+  return set;
+}
+
+/**
+ * glnx_dir_sync_set_free:
+ * @set: A #GLnxDirSyncSet
+ *
+ * Free @set, without syncing the directories in it.
+ *
+ * Since: UNRELEASED
+ */
+void
+glnx_dir_sync_set_free (GLnxDirSyncSet *set)
+{
+  dir_sync_set_reset (set);
+  g_hash_table_unref (set->paths);
+  g_hash_table_unref (set->dir_ids);
+  g_array_unref (set->fds);
+  g_free (set);
+}
+
+/**
+ * glnx_dir_sync_set_add:
+ * @set: A #GLnxDirSyncSet
+ * @dfd: Directory fd
+ * @path: Path to a directory, relative to @dfd
+ * @error: Error
+ *
+ * Add the directory at @path to @set, unless it is already in it.  An fd
+ * for each distinct directory is kept open until @set is flushed.
+ *
+ * Paths that were added before are recognized without any system calls,
+ * so @dfd must keep referring to the same directory until @set is
+ * flushed.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_dir_sync_set_add (GLnxDirSyncSet  *set,
+                       int              dfd,
+                       const char      *path,
+                       GError         **error)
+{
+  g_autofree char *key = NULL;
+  g_autoptr(GBytes) dir_id = NULL;
+  glnx_autofd int fd = -1;
+  struct stat stbuf;
+  guint64 dev_ino[2];
+
+  dfd = glnx_dirfd_canonicalize (dfd);
+  key = g_strdup_printf ("%d/%s", dfd, path);
+  if (g_hash_table_contains (set->paths, key))
+    return TRUE;
+
+  /* Different paths can lead to the same directory */
+  if (!glnx_opendirat (dfd, path, TRUE, &fd, error))
+    return FALSE;
+  if (!glnx_fstat (fd, &stbuf, error))
+    return FALSE;
+  dev_ino[0] = stbuf.st_dev;
+  dev_ino[1] = stbuf.st_ino;
+  dir_id = g_bytes_new (dev_ino, sizeof (dev_ino));
+
+  if (!g_hash_table_contains (set->dir_ids, dir_id))
+    {
+      g_hash_table_add (set->dir_ids, g_steal_pointer (&dir_id));
+      g_array_append_val (set->fds, fd);
+      fd = -1;
+    }
+  g_hash_table_add (set->paths, g_steal_pointer (&key));
+
+  return TRUE;
+}
+
+/**
+ * glnx_dir_sync_set_add_parent:
+ * @set: A #GLnxDirSyncSet
+ * @dfd: Directory fd
+ * @path: Path relative to @dfd
+ * @error: Error
+ *
+ * Add the directory containing @path to @set, as with
+ * glnx_dir_sync_set_add().
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_dir_sync_set_add_parent (GLnxDirSyncSet  *set,
+                              int              dfd,
+                              const char      *path,
+                              GError         **error)
+{
+  char *dnbuf = strdupa (path);
+  const char *dn = dirname (dnbuf);
+
+  return glnx_dir_sync_set_add (set, dfd, dn, error);
+}
+
+/**
+ * glnx_dir_sync_set_flush:
+ * @set: A #GLnxDirSyncSet
+ * @error: Error
+ *
+ * fsync() each directory in @set once, and empty it.  @set is emptied even
+ * on error.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_dir_sync_set_flush (GLnxDirSyncSet  *set,
+                         GError         **error)
+{
+  gboolean ret = TRUE;
+
+  for (guint i = 0; i < set->fds->len; i++)
+    {
+      if (TEMP_FAILURE_RETRY (fsync (g_array_index (set->fds, int, i))) < 0)
+        {
+          ret = glnx_throw_errno_prefix (error, "fsync");
+          break;
+        }
+    }
+
+  dir_sync_set_reset (set);
+  return ret;
+}
+
+/**
+ * glnx_link_tmpfile_at_with_dir_sync:
+ * @tmpf: Temporary file
+ * @mode: Replacement mode
+ * @target_dfd: Target directory fd
+ * @target: Target path
+ * @dir_sync: (nullable): Set to add the directory of @target to
+ * @error: Error
+ *
+ * Like glnx_link_tmpfile_at(), but also add the directory of @target to
+ * @dir_sync, so that the link can be made durable together with others by
+ * glnx_dir_sync_set_flush().
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_link_tmpfile_at_with_dir_sync (GLnxTmpfile                 *tmpf,
+                                    GLnxLinkTmpfileReplaceMode   mode,
+                                    int                          target_dfd,
+                                    const char                  *target,
+                                    GLnxDirSyncSet              *dir_sync,
+                                    GError                     **error)
+{
+  if (!glnx_link_tmpfile_at (tmpf, mode, target_dfd, target, error))
+    return FALSE;
+
+  if (dir_sync != NULL &&
+      !glnx_dir_sync_set_add_parent (dir_sync, target_dfd, target, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/**
+ * glnx_renameat_with_dir_sync:
+ * @src_dfd: Source directory fd
+ * @src_path: Source path
+ * @dest_dfd: Destination directory fd
+ * @dest_path: Destination path
+ * @dir_sync: (nullable): Set to add the directories of both paths to
+ * @error: Error
+ *
+ * Like glnx_renameat(), but also add the directories that were changed to
+ * @dir_sync, so that the rename can be made durable together with others
+ * by glnx_dir_sync_set_flush().
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_renameat_with_dir_sync (int              src_dfd,
+                             const char      *src_path,
+                             int              dest_dfd,
+                             const char      *dest_path,
+                             GLnxDirSyncSet  *dir_sync,
+                             GError         **error)
+{
+  if (!glnx_renameat (src_dfd, src_path, dest_dfd, dest_path, error))
+    return FALSE;
+
+  if (dir_sync != NULL &&
+      (!glnx_dir_sync_set_add_parent (dir_sync, src_dfd, src_path, error) ||
+       !glnx_dir_sync_set_add_parent (dir_sync, dest_dfd, dest_path, error)))
+    return FALSE;
+
+  return TRUE;
+}
+
+struct _GLnxTmpfilePool
+{
+  /* The directory the files are created in; fixed after creation */
+  int dfd;
+  int flags;
+  guint size;
+  uid_t uid;
+  gid_t gid;
+
+  /* The rest is protected by the lock */
+  GMutex lock;
+  GCond cond;
+  /* Unused O_TMPFILE fds, ready to be handed out */
+  GArray *fds;
+  gboolean shutdown;
+  GThread *filler;
+};
+
+/* The filler is woken up once fewer than this many files are left */
+#define TMPFILE_POOL_LOW_WATER(pool) ((pool)->size / 2)
+
+#if defined(O_TMPFILE) && !defined(DISABLE_OTMPFILE) && !defined(ENABLE_WRPSEUDO_COMPAT)
+/* Like the O_TMPFILE path of open_tmpfile_core(), but without any
+ * fallback; sets errno and returns -1 on error */
+static int
+tmpfile_pool_open_one (GLnxTmpfilePool *pool)
+{
+  glnx_autofd int fd = openat (pool->dfd, ".", O_TMPFILE | pool->flags, 0600);
+  if (fd < 0)
+    return -1;
+  /* See open_tmpfile_core() */
+  if (fchmod (fd, 0600) < 0)
+    return -1;
+  return g_steal_fd (&fd);
+}
+
+static gpointer
+tmpfile_pool_filler (gpointer data)
+{
+  GLnxTmpfilePool *pool = data;
+
+  g_mutex_lock (&pool->lock);
+  while (!pool->shutdown)
+    {
+      guint n_wanted;
+      g_autoptr(GArray) fds = NULL;
+
+      if (pool->fds->len >= TMPFILE_POOL_LOW_WATER (pool))
+        {
+          g_cond_wait (&pool->cond, &pool->lock);
+          continue;
+        }
+
+      /* Open the files without holding the lock, so that callers can keep
+       * taking the ones that are left in the meantime */
+      n_wanted = pool->size - pool->fds->len;
+      g_mutex_unlock (&pool->lock);
+
+      fds = g_array_sized_new (FALSE, FALSE, sizeof (int), n_wanted);
+      for (guint i = 0; i < n_wanted; i++)
+        {
+          int fd = tmpfile_pool_open_one (pool);
+          if (fd < 0)
+            break;
+          g_array_append_val (fds, fd);
+        }
+
+      g_mutex_lock (&pool->lock);
+      g_array_append_vals (pool->fds, fds->data, fds->len);
+
+      /* On errors (such as running out of fds), stop until a caller runs
+       * out of pooled files and wakes us up again, rather than spinning;
+       * that caller reports the error when it opens a file itself */
+      if (fds->len < n_wanted && !pool->shutdown)
+        g_cond_wait (&pool->cond, &pool->lock);
+    }
+  g_mutex_unlock (&pool->lock);
+
+  return NULL;
+}
+#endif
+
+/**
+ * glnx_tmpfile_pool_new:
+ * @dfd: Directory fd
+ * @subpath: Path to the directory the files will be created in, relative to @dfd
+ * @flags: Flags for opening the files, as for glnx_open_tmpfile_linkable_at()
+ * @size: The maximum number of unused files to keep open
+ * @error: Error
+ *
+ * Create a pool of O_TMPFILE files in the directory at @subpath, for
+ * callers that write many small files there at a high rate.  A background
+ * thread keeps up to @size files open ahead of time, so that
+ * glnx_tmpfile_pool_acquire() usually doesn't need any system calls, and
+ * files that were never linked can be recycled with
+ * glnx_tmpfile_pool_release().
+ *
+ * If O_TMPFILE isn't supported in the directory, the pool does nothing
+ * and glnx_tmpfile_pool_acquire() just calls
+ * glnx_open_tmpfile_linkable_at().
+ *
+ * Returns: (transfer full): A new pool, or %NULL on error
+ * Since: UNRELEASED
+ */
+GLnxTmpfilePool *
+glnx_tmpfile_pool_new (int          dfd,
+                       const char  *subpath,
+                       int          flags,
+                       guint        size,
+                       GError     **error)
+{
+  g_autoptr(GLnxTmpfilePool) pool = NULL;
+
+  g_return_val_if_fail ((flags & O_EXCL) == 0, NULL);
+  g_return_val_if_fail (size > 0, NULL);
+
+  pool = g_new0 (GLnxTmpfilePool, 1);
+  pool->dfd = -1;
+  pool->flags = flags | O_CLOEXEC;
+  pool->size = size;
+  g_mutex_init (&pool->lock);
+  g_cond_init (&pool->cond);
+  pool->fds = g_array_sized_new (FALSE, FALSE, sizeof (int), size);
+
+  if (!glnx_opendirat (dfd, subpath, TRUE, &pool->dfd, error))
+    return NULL;
+
+#if defined(O_TMPFILE) && !defined(DISABLE_OTMPFILE) && !defined(ENABLE_WRPSEUDO_COMPAT)
+  {
+    struct stat stbuf;
+    glnx_autofd int fd = tmpfile_pool_open_one (pool);
+
+    if (fd < 0)
+      {
+        if (!G_IN_SET (errno, ENOSYS, EISDIR, EOPNOTSUPP))
+          return glnx_null_throw_errno_prefix (error, "open(O_TMPFILE)");
+        return g_steal_pointer (&pool);
+      }
+
+    /* Files are only recycled if they still have the owner that new
+     * files get in this directory */
+    if (!glnx_fstat (fd, &stbuf, error))
+      return NULL;
+    pool->uid = stbuf.st_uid;
+    pool->gid = stbuf.st_gid;
+    g_array_append_val (pool->fds, fd);
+    fd = -1;
+
+    pool->filler = g_thread_try_new ("glnx-tmpfile", tmpfile_pool_filler, pool, error);
+    if (pool->filler == NULL)
+      return NULL;
+  }
+#endif
+
+  return g_steal_pointer (&pool);
+}
+
+/**
+ * glnx_tmpfile_pool_free:
+ * @pool: A #GLnxTmpfilePool
+ *
+ * Stop the background thread of @pool and close its unused files.  Files
+ * that were acquired from @pool refer to its directory fd, so they must
+ * be cleared before this is called.
+ *
+ * Since: UNRELEASED
+ */
+void
+glnx_tmpfile_pool_free (GLnxTmpfilePool *pool)
+{
+  if (pool->filler != NULL)
+    {
+      g_mutex_lock (&pool->lock);
+      pool->shutdown = TRUE;
+      g_cond_signal (&pool->cond);
+      g_mutex_unlock (&pool->lock);
+      g_thread_join (pool->filler);
+    }
+
+  for (guint i = 0; i < pool->fds->len; i++)
+    glnx_close_fd (&g_array_index (pool->fds, int, i));
+  g_array_unref (pool->fds);
+  g_mutex_clear (&pool->lock);
+  g_cond_clear (&pool->cond);
+  glnx_close_fd (&pool->dfd);
+  g_free (pool);
+}
+
+/**
+ * glnx_tmpfile_pool_acquire:
+ * @pool: A #GLnxTmpfilePool
+ * @out_tmpf: (out caller-allocates): Return location for the file
+ * @error: Error
+ *
+ * Take an empty temporary file from @pool, or open a new one if there
+ * are none left.  The result is like one from
+ * glnx_open_tmpfile_linkable_at(), and can be linked into place with
+ * glnx_link_tmpfile_at().  Its source directory fd is owned by @pool.
+ *
+ * This may be called from multiple threads at once.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_tmpfile_pool_acquire (GLnxTmpfilePool  *pool,
+                           GLnxTmpfile      *out_tmpf,
+                           GError          **error)
+{
+  int fd = -1;
+
+  if (pool->filler != NULL)
+    {
+      g_mutex_lock (&pool->lock);
+      if (pool->fds->len > 0)
+        {
+          fd = g_array_index (pool->fds, int, pool->fds->len - 1);
+          g_array_set_size (pool->fds, pool->fds->len - 1);
+        }
+      if (pool->fds->len < TMPFILE_POOL_LOW_WATER (pool))
+        g_cond_signal (&pool->cond);
+      g_mutex_unlock (&pool->lock);
+    }
+
+  if (fd < 0)
+    return glnx_open_tmpfile_linkable_at (pool->dfd, ".", pool->flags, out_tmpf, error);
+
+  out_tmpf->initialized = TRUE;
+  out_tmpf->anonymous = FALSE;
+  out_tmpf->src_dfd = pool->dfd;
+  out_tmpf->fd = fd;
+  out_tmpf->path = NULL;
+  out_tmpf->linked = FALSE;
+  return TRUE;
+}
+
+/**
+ * glnx_tmpfile_pool_release:
+ * @pool: A #GLnxTmpfilePool
+ * @tmpf: A file acquired from @pool
+ *
+ * Clear @tmpf like glnx_tmpfile_clear().  If it was never linked into
+ * place with glnx_link_tmpfile_at(), its contents are discarded and it is
+ * kept for reuse by glnx_tmpfile_pool_acquire(), avoiding the cost of
+ * creating a new one.  Files that were linked are never reused, even if
+ * their name has since been unlinked or replaced.
+ *
+ * Files that are reused get their mode reset, but not their extended
+ * attributes, so don't release files that had some set.
+ *
+ * Since: UNRELEASED
+ */
+void
+glnx_tmpfile_pool_release (GLnxTmpfilePool *pool,
+                           GLnxTmpfile     *tmpf)
+{
+  struct stat stbuf;
+
+  if (!tmpf->initialized)
+    return;
+
+  if (pool->filler != NULL &&
+      tmpf->src_dfd == pool->dfd && tmpf->path == NULL && tmpf->fd >= 0 &&
+      !tmpf->linked &&
+      fstat (tmpf->fd, &stbuf) == 0 &&
+      stbuf.st_nlink == 0 &&
+      stbuf.st_uid == pool->uid && stbuf.st_gid == pool->gid &&
+      (stbuf.st_size == 0 || ftruncate (tmpf->fd, 0) == 0) &&
+      lseek (tmpf->fd, 0, SEEK_SET) == 0 &&
+      ((stbuf.st_mode & 07777) == 0600 || fchmod (tmpf->fd, 0600) == 0))
+    {
+      g_mutex_lock (&pool->lock);
+      if (pool->fds->len < pool->size)
+        {
+          g_array_append_val (pool->fds, tmpf->fd);
+          tmpf->fd = -1;
+        }
+      g_mutex_unlock (&pool->lock);
+    }
+
+  glnx_tmpfile_clear (tmpf);
+}
+
 /* glnx_tmpfile_reopen_rdonly:
  * @tmpf: tmpfile
  * @error: Error
@@ -518,31 +1102,32 @@ glnx_fd_readall_malloc (int               fd,
                         GCancellable     *cancellable,
                         GError          **error)
 {
-  const guint maxreadlen = 4096;
-
   struct stat stbuf;
   if (!glnx_fstat (fd, &stbuf, error))
     return FALSE;
 
+  /* For regular files, leave room to see EOF (and add the NUL) without
+   * growing the buffer */
   gsize buf_allocated;
   if (S_ISREG (stbuf.st_mode) && stbuf.st_size > 0)
-    buf_allocated = stbuf.st_size;
+    buf_allocated = stbuf.st_size + 1;
   else
-    buf_allocated = 16;
+    buf_allocated = 4096;
 
   g_autofree guint8* buf = g_malloc (buf_allocated);
 
   gsize buf_size = 0;
   while (TRUE)
     {
-      gsize readlen = MIN (buf_allocated - buf_size, maxreadlen);
-
       if (g_cancellable_set_error_if_cancelled (cancellable, error))
         return FALSE;
 
+      if (buf_allocated == buf_size)
+        buf = g_realloc (buf, buf_allocated *= 2);
+
       gssize bytes_read;
       do
-        bytes_read = read (fd, buf + buf_size, readlen);
+        bytes_read = read (fd, buf + buf_size, buf_allocated - buf_size);
       while (G_UNLIKELY (bytes_read == -1 && errno == EINTR));
       if (G_UNLIKELY (bytes_read == -1))
         return glnx_null_throw_errno (error);
@@ -550,8 +1135,6 @@ glnx_fd_readall_malloc (int               fd,
         break;
 
       buf_size += bytes_read;
-      if (buf_allocated - buf_size < maxreadlen)
-        buf = g_realloc (buf, buf_allocated *= 2);
     }
 
   if (nul_terminate)
@@ -572,7 +1155,8 @@ glnx_fd_readall_malloc (int               fd,
  * @error: Error
  *
  * Read all data from file descriptor @fd into a #GBytes.  It's
- * recommended to only use this for small files.
+ * recommended to only use this for small files; see also
+ * glnx_fd_map_bytes().
  *
  * Returns: (transfer full): A newly allocated #GBytes
  */
@@ -588,18 +1172,113 @@ glnx_fd_readall_bytes (int               fd,
   return g_bytes_new_take (buf, len);
 }
 
+/* Regular files at least this big are mapped rather than read by
+ * glnx_fd_map_bytes() */
+#define MAP_BYTES_THRESHOLD (64 * 1024)
+
+typedef struct
+{
+  void *addr;
+  gsize len;
+} GLnxMappedBytes;
+
+static void
+mapped_bytes_free (gpointer data)
+{
+  GLnxMappedBytes *mapped = data;
+
+  (void) munmap (mapped->addr, mapped->len);
+  g_free (mapped);
+}
+
 /**
- * glnx_fd_readall_utf8:
+ * glnx_fd_map_bytes:
  * @fd: A file descriptor
- * @out_len: (out): Returned length
- * @cancellable: Cancellable:
+ * @cancellable: Cancellable
  * @error: Error
  *
- * Read all data from file descriptor @fd, validating
- * the result as UTF-8.
+ * Get the contents of @fd as a #GBytes.  If @fd is a large regular file,
+ * the result is backed by a read-only mmap() of the whole file, so no
+ * data is copied; smaller regular files are read with pread() in as few
+ * calls as possible.  Either way, the file offset of @fd is not used or
+ * changed.  Anything else is read up to EOF, as with
+ * glnx_fd_readall_bytes().
  *
- * Returns: (transfer full): A string validated as UTF-8, or %NULL on error.
- */
+ * As with any mapping, the contents may change (and accessing them may
+ * crash) if the file is modified or truncated while the result is alive,
+ * so this is meant for files that are replaced rather than changed in place.
+ *
+ * Returns: (transfer full): A newly allocated #GBytes
+ * Since: UNRELEASED
+ */
+GBytes *
+glnx_fd_map_bytes (int               fd,
+                   GCancellable     *cancellable,
+                   GError          **error)
+{
+  struct stat stbuf;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return NULL;
+
+  if (!glnx_fstat (fd, &stbuf, error))
+    return NULL;
+
+  if (!S_ISREG (stbuf.st_mode))
+    return glnx_fd_readall_bytes (fd, cancellable, error);
+
+  if (stbuf.st_size >= MAP_BYTES_THRESHOLD && (guint64) stbuf.st_size <= G_MAXSIZE)
+    {
+      void *addr = mmap (NULL, stbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+      /* Fall back to reading it, e.g. for filesystems without mmap() */
+      if (addr != MAP_FAILED)
+        {
+          GLnxMappedBytes *mapped = g_new (GLnxMappedBytes, 1);
+
+          mapped->addr = addr;
+          mapped->len = stbuf.st_size;
+          return g_bytes_new_with_free_func (addr, stbuf.st_size, mapped_bytes_free, mapped);
+        }
+    }
+
+  /* Leave room to see EOF without growing the buffer */
+  gsize buf_allocated = stbuf.st_size + 1;
+  g_autofree guint8 *buf = g_malloc (buf_allocated);
+  gsize buf_size = 0;
+
+  while (TRUE)
+    {
+      gssize bytes_read;
+
+      if (buf_allocated == buf_size)
+        buf = g_realloc (buf, buf_allocated *= 2);
+
+      bytes_read = TEMP_FAILURE_RETRY (pread (fd, buf + buf_size, buf_allocated - buf_size,
+                                              buf_size));
+      if (bytes_read < 0)
+        return glnx_null_throw_errno_prefix (error, "pread");
+      if (bytes_read == 0)
+        break;
+
+      buf_size += bytes_read;
+    }
+
+  return g_bytes_new_take (g_steal_pointer (&buf), buf_size);
+}
+
+/**
+ * glnx_fd_readall_utf8:
+ * @fd: A file descriptor
+ * @out_len: (out): Returned length
+ * @cancellable: Cancellable:
+ * @error: Error
+ *
+ * Read all data from file descriptor @fd, validating
+ * the result as UTF-8.
+ *
+ * Returns: (transfer full): A string validated as UTF-8, or %NULL on error.
+ */
 char *
 glnx_fd_readall_utf8 (int               fd,
                       gsize            *out_len,
@@ -738,7 +1417,15 @@ copy_symlink_at (int                   src_dfd,
   return TRUE;
 }
 
-#define COPY_BUFFER_SIZE (16*1024)
+/* Bounds for the read()/write() fallback buffer.  Filesystems like FUSE and
+ * 9p often report a small st_blksize, but perform much better with large
+ * I/Os. */
+#define COPY_BUFFER_SIZE_MIN (128 * 1024)
+#define COPY_BUFFER_SIZE_DEFAULT_MAX (1024 * 1024)
+#define COPY_BUFFER_SIZE_MAX (64 * 1024 * 1024)
+/* Copies at least this big overlap reads and writes using a second thread,
+ * and drop the source from the page cache as they go */
+#define COPY_STREAM_THRESHOLD (16 * 1024 * 1024)
 
 /* Most of the code below is from systemd, but has been reindented to GNU style,
  * and changed to use POSIX error conventions (return -1, set errno) to more
@@ -784,6 +1471,398 @@ glnx_loop_write(int fd, const void *buf, size_t nbytes)
   return 0;
 }
 
+/* Like writev(), but loop until all of @iov is written, or an error
+ * occurs.  @iov itself is not modified.
+ *
+ * On error, -1 is returned and @errno is set.
+ */
+int
+glnx_loop_writev (int fd, const struct iovec *iov, int iovcnt)
+{
+  g_return_val_if_fail (fd >= 0, -1);
+  g_return_val_if_fail (iovcnt == 0 || iov != NULL, -1);
+
+  errno = 0;
+
+  while (iovcnt > 0)
+    {
+      if (iov->iov_len == 0)
+        {
+          iov++;
+          iovcnt--;
+          continue;
+        }
+
+      ssize_t k = writev (fd, iov, MIN (iovcnt, IOV_MAX));
+      if (k < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          return -1;
+        }
+
+      if (k == 0) /* Can't really happen */
+        {
+          errno = EIO;
+          return -1;
+        }
+
+      /* Skip the buffers that were written completely */
+      while (iovcnt > 0 && (size_t) k >= iov->iov_len)
+        {
+          k -= iov->iov_len;
+          iov++;
+          iovcnt--;
+        }
+
+      /* Finish a partially written buffer on its own, rather than copying
+       * @iov to adjust its first element */
+      if (k > 0)
+        {
+          if (glnx_loop_write (fd, (const guint8 *) iov->iov_base + k, iov->iov_len - k) < 0)
+            return -1;
+          iov++;
+          iovcnt--;
+        }
+    }
+
+  return 0;
+}
+
+/* Per-thread cache of the read()/write() fallback buffer, so that copying
+ * many files doesn't allocate for each of them */
+typedef struct
+{
+  gsize size;
+  void *buf;
+} GLnxCopyBuffer;
+
+static void
+copy_buffer_free (GLnxCopyBuffer *buffer)
+{
+  if (buffer == NULL)
+    return;
+
+  free (buffer->buf);
+  g_free (buffer);
+}
+
+static GPrivate copy_buffer_key = G_PRIVATE_INIT ((GDestroyNotify) copy_buffer_free);
+
+/* Returns a page-aligned buffer of at least @size bytes, to be released
+ * with copy_buffer_release() */
+static void *
+copy_buffer_acquire (gsize size)
+{
+  GLnxCopyBuffer *buffer = g_private_get (&copy_buffer_key);
+  void *buf;
+
+  if (buffer != NULL && buffer->size >= size)
+    {
+      buf = g_steal_pointer (&buffer->buf);
+      buffer->size = 0;
+      return buf;
+    }
+
+  if (posix_memalign (&buf, sysconf (_SC_PAGESIZE), size) != 0)
+    g_error ("%s: failed to allocate %" G_GSIZE_FORMAT " bytes", G_STRLOC, size);
+
+  return buf;
+}
+
+static void
+copy_buffer_release (void  *buf,
+                     gsize  size)
+{
+  GLnxCopyBuffer *buffer;
+
+  /* Don't keep unusually large buffers around */
+  if (size > COPY_BUFFER_SIZE_DEFAULT_MAX)
+    {
+      free (buf);
+      return;
+    }
+
+  buffer = g_private_get (&copy_buffer_key);
+  if (buffer == NULL)
+    {
+      buffer = g_new0 (GLnxCopyBuffer, 1);
+      g_private_set (&copy_buffer_key, buffer);
+    }
+  else if (buffer->size >= size)
+    {
+      free (buf);
+      return;
+    }
+
+  free (buffer->buf);
+  buffer->buf = buf;
+  buffer->size = size;
+}
+
+/* Pick a buffer size for copying up to @remaining bytes (-1 if unknown)
+ * from @fd, based on @hint if nonzero, or st_blksize otherwise */
+static gsize
+copy_buffer_size_for_fd (int    fd,
+                         gsize  hint,
+                         off_t  remaining)
+{
+  const gsize page_size = sysconf (_SC_PAGESIZE);
+  gsize size = hint;
+
+  if (size == 0)
+    {
+      struct stat stbuf;
+
+      if (fstat (fd, &stbuf) == 0 && stbuf.st_blksize > 0)
+        size = stbuf.st_blksize;
+      size = CLAMP (size, COPY_BUFFER_SIZE_MIN, COPY_BUFFER_SIZE_DEFAULT_MAX);
+    }
+  size = MIN (size, COPY_BUFFER_SIZE_MAX);
+
+  if (remaining >= 0 && (guint64) remaining < size)
+    size = MAX (remaining, 1);
+
+  return (size + page_size - 1) & ~(page_size - 1);
+}
+
+/* State shared between the writer and the reader thread of
+ * readwrite_copy_bytes() */
+typedef struct
+{
+  int fd;
+  off_t max_bytes;
+  gsize buf_size;
+  void *bufs[2];
+  gssize lens[2];  /* -1 if the buffer is free */
+
+  GMutex lock;
+  GCond cond;
+  gboolean eof;
+  int read_errsv;
+  gboolean stop;  /* Set by the writer on error */
+} GLnxCopyStream;
+
+static gpointer
+copy_stream_reader (gpointer data)
+{
+  GLnxCopyStream *stream = data;
+
+  for (guint i = 0; ; i ^= 1)
+    {
+      gsize want = stream->buf_size;
+      ssize_t n = 0;
+
+      g_mutex_lock (&stream->lock);
+      while (stream->lens[i] >= 0 && !stream->stop)
+        g_cond_wait (&stream->cond, &stream->lock);
+      if (stream->stop)
+        {
+          g_mutex_unlock (&stream->lock);
+          break;
+        }
+      g_mutex_unlock (&stream->lock);
+
+      if (stream->max_bytes != (off_t) -1)
+        want = MIN (want, (guint64) stream->max_bytes);
+      if (want > 0)
+        n = TEMP_FAILURE_RETRY (read (stream->fd, stream->bufs[i], want));
+
+      g_mutex_lock (&stream->lock);
+      if (n < 0)
+        {
+          stream->read_errsv = errno;
+          stream->eof = TRUE;
+        }
+      else if (n == 0)
+        stream->eof = TRUE;
+      else
+        {
+          stream->lens[i] = n;
+          if (stream->max_bytes != (off_t) -1)
+            stream->max_bytes -= n;
+        }
+      g_cond_broadcast (&stream->cond);
+      g_mutex_unlock (&stream->lock);
+
+      if (n <= 0)
+        break;
+    }
+
+  return NULL;
+}
+
+/* Copy by overlapping reads on a second thread with writes on this one,
+ * feeding the data into @digest if non-%NULL.  Returns -1 with errno set
+ * on error, or 1 if the thread couldn't be created and nothing was
+ * copied. */
+static int
+readwrite_copy_bytes_streamed (int          fdf,
+                               int          fdt,
+                               off_t        max_bytes,
+                               gsize        buf_size,
+                               void        *buf,
+                               GLnxDigest  *digest)
+{
+  GLnxCopyStream stream = { 0, };
+  off_t src_offset;
+  GThread *reader;
+  int errsv = 0;
+
+  stream.fd = fdf;
+  stream.max_bytes = max_bytes;
+  stream.buf_size = buf_size;
+  stream.bufs[0] = buf;
+  stream.bufs[1] = copy_buffer_acquire (buf_size);
+  stream.lens[0] = stream.lens[1] = -1;
+  g_mutex_init (&stream.lock);
+  g_cond_init (&stream.cond);
+
+  src_offset = lseek (fdf, 0, SEEK_CUR);
+
+  reader = g_thread_try_new ("glnx-copy", copy_stream_reader, &stream, NULL);
+  if (reader == NULL)
+    {
+      copy_buffer_release (stream.bufs[1], buf_size);
+      g_mutex_clear (&stream.lock);
+      g_cond_clear (&stream.cond);
+      return 1;
+    }
+
+  for (guint i = 0; ; i ^= 1)
+    {
+      gssize n;
+
+      g_mutex_lock (&stream.lock);
+      while (stream.lens[i] < 0 && !stream.eof)
+        g_cond_wait (&stream.cond, &stream.lock);
+      n = stream.lens[i];
+      if (n < 0)
+        errsv = stream.read_errsv;
+      g_mutex_unlock (&stream.lock);
+
+      if (n < 0)
+        break;
+
+      if (digest != NULL)
+        glnx_digest_update (digest, stream.bufs[i], n);
+
+      if (glnx_loop_write (fdt, stream.bufs[i], n) < 0)
+        {
+          errsv = errno;
+          g_mutex_lock (&stream.lock);
+          stream.stop = TRUE;
+          g_cond_broadcast (&stream.cond);
+          g_mutex_unlock (&stream.lock);
+          break;
+        }
+
+      /* We won't be reading this again */
+      if (src_offset >= 0)
+        {
+          (void) posix_fadvise (fdf, src_offset, n, POSIX_FADV_DONTNEED);
+          src_offset += n;
+        }
+
+      g_mutex_lock (&stream.lock);
+      stream.lens[i] = -1;
+      g_cond_broadcast (&stream.cond);
+      g_mutex_unlock (&stream.lock);
+    }
+
+  g_thread_join (reader);
+  copy_buffer_release (stream.bufs[1], buf_size);
+  g_mutex_clear (&stream.lock);
+  g_cond_clear (&stream.cond);
+
+  if (errsv != 0)
+    {
+      errno = errsv;
+      return -1;
+    }
+
+  return 0;
+}
+
+/* The last resort for glnx_regfile_copy_bytes(): read() and write() through
+ * a buffer of @buffer_size bytes, or one picked based on @fdf if 0.  Since
+ * the data passes through userspace anyway, it is also fed into @digest if
+ * that is non-%NULL. */
+static int
+readwrite_copy_bytes (int          fdf,
+                      int          fdt,
+                      off_t        max_bytes,
+                      gsize        buffer_size,
+                      GLnxDigest  *digest)
+{
+  off_t remaining = max_bytes;
+  gsize buf_size;
+  void *buf;
+  int ret = 0;
+
+  if (remaining == (off_t) -1)
+    {
+      struct stat stbuf;
+      off_t offset = lseek (fdf, 0, SEEK_CUR);
+
+      if (offset >= 0 && fstat (fdf, &stbuf) == 0)
+        remaining = MAX (stbuf.st_size - offset, 0);
+    }
+
+  (void) posix_fadvise (fdf, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  buf_size = copy_buffer_size_for_fd (fdf, buffer_size, remaining);
+  buf = copy_buffer_acquire (buf_size);
+
+  if (remaining >= COPY_STREAM_THRESHOLD)
+    {
+      ret = readwrite_copy_bytes_streamed (fdf, fdt, max_bytes, buf_size, buf, digest);
+      if (ret <= 0)
+        goto out;
+      ret = 0;
+    }
+
+  while (max_bytes != 0)
+    {
+      gsize want = buf_size;
+      ssize_t n;
+
+      if (max_bytes != (off_t) -1)
+        want = MIN (want, (guint64) max_bytes);
+
+      n = TEMP_FAILURE_RETRY (read (fdf, buf, want));
+      if (n < 0)
+        {
+          ret = -1;
+          break;
+        }
+      if (n == 0) /* EOF */
+        break;
+
+      if (digest != NULL)
+        glnx_digest_update (digest, buf, n);
+
+      if (glnx_loop_write (fdt, buf, (size_t) n) < 0)
+        {
+          ret = -1;
+          break;
+        }
+
+      if (max_bytes != (off_t) -1)
+        max_bytes -= n;
+    }
+
+ out:
+  {
+    int errsv = errno;
+    copy_buffer_release (buf, buf_size);
+    errno = errsv;
+  }
+
+  return ret;
+}
+
 /* Read from @fdf until EOF, writing to @fdt. If max_bytes is -1, a full-file
  * clone will be attempted. Otherwise Linux copy_file_range(), sendfile()
  * syscall will be attempted.  If none of those work, this function will do a
@@ -796,12 +1875,31 @@ glnx_loop_write(int fd, const void *buf, size_t nbytes)
  */
 int
 glnx_regfile_copy_bytes (int fdf, int fdt, off_t max_bytes)
+{
+  return glnx_regfile_copy_bytes_with_buffer_size (fdf, fdt, max_bytes, 0);
+}
+
+/* The implementation of glnx_regfile_copy_bytes_with_buffer_size().  If
+ * @digest is non-%NULL and the data has to go through userspace, it is fed
+ * into @digest on the way, and *@out_digested is set to %TRUE; otherwise
+ * the caller has to compute the digest itself. */
+static int
+regfile_copy_bytes_internal (int          fdf,
+                             int          fdt,
+                             off_t        max_bytes,
+                             gsize        buffer_size,
+                             GLnxDigest  *digest,
+                             gboolean    *out_digested)
 {
   /* Last updates from systemd as of commit 6bda23dd6aaba50cf8e3e6024248cf736cc443ca */
   static int have_cfr = -1; /* -1 means unknown */
   bool try_cfr = have_cfr != 0;
   static int have_sendfile = -1; /* -1 means unknown */
   bool try_sendfile = have_sendfile != 0;
+  /* Whether the kernel copied part of the data before we fell back */
+  gboolean kernel_copied = FALSE;
+
+  *out_digested = FALSE;
 
   g_return_val_if_fail (fdf >= 0, -1);
   g_return_val_if_fail (fdt >= 0, -1);
@@ -915,26 +2013,15 @@ glnx_regfile_copy_bytes (int fdf, int fdt, off_t max_bytes)
             }
         }
 
-      /* As a fallback just copy bits by hand */
-      { size_t m = COPY_BUFFER_SIZE;
-        if (max_bytes != (off_t) -1)
-          {
-            if ((off_t) m > max_bytes)
-              m = (size_t) max_bytes;
-          }
-        char buf[m];
-
-        n = TEMP_FAILURE_RETRY (read (fdf, buf, m));
-        if (n < 0)
-          return -1;
-        if (n == 0) /* EOF */
-          break;
-
-        if (glnx_loop_write (fdt, buf, (size_t) n) < 0)
-          return -1;
-      }
+      /* As a fallback just copy bits by hand.  The digest has to cover the
+       * whole file, so only compute it here if nothing was copied yet. */
+      if (kernel_copied)
+        digest = NULL;
+      *out_digested = digest != NULL;
+      return readwrite_copy_bytes (fdf, fdt, max_bytes, buffer_size, digest);
 
     next:
+      kernel_copied = TRUE;
       if (max_bytes != (off_t) -1)
         {
           g_assert_cmpint (max_bytes, >=, n);
@@ -948,277 +2035,1734 @@ glnx_regfile_copy_bytes (int fdf, int fdt, off_t max_bytes)
 }
 
 /**
- * glnx_file_copy_at:
- * @src_dfd: Source directory fd
- * @src_subpath: Subpath relative to @src_dfd
- * @src_stbuf: (allow-none): Optional stat buffer for source; if a stat() has already been done
- * @dest_dfd: Target directory fd
- * @dest_subpath: Destination name
- * @copyflags: Flags
- * @cancellable: cancellable
- * @error: Error
+ * glnx_regfile_copy_bytes_with_buffer_size:
+ * @fdf: Source regular file
+ * @fdt: Destination file
+ * @max_bytes: Maximum number of bytes to copy, or -1 to copy until EOF
+ * @buffer_size: Buffer size for the read()/write() fallback, or 0 to choose
+ *   one based on the `st_blksize` of @fdf
  *
- * Perform a full copy of the regular file or symbolic link from @src_subpath to
- * @dest_subpath; if @src_subpath is anything other than a regular file or
- * symbolic link, an error will be returned.
+ * Like glnx_regfile_copy_bytes(), but allows tuning the buffer used when
+ * the kernel can't copy the data itself, as is often the case on FUSE and
+ * network filesystems.
  *
- * If the source is a regular file and the destination exists as a symbolic
- * link, the symbolic link will not be followed; rather the link itself will be
- * replaced. Related to this: for regular files, when `GLNX_FILE_COPY_OVERWRITE`
- * is specified, this function always uses `O_TMPFILE` (if available) and does a
- * rename-into-place rather than `open(O_TRUNC)`.
+ * Large copies done that way read ahead on a second thread, and drop the
+ * source data from the page cache once it has been written out.
+ *
+ * Returns: 0 on success, -1 on error with @errno set
+ * Since: UNRELEASED
  */
-gboolean
-glnx_file_copy_at (int                   src_dfd,
-                   const char           *src_subpath,
-                   const struct stat    *src_stbuf,
-                   int                   dest_dfd,
-                   const char           *dest_subpath,
-                   GLnxFileCopyFlags     copyflags,
-                   GCancellable         *cancellable,
-                   GError              **error)
+int
+glnx_regfile_copy_bytes_with_buffer_size (int    fdf,
+                                          int    fdt,
+                                          off_t  max_bytes,
+                                          gsize  buffer_size)
 {
-  /* Canonicalize dfds */
-  src_dfd = glnx_dirfd_canonicalize (src_dfd);
-  dest_dfd = glnx_dirfd_canonicalize (dest_dfd);
+  gboolean digested;
+
+  return regfile_copy_bytes_internal (fdf, fdt, max_bytes, buffer_size, NULL, &digested);
+}
+
+/* Read up to @max_bytes (-1 for all) from @fdf into @digest through a
+ * fixed-size buffer, also writing them to @fdt unless it is -1 */
+static gboolean
+digest_copy_bytes (int            fdf,
+                   int            fdt,
+                   off_t          max_bytes,
+                   GLnxDigest    *digest,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  gsize buf_size = copy_buffer_size_for_fd (fdf, 0, max_bytes);
+  void *buf = copy_buffer_acquire (buf_size);
+  gboolean ret = FALSE;
+
+  (void) posix_fadvise (fdf, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  while (max_bytes != 0)
+    {
+      gsize want = buf_size;
+      ssize_t n;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      if (max_bytes != (off_t) -1)
+        want = MIN (want, (guint64) max_bytes);
+
+      n = TEMP_FAILURE_RETRY (read (fdf, buf, want));
+      if (n < 0)
+        {
+          glnx_throw_errno_prefix (error, "read");
+          goto out;
+        }
+      if (n == 0) /* EOF */
+        break;
+
+      glnx_digest_update (digest, buf, n);
+
+      if (fdt >= 0 && glnx_loop_write (fdt, buf, (size_t) n) < 0)
+        {
+          glnx_throw_errno_prefix (error, "write");
+          goto out;
+        }
+
+      if (max_bytes != (off_t) -1)
+        max_bytes -= n;
+    }
+
+  ret = TRUE;
+
+ out:
+  copy_buffer_release (buf, buf_size);
+  return ret;
+}
+
+/**
+ * glnx_fd_readall_digest:
+ * @fd: A file descriptor
+ * @digest: An initialized #GLnxDigest
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Read all data from @fd, from its current offset, into @digest.  Unlike
+ * glnx_fd_readall_bytes(), the data is never held in memory as a whole,
+ * so this is suitable for files of any size.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_fd_readall_digest (int            fd,
+                        GLnxDigest    *digest,
+                        GCancellable  *cancellable,
+                        GError       **error)
+{
+  g_return_val_if_fail (fd >= 0, FALSE);
+
+  return digest_copy_bytes (fd, -1, (off_t) -1, digest, cancellable, error);
+}
+
+/**
+ * glnx_regfile_copy_bytes_digest:
+ * @fdf: Source file descriptor
+ * @fdt: Destination file descriptor
+ * @max_bytes: Maximum number of bytes to copy, or -1 to copy until EOF
+ * @digest: An initialized #GLnxDigest
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like glnx_regfile_copy_bytes(), but also feed the data into @digest, so
+ * that it doesn't need to be read again to verify or index it.  The data
+ * always goes through a buffer in userspace: the kernel's copy offloads
+ * can't be used, since they don't let us see it.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_regfile_copy_bytes_digest (int            fdf,
+                                int            fdt,
+                                off_t          max_bytes,
+                                GLnxDigest    *digest,
+                                GCancellable  *cancellable,
+                                GError       **error)
+{
+  g_return_val_if_fail (fdf >= 0, FALSE);
+  g_return_val_if_fail (fdt >= 0, FALSE);
+  g_return_val_if_fail (max_bytes >= -1, FALSE);
+
+  return digest_copy_bytes (fdf, fdt, max_bytes, digest, cancellable, error);
+}
+
+/* Copy @len bytes at @offset in @src_fd to the same offset in @dest_fd,
+ * without using or changing the file offset of either.  @try_clone and
+ * @try_cfr start out %TRUE and are cleared once we find that reflinking
+ * or copy_file_range() respectively don't work for this pair of files.
+ *
+ * If @src_fd turns out to be shorter than expected, the copy stops early.
+ * On error, returns -1 and sets errno.
+ */
+static int
+copy_file_range_at (int        src_fd,
+                    int        dest_fd,
+                    off_t      offset,
+                    off_t      len,
+                    gboolean  *try_clone,
+                    gboolean  *try_cfr)
+{
+  gsize buf_size;
+  void *buf;
+
+  if (*try_clone)
+    {
+      struct glnx_file_clone_range range = { src_fd, offset, len, offset };
+
+      if (ioctl (dest_fd, FICLONERANGE, &range) == 0)
+        return 0;
+
+      /* Not supported, different filesystems, or not block-aligned */
+      *try_clone = FALSE;
+    }
+
+  while (*try_cfr && len > 0)
+    {
+      loff_t off_in = offset;
+      loff_t off_out = offset;
+      ssize_t n = copy_file_range (src_fd, &off_in, dest_fd, &off_out, len, 0u);
+
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (!G_IN_SET (errno, ENOSYS, EXDEV, EINVAL, EOPNOTSUPP))
+            return -1;
+
+          *try_cfr = FALSE;
+          break;
+        }
+      if (n == 0) /* EOF */
+        return 0;
+
+      offset += n;
+      len -= n;
+    }
+
+  if (len == 0)
+    return 0;
+
+  buf_size = copy_buffer_size_for_fd (src_fd, 0, len);
+  buf = copy_buffer_acquire (buf_size);
+
+  while (len > 0)
+    {
+      ssize_t n = TEMP_FAILURE_RETRY (pread (src_fd, buf, MIN (len, (off_t) buf_size), offset));
+      if (n < 0)
+        goto fail;
+      if (n == 0) /* EOF */
+        break;
+
+      for (ssize_t written = 0; written < n; )
+        {
+          ssize_t k = TEMP_FAILURE_RETRY (pwrite (dest_fd, (char *) buf + written, n - written,
+                                                  offset + written));
+          if (k < 0)
+            goto fail;
+          if (k == 0) /* Can't really happen */
+            {
+              errno = EIO;
+              goto fail;
+            }
+          written += k;
+        }
+
+      offset += n;
+      len -= n;
+    }
+
+  copy_buffer_release (buf, buf_size);
+  return 0;
+
+ fail:
+  {
+    int errsv = errno;
+    copy_buffer_release (buf, buf_size);
+    errno = errsv;
+    return -1;
+  }
+}
+
+/* Copy all of @src_fd to the empty file @dest_fd, skipping the holes in
+ * @src_fd.  Since @dest_fd starts out empty, extending it with ftruncate()
+ * is enough to recreate the holes; nothing needs to be punched.
+ *
+ * On error, returns -1 and sets errno.
+ */
+static int
+sparse_copy_bytes (int src_fd,
+                   int dest_fd)
+{
+  gboolean try_clone = TRUE;
+  gboolean try_cfr = TRUE;
+  struct stat stbuf;
+  off_t offset = 0;
+
+  /* A reflink shares the holes too */
+  if (ioctl (dest_fd, FICLONE, src_fd) == 0)
+    return 0;
+
+  if (fstat (src_fd, &stbuf) < 0)
+    return -1;
+
+  while (offset < stbuf.st_size)
+    {
+      off_t data_start, data_end;
+
+      data_start = lseek (src_fd, offset, SEEK_DATA);
+      if (data_start < 0)
+        {
+          /* Only holes from here to the end of the file */
+          if (errno == ENXIO)
+            break;
+          /* SEEK_DATA not supported; just copy everything */
+          else if (errno == EINVAL && offset == 0)
+            {
+              if (lseek (src_fd, 0, SEEK_SET) < 0)
+                return -1;
+              return glnx_regfile_copy_bytes (src_fd, dest_fd, (off_t) -1);
+            }
+          return -1;
+        }
+
+      data_end = lseek (src_fd, data_start, SEEK_HOLE);
+      if (data_end < 0)
+        return -1;
+      data_end = MIN (data_end, stbuf.st_size);
+
+      if (copy_file_range_at (src_fd, dest_fd, data_start, data_end - data_start,
+                              &try_clone, &try_cfr) < 0)
+        return -1;
+
+      offset = data_end;
+    }
+
+  if (TEMP_FAILURE_RETRY (ftruncate (dest_fd, stbuf.st_size)) < 0)
+    return -1;
+
+  /* Leave the file offsets at the end, like glnx_regfile_copy_bytes() */
+  if (lseek (src_fd, 0, SEEK_END) < 0)
+    return -1;
+  if (lseek (dest_fd, 0, SEEK_END) < 0)
+    return -1;
+
+  return 0;
+}
+
+typedef struct
+{
+  int src_fd;
+  int dest_fd;
+  guint64 size;
+  guint64 chunk_size;
+  guint64 n_chunks;
+  GCancellable *cancellable;
+  GLnxFileCopyProgressFunc progress;
+  gpointer user_data;
+  guint64 bytes_reported;  /* Only used by the calling thread */
+
+  /* Worker threads signal @cond after each extent and when exiting */
+  GMutex lock;
+  GCond cond;
+  guint n_running;  /* Protected by @lock */
+
+  /* All accessed atomically */
+  guint64 next_chunk;
+  guint64 bytes_copied;
+  int errsv;  /* First error; ECANCELED for cancellation */
+} GLnxChunkedCopy;
+
+static void
+chunked_copy_set_error (GLnxChunkedCopy *copy,
+                        int              errsv)
+{
+  int expected = 0;
+
+  __atomic_compare_exchange_n (&copy->errsv, &expected, errsv, FALSE,
+                               __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/* Report progress if any has been made since the last call; only called
+ * from the calling thread. */
+static void
+chunked_copy_report (GLnxChunkedCopy *copy)
+{
+  guint64 bytes_copied = __atomic_load_n (&copy->bytes_copied, __ATOMIC_SEQ_CST);
+
+  if (copy->progress == NULL || bytes_copied == copy->bytes_reported)
+    return;
+
+  copy->progress (bytes_copied, copy->size, copy->user_data);
+  copy->bytes_reported = bytes_copied;
+}
+
+/* Copy chunks until there are none left or something fails.  Only the
+ * calling thread reports progress; the others wake it up instead. */
+static void
+chunked_copy_run (GLnxChunkedCopy *copy,
+                  gboolean         report)
+{
+  gboolean try_clone = TRUE;
+  gboolean try_cfr = TRUE;
+
+  while (__atomic_load_n (&copy->errsv, __ATOMIC_SEQ_CST) == 0)
+    {
+      guint64 idx, offset, len;
+
+      if (g_cancellable_is_cancelled (copy->cancellable))
+        {
+          chunked_copy_set_error (copy, ECANCELED);
+          break;
+        }
+
+      idx = __atomic_fetch_add (&copy->next_chunk, 1, __ATOMIC_SEQ_CST);
+      if (idx >= copy->n_chunks)
+        break;
+
+      offset = idx * copy->chunk_size;
+      len = MIN (copy->chunk_size, copy->size - offset);
+      if (copy_file_range_at (copy->src_fd, copy->dest_fd, offset, len,
+                              &try_clone, &try_cfr) < 0)
+        {
+          chunked_copy_set_error (copy, errno);
+          break;
+        }
+
+      __atomic_add_fetch (&copy->bytes_copied, len, __ATOMIC_SEQ_CST);
+      if (report)
+        chunked_copy_report (copy);
+      else
+        {
+          g_mutex_lock (&copy->lock);
+          g_cond_signal (&copy->cond);
+          g_mutex_unlock (&copy->lock);
+        }
+    }
+}
+
+static gpointer
+chunked_copy_thread (gpointer data)
+{
+  GLnxChunkedCopy *copy = data;
+
+  chunked_copy_run (copy, FALSE);
+
+  g_mutex_lock (&copy->lock);
+  copy->n_running--;
+  g_cond_signal (&copy->cond);
+  g_mutex_unlock (&copy->lock);
+
+  return NULL;
+}
+
+/**
+ * glnx_regfile_copy_bytes_chunked:
+ * @src_fd: Source regular file
+ * @dest_fd: Destination regular file, open for writing
+ * @chunk_size: Size of each independently copied extent, or 0 for a default
+ *   of 64 MiB
+ * @n_threads: Maximum number of threads to use, or 0 for one per CPU
+ * @progress: (nullable) (scope call): Called with the number of bytes copied
+ *   so far and the total size
+ * @user_data: Data for @progress
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Copy the whole contents of @src_fd to @dest_fd, which is truncated to the
+ * same size.  Unlike glnx_regfile_copy_bytes(), the data is copied
+ * in extents of @chunk_size at explicit offsets, so the file offsets of
+ * @src_fd and @dest_fd are neither used nor changed.  Each extent is
+ * reflinked if possible, otherwise copied with copy_file_range() or as a
+ * last resort by reading and writing.
+ *
+ * Up to @n_threads extents are copied concurrently.  @cancellable is checked
+ * and @progress called (always from the calling thread) between extents.
+ * On error or cancellation, the contents of @dest_fd are unspecified.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_regfile_copy_bytes_chunked (int                        src_fd,
+                                 int                        dest_fd,
+                                 guint64                    chunk_size,
+                                 guint                      n_threads,
+                                 GLnxFileCopyProgressFunc   progress,
+                                 gpointer                   user_data,
+                                 GCancellable              *cancellable,
+                                 GError                   **error)
+{
+  GLnxChunkedCopy copy = { 0, };
+  g_autoptr(GPtrArray) threads = g_ptr_array_new ();
+  struct stat stbuf;
+
+  g_return_val_if_fail (src_fd >= 0, FALSE);
+  g_return_val_if_fail (dest_fd >= 0, FALSE);
 
   if (g_cancellable_set_error_if_cancelled (cancellable, error))
     return FALSE;
 
-  /* Automatically do stat() if no stat buffer was supplied */
-  struct stat local_stbuf;
-  if (!src_stbuf)
+  if (!glnx_fstat (src_fd, &stbuf, error))
+    return FALSE;
+  if (!S_ISREG (stbuf.st_mode))
+    return glnx_throw (error, "Cannot copy non-regular file");
+
+  if (chunk_size == 0)
+    chunk_size = 64 * 1024 * 1024;
+
+  copy.src_fd = src_fd;
+  copy.dest_fd = dest_fd;
+  copy.size = stbuf.st_size;
+  copy.chunk_size = chunk_size;
+  copy.n_chunks = (copy.size + chunk_size - 1) / chunk_size;
+  copy.cancellable = cancellable;
+  copy.progress = progress;
+  copy.user_data = user_data;
+
+  if (TEMP_FAILURE_RETRY (ftruncate (dest_fd, stbuf.st_size)) < 0)
+    return glnx_throw_errno_prefix (error, "ftruncate");
+
+  if (n_threads == 0)
+    n_threads = g_get_num_processors ();
+  n_threads = CLAMP (MIN (n_threads, copy.n_chunks), 1, 64);
+
+  g_mutex_init (&copy.lock);
+  g_cond_init (&copy.cond);
+
+  for (guint i = 1; i < n_threads; i++)
+    {
+      GThread *thread;
+
+      g_mutex_lock (&copy.lock);
+      copy.n_running++;
+      g_mutex_unlock (&copy.lock);
+
+      thread = g_thread_try_new ("glnx-copy", chunked_copy_thread, &copy, NULL);
+      /* Not fatal; the remaining threads will pick up its share */
+      if (thread == NULL)
+        {
+          g_mutex_lock (&copy.lock);
+          copy.n_running--;
+          g_mutex_unlock (&copy.lock);
+          break;
+        }
+      g_ptr_array_add (threads, thread);
+    }
+
+  chunked_copy_run (&copy, TRUE);
+
+  /* Keep reporting progress while the other threads finish their extents */
+  g_mutex_lock (&copy.lock);
+  while (copy.n_running > 0)
+    {
+      g_cond_wait (&copy.cond, &copy.lock);
+      g_mutex_unlock (&copy.lock);
+      chunked_copy_report (&copy);
+      g_mutex_lock (&copy.lock);
+    }
+  g_mutex_unlock (&copy.lock);
+
+  for (guint i = 0; i < threads->len; i++)
+    g_thread_join (threads->pdata[i]);
+
+  g_cond_clear (&copy.cond);
+  g_mutex_clear (&copy.lock);
+
+  if (copy.errsv == ECANCELED && g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+  else if (copy.errsv != 0)
+    {
+      errno = copy.errsv;
+      return glnx_throw_errno_prefix (error, "Copying");
+    }
+
+  /* Make sure the caller sees the copy finish, even if another thread
+   * did the last extent */
+  if (progress != NULL && (copy.bytes_reported != copy.size || copy.size == 0))
+    progress (copy.size, copy.size, user_data);
+
+  return TRUE;
+}
+
+/**
+ * glnx_file_copy_at:
+ * @src_dfd: Source directory fd
+ * @src_subpath: Subpath relative to @src_dfd
+ * @src_stbuf: (allow-none): Optional stat buffer for source; if a stat() has already been done
+ * @dest_dfd: Target directory fd
+ * @dest_subpath: Destination name
+ * @copyflags: Flags
+ * @cancellable: cancellable
+ * @error: Error
+ *
+ * Perform a full copy of the regular file or symbolic link from @src_subpath to
+ * @dest_subpath; if @src_subpath is anything other than a regular file or
+ * symbolic link, an error will be returned.
+ *
+ * If the source is a regular file and the destination exists as a symbolic
+ * link, the symbolic link will not be followed; rather the link itself will be
+ * replaced. Related to this: for regular files, when `GLNX_FILE_COPY_OVERWRITE`
+ * is specified, this function always uses `O_TMPFILE` (if available) and does a
+ * rename-into-place rather than `open(O_TRUNC)`.
+ *
+ * If `GLNX_FILE_COPY_SPARSE` is specified and the file can't be reflinked,
+ * only the data ranges found with `SEEK_DATA` and `SEEK_HOLE` are copied, so
+ * holes in the source stay holes in the copy (Since: UNRELEASED).
+ */
+gboolean
+glnx_file_copy_at (int                   src_dfd,
+                   const char           *src_subpath,
+                   const struct stat    *src_stbuf,
+                   int                   dest_dfd,
+                   const char           *dest_subpath,
+                   GLnxFileCopyFlags     copyflags,
+                   GCancellable         *cancellable,
+                   GError              **error)
+{
+  return glnx_file_copy_at_with_digest (src_dfd, src_subpath, src_stbuf,
+                                        dest_dfd, dest_subpath, copyflags,
+                                        NULL, cancellable, error);
+}
+
+/**
+ * glnx_file_copy_at_with_digest:
+ * @src_dfd: Source directory fd
+ * @src_subpath: Subpath relative to @src_dfd
+ * @src_stbuf: (allow-none): Optional stat buffer for source; if a stat() has already been done
+ * @dest_dfd: Target directory fd
+ * @dest_subpath: Destination name
+ * @copyflags: Flags
+ * @digest: (allow-none): An initialized #GLnxDigest to feed the file contents into
+ * @cancellable: cancellable
+ * @error: Error
+ *
+ * Like glnx_file_copy_at(), but if the source is a regular file, also feed
+ * its contents into @digest; @digest is left alone for symbolic links.
+ *
+ * If the data has to be copied through userspace, it is hashed on the way
+ * with no extra I/O.  If the kernel copies it (by reflinking or with
+ * copy_file_range()), the source is read once more, sequentially, to hash
+ * it.  Either way, callers don't need to read the copy back to verify it.
+ *
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_file_copy_at_with_digest (int                   src_dfd,
+                               const char           *src_subpath,
+                               const struct stat    *src_stbuf,
+                               int                   dest_dfd,
+                               const char           *dest_subpath,
+                               GLnxFileCopyFlags     copyflags,
+                               GLnxDigest           *digest,
+                               GCancellable         *cancellable,
+                               GError              **error)
+{
+  gboolean digested = FALSE;
+
+  /* Canonicalize dfds */
+  src_dfd = glnx_dirfd_canonicalize (src_dfd);
+  dest_dfd = glnx_dirfd_canonicalize (dest_dfd);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  /* Automatically do stat() if no stat buffer was supplied */
+  struct stat local_stbuf;
+  if (!src_stbuf)
+    {
+      if (!glnx_fstatat (src_dfd, src_subpath, &local_stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+      src_stbuf = &local_stbuf;
+    }
+
+  /* For symlinks, defer entirely to copy_symlink_at() */
+  if (S_ISLNK (src_stbuf->st_mode))
+    {
+      return copy_symlink_at (src_dfd, src_subpath, src_stbuf,
+                              dest_dfd, dest_subpath,
+                              copyflags,
+                              cancellable, error);
+    }
+  else if (!S_ISREG (src_stbuf->st_mode))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Cannot copy non-regular/non-symlink file: %s", src_subpath);
+      return FALSE;
+    }
+
+  /* Regular file path below here */
+
+  glnx_autofd int src_fd = -1;
+  if (!glnx_openat_rdonly (src_dfd, src_subpath, FALSE, &src_fd, error))
+    return FALSE;
+
+  /* Open a tmpfile for dest. Particularly for AT_FDCWD calls, we really want to
+   * open in the target directory, otherwise we may not be able to link.
+   */
+  g_auto(GLnxTmpfile) tmp_dest = { 0, };
+  { char *dnbuf = strdupa (dest_subpath);
+    const char *dn = dirname (dnbuf);
+    if (!glnx_open_tmpfile_linkable_at (dest_dfd, dn, O_WRONLY | O_CLOEXEC,
+                                        &tmp_dest, error))
+      return FALSE;
+  }
+
+  if (copyflags & GLNX_FILE_COPY_SPARSE)
+    {
+      if (sparse_copy_bytes (src_fd, tmp_dest.fd) < 0)
+        return glnx_throw_errno_prefix (error, "regfile copy");
+    }
+  else if (regfile_copy_bytes_internal (src_fd, tmp_dest.fd, (off_t) -1, 0,
+                                        digest, &digested) < 0)
+    return glnx_throw_errno_prefix (error, "regfile copy");
+
+  if (digest != NULL && !digested)
+    {
+      if (lseek (src_fd, 0, SEEK_SET) < 0)
+        return glnx_throw_errno_prefix (error, "lseek");
+      if (!glnx_fd_readall_digest (src_fd, digest, cancellable, error))
+        return FALSE;
+    }
+
+  if (!(copyflags & GLNX_FILE_COPY_NOCHOWN))
+    {
+      if (fchown (tmp_dest.fd, src_stbuf->st_uid, src_stbuf->st_gid) != 0)
+        return glnx_throw_errno_prefix (error, "fchown");
+    }
+
+  if (!(copyflags & GLNX_FILE_COPY_NOXATTRS))
+    {
+      g_autoptr(GVariant) xattrs = NULL;
+
+      if (!glnx_fd_get_all_xattrs (src_fd, &xattrs,
+                                   cancellable, error))
+        return FALSE;
+
+      if (!glnx_fd_set_all_xattrs (tmp_dest.fd, xattrs,
+                                   cancellable, error))
+        return FALSE;
+    }
+
+  /* Always chmod after setting xattrs, in case the file has mode 0400 or less,
+   * like /etc/shadow.  Linux currently allows write() on non-writable open files
+   * but not fsetxattr().
+   */
+  if (fchmod (tmp_dest.fd, src_stbuf->st_mode & 07777) != 0)
+    return glnx_throw_errno_prefix (error, "fchmod");
+
+  struct timespec ts[2];
+  ts[0] = src_stbuf->st_atim;
+  ts[1] = src_stbuf->st_mtim;
+  (void) futimens (tmp_dest.fd, ts);
+
+  if (copyflags & GLNX_FILE_COPY_DATASYNC)
+    {
+      if (fdatasync (tmp_dest.fd) < 0)
+        return glnx_throw_errno_prefix (error, "fdatasync");
+    }
+
+  const GLnxLinkTmpfileReplaceMode replacemode =
+    (copyflags & GLNX_FILE_COPY_OVERWRITE) ?
+    GLNX_LINK_TMPFILE_REPLACE :
+    GLNX_LINK_TMPFILE_NOREPLACE;
+
+  if (!glnx_link_tmpfile_at (&tmp_dest, replacemode, dest_dfd, dest_subpath, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/**
+ * glnx_file_replace_contents_at:
+ * @dfd: Directory fd
+ * @subpath: Subpath
+ * @buf: (array len=len) (element-type guint8): File contents
+ * @len: Length (if `-1`, assume @buf is `NUL` terminated)
+ * @flags: Flags
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Create a new file, atomically replacing the contents of @subpath
+ * (relative to @dfd) with @buf.  By default, if the file already
+ * existed, fdatasync() will be used before rename() to ensure stable
+ * contents.  This and other behavior can be controlled via @flags.
+ *
+ * Note that no metadata from the existing file is preserved, such as
+ * uid/gid or extended attributes.  The default mode will be `0644`.
+ */ 
+gboolean
+glnx_file_replace_contents_at (int                   dfd,
+                               const char           *subpath,
+                               const guint8         *buf,
+                               gsize                 len,
+                               GLnxFileReplaceFlags  flags,
+                               GCancellable         *cancellable,
+                               GError              **error)
+{
+  return glnx_file_replace_contents_with_perms_at (dfd, subpath, buf, len,
+                                                   (mode_t) -1, (uid_t) -1, (gid_t) -1,
+                                                   flags, cancellable, error);
+}
+
+/* Create a tmpfile in the directory of @subpath, and write the
+ * concatenation of @iov to it */
+static gboolean
+replace_contents_write_tmpfile (int                  dfd,
+                                const char          *subpath,
+                                const struct iovec  *iov,
+                                int                  iovcnt,
+                                GLnxTmpfile         *out_tmpf,
+                                GError             **error)
+{
+  char *dnbuf = strdupa (subpath);
+  const char *dn = dirname (dnbuf);
+  gsize len = 0;
+
+  if (!glnx_open_tmpfile_linkable_at (dfd, dn, O_WRONLY | O_CLOEXEC,
+                                      out_tmpf, error))
+    return FALSE;
+
+  for (int i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+
+  if (!glnx_try_fallocate (out_tmpf->fd, 0, len, error))
+    return FALSE;
+
+  if (glnx_loop_writev (out_tmpf->fd, iov, iovcnt) < 0)
+    return glnx_throw_errno_prefix (error, "write");
+
+  return TRUE;
+}
+
+/* Set the owner (unless @uid is -1) and mode of @fd */
+static gboolean
+replace_contents_set_perms (int       fd,
+                            mode_t    mode,
+                            uid_t     uid,
+                            gid_t     gid,
+                            GError  **error)
+{
+  if (uid != (uid_t) -1)
+    {
+      if (TEMP_FAILURE_RETRY (fchown (fd, uid, gid)) != 0)
+        return glnx_throw_errno_prefix (error, "fchown");
+    }
+
+  if (TEMP_FAILURE_RETRY (fchmod (fd, mode)) != 0)
+    return glnx_throw_errno_prefix (error, "fchmod");
+
+  return TRUE;
+}
+
+/* The part of replacing a file's contents that follows writing them to
+ * @tmpf: syncing, setting metadata as requested by @mode, @uid, @gid and
+ * @flags, and linking it into place as @subpath */
+static gboolean
+replace_contents_finish (GLnxTmpfile          *tmpf,
+                         int                   dfd,
+                         const char           *subpath,
+                         mode_t                mode,
+                         uid_t                 uid,
+                         gid_t                 gid,
+                         GLnxFileReplaceFlags  flags,
+                         GError              **error)
+{
+  gboolean increasing_mtime = (flags & GLNX_FILE_REPLACE_INCREASING_MTIME) != 0;
+  gboolean nodatasync = (flags & GLNX_FILE_REPLACE_NODATASYNC) != 0;
+  gboolean datasync_new = (flags & GLNX_FILE_REPLACE_DATASYNC_NEW) != 0;
+  struct stat stbuf;
+  gboolean has_stbuf = FALSE;
+
+  /* With O_TMPFILE we can't use umask, and we can't sanely query the
+   * umask...let's assume something relatively standard.
+   */
+  if (mode == (mode_t) -1)
+    mode = 0644;
+
+  if (!nodatasync || increasing_mtime)
+    {
+      if (!glnx_fstatat_allow_noent (dfd, subpath, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+      has_stbuf = errno != ENOENT;
+    }
+
+  if (!nodatasync)
+    {
+      gboolean do_sync;
+      if (!has_stbuf)
+        do_sync = datasync_new;
+      else
+        do_sync = TRUE;
+
+      if (do_sync)
+        {
+          if (TEMP_FAILURE_RETRY (fdatasync (tmpf->fd)) != 0)
+            return glnx_throw_errno_prefix (error, "fdatasync");
+        }
+    }
+
+  if (!replace_contents_set_perms (tmpf->fd, mode, uid, gid, error))
+    return FALSE;
+
+  if (increasing_mtime && has_stbuf)
+    {
+      struct stat fd_stbuf;
+
+      if (fstat (tmpf->fd, &fd_stbuf) != 0)
+        return glnx_throw_errno_prefix (error, "fstat");
+
+      /* We want to ensure that the new file has a st_mtime (i.e. the second precision)
+       * is incrementing to avoid mtime check issues when files change often.
+       */
+      if (fd_stbuf.st_mtime <= stbuf.st_mtime)
+        {
+          struct timespec ts[2] = { {0, UTIME_OMIT}, {stbuf.st_mtime + 1, 0} };
+          if (TEMP_FAILURE_RETRY (futimens (tmpf->fd, ts)) != 0)
+            return glnx_throw_errno_prefix (error, "futimens");
+        }
+    }
+
+  if (!glnx_link_tmpfile_at (tmpf, GLNX_LINK_TMPFILE_REPLACE,
+                             dfd, subpath, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+static gboolean
+replace_contents_iov (int                   dfd,
+                      const char           *subpath,
+                      const struct iovec   *iov,
+                      int                   iovcnt,
+                      mode_t                mode,
+                      uid_t                 uid,
+                      gid_t                 gid,
+                      GLnxFileReplaceFlags  flags,
+                      G_GNUC_UNUSED GCancellable *cancellable,
+                      GError              **error)
+{
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+
+  dfd = glnx_dirfd_canonicalize (dfd);
+
+  if (!replace_contents_write_tmpfile (dfd, subpath, iov, iovcnt, &tmpf, error))
+    return FALSE;
+
+  return replace_contents_finish (&tmpf, dfd, subpath, mode, uid, gid, flags, error);
+}
+
+/**
+ * glnx_file_replace_contents_with_perms_at:
+ * @dfd: Directory fd
+ * @subpath: Subpath
+ * @buf: (array len=len) (element-type guint8): File contents
+ * @len: Length (if `-1`, assume @buf is `NUL` terminated)
+ * @mode: File mode; if `-1`, use `0644`
+ * @flags: Flags
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like glnx_file_replace_contents_at(), but also supports
+ * setting mode, and uid/gid.
+ */ 
+gboolean
+glnx_file_replace_contents_with_perms_at (int                   dfd,
+                                          const char           *subpath,
+                                          const guint8         *buf,
+                                          gsize                 len,
+                                          mode_t                mode,
+                                          uid_t                 uid,
+                                          gid_t                 gid,
+                                          GLnxFileReplaceFlags  flags,
+                                          GCancellable         *cancellable,
+                                          GError              **error)
+{
+  struct iovec iov;
+
+  if (len == (gsize) -1)
+    len = strlen ((char*)buf);
+
+  iov.iov_base = (void *) buf;
+  iov.iov_len = len;
+  return replace_contents_iov (dfd, subpath, &iov, 1, mode, uid, gid,
+                               flags, cancellable, error);
+}
+
+/**
+ * glnx_file_replace_contents_iov_at:
+ * @dfd: Directory fd
+ * @subpath: Subpath
+ * @iov: (array length=iovcnt): Buffers to write, in order
+ * @iovcnt: Number of elements in @iov
+ * @flags: Flags
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like glnx_file_replace_contents_at(), but the contents are the
+ * concatenation of the buffers in @iov, which are written with
+ * glnx_loop_writev().  This avoids copying separately built parts of a
+ * file (say, a header, a body and a trailer) into a single buffer first.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_file_replace_contents_iov_at (int                   dfd,
+                                   const char           *subpath,
+                                   const struct iovec   *iov,
+                                   int                   iovcnt,
+                                   GLnxFileReplaceFlags  flags,
+                                   GCancellable         *cancellable,
+                                   GError              **error)
+{
+  return replace_contents_iov (dfd, subpath, iov, iovcnt,
+                               (mode_t) -1, (uid_t) -1, (gid_t) -1,
+                               flags, cancellable, error);
+}
+
+/* Appends smaller than this are buffered */
+#define ATOMIC_WRITER_BUFFER_SIZE (64 * 1024)
+
+struct _GLnxAtomicWriter
+{
+  GLnxTmpfile tmpf;
+  int dfd;
+  char *subpath;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  GLnxFileReplaceFlags flags;
+  /* What was preallocated */
+  guint64 expected_size;
+
+  guint8 *buf;
+  gsize buf_len;
+  gboolean committed;
+  /* A write failed, so it's unknown what made it into the file */
+  gboolean failed;
+
+  /* A GLnxAtomicWriterStream */
+  GOutputStream *stream;
+};
+
+/* The #GOutputStream returned by glnx_atomic_writer_get_output_stream().
+ * It writes to the tmpfile through a duplicate of its fd, so that it
+ * shares the file offset with appends, and remembers whether a write
+ * failed. */
+typedef struct
+{
+  GOutputStream parent_instance;
+  int fd;
+  gboolean failed;
+} GLnxAtomicWriterStream;
+
+typedef struct
+{
+  GOutputStreamClass parent_class;
+} GLnxAtomicWriterStreamClass;
+
+static gpointer atomic_writer_stream_parent_class;
+
+static gssize
+atomic_writer_stream_write (GOutputStream  *stream,
+                            const void     *buffer,
+                            gsize           count,
+                            GCancellable   *cancellable,
+                            GError        **error)
+{
+  GLnxAtomicWriterStream *self = (GLnxAtomicWriterStream *) stream;
+  gssize n;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return -1;
+
+  n = TEMP_FAILURE_RETRY (write (self->fd, buffer, MIN (count, G_MAXSSIZE)));
+  if (n < 0)
     {
-      if (!glnx_fstatat (src_dfd, src_subpath, &local_stbuf, AT_SYMLINK_NOFOLLOW, error))
-        return FALSE;
-      src_stbuf = &local_stbuf;
+      self->failed = TRUE;
+      glnx_set_error_from_errno (error);
+      return -1;
     }
 
-  /* For symlinks, defer entirely to copy_symlink_at() */
-  if (S_ISLNK (src_stbuf->st_mode))
+  return n;
+}
+
+static gboolean
+atomic_writer_stream_close (GOutputStream               *stream,
+                            G_GNUC_UNUSED GCancellable  *cancellable,
+                            GError                     **error)
+{
+  GLnxAtomicWriterStream *self = (GLnxAtomicWriterStream *) stream;
+  int fd = glnx_steal_fd (&self->fd);
+
+  if (fd >= 0 && close (fd) < 0)
+    return glnx_throw_errno_prefix (error, "close");
+  return TRUE;
+}
+
+static void
+atomic_writer_stream_finalize (GObject *object)
+{
+  GLnxAtomicWriterStream *self = (GLnxAtomicWriterStream *) object;
+
+  glnx_close_fd (&self->fd);
+  G_OBJECT_CLASS (atomic_writer_stream_parent_class)->finalize (object);
+}
+
+static void
+atomic_writer_stream_class_init (gpointer klass,
+                                 G_GNUC_UNUSED gpointer class_data)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GOutputStreamClass *stream_class = G_OUTPUT_STREAM_CLASS (klass);
+
+  atomic_writer_stream_parent_class = g_type_class_peek_parent (klass);
+  object_class->finalize = atomic_writer_stream_finalize;
+  stream_class->write_fn = atomic_writer_stream_write;
+  stream_class->close_fn = atomic_writer_stream_close;
+}
+
+static void
+atomic_writer_stream_init (GTypeInstance *instance,
+                           G_GNUC_UNUSED gpointer klass)
+{
+  GLnxAtomicWriterStream *self = (GLnxAtomicWriterStream *) instance;
+
+  self->fd = -1;
+}
+
+static GType
+atomic_writer_stream_get_type (void)
+{
+  static gsize type_id = 0;
+
+  if (g_once_init_enter (&type_id))
     {
-      return copy_symlink_at (src_dfd, src_subpath, src_stbuf,
-                              dest_dfd, dest_subpath,
-                              copyflags,
-                              cancellable, error);
+      /* Not G_DEFINE_TYPE: libglnx gets embedded into several libraries,
+       * whose copies would all try to register the same type name */
+      g_autofree char *name = g_strdup_printf ("GLnxAtomicWriterStream-%p",
+                                               (void *) &type_id);
+      GType type = g_type_register_static_simple (G_TYPE_OUTPUT_STREAM, name,
+                                                  sizeof (GLnxAtomicWriterStreamClass),
+                                                  atomic_writer_stream_class_init,
+                                                  sizeof (GLnxAtomicWriterStream),
+                                                  atomic_writer_stream_init, 0);
+
+      g_once_init_leave (&type_id, type);
     }
-  else if (!S_ISREG (src_stbuf->st_mode))
+
+  return type_id;
+}
+
+static gboolean
+atomic_writer_check_failed (GLnxAtomicWriter  *writer,
+                            GError           **error)
+{
+  if (writer->stream != NULL &&
+      ((GLnxAtomicWriterStream *) writer->stream)->failed)
+    writer->failed = TRUE;
+  if (writer->failed)
+    return glnx_throw (error, "A previous write to %s failed", writer->subpath);
+  return TRUE;
+}
+
+/**
+ * glnx_atomic_writer_new:
+ * @dfd: Directory fd
+ * @subpath: Subpath of the file to replace
+ * @expected_size: Size to preallocate, or 0 if not known
+ * @mode: File mode; if `-1`, use `0644`
+ * @uid: File owner, or `-1` to not change it
+ * @gid: File group, used if @uid is not `-1`
+ * @flags: Flags
+ * @error: Error
+ *
+ * Start replacing the contents of @subpath (relative to @dfd) like
+ * glnx_file_replace_contents_with_perms_at() does, but with contents that
+ * are written incrementally with glnx_atomic_writer_append() or the
+ * #GOutputStream from glnx_atomic_writer_get_output_stream().  This allows
+ * generating large files atomically without holding them in memory.
+ *
+ * The data goes to a temporary file, which glnx_atomic_writer_commit()
+ * links into place, applying @mode, @uid, @gid and @flags as
+ * glnx_file_replace_contents_with_perms_at() would.  Freeing the writer
+ * without committing discards it.
+ *
+ * If @expected_size is known, that much space is allocated up front; it is
+ * fine to end up writing less or more.  The directory fd @dfd must stay
+ * open until the writer is freed.
+ *
+ * Returns: (transfer full): A new writer, or %NULL on error
+ * Since: UNRELEASED
+ */
+GLnxAtomicWriter *
+glnx_atomic_writer_new (int                    dfd,
+                        const char            *subpath,
+                        guint64                expected_size,
+                        mode_t                 mode,
+                        uid_t                  uid,
+                        gid_t                  gid,
+                        GLnxFileReplaceFlags   flags,
+                        GError               **error)
+{
+  g_autoptr(GLnxAtomicWriter) writer = g_new0 (GLnxAtomicWriter, 1);
+  char *dnbuf = strdupa (subpath);
+  const char *dn = dirname (dnbuf);
+
+  writer->dfd = glnx_dirfd_canonicalize (dfd);
+  writer->subpath = g_strdup (subpath);
+  writer->mode = mode;
+  writer->uid = uid;
+  writer->gid = gid;
+  writer->flags = flags;
+  writer->expected_size = expected_size;
+
+  if (!glnx_open_tmpfile_linkable_at (writer->dfd, dn, O_WRONLY | O_CLOEXEC,
+                                      &writer->tmpf, error))
+    return NULL;
+
+  if (!glnx_try_fallocate (writer->tmpf.fd, 0, expected_size, error))
+    return NULL;
+
+  return g_steal_pointer (&writer);
+}
+
+/**
+ * glnx_atomic_writer_free:
+ * @writer: A #GLnxAtomicWriter
+ *
+ * Free @writer.  If it wasn't committed, the data written so far is
+ * discarded, and the file it was going to replace is left alone.
+ *
+ * Since: UNRELEASED
+ */
+void
+glnx_atomic_writer_free (GLnxAtomicWriter *writer)
+{
+  if (writer->stream != NULL)
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
-                   "Cannot copy non-regular/non-symlink file: %s", src_subpath);
-      return FALSE;
+      /* In case the caller holds another reference */
+      (void) g_output_stream_close (writer->stream, NULL, NULL);
+      g_object_unref (writer->stream);
     }
+  glnx_tmpfile_clear (&writer->tmpf);
+  g_free (writer->subpath);
+  g_free (writer->buf);
+  g_free (writer);
+}
 
-  /* Regular file path below here */
+/**
+ * glnx_atomic_writer_append:
+ * @writer: A #GLnxAtomicWriter
+ * @buf: (array length=len): Data
+ * @len: Length of @buf
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Append @buf to the contents of the file.  Small appends are collected
+ * in a buffer, and written out together, unless the stream from
+ * glnx_atomic_writer_get_output_stream() is in use.
+ *
+ * If writing fails, it is unknown how much of the data made it into the
+ * file, so this and all other operations on @writer fail from then on.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_atomic_writer_append (GLnxAtomicWriter  *writer,
+                           const void        *buf,
+                           gsize              len,
+                           GCancellable      *cancellable,
+                           GError           **error)
+{
+  g_return_val_if_fail (!writer->committed, FALSE);
 
-  glnx_autofd int src_fd = -1;
-  if (!glnx_openat_rdonly (src_dfd, src_subpath, FALSE, &src_fd, error))
+  if (!atomic_writer_check_failed (writer, error))
     return FALSE;
 
-  /* Open a tmpfile for dest. Particularly for AT_FDCWD calls, we really want to
-   * open in the target directory, otherwise we may not be able to link.
-   */
-  g_auto(GLnxTmpfile) tmp_dest = { 0, };
-  { char *dnbuf = strdupa (dest_subpath);
-    const char *dn = dirname (dnbuf);
-    if (!glnx_open_tmpfile_linkable_at (dest_dfd, dn, O_WRONLY | O_CLOEXEC,
-                                        &tmp_dest, error))
-      return FALSE;
-  }
+  /* Data written through the stream must not overtake the buffer */
+  if (writer->stream == NULL &&
+      writer->buf_len + len <= ATOMIC_WRITER_BUFFER_SIZE)
+    {
+      if (writer->buf == NULL)
+        writer->buf = g_malloc (ATOMIC_WRITER_BUFFER_SIZE);
+      memcpy (writer->buf + writer->buf_len, buf, len);
+      writer->buf_len += len;
+      return TRUE;
+    }
 
-  if (glnx_regfile_copy_bytes (src_fd, tmp_dest.fd, (off_t) -1) < 0)
-    return glnx_throw_errno_prefix (error, "regfile copy");
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
 
-  if (!(copyflags & GLNX_FILE_COPY_NOCHOWN))
+  /* Write what's buffered and @buf in one go, rather than copying @buf */
+  const struct iovec iov[] = {
+    { writer->buf, writer->buf_len },
+    { (void *) buf, len },
+  };
+  if (glnx_loop_writev (writer->tmpf.fd, iov, G_N_ELEMENTS (iov)) < 0)
     {
-      if (fchown (tmp_dest.fd, src_stbuf->st_uid, src_stbuf->st_gid) != 0)
-        return glnx_throw_errno_prefix (error, "fchown");
+      writer->failed = TRUE;
+      return glnx_throw_errno_prefix (error, "write");
     }
+  writer->buf_len = 0;
 
-  if (!(copyflags & GLNX_FILE_COPY_NOXATTRS))
-    {
-      g_autoptr(GVariant) xattrs = NULL;
+  return TRUE;
+}
 
-      if (!glnx_fd_get_all_xattrs (src_fd, &xattrs,
-                                   cancellable, error))
-        return FALSE;
+/**
+ * glnx_atomic_writer_flush:
+ * @writer: A #GLnxAtomicWriter
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Write out any buffered data to the temporary file.  This doesn't make
+ * any of it visible in the file being replaced.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_atomic_writer_flush (GLnxAtomicWriter  *writer,
+                          GCancellable      *cancellable,
+                          GError           **error)
+{
+  g_return_val_if_fail (!writer->committed, FALSE);
 
-      if (!glnx_fd_set_all_xattrs (tmp_dest.fd, xattrs,
-                                   cancellable, error))
-        return FALSE;
+  if (!atomic_writer_check_failed (writer, error))
+    return FALSE;
+
+  if (writer->buf_len == 0)
+    return TRUE;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  if (glnx_loop_write (writer->tmpf.fd, writer->buf, writer->buf_len) < 0)
+    {
+      writer->failed = TRUE;
+      return glnx_throw_errno_prefix (error, "write");
     }
+  writer->buf_len = 0;
 
-  /* Always chmod after setting xattrs, in case the file has mode 0400 or less,
-   * like /etc/shadow.  Linux currently allows write() on non-writable open files
-   * but not fsetxattr().
-   */
-  if (fchmod (tmp_dest.fd, src_stbuf->st_mode & 07777) != 0)
-    return glnx_throw_errno_prefix (error, "fchmod");
+  return TRUE;
+}
 
-  struct timespec ts[2];
-  ts[0] = src_stbuf->st_atim;
-  ts[1] = src_stbuf->st_mtim;
-  (void) futimens (tmp_dest.fd, ts);
+/**
+ * glnx_atomic_writer_get_output_stream:
+ * @writer: A #GLnxAtomicWriter
+ * @error: Error
+ *
+ * Get a #GOutputStream that appends to @writer, for use with APIs such as
+ * g_output_stream_splice().  Buffered data is written out first, and from
+ * then on glnx_atomic_writer_append() doesn't buffer, so that both can be
+ * mixed.  Closing the stream does not commit @writer; call
+ * glnx_atomic_writer_commit() for that, which closes the stream.
+ *
+ * As with glnx_atomic_writer_append(), once a write to the stream failed,
+ * all other operations on @writer fail too.
+ *
+ * Returns: (transfer none): The stream, owned by @writer, or %NULL on error
+ * Since: UNRELEASED
+ */
+GOutputStream *
+glnx_atomic_writer_get_output_stream (GLnxAtomicWriter  *writer,
+                                      GError           **error)
+{
+  g_return_val_if_fail (!writer->committed, NULL);
 
-  if (copyflags & GLNX_FILE_COPY_DATASYNC)
+  if (writer->stream == NULL)
     {
-      if (fdatasync (tmp_dest.fd) < 0)
-        return glnx_throw_errno_prefix (error, "fdatasync");
+      int fd;
+
+      if (!glnx_atomic_writer_flush (writer, NULL, error))
+        return NULL;
+
+      fd = fcntl (writer->tmpf.fd, F_DUPFD_CLOEXEC, 3);
+      if (fd < 0)
+        return glnx_null_throw_errno_prefix (error, "fcntl(F_DUPFD_CLOEXEC)");
+      writer->stream = g_object_new (atomic_writer_stream_get_type (), NULL);
+      ((GLnxAtomicWriterStream *) writer->stream)->fd = fd;
     }
 
-  const GLnxLinkTmpfileReplaceMode replacemode =
-    (copyflags & GLNX_FILE_COPY_OVERWRITE) ?
-    GLNX_LINK_TMPFILE_REPLACE :
-    GLNX_LINK_TMPFILE_NOREPLACE;
+  return writer->stream;
+}
+
+/**
+ * glnx_atomic_writer_commit:
+ * @writer: A #GLnxAtomicWriter
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Write out any buffered data, and atomically replace the file with the
+ * data written so far, applying the flags and permissions @writer was
+ * created with.  Nothing can be appended after this.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_atomic_writer_commit (GLnxAtomicWriter  *writer,
+                           GCancellable      *cancellable,
+                           GError           **error)
+{
+  off_t size;
+
+  g_return_val_if_fail (!writer->committed, FALSE);
+
+  if (!glnx_atomic_writer_flush (writer, cancellable, error))
+    return FALSE;
+
+  if (writer->stream != NULL &&
+      !g_output_stream_close (writer->stream, cancellable, error))
+    return FALSE;
+
+  /* Everything was appended, so the offset is the size */
+  size = lseek (writer->tmpf.fd, 0, SEEK_CUR);
+  if (size < 0)
+    return glnx_throw_errno_prefix (error, "lseek");
+
+  /* Preallocating extended the file */
+  if ((guint64) size < writer->expected_size &&
+      TEMP_FAILURE_RETRY (ftruncate (writer->tmpf.fd, size)) != 0)
+    return glnx_throw_errno_prefix (error, "ftruncate");
+
+  if (!replace_contents_finish (&writer->tmpf, writer->dfd, writer->subpath,
+                                writer->mode, writer->uid, writer->gid,
+                                writer->flags, error))
+    return FALSE;
+
+  writer->committed = TRUE;
+  return TRUE;
+}
+
+/* Staged files are committed early once there are this many, since each
+ * of them holds a file descriptor */
+#define REPLACE_BATCH_MAX_STAGED 512
+
+typedef struct
+{
+  GLnxTmpfile tmpf;
+  int dfd;
+  char *subpath;
+} GLnxReplaceBatchEntry;
+
+struct _GLnxReplaceBatch
+{
+  GArray *entries;  /* GLnxReplaceBatchEntry */
+};
+
+static void
+replace_batch_entry_clear (gpointer data)
+{
+  GLnxReplaceBatchEntry *entry = data;
 
-  if (!glnx_link_tmpfile_at (&tmp_dest, replacemode, dest_dfd, dest_subpath, error))
-    return FALSE;
+  glnx_tmpfile_clear (&entry->tmpf);
+  g_free (entry->subpath);
+}
 
-  return TRUE;
+/**
+ * glnx_replace_batch_new:
+ *
+ * Create a batch of files to be replaced together with
+ * glnx_replace_batch_commit().  This gives the same guarantees as
+ * glnx_file_replace_contents_at() for each file, plus durability of the
+ * rename, but with one round of flushes for the whole batch instead of a
+ * synchronous flush per file.
+ *
+ * Returns: (transfer full): A new, empty batch
+ * Since: UNRELEASED
+ */
+GLnxReplaceBatch *
+glnx_replace_batch_new (void)
+{
+  GLnxReplaceBatch *batch = g_new0 (GLnxReplaceBatch, 1);
+
+  batch->entries = g_array_new (FALSE, FALSE, sizeof (GLnxReplaceBatchEntry));
+  g_array_set_clear_func (batch->entries, replace_batch_entry_clear);
+  return batch;
 }
 
 /**
- * glnx_file_replace_contents_at:
+ * glnx_replace_batch_free:
+ * @batch: A #GLnxReplaceBatch
+ *
+ * Free @batch.  Files that were added but not committed are discarded.
+ *
+ * Since: UNRELEASED
+ */
+void
+glnx_replace_batch_free (GLnxReplaceBatch *batch)
+{
+  g_clear_pointer (&batch->entries, g_array_unref);
+  g_free (batch);
+}
+
+/**
+ * glnx_replace_batch_add_tmpfile:
+ * @batch: A #GLnxReplaceBatch
+ * @tmpf: A tmpfile from glnx_open_tmpfile_linkable_at(), with its contents
+ *   and permissions already set up
  * @dfd: Directory fd
- * @subpath: Subpath
- * @buf: (array len=len) (element-type guint8): File contents
- * @len: Length (if `-1`, assume @buf is `NUL` terminated)
- * @flags: Flags
+ * @subpath: Path to replace, relative to @dfd; it must be in the directory
+ *   @tmpf was created in
  * @cancellable: Cancellable
  * @error: Error
  *
- * Create a new file, atomically replacing the contents of @subpath
- * (relative to @dfd) with @buf.  By default, if the file already
- * existed, fdatasync() will be used before rename() to ensure stable
- * contents.  This and other behavior can be controlled via @flags.
+ * Take over @tmpf, to be linked into place at @subpath when @batch is
+ * committed.  @tmpf is cleared, and @dfd must stay open until then.
  *
- * Note that no metadata from the existing file is preserved, such as
- * uid/gid or extended attributes.  The default mode will be `0644`.
- */ 
+ * Since each staged file holds a file descriptor, this commits the batch
+ * when it grows large, and can fail for the same reasons as
+ * glnx_replace_batch_commit().
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ * Since: UNRELEASED
+ */
 gboolean
-glnx_file_replace_contents_at (int                   dfd,
-                               const char           *subpath,
-                               const guint8         *buf,
-                               gsize                 len,
-                               GLnxFileReplaceFlags  flags,
-                               GCancellable         *cancellable,
-                               GError              **error)
+glnx_replace_batch_add_tmpfile (GLnxReplaceBatch  *batch,
+                                GLnxTmpfile       *tmpf,
+                                int                dfd,
+                                const char        *subpath,
+                                GCancellable      *cancellable,
+                                GError           **error)
 {
-  return glnx_file_replace_contents_with_perms_at (dfd, subpath, buf, len,
-                                                   (mode_t) -1, (uid_t) -1, (gid_t) -1,
-                                                   flags, cancellable, error);
+  GLnxReplaceBatchEntry entry = { { 0, }, };
+
+  g_return_val_if_fail (tmpf->initialized, FALSE);
+
+  entry.tmpf = *tmpf;
+  *tmpf = (GLnxTmpfile) { 0, };
+  entry.dfd = glnx_dirfd_canonicalize (dfd);
+  entry.subpath = g_strdup (subpath);
+  g_array_append_val (batch->entries, entry);
+
+  if (batch->entries->len >= REPLACE_BATCH_MAX_STAGED)
+    return glnx_replace_batch_commit (batch, cancellable, error);
+
+  return TRUE;
 }
 
 /**
- * glnx_file_replace_contents_with_perms_at:
+ * glnx_replace_batch_add_contents:
+ * @batch: A #GLnxReplaceBatch
  * @dfd: Directory fd
- * @subpath: Subpath
- * @buf: (array len=len) (element-type guint8): File contents
- * @len: Length (if `-1`, assume @buf is `NUL` terminated)
+ * @subpath: Path to replace, relative to @dfd
+ * @buf: (array length=len) (element-type guint8): File contents
+ * @len: Length of @buf, or -1 if @buf is nul-terminated
  * @mode: File mode; if `-1`, use `0644`
- * @flags: Flags
+ * @uid: File uid, or `-1` to keep the current one
+ * @gid: File gid, used with @uid
  * @cancellable: Cancellable
  * @error: Error
  *
- * Like glnx_file_replace_contents_at(), but also supports
- * setting mode, and uid/gid.
- */ 
+ * Write @buf to a new tmpfile in the directory of @subpath, and stage it
+ * with glnx_replace_batch_add_tmpfile().
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ * Since: UNRELEASED
+ */
 gboolean
-glnx_file_replace_contents_with_perms_at (int                   dfd,
-                                          const char           *subpath,
-                                          const guint8         *buf,
-                                          gsize                 len,
-                                          mode_t                mode,
-                                          uid_t                 uid,
-                                          gid_t                 gid,
-                                          GLnxFileReplaceFlags  flags,
-                                          G_GNUC_UNUSED GCancellable *cancellable,
-                                          GError              **error)
+glnx_replace_batch_add_contents (GLnxReplaceBatch  *batch,
+                                 int                dfd,
+                                 const char        *subpath,
+                                 const guint8      *buf,
+                                 gsize              len,
+                                 mode_t             mode,
+                                 uid_t              uid,
+                                 gid_t              gid,
+                                 GCancellable      *cancellable,
+                                 GError           **error)
 {
-  char *dnbuf = strdupa (subpath);
-  const char *dn = dirname (dnbuf);
-  gboolean increasing_mtime = (flags & GLNX_FILE_REPLACE_INCREASING_MTIME) != 0;
-  gboolean nodatasync = (flags & GLNX_FILE_REPLACE_NODATASYNC) != 0;
-  gboolean datasync_new = (flags & GLNX_FILE_REPLACE_DATASYNC_NEW) != 0;
-  struct stat stbuf;
-  gboolean has_stbuf = FALSE;
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  struct iovec iov;
 
   dfd = glnx_dirfd_canonicalize (dfd);
 
-  /* With O_TMPFILE we can't use umask, and we can't sanely query the
-   * umask...let's assume something relatively standard.
-   */
   if (mode == (mode_t) -1)
     mode = 0644;
 
-  g_auto(GLnxTmpfile) tmpf = { 0, };
-  if (!glnx_open_tmpfile_linkable_at (dfd, dn, O_WRONLY | O_CLOEXEC,
-                                      &tmpf, error))
-    return FALSE;
-
   if (len == (gsize) -1)
     len = strlen ((char*)buf);
 
-  if (!glnx_try_fallocate (tmpf.fd, 0, len, error))
+  iov.iov_base = (void *) buf;
+  iov.iov_len = len;
+  if (!replace_contents_write_tmpfile (dfd, subpath, &iov, 1, &tmpf, error))
     return FALSE;
 
-  if (glnx_loop_write (tmpf.fd, buf, len) < 0)
-    return glnx_throw_errno_prefix (error, "write");
+  if (!replace_contents_set_perms (tmpf.fd, mode, uid, gid, error))
+    return FALSE;
 
-  if (!nodatasync || increasing_mtime)
-    {
-      if (!glnx_fstatat_allow_noent (dfd, subpath, &stbuf, AT_SYMLINK_NOFOLLOW, error))
-        return FALSE;
-      has_stbuf = errno != ENOENT;
-    }
+  return glnx_replace_batch_add_tmpfile (batch, &tmpf, dfd, subpath,
+                                         cancellable, error);
+}
 
-  if (!nodatasync)
+#if GLNX_HAVE_IO_URING
+/* Flush the data of all of @entries with parallel fdatasyncs.  If io_uring
+ * can't be used, *out_handled is left %FALSE and the caller has to fall
+ * back to syncfs(). */
+static gboolean
+replace_batch_sync_uring (GArray    *entries,
+                          gboolean  *out_handled,
+                          GError   **error)
+{
+  GLnxUring *ring = _glnx_uring_get (IORING_OP_FSYNC);
+  g_autofree int *results = NULL;
+  guint capacity;
+
+  *out_handled = FALSE;
+  if (ring == NULL)
+    return TRUE;
+
+  capacity = _glnx_uring_get_capacity (ring);
+  results = g_new (int, capacity);
+
+  for (guint start = 0; start < entries->len; start += capacity)
     {
-      gboolean do_sync;
-      if (!has_stbuf)
-        do_sync = datasync_new;
-      else
-        do_sync = TRUE;
+      guint n = MIN (capacity, entries->len - start);
 
-      if (do_sync)
+      for (guint i = start; i < start + n; i++)
         {
-          if (TEMP_FAILURE_RETRY (fdatasync (tmpf.fd)) != 0)
-            return glnx_throw_errno_prefix (error, "fdatasync");
+          GLnxReplaceBatchEntry *entry = &g_array_index (entries, GLnxReplaceBatchEntry, i);
+          struct io_uring_sqe *sqe = _glnx_uring_prep (ring, IORING_OP_FSYNC);
+
+          sqe->fd = entry->tmpf.fd;
+          sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        }
+
+      /* Nothing is lost by syncing the first chunks again */
+      if (_glnx_uring_submit_and_wait (ring, results) < 0)
+        return TRUE;
+
+      for (guint i = 0; i < n; i++)
+        {
+          GLnxReplaceBatchEntry *entry = &g_array_index (entries, GLnxReplaceBatchEntry, start + i);
+
+          if (results[i] < 0)
+            {
+              errno = -results[i];
+              return glnx_throw_errno_prefix (error, "fdatasync(%s)", entry->subpath);
+            }
         }
     }
 
-  if (uid != (uid_t) -1)
+  *out_handled = TRUE;
+  return TRUE;
+}
+#endif
+
+/* Whether syncfs() reports writeback errors, which it only does since
+ * Linux 5.8; before that it always succeeds */
+static gboolean
+syncfs_reports_errors (void)
+{
+  static int reports_errors = -1; /* -1 means unknown */
+
+  if (reports_errors < 0)
     {
-      if (TEMP_FAILURE_RETRY (fchown (tmpf.fd, uid, gid)) != 0)
-        return glnx_throw_errno_prefix (error, "fchown");
+      struct utsname uts;
+      guint major = 0, minor = 0;
+
+      reports_errors = uname (&uts) == 0 &&
+                       sscanf (uts.release, "%u.%u", &major, &minor) == 2 &&
+                       (major > 5 || (major == 5 && minor >= 8));
     }
 
-  if (TEMP_FAILURE_RETRY (fchmod (tmpf.fd, mode)) != 0)
-    return glnx_throw_errno_prefix (error, "fchmod");
+  return reports_errors;
+}
 
-  if (increasing_mtime && has_stbuf)
+/* Flush the data of all of @entries one by one */
+static gboolean
+replace_batch_fdatasync (GArray  *entries,
+                         GError **error)
+{
+  for (guint i = 0; i < entries->len; i++)
     {
-      struct stat fd_stbuf;
+      GLnxReplaceBatchEntry *entry = &g_array_index (entries, GLnxReplaceBatchEntry, i);
 
-      if (fstat (tmpf.fd, &fd_stbuf) != 0)
-        return glnx_throw_errno_prefix (error, "fstat");
+      if (TEMP_FAILURE_RETRY (fdatasync (entry->tmpf.fd)) != 0)
+        return glnx_throw_errno_prefix (error, "fdatasync(%s)", entry->subpath);
+    }
 
-      /* We want to ensure that the new file has a st_mtime (i.e. the second precision)
-       * is incrementing to avoid mtime check issues when files change often.
-       */
-      if (fd_stbuf.st_mtime <= stbuf.st_mtime)
-        {
-          struct timespec ts[2] = { {0, UTIME_OMIT}, {stbuf.st_mtime + 1, 0} };
-          if (TEMP_FAILURE_RETRY (futimens (tmpf.fd, ts)) != 0)
-            return glnx_throw_errno_prefix (error, "futimens");
-        }
+  return TRUE;
+}
+
+/* Flush the data of all of @entries, with one syncfs() per filesystem
+ * they are on, if that reports errors; otherwise one file at a time */
+static gboolean
+replace_batch_syncfs (GArray  *entries,
+                      GError **error)
+{
+  g_autoptr(GHashTable) synced_devs = NULL;
+
+  if (!syncfs_reports_errors ())
+    return replace_batch_fdatasync (entries, error);
+
+  synced_devs = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+  for (guint i = 0; i < entries->len; i++)
+    {
+      GLnxReplaceBatchEntry *entry = &g_array_index (entries, GLnxReplaceBatchEntry, i);
+      struct stat stbuf;
+      gint64 dev;
+
+      if (!glnx_fstat (entry->tmpf.fd, &stbuf, error))
+        return FALSE;
+      dev = stbuf.st_dev;
+      if (g_hash_table_contains (synced_devs, &dev))
+        continue;
+
+      if (syncfs (entry->tmpf.fd) < 0)
+        return glnx_throw_errno_prefix (error, "syncfs(%s)", entry->subpath);
+      g_hash_table_add (synced_devs, g_memdup2 (&dev, sizeof (dev)));
     }
 
-  if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_REPLACE,
-                             dfd, subpath, error))
+  return TRUE;
+}
+
+/**
+ * glnx_replace_batch_commit:
+ * @batch: A #GLnxReplaceBatch
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Replace all staged files.  First the data of all of them is flushed,
+ * with parallel fdatasync() calls through io_uring if possible, otherwise
+ * one syncfs() per filesystem (or, before Linux 5.8, where syncfs()
+ * doesn't report writeback errors, one fdatasync() per file).  Then each
+ * file is renamed into place, and finally each directory that was changed
+ * is fsynced once.
+ *
+ * On error, some of the files may have been replaced, but none are left
+ * partially written, and @batch is emptied either way.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_replace_batch_commit (GLnxReplaceBatch  *batch,
+                           GCancellable      *cancellable,
+                           GError           **error)
+{
+  g_autoptr(GArray) entries = g_steal_pointer (&batch->entries);
+  g_autoptr(GLnxDirSyncSet) dir_sync = NULL;
+  gboolean synced = FALSE;
+
+  batch->entries = g_array_new (FALSE, FALSE, sizeof (GLnxReplaceBatchEntry));
+  g_array_set_clear_func (batch->entries, replace_batch_entry_clear);
+
+  if (entries->len == 0)
+    return TRUE;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
     return FALSE;
 
-  return TRUE;
+#if GLNX_HAVE_IO_URING
+  if (!replace_batch_sync_uring (entries, &synced, error))
+    return FALSE;
+#endif
+  if (!synced && !replace_batch_syncfs (entries, error))
+    return FALSE;
+
+  dir_sync = glnx_dir_sync_set_new ();
+  for (guint i = 0; i < entries->len; i++)
+    {
+      GLnxReplaceBatchEntry *entry = &g_array_index (entries, GLnxReplaceBatchEntry, i);
+
+      if (!glnx_link_tmpfile_at_with_dir_sync (&entry->tmpf, GLNX_LINK_TMPFILE_REPLACE,
+                                               entry->dfd, entry->subpath, dir_sync, error))
+        return FALSE;
+    }
+
+  return glnx_dir_sync_set_flush (dir_sync, error);
 }
 
 /**
@@ -1458,3 +4002,199 @@ glnx_name_to_handle_at (int                  dfd,
 
   return TRUE;
 }
+
+/* Each thread takes this many names at a time */
+#define STATX_MANY_CHUNK 64
+/* Below this many names per thread, starting threads costs more than it
+ * saves */
+#define STATX_MANY_PER_THREAD 256
+
+typedef struct
+{
+  int dfd;
+  const char * const *names;
+  gsize n_names;
+  unsigned flags;
+  unsigned int mask;
+  struct glnx_statx *bufs;
+  int *errnos;
+  GCancellable *cancellable;
+  gsize next;  /* atomic */
+} GLnxStatxMany;
+
+static void
+statx_many_run (GLnxStatxMany *batch)
+{
+  for (;;)
+    {
+      gsize i = __atomic_fetch_add (&batch->next, STATX_MANY_CHUNK, __ATOMIC_RELAXED);
+      gsize end;
+
+      if (i >= batch->n_names || g_cancellable_is_cancelled (batch->cancellable))
+        break;
+
+      end = MIN (i + STATX_MANY_CHUNK, batch->n_names);
+      for (; i < end; i++)
+        {
+          if (TEMP_FAILURE_RETRY (glnx_statx_syscall (batch->dfd, batch->names[i],
+                                                      batch->flags, batch->mask,
+                                                      &batch->bufs[i])) != 0)
+            batch->errnos[i] = errno;
+          else
+            batch->errnos[i] = 0;
+        }
+    }
+}
+
+static gpointer
+statx_many_thread (gpointer data)
+{
+  statx_many_run (data);
+  return NULL;
+}
+
+#if GLNX_HAVE_IO_URING
+/* Does as much of @batch as possible with IORING_OP_STATX, one ring's worth
+ * at a time; anything from batch->next onwards is left for the fallback. */
+static void
+statx_many_uring (GLnxStatxMany *batch)
+{
+  GLnxUring *ring = _glnx_uring_get (IORING_OP_STATX);
+  g_autofree int *results = NULL;
+  guint capacity;
+
+  if (ring == NULL)
+    return;
+
+  capacity = _glnx_uring_get_capacity (ring);
+  results = g_new (int, capacity);
+
+  while (batch->next < batch->n_names &&
+         !g_cancellable_is_cancelled (batch->cancellable))
+    {
+      gsize start = batch->next;
+      gsize n = MIN (capacity, batch->n_names - start);
+
+      for (gsize i = start; i < start + n; i++)
+        {
+          struct io_uring_sqe *sqe = _glnx_uring_prep (ring, IORING_OP_STATX);
+
+          sqe->fd = batch->dfd;
+          sqe->addr = (guintptr) batch->names[i];
+          sqe->len = batch->mask;
+          sqe->off = (guintptr) &batch->bufs[i];
+          sqe->statx_flags = batch->flags;
+        }
+
+      /* On failure, this only returns once none of the statx() calls
+       * are still writing to @bufs, so the threads taking over from
+       * batch->next can safely overwrite them, and the caller free them */
+      if (_glnx_uring_submit_and_wait (ring, results) < 0)
+        return;
+
+      for (gsize i = 0; i < n; i++)
+        batch->errnos[start + i] = results[i] < 0 ? -results[i] : 0;
+      batch->next = start + n;
+    }
+}
+#endif
+
+/**
+ * glnx_statx_many:
+ * @dfd: Directory FD to stat beneath
+ * @names: (array length=n_names): Paths to stat beneath @dfd
+ * @n_names: Number of elements in @names
+ * @flags: Flags to pass to statx()
+ * @mask: Mask to pass to statx()
+ * @out_bufs: (out caller-allocates) (array length=n_names): Return location
+ *   for the statx details of each of @names
+ * @out_errnos: (out caller-allocates) (array length=n_names) (optional):
+ *   Return location for the `errno` of each lookup, or 0 where it succeeded
+ * @cancellable: Cancellable
+ * @error: Return location for a #GError, or %NULL
+ *
+ * Like calling glnx_statx() for each of @names, but much faster for many
+ * names: where io_uring is available the lookups are submitted to the
+ * kernel in batches, and otherwise they are spread over several threads.
+ * This helps most where every lookup has to wait for the filesystem, for
+ * example on network filesystems, or when `d_type` isn't available and
+ * every directory entry needs a stat.
+ *
+ * If @out_errnos is given, lookups which fail are only reported there (and
+ * the corresponding element of @out_bufs is undefined); otherwise the first
+ * failing lookup is returned as an error.
+ *
+ * Returns: %TRUE on success, or %FALSE setting @error
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_statx_many (int                  dfd,
+                 const char * const  *names,
+                 gsize                n_names,
+                 unsigned             flags,
+                 unsigned int         mask,
+                 struct glnx_statx   *out_bufs,
+                 int                 *out_errnos,
+                 GCancellable        *cancellable,
+                 GError             **error)
+{
+  g_autofree int *owned_errnos = NULL;
+  g_autoptr(GPtrArray) threads = NULL;
+  GLnxStatxMany batch = { 0, };
+  guint n_threads;
+
+  g_return_val_if_fail (names != NULL || n_names == 0, FALSE);
+  g_return_val_if_fail (out_bufs != NULL || n_names == 0, FALSE);
+
+  if (out_errnos == NULL)
+    out_errnos = owned_errnos = g_new (int, n_names);
+
+  batch.dfd = dfd;
+  batch.names = names;
+  batch.n_names = n_names;
+  batch.flags = flags;
+  batch.mask = mask;
+  batch.bufs = out_bufs;
+  batch.errnos = out_errnos;
+  batch.cancellable = cancellable;
+
+#if GLNX_HAVE_IO_URING
+  if (n_names > 1)
+    statx_many_uring (&batch);
+#endif
+
+  n_threads = (n_names - MIN (batch.next, n_names)) / STATX_MANY_PER_THREAD;
+  n_threads = CLAMP (MIN (n_threads, g_get_num_processors ()), 1, 16);
+
+  threads = g_ptr_array_new ();
+  for (guint i = 1; i < n_threads; i++)
+    {
+      GThread *thread = g_thread_try_new ("glnx-statx", statx_many_thread, &batch, NULL);
+      /* Not fatal; the remaining threads will pick up its share */
+      if (thread == NULL)
+        break;
+      g_ptr_array_add (threads, thread);
+    }
+
+  statx_many_run (&batch);
+
+  for (guint i = 0; i < threads->len; i++)
+    g_thread_join (threads->pdata[i]);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  if (owned_errnos != NULL)
+    {
+      for (gsize i = 0; i < n_names; i++)
+        {
+          if (owned_errnos[i] != 0)
+            {
+              errno = owned_errnos[i];
+              return glnx_throw_errno_prefix (error, "statx(%s)", names[i]);
+            }
+        }
+    }
+
+  return TRUE;
+}
@@ -31,11 +31,13 @@
 #include <string.h>
 #include <stdio.h>
 #include <sys/xattr.h>
+#include <sys/uio.h>
 // For dirname(), and previously basename()
 #include <libgen.h>
 
 #include <glnx-macros.h>
 #include <glnx-errors.h>
+#include <glnx-digest.h>
 
 G_BEGIN_DECLS
 
@@ -76,6 +78,8 @@ typedef struct {
   int src_dfd;
   int fd;
   char *path;
+  /* Whether the fd was ever given a name by glnx_link_tmpfile_at() */
+  gboolean linked;
 } GLnxTmpfile;
 void glnx_tmpfile_clear (GLnxTmpfile *tmpf);
 G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(GLnxTmpfile, glnx_tmpfile_clear)
@@ -112,6 +116,71 @@ glnx_link_tmpfile_at (GLnxTmpfile *tmpf,
                       const char *target,
                       GError **error);
 
+typedef struct _GLnxDirSyncSet GLnxDirSyncSet;
+
+GLnxDirSyncSet *
+glnx_dir_sync_set_new (void);
+
+void
+glnx_dir_sync_set_free (GLnxDirSyncSet *set);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GLnxDirSyncSet, glnx_dir_sync_set_free)
+
+gboolean
+glnx_dir_sync_set_add (GLnxDirSyncSet  *set,
+                       int              dfd,
+                       const char      *path,
+                       GError         **error);
+
+gboolean
+glnx_dir_sync_set_add_parent (GLnxDirSyncSet  *set,
+                              int              dfd,
+                              const char      *path,
+                              GError         **error);
+
+gboolean
+glnx_dir_sync_set_flush (GLnxDirSyncSet  *set,
+                         GError         **error);
+
+gboolean
+glnx_link_tmpfile_at_with_dir_sync (GLnxTmpfile                 *tmpf,
+                                    GLnxLinkTmpfileReplaceMode   mode,
+                                    int                          target_dfd,
+                                    const char                  *target,
+                                    GLnxDirSyncSet              *dir_sync,
+                                    GError                     **error);
+
+gboolean
+glnx_renameat_with_dir_sync (int              src_dfd,
+                             const char      *src_path,
+                             int              dest_dfd,
+                             const char      *dest_path,
+                             GLnxDirSyncSet  *dir_sync,
+                             GError         **error);
+
+typedef struct _GLnxTmpfilePool GLnxTmpfilePool;
+
+GLnxTmpfilePool *
+glnx_tmpfile_pool_new (int          dfd,
+                       const char  *subpath,
+                       int          flags,
+                       guint        size,
+                       GError     **error);
+
+void
+glnx_tmpfile_pool_free (GLnxTmpfilePool *pool);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GLnxTmpfilePool, glnx_tmpfile_pool_free)
+
+gboolean
+glnx_tmpfile_pool_acquire (GLnxTmpfilePool  *pool,
+                           GLnxTmpfile      *out_tmpf,
+                           GError          **error);
+
+void
+glnx_tmpfile_pool_release (GLnxTmpfilePool *pool,
+                           GLnxTmpfile     *tmpf);
+
 gboolean
 glnx_tmpfile_reopen_rdonly (GLnxTmpfile *tmpf,
                             GError **error);
@@ -128,6 +197,17 @@ glnx_fd_readall_bytes (int               fd,
                        GCancellable     *cancellable,
                        GError          **error);
 
+gboolean
+glnx_fd_readall_digest (int            fd,
+                        GLnxDigest    *digest,
+                        GCancellable  *cancellable,
+                        GError       **error);
+
+GBytes *
+glnx_fd_map_bytes (int               fd,
+                   GCancellable     *cancellable,
+                   GError          **error);
+
 char *
 glnx_fd_readall_utf8 (int               fd,
                       gsize            *out_len,
@@ -176,6 +256,88 @@ glnx_file_replace_contents_with_perms_at (int                   dfd,
                                           GCancellable         *cancellable,
                                           GError              **error);
 
+gboolean
+glnx_file_replace_contents_iov_at (int                   dfd,
+                                   const char           *subpath,
+                                   const struct iovec   *iov,
+                                   int                   iovcnt,
+                                   GLnxFileReplaceFlags  flags,
+                                   GCancellable         *cancellable,
+                                   GError              **error);
+
+typedef struct _GLnxAtomicWriter GLnxAtomicWriter;
+
+GLnxAtomicWriter *
+glnx_atomic_writer_new (int                    dfd,
+                        const char            *subpath,
+                        guint64                expected_size,
+                        mode_t                 mode,
+                        uid_t                  uid,
+                        gid_t                  gid,
+                        GLnxFileReplaceFlags   flags,
+                        GError               **error);
+
+void
+glnx_atomic_writer_free (GLnxAtomicWriter *writer);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GLnxAtomicWriter, glnx_atomic_writer_free)
+
+gboolean
+glnx_atomic_writer_append (GLnxAtomicWriter  *writer,
+                           const void        *buf,
+                           gsize              len,
+                           GCancellable      *cancellable,
+                           GError           **error);
+
+gboolean
+glnx_atomic_writer_flush (GLnxAtomicWriter  *writer,
+                          GCancellable      *cancellable,
+                          GError           **error);
+
+GOutputStream *
+glnx_atomic_writer_get_output_stream (GLnxAtomicWriter  *writer,
+                                      GError           **error);
+
+gboolean
+glnx_atomic_writer_commit (GLnxAtomicWriter  *writer,
+                           GCancellable      *cancellable,
+                           GError           **error);
+
+typedef struct _GLnxReplaceBatch GLnxReplaceBatch;
+
+GLnxReplaceBatch *
+glnx_replace_batch_new (void);
+
+void
+glnx_replace_batch_free (GLnxReplaceBatch *batch);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GLnxReplaceBatch, glnx_replace_batch_free)
+
+gboolean
+glnx_replace_batch_add_tmpfile (GLnxReplaceBatch  *batch,
+                                GLnxTmpfile       *tmpf,
+                                int                dfd,
+                                const char        *subpath,
+                                GCancellable      *cancellable,
+                                GError           **error);
+
+gboolean
+glnx_replace_batch_add_contents (GLnxReplaceBatch  *batch,
+                                 int                dfd,
+                                 const char        *subpath,
+                                 const guint8      *buf,
+                                 gsize              len,
+                                 mode_t             mode,
+                                 uid_t              uid,
+                                 gid_t              gid,
+                                 GCancellable      *cancellable,
+                                 GError           **error);
+
+gboolean
+glnx_replace_batch_commit (GLnxReplaceBatch  *batch,
+                           GCancellable      *cancellable,
+                           GError           **error);
+
 char *
 glnx_readlinkat_malloc (int            dfd,
                         const char    *subpath,
@@ -185,14 +347,56 @@ glnx_readlinkat_malloc (int            dfd,
 int
 glnx_loop_write (int fd, const void *buf, size_t nbytes);
 
+int
+glnx_loop_writev (int fd, const struct iovec *iov, int iovcnt);
+
 int
 glnx_regfile_copy_bytes (int fdf, int fdt, off_t max_bytes);
 
+int
+glnx_regfile_copy_bytes_with_buffer_size (int    fdf,
+                                          int    fdt,
+                                          off_t  max_bytes,
+                                          gsize  buffer_size);
+
+gboolean
+glnx_regfile_copy_bytes_digest (int            fdf,
+                                int            fdt,
+                                off_t          max_bytes,
+                                GLnxDigest    *digest,
+                                GCancellable  *cancellable,
+                                GError       **error);
+
+/**
+ * GLnxFileCopyProgressFunc:
+ * @bytes_copied: Number of bytes copied so far
+ * @total_bytes: Total number of bytes to copy
+ * @user_data: User data
+ *
+ * Progress callback for glnx_regfile_copy_bytes_chunked().
+ *
+ * Since: UNRELEASED
+ */
+typedef void (*GLnxFileCopyProgressFunc) (guint64   bytes_copied,
+                                          guint64   total_bytes,
+                                          gpointer  user_data);
+
+gboolean
+glnx_regfile_copy_bytes_chunked (int                        src_fd,
+                                 int                        dest_fd,
+                                 guint64                    chunk_size,
+                                 guint                      n_threads,
+                                 GLnxFileCopyProgressFunc   progress,
+                                 gpointer                   user_data,
+                                 GCancellable              *cancellable,
+                                 GError                   **error);
+
 typedef enum {
   GLNX_FILE_COPY_OVERWRITE = (1 << 0),
   GLNX_FILE_COPY_NOXATTRS = (1 << 1),
   GLNX_FILE_COPY_DATASYNC = (1 << 2),
-  GLNX_FILE_COPY_NOCHOWN = (1 << 3)
+  GLNX_FILE_COPY_NOCHOWN = (1 << 3),
+  GLNX_FILE_COPY_SPARSE = (1 << 4)
 } GLnxFileCopyFlags;
 
 gboolean
@@ -205,6 +409,17 @@ glnx_file_copy_at (int                   src_dfd,
                    GCancellable         *cancellable,
                    GError              **error);
 
+gboolean
+glnx_file_copy_at_with_digest (int                   src_dfd,
+                               const char           *src_subpath,
+                               const struct stat    *src_stbuf,
+                               int                   dest_dfd,
+                               const char           *dest_subpath,
+                               GLnxFileCopyFlags     copyflags,
+                               GLnxDigest           *digest,
+                               GCancellable         *cancellable,
+                               GError              **error);
+
 int glnx_renameat2_noreplace (int olddirfd, const char *oldpath,
                               int newdirfd, const char *newpath);
 int glnx_renameat2_exchange (int olddirfd, const char *oldpath,
@@ -345,6 +560,16 @@ glnx_statx (int                 dfd,
   return TRUE;
 }
 
+gboolean glnx_statx_many (int                  dfd,
+                          const char * const  *names,
+                          gsize                n_names,
+                          unsigned             flags,
+                          unsigned int         mask,
+                          struct glnx_statx   *out_bufs,
+                          int                 *out_errnos,
+                          GCancellable        *cancellable,
+                          GError             **error);
+
 /**
  * glnx_fstatat_allow_noent:
  * @dfd: Directory FD to stat beneath
@@ -27,6 +27,8 @@
 #include <glnx-errors.h>
 #include <glnx-fdio.h>
 #include <glnx-local-alloc.h>
+#include <glnx-uring.h>
+#include <glnx-xattrs.h>
 
 static gboolean
 unlinkat_allow_noent (int dfd,
@@ -42,11 +44,121 @@ unlinkat_allow_noent (int dfd,
   return TRUE;
 }
 
+/* Removes the non-directory entries of a single directory.  When io_uring
+ * is available, the unlinkat() calls are submitted in batches instead of
+ * one syscall each.  The ring is per-thread, so a batch must be flushed
+ * before anything else on the same thread can use io_uring.
+ */
+typedef struct
+{
+  int dfd;
+  GLnxUring *ring;
+  GStringChunk *names;
+  GPtrArray *pending;
+} ShutilUnlinkBatch;
+
+static void
+shutil_unlink_batch_clear (ShutilUnlinkBatch *batch)
+{
+#if GLNX_HAVE_IO_URING
+  /* Don't leave the unlinkat()s of a batch we gave up on (on errors or
+   * cancellation) for the next user of the ring to submit */
+  if (batch->ring != NULL)
+    _glnx_uring_discard (batch->ring);
+#endif
+  g_clear_pointer (&batch->names, g_string_chunk_free);
+  g_clear_pointer (&batch->pending, g_ptr_array_unref);
+}
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(ShutilUnlinkBatch, shutil_unlink_batch_clear)
+
+static gboolean
+shutil_unlink_batch_flush (ShutilUnlinkBatch  *batch,
+                           GError            **error)
+{
+#if GLNX_HAVE_IO_URING
+  g_autofree int *results = NULL;
+  GLnxUring *ring;
+
+  if (batch->pending == NULL || batch->pending->len == 0)
+    return TRUE;
+
+  results = g_new (int, batch->pending->len);
+  ring = g_steal_pointer (&batch->ring);
+  if (_glnx_uring_submit_and_wait (ring, results) < 0)
+    {
+      /* The ring is gone, and we don't know which entries were removed;
+       * that's fine, since we ignore ENOENT anyway. */
+      for (guint i = 0; i < batch->pending->len; i++)
+        {
+          if (!unlinkat_allow_noent (batch->dfd, batch->pending->pdata[i], 0, error))
+            return FALSE;
+        }
+    }
+  else
+    {
+      for (guint i = 0; i < batch->pending->len; i++)
+        {
+          if (results[i] < 0 && results[i] != -ENOENT)
+            {
+              errno = -results[i];
+              return glnx_throw_errno_prefix (error, "unlinkat(%s)",
+                                              (const char *) batch->pending->pdata[i]);
+            }
+        }
+    }
+
+  g_ptr_array_set_size (batch->pending, 0);
+  g_string_chunk_clear (batch->names);
+#endif
+
+  return TRUE;
+}
+
+static gboolean
+shutil_unlink_batch_add (ShutilUnlinkBatch  *batch,
+                         const char         *name,
+                         GError            **error)
+{
+#if GLNX_HAVE_IO_URING
+  /* Look the ring up again for each batch, as it may have been discarded
+   * by someone else on this thread in the meantime. */
+  if (batch->ring == NULL)
+    batch->ring = _glnx_uring_get (IORING_OP_UNLINKAT);
+
+  if (batch->ring != NULL)
+    {
+      struct io_uring_sqe *sqe;
+      char *name_copy;
+
+      if (batch->names == NULL)
+        {
+          batch->names = g_string_chunk_new (4096);
+          batch->pending = g_ptr_array_new ();
+        }
+
+      name_copy = g_string_chunk_insert (batch->names, name);
+      sqe = _glnx_uring_prep (batch->ring, IORING_OP_UNLINKAT);
+      sqe->fd = batch->dfd;
+      sqe->addr = (guintptr) name_copy;
+      g_ptr_array_add (batch->pending, name_copy);
+
+      if (batch->pending->len == _glnx_uring_get_capacity (batch->ring))
+        return shutil_unlink_batch_flush (batch, error);
+
+      return TRUE;
+    }
+#endif
+
+  return unlinkat_allow_noent (batch->dfd, name, 0, error);
+}
+
 static gboolean
 glnx_shutil_rm_rf_children (GLnxDirFdIterator    *dfd_iter,
                             GCancellable       *cancellable,
                             GError            **error)
 {
+  g_auto(ShutilUnlinkBatch) batch = { dfd_iter->fd, };
+  g_autoptr(GPtrArray) subdirs = g_ptr_array_new_with_free_func (g_free);
   struct dirent *dent;
 
   while (TRUE)
@@ -56,46 +168,386 @@ glnx_shutil_rm_rf_children (GLnxDirFdIterator    *dfd_iter,
       if (dent == NULL)
         break;
 
+      /* Recurse only once we're done with this directory, so that we
+       * don't have to interrupt the batch. */
       if (dent->d_type == DT_DIR)
+        g_ptr_array_add (subdirs, g_strdup (dent->d_name));
+      else if (!shutil_unlink_batch_add (&batch, dent->d_name, error))
+        return FALSE;
+    }
+
+  if (!shutil_unlink_batch_flush (&batch, error))
+    return FALSE;
+
+  for (guint i = 0; i < subdirs->len; i++)
+    {
+      const char *name = subdirs->pdata[i];
+      g_auto(GLnxDirFdIterator) child_dfd_iter = { 0, };
+
+      if (!glnx_dirfd_iterator_init_at (dfd_iter->fd, name, FALSE,
+                                        &child_dfd_iter, error))
+        return FALSE;
+
+      if (!glnx_shutil_rm_rf_children (&child_dfd_iter, cancellable, error))
+        return FALSE;
+
+      if (!glnx_unlinkat (dfd_iter->fd, name, AT_REMOVEDIR, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Parallel tree walking.
+ *
+ * Each directory being operated on is represented by a #ShutilTreeNode; a
+ * node (and its directory fd) stays alive until the directory has been
+ * processed and all of its child directories have been finished, at which
+ * point the finish callback runs for it.  Every worker has its own deque:
+ * it pushes newly discovered child directories to, and pops work from, the
+ * tail of its own deque (depth-first, which bounds the number of open
+ * directories), while idle workers steal from the head of other workers'
+ * deques (which tends to hand out large subtrees).
+ */
+typedef struct _ShutilTreeNode ShutilTreeNode;
+typedef struct _ShutilTreeWalk ShutilTreeWalk;
+typedef struct _ShutilTreeWorker ShutilTreeWorker;
+
+struct _ShutilTreeNode
+{
+  ShutilTreeNode *parent;
+  int dfd;
+  gint pending;  /* atomic; 1 for the node itself + 1 per unfinished child */
+  gpointer data;
+  char name[];   /* relative to parent->dfd */
+};
+
+typedef struct
+{
+  gboolean (*process) (ShutilTreeWorker  *worker,
+                       ShutilTreeNode    *node,
+                       GCancellable      *cancellable,
+                       GError           **error);
+  gboolean (*finish)  (ShutilTreeWalk    *walk,
+                       ShutilTreeNode    *node,
+                       GError           **error);
+  GDestroyNotify free_data;
+} ShutilTreeWalkOps;
+
+struct _ShutilTreeWorker
+{
+  ShutilTreeWalk *walk;
+  guint idx;
+  GMutex lock;
+  GQueue deque;
+};
+
+struct _ShutilTreeWalk
+{
+  const ShutilTreeWalkOps *ops;
+  gpointer user_data;
+  GCancellable *cancellable;
+
+  ShutilTreeWorker *workers;
+  guint n_workers;
+
+  GMutex lock;
+  GCond cond;
+  gint n_queued;    /* atomic; only incremented with @lock held */
+  gint aborted;     /* atomic */
+  gboolean done;    /* protected by @lock */
+  GError *error;    /* protected by @lock */
+};
+
+static void
+shutil_tree_walk_abort (ShutilTreeWalk *walk,
+                        GError         *error)
+{
+  g_mutex_lock (&walk->lock);
+  if (walk->error == NULL)
+    walk->error = error;
+  else
+    g_error_free (error);
+  g_atomic_int_set (&walk->aborted, 1);
+  g_mutex_unlock (&walk->lock);
+}
+
+static ShutilTreeNode *
+shutil_tree_node_new (ShutilTreeNode *parent,
+                      const char     *name,
+                      gpointer        data)
+{
+  gsize len = strlen (name);
+  ShutilTreeNode *node = g_malloc (sizeof (ShutilTreeNode) + len + 1);
+
+  node->parent = parent;
+  node->dfd = -1;
+  node->pending = 1;
+  node->data = data;
+  memcpy (node->name, name, len + 1);
+
+  return node;
+}
+
+static void
+shutil_tree_walk_push (ShutilTreeWorker *worker,
+                       ShutilTreeNode   *node)
+{
+  ShutilTreeWalk *walk = worker->walk;
+
+  g_mutex_lock (&worker->lock);
+  g_queue_push_tail (&worker->deque, node);
+  g_mutex_unlock (&worker->lock);
+
+  g_mutex_lock (&walk->lock);
+  g_atomic_int_inc (&walk->n_queued);
+  g_cond_signal (&walk->cond);
+  g_mutex_unlock (&walk->lock);
+}
+
+/* Queue @name, a subdirectory of @parent, to be processed by some worker. */
+static void
+shutil_tree_walk_push_child (ShutilTreeWorker *worker,
+                             ShutilTreeNode   *parent,
+                             const char       *name,
+                             gpointer          data)
+{
+  g_atomic_int_inc (&parent->pending);
+  shutil_tree_walk_push (worker, shutil_tree_node_new (parent, name, data));
+}
+
+static ShutilTreeNode *
+shutil_tree_walk_pop (ShutilTreeWorker *worker)
+{
+  ShutilTreeWalk *walk = worker->walk;
+  ShutilTreeNode *node;
+
+  g_mutex_lock (&worker->lock);
+  node = g_queue_pop_tail (&worker->deque);
+  g_mutex_unlock (&worker->lock);
+
+  for (guint i = 1; node == NULL && i < walk->n_workers; i++)
+    {
+      ShutilTreeWorker *victim = &walk->workers[(worker->idx + i) % walk->n_workers];
+
+      g_mutex_lock (&victim->lock);
+      node = g_queue_pop_head (&victim->deque);
+      g_mutex_unlock (&victim->lock);
+    }
+
+  if (node != NULL)
+    g_atomic_int_add (&walk->n_queued, -1);
+
+  return node;
+}
+
+/* Drop the reference @node holds on itself or one of its children; once
+ * nothing is pending, finish the node and propagate up to its parent.
+ */
+static void
+shutil_tree_walk_release (ShutilTreeWalk *walk,
+                          ShutilTreeNode *node)
+{
+  while (node != NULL && g_atomic_int_dec_and_test (&node->pending))
+    {
+      ShutilTreeNode *parent = node->parent;
+
+      if (!g_atomic_int_get (&walk->aborted) && walk->ops->finish != NULL)
         {
-          g_auto(GLnxDirFdIterator) child_dfd_iter = { 0, };
+          GError *local_error = NULL;
 
-          if (!glnx_dirfd_iterator_init_at (dfd_iter->fd, dent->d_name, FALSE,
-                                            &child_dfd_iter, error))
-            return FALSE;
+          if (!walk->ops->finish (walk, node, &local_error))
+            shutil_tree_walk_abort (walk, local_error);
+        }
 
-          if (!glnx_shutil_rm_rf_children (&child_dfd_iter, cancellable, error))
-            return FALSE;
+      glnx_close_fd (&node->dfd);
+      if (node->data != NULL && walk->ops->free_data != NULL)
+        walk->ops->free_data (node->data);
+      g_free (node);
 
-          if (!glnx_unlinkat (dfd_iter->fd, dent->d_name, AT_REMOVEDIR, error))
-            return FALSE;
+      if (parent == NULL)
+        {
+          g_mutex_lock (&walk->lock);
+          walk->done = TRUE;
+          g_cond_broadcast (&walk->cond);
+          g_mutex_unlock (&walk->lock);
         }
-      else
+
+      node = parent;
+    }
+}
+
+static gpointer
+shutil_tree_walk_worker (gpointer data)
+{
+  ShutilTreeWorker *worker = data;
+  ShutilTreeWalk *walk = worker->walk;
+
+  while (TRUE)
+    {
+      ShutilTreeNode *node = shutil_tree_walk_pop (worker);
+      gboolean done;
+
+      if (node != NULL)
         {
-          if (!unlinkat_allow_noent (dfd_iter->fd, dent->d_name, 0, error))
-            return FALSE;
+          /* Once aborted, just drain the queues so that everything is freed */
+          if (!g_atomic_int_get (&walk->aborted))
+            {
+              GError *local_error = NULL;
+
+              if (!walk->ops->process (worker, node, walk->cancellable, &local_error))
+                shutil_tree_walk_abort (walk, local_error);
+            }
+
+          shutil_tree_walk_release (walk, node);
+          continue;
         }
+
+      g_mutex_lock (&walk->lock);
+      while (!walk->done && g_atomic_int_get (&walk->n_queued) <= 0)
+        g_cond_wait (&walk->cond, &walk->lock);
+      done = walk->done;
+      g_mutex_unlock (&walk->lock);
+
+      if (done)
+        break;
     }
 
-  return TRUE;
+  return NULL;
 }
 
-/**
- * glnx_shutil_rm_rf_at:
- * @dfd: A directory file descriptor, or `AT_FDCWD` or `-1` for current
- * @path: Path
- * @cancellable: Cancellable
- * @error: Error
- *
- * Recursively delete the filename referenced by the combination of
- * the directory fd @dfd and @path; it may be a file or directory.  No
- * error is thrown if @path does not exist.
+/* Walk the directory tree rooted at @root_dfd (which is consumed) using
+ * @n_workers threads, including the calling one.
  */
-gboolean
-glnx_shutil_rm_rf_at (int                   dfd,
-                      const char           *path,
-                      GCancellable         *cancellable,
-                      GError              **error)
+static gboolean
+shutil_tree_walk_run (const ShutilTreeWalkOps  *ops,
+                      gpointer                  user_data,
+                      int                      *root_dfd,
+                      gpointer                  root_data,
+                      guint                     n_workers,
+                      GCancellable             *cancellable,
+                      GError                  **error)
+{
+  ShutilTreeWalk walk = { 0, };
+  g_autoptr(GPtrArray) threads = g_ptr_array_new ();
+  ShutilTreeNode *root;
+
+  if (n_workers == 0)
+    n_workers = g_get_num_processors ();
+  n_workers = CLAMP (n_workers, 1, 64);
+
+  walk.ops = ops;
+  walk.user_data = user_data;
+  walk.cancellable = cancellable;
+  walk.n_workers = n_workers;
+  walk.workers = g_new0 (ShutilTreeWorker, n_workers);
+  g_mutex_init (&walk.lock);
+  g_cond_init (&walk.cond);
+
+  for (guint i = 0; i < n_workers; i++)
+    {
+      walk.workers[i].walk = &walk;
+      walk.workers[i].idx = i;
+      g_mutex_init (&walk.workers[i].lock);
+      g_queue_init (&walk.workers[i].deque);
+    }
+
+  root = shutil_tree_node_new (NULL, "", root_data);
+  root->dfd = g_steal_fd (root_dfd);
+  shutil_tree_walk_push (&walk.workers[0], root);
+
+  for (guint i = 1; i < n_workers; i++)
+    {
+      GThread *thread = g_thread_try_new ("glnx-shutil", shutil_tree_walk_worker,
+                                          &walk.workers[i], NULL);
+      /* Not fatal; the remaining workers will steal its share */
+      if (thread == NULL)
+        break;
+      g_ptr_array_add (threads, thread);
+    }
+
+  shutil_tree_walk_worker (&walk.workers[0]);
+
+  for (guint i = 0; i < threads->len; i++)
+    g_thread_join (threads->pdata[i]);
+
+  for (guint i = 0; i < n_workers; i++)
+    {
+      g_assert (g_queue_is_empty (&walk.workers[i].deque));
+      g_mutex_clear (&walk.workers[i].lock);
+    }
+  g_free (walk.workers);
+  g_mutex_clear (&walk.lock);
+  g_cond_clear (&walk.cond);
+
+  if (walk.error != NULL)
+    {
+      g_propagate_error (error, walk.error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+rm_rf_process_dir (ShutilTreeWorker  *worker,
+                   ShutilTreeNode    *node,
+                   GCancellable      *cancellable,
+                   GError           **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  g_auto(ShutilUnlinkBatch) batch = { -1, };
+  struct dirent *dent;
+
+  if (node->dfd == -1 &&
+      !glnx_opendirat (node->parent->dfd, node->name, FALSE, &node->dfd, error))
+    return FALSE;
+
+  /* The iterator needs its own fd; ours stays open for our children */
+  if (!glnx_dirfd_iterator_init_at (node->dfd, ".", FALSE, &dfd_iter, error))
+    return FALSE;
+  batch.dfd = dfd_iter.fd;
+
+  while (TRUE)
+    {
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      if (dent->d_type == DT_DIR)
+        shutil_tree_walk_push_child (worker, node, dent->d_name, NULL);
+      else if (!shutil_unlink_batch_add (&batch, dent->d_name, error))
+        return FALSE;
+    }
+
+  return shutil_unlink_batch_flush (&batch, error);
+}
+
+static gboolean
+rm_rf_finish_dir (G_GNUC_UNUSED ShutilTreeWalk *walk,
+                  ShutilTreeNode               *node,
+                  GError                      **error)
+{
+  /* The root itself is removed by our caller */
+  if (node->parent == NULL)
+    return TRUE;
+
+  return unlinkat_allow_noent (node->parent->dfd, node->name, AT_REMOVEDIR, error);
+}
+
+static const ShutilTreeWalkOps rm_rf_ops = {
+  rm_rf_process_dir,
+  rm_rf_finish_dir,
+  NULL,
+};
+
+static gboolean
+rm_rf_at_internal (int                   dfd,
+                   const char           *path,
+                   guint                 n_threads,
+                   GCancellable         *cancellable,
+                   GError              **error)
 {
   dfd = glnx_dirfd_canonicalize (dfd);
 
@@ -118,7 +570,7 @@ glnx_shutil_rm_rf_at (int                   dfd,
       else
         return glnx_throw_errno_prefix (error, "open(%s)", path);
     }
-  else
+  else if (n_threads == 1)
     {
       g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
       if (!glnx_dirfd_iterator_init_take_fd (&target_dfd, &dfd_iter, error))
@@ -130,9 +582,138 @@ glnx_shutil_rm_rf_at (int                   dfd,
       if (!unlinkat_allow_noent (dfd, path, AT_REMOVEDIR, error))
         return FALSE;
     }
+  else
+    {
+      if (!shutil_tree_walk_run (&rm_rf_ops, NULL, &target_dfd, NULL, n_threads,
+                                 cancellable, error))
+        return glnx_prefix_error (error, "Removing %s", path);
+
+      if (!unlinkat_allow_noent (dfd, path, AT_REMOVEDIR, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * glnx_shutil_rm_rf_at:
+ * @dfd: A directory file descriptor, or `AT_FDCWD` or `-1` for current
+ * @path: Path
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Recursively delete the filename referenced by the combination of
+ * the directory fd @dfd and @path; it may be a file or directory.  No
+ * error is thrown if @path does not exist.
+ */
+gboolean
+glnx_shutil_rm_rf_at (int                   dfd,
+                      const char           *path,
+                      GCancellable         *cancellable,
+                      GError              **error)
+{
+  return rm_rf_at_internal (dfd, path, 1, cancellable, error);
+}
+
+/**
+ * glnx_shutil_rm_rf_at_parallel:
+ * @dfd: A directory file descriptor, or `AT_FDCWD` or `-1` for current
+ * @path: Path
+ * @n_threads: Maximum number of threads to use, or 0 for one per CPU
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like glnx_shutil_rm_rf_at(), but distributes the subdirectories of @path
+ * across a bounded set of worker threads (including the calling thread),
+ * which steal work from each other when they run out.  This is primarily
+ * useful for wide trees on storage where metadata operations have a high
+ * latency, such as network filesystems.
+ *
+ * The first error encountered by any worker is returned, after all workers
+ * have stopped; @cancellable is checked by every worker.  If @n_threads is 1,
+ * this is exactly equivalent to glnx_shutil_rm_rf_at().
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_shutil_rm_rf_at_parallel (int                   dfd,
+                               const char           *path,
+                               guint                 n_threads,
+                               GCancellable         *cancellable,
+                               GError              **error)
+{
+  return rm_rf_at_internal (dfd, path, n_threads, cancellable, error);
+}
+
+#if GLNX_HAVE_IO_URING
+/* Create all the leading directories of @path and @path itself with one
+ * chain of linked mkdirat() operations, rather than walking up and back
+ * down one syscall at a time.  If io_uring can't be used, *out_handled is
+ * set to %FALSE and nothing is done. */
+static gboolean
+mkdir_p_uring (int          dfd,
+               const char  *path,
+               int          mode,
+               gboolean    *out_handled,
+               GError     **error)
+{
+  GLnxUring *ring = _glnx_uring_get (IORING_OP_MKDIRAT);
+  g_autoptr(GPtrArray) prefixes = NULL;
+  g_autofree int *results = NULL;
+  int res;
+
+  *out_handled = FALSE;
+
+  if (ring == NULL)
+    return TRUE;
+
+  prefixes = g_ptr_array_new_with_free_func (g_free);
+  for (const char *p = path + 1; *p != '\0'; p++)
+    {
+      if (*p == '/' && p[-1] != '/')
+        g_ptr_array_add (prefixes, g_strndup (path, p - path));
+    }
+  if (path[strlen (path) - 1] != '/')
+    g_ptr_array_add (prefixes, g_strdup (path));
+
+  if (prefixes->len > _glnx_uring_get_capacity (ring))
+    return TRUE;
+
+  for (guint i = 0; i < prefixes->len; i++)
+    {
+      struct io_uring_sqe *sqe = _glnx_uring_prep (ring, IORING_OP_MKDIRAT);
+
+      sqe->fd = dfd;
+      sqe->addr = (guintptr) prefixes->pdata[i];
+      sqe->len = mode;
+      /* Run them in order, but carry on after EEXIST */
+      if (i + 1 < prefixes->len)
+        sqe->flags = IOSQE_IO_HARDLINK;
+    }
+
+  results = g_new (int, prefixes->len);
+  if (_glnx_uring_submit_and_wait (ring, results) < 0)
+    return TRUE;
+
+  *out_handled = TRUE;
+
+  /* The chain carries on after errors, so a parent that couldn't be
+   * created makes everything below it fail with ENOENT; report the first
+   * error, which is the real cause. */
+  for (guint i = 0; i < prefixes->len; i++)
+    {
+      res = results[i];
+      if (res < 0 && res != -EEXIST)
+        {
+          errno = -res;
+          return glnx_throw_errno_prefix (error, "mkdir(%s)", (char *) prefixes->pdata[i]);
+        }
+    }
 
   return TRUE;
 }
+#endif
 
 static gboolean
 mkdir_p_at_internal (int              dfd,
@@ -161,6 +742,17 @@ mkdir_p_at_internal (int              dfd,
               return glnx_throw_errno_prefix (error, "mkdir(%s)", path);
             }
 
+#if GLNX_HAVE_IO_URING
+          {
+            gboolean handled;
+
+            if (!mkdir_p_uring (dfd, path, mode, &handled, error))
+              return FALSE;
+            if (handled)
+              return TRUE;
+          }
+#endif
+
           /* Note we can mutate the buffer as we dup'd it */
           *lastslash = '\0';
 
@@ -265,3 +857,451 @@ glnx_shutil_mkdir_p_at_open (int            dfd,
 
   return glnx_opendirat (dfd, path, TRUE, out_dfd, error);
 }
+
+/* State shared by all workers of a glnx_shutil_cp_a_at() */
+typedef struct
+{
+  GLnxFileCopyFlags copyflags;
+  int dest_root_dfd;
+
+  GMutex lock;
+  GCond cond;
+  /* (dev, ino) → ShutilCopyHardlink, for sources with more than one link */
+  GHashTable *hardlinks;
+} ShutilCopyContext;
+
+/* Per-directory state */
+typedef struct
+{
+  int dest_dfd;
+  struct stat src_stbuf;
+} ShutilCopyDir;
+
+typedef struct
+{
+  dev_t dev;
+  ino_t ino;
+} ShutilCopyInode;
+
+typedef struct
+{
+  ShutilCopyInode key;
+  char *dest_relpath;  /* relative to dest_root_dfd */
+  gboolean done;       /* protected by ShutilCopyContext.lock */
+  gboolean failed;     /* protected by ShutilCopyContext.lock */
+} ShutilCopyHardlink;
+
+static guint
+shutil_copy_inode_hash (gconstpointer v)
+{
+  const ShutilCopyInode *inode = v;
+
+  return (guint) inode->ino ^ (guint) ((guint64) inode->ino >> 32) ^ (guint) inode->dev;
+}
+
+static gboolean
+shutil_copy_inode_equal (gconstpointer a,
+                         gconstpointer b)
+{
+  const ShutilCopyInode *inode_a = a;
+  const ShutilCopyInode *inode_b = b;
+
+  return inode_a->dev == inode_b->dev && inode_a->ino == inode_b->ino;
+}
+
+static void
+shutil_copy_hardlink_free (ShutilCopyHardlink *link)
+{
+  g_free (link->dest_relpath);
+  g_free (link);
+}
+
+static void
+shutil_copy_dir_free (ShutilCopyDir *dir)
+{
+  glnx_close_fd (&dir->dest_dfd);
+  g_free (dir);
+}
+
+/* Path of @name in @node, relative to the root of the copy */
+static char *
+shutil_tree_node_relpath (ShutilTreeNode *node,
+                          const char     *name)
+{
+  g_autoptr(GPtrArray) components = g_ptr_array_new ();
+  GString *path = g_string_new ("");
+
+  for (; node->parent != NULL; node = node->parent)
+    g_ptr_array_add (components, node->name);
+
+  for (guint i = components->len; i > 0; i--)
+    {
+      g_string_append (path, components->pdata[i - 1]);
+      g_string_append_c (path, '/');
+    }
+  g_string_append (path, name);
+
+  return g_string_free (path, FALSE);
+}
+
+/* Create @name as a directory we can fill in; its final mode is only
+ * applied once it has been populated. */
+static gboolean
+cp_a_mkdir_open (int                 dfd,
+                 const char         *name,
+                 GLnxFileCopyFlags   copyflags,
+                 int                *out_dfd,
+                 GError            **error)
+{
+  if (TEMP_FAILURE_RETRY (mkdirat (dfd, name, 0700)) != 0)
+    {
+      struct stat stbuf;
+
+      if (errno != EEXIST || !(copyflags & GLNX_FILE_COPY_OVERWRITE))
+        return glnx_throw_errno_prefix (error, "mkdirat(%s)", name);
+
+      /* Merge into an existing directory, but replace anything else */
+      if (!glnx_fstatat (dfd, name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+      if (!S_ISDIR (stbuf.st_mode))
+        {
+          if (!glnx_unlinkat (dfd, name, 0, error))
+            return FALSE;
+          if (TEMP_FAILURE_RETRY (mkdirat (dfd, name, 0700)) != 0)
+            return glnx_throw_errno_prefix (error, "mkdirat(%s)", name);
+        }
+    }
+
+  return glnx_opendirat (dfd, name, FALSE, out_dfd, error);
+}
+
+/* Copy a device node, FIFO or socket */
+static gboolean
+cp_a_copy_special (int                 src_dfd,
+                   const char         *src_name,
+                   const struct stat  *src_stbuf,
+                   int                 dest_dfd,
+                   const char         *dest_name,
+                   GLnxFileCopyFlags   copyflags,
+                   GCancellable       *cancellable,
+                   GError            **error)
+{
+  mode_t type = src_stbuf->st_mode & S_IFMT;
+
+  if (mknodat (dest_dfd, dest_name, type | 0600, src_stbuf->st_rdev) != 0)
+    {
+      if (errno != EEXIST || !(copyflags & GLNX_FILE_COPY_OVERWRITE))
+        return glnx_throw_errno_prefix (error, "mknodat(%s)", dest_name);
+      if (!glnx_unlinkat (dest_dfd, dest_name, 0, error))
+        return FALSE;
+      if (mknodat (dest_dfd, dest_name, type | 0600, src_stbuf->st_rdev) != 0)
+        return glnx_throw_errno_prefix (error, "mknodat(%s)", dest_name);
+    }
+
+  if (!(copyflags & GLNX_FILE_COPY_NOCHOWN))
+    {
+      if (fchownat (dest_dfd, dest_name, src_stbuf->st_uid, src_stbuf->st_gid,
+                    AT_SYMLINK_NOFOLLOW) != 0)
+        return glnx_throw_errno_prefix (error, "fchownat(%s)", dest_name);
+    }
+
+  if (!(copyflags & GLNX_FILE_COPY_NOXATTRS))
+    {
+      g_autoptr(GVariant) xattrs = NULL;
+
+      if (!glnx_dfd_name_get_all_xattrs (src_dfd, src_name, &xattrs, cancellable, error))
+        return FALSE;
+      if (!glnx_dfd_name_set_all_xattrs (dest_dfd, dest_name, xattrs, cancellable, error))
+        return FALSE;
+    }
+
+  if (fchmodat (dest_dfd, dest_name, src_stbuf->st_mode & 07777, 0) != 0)
+    return glnx_throw_errno_prefix (error, "fchmodat(%s)", dest_name);
+
+  struct timespec ts[2];
+  ts[0] = src_stbuf->st_atim;
+  ts[1] = src_stbuf->st_mtim;
+  (void) utimensat (dest_dfd, dest_name, ts, AT_SYMLINK_NOFOLLOW);
+
+  return TRUE;
+}
+
+static gboolean
+cp_a_copy_nondir (ShutilCopyContext  *ctx,
+                  int                 src_dfd,
+                  const char         *name,
+                  const struct stat  *src_stbuf,
+                  int                 dest_dfd,
+                  GCancellable       *cancellable,
+                  GError            **error)
+{
+  if (S_ISREG (src_stbuf->st_mode) || S_ISLNK (src_stbuf->st_mode))
+    return glnx_file_copy_at (src_dfd, name, src_stbuf, dest_dfd, name,
+                              ctx->copyflags, cancellable, error);
+  else
+    return cp_a_copy_special (src_dfd, name, src_stbuf, dest_dfd, name,
+                              ctx->copyflags, cancellable, error);
+}
+
+/* The first time we see an inode with several links, it's copied and
+ * remembered; later links to it are recreated with linkat().  If another
+ * worker is still copying it, wait for that to finish.
+ */
+static gboolean
+cp_a_copy_maybe_hardlink (ShutilCopyContext  *ctx,
+                          ShutilTreeNode     *node,
+                          const char         *name,
+                          const struct stat  *src_stbuf,
+                          int                 dest_dfd,
+                          GCancellable       *cancellable,
+                          GError            **error)
+{
+  ShutilCopyInode key = { src_stbuf->st_dev, src_stbuf->st_ino };
+  ShutilCopyHardlink *link;
+  gboolean ret;
+
+  if (src_stbuf->st_nlink < 2)
+    return cp_a_copy_nondir (ctx, node->dfd, name, src_stbuf, dest_dfd,
+                             cancellable, error);
+
+  g_mutex_lock (&ctx->lock);
+  link = g_hash_table_lookup (ctx->hardlinks, &key);
+  if (link != NULL)
+    {
+      g_autofree char *target = NULL;
+
+      while (!link->done && !link->failed)
+        g_cond_wait (&ctx->cond, &ctx->lock);
+      if (link->done)
+        target = g_strdup (link->dest_relpath);
+      g_mutex_unlock (&ctx->lock);
+
+      /* If linking isn't possible (e.g. EMLINK), fall back to a copy */
+      if (target != NULL &&
+          linkat (ctx->dest_root_dfd, target, dest_dfd, name, 0) == 0)
+        return TRUE;
+
+      return cp_a_copy_nondir (ctx, node->dfd, name, src_stbuf, dest_dfd,
+                               cancellable, error);
+    }
+
+  link = g_new0 (ShutilCopyHardlink, 1);
+  link->key = key;
+  link->dest_relpath = shutil_tree_node_relpath (node, name);
+  g_hash_table_insert (ctx->hardlinks, &link->key, link);
+  g_mutex_unlock (&ctx->lock);
+
+  ret = cp_a_copy_nondir (ctx, node->dfd, name, src_stbuf, dest_dfd,
+                          cancellable, error);
+
+  g_mutex_lock (&ctx->lock);
+  if (ret)
+    link->done = TRUE;
+  else
+    link->failed = TRUE;
+  g_cond_broadcast (&ctx->cond);
+  g_mutex_unlock (&ctx->lock);
+
+  return ret;
+}
+
+static gboolean
+cp_a_process_dir (ShutilTreeWorker  *worker,
+                  ShutilTreeNode    *node,
+                  GCancellable      *cancellable,
+                  GError           **error)
+{
+  ShutilCopyContext *ctx = worker->walk->user_data;
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  ShutilCopyDir *dir = node->data;
+  struct dirent *dent;
+
+  if (dir == NULL)
+    {
+      ShutilCopyDir *parent_dir = node->parent->data;
+
+      if (!glnx_opendirat (node->parent->dfd, node->name, FALSE, &node->dfd, error))
+        return FALSE;
+
+      node->data = dir = g_new0 (ShutilCopyDir, 1);
+      dir->dest_dfd = -1;
+      if (!glnx_fstat (node->dfd, &dir->src_stbuf, error))
+        return FALSE;
+      if (!cp_a_mkdir_open (parent_dir->dest_dfd, node->name, ctx->copyflags,
+                            &dir->dest_dfd, error))
+        return FALSE;
+    }
+
+  if (!glnx_dirfd_iterator_init_at (node->dfd, ".", FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct stat stbuf;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      if (dent->d_type == DT_DIR)
+        {
+          shutil_tree_walk_push_child (worker, node, dent->d_name, NULL);
+          continue;
+        }
+
+      if (!glnx_fstatat (node->dfd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+
+      if (!cp_a_copy_maybe_hardlink (ctx, node, dent->d_name, &stbuf, dir->dest_dfd,
+                                     cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Now that the directory is fully populated, apply its metadata */
+static gboolean
+cp_a_finish_dir (ShutilTreeWalk  *walk,
+                 ShutilTreeNode  *node,
+                 GError         **error)
+{
+  ShutilCopyContext *ctx = walk->user_data;
+  ShutilCopyDir *dir = node->data;
+  const struct stat *src_stbuf = &dir->src_stbuf;
+
+  if (!(ctx->copyflags & GLNX_FILE_COPY_NOCHOWN))
+    {
+      if (fchown (dir->dest_dfd, src_stbuf->st_uid, src_stbuf->st_gid) != 0)
+        return glnx_throw_errno_prefix (error, "fchown");
+    }
+
+  if (!(ctx->copyflags & GLNX_FILE_COPY_NOXATTRS))
+    {
+      g_autoptr(GVariant) xattrs = NULL;
+
+      if (!glnx_fd_get_all_xattrs (node->dfd, &xattrs, walk->cancellable, error))
+        return FALSE;
+      if (!glnx_fd_set_all_xattrs (dir->dest_dfd, xattrs, walk->cancellable, error))
+        return FALSE;
+    }
+
+  if (!glnx_fchmod (dir->dest_dfd, src_stbuf->st_mode & 07777, error))
+    return FALSE;
+
+  struct timespec ts[2];
+  ts[0] = src_stbuf->st_atim;
+  ts[1] = src_stbuf->st_mtim;
+  (void) futimens (dir->dest_dfd, ts);
+
+  if (ctx->copyflags & GLNX_FILE_COPY_DATASYNC)
+    {
+      if (fsync (dir->dest_dfd) != 0)
+        return glnx_throw_errno_prefix (error, "fsync");
+    }
+
+  return TRUE;
+}
+
+static const ShutilTreeWalkOps cp_a_ops = {
+  cp_a_process_dir,
+  cp_a_finish_dir,
+  (GDestroyNotify) shutil_copy_dir_free,
+};
+
+/**
+ * glnx_shutil_cp_a_at:
+ * @src_dfd: Source directory fd, or `AT_FDCWD` or `-1` for current
+ * @src_path: Path to copy, relative to @src_dfd
+ * @dest_dfd: Destination directory fd, or `AT_FDCWD` or `-1` for current
+ * @dest_path: Path to create, relative to @dest_dfd
+ * @copyflags: Flags, as for glnx_file_copy_at()
+ * @n_threads: Maximum number of threads to use, or 0 for one per CPU
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Recursively copy @src_path to @dest_path, like `cp -a`.  Regular files
+ * are copied with glnx_file_copy_at(), so they are reflinked where the
+ * filesystem supports it.  Modes, timestamps and (unless disabled with
+ * %GLNX_FILE_COPY_NOCHOWN and %GLNX_FILE_COPY_NOXATTRS) ownership and
+ * extended attributes are preserved for all file types, and files with
+ * several hard links inside @src_path are linked together in the copy.
+ * Symbolic links are copied, not followed.
+ *
+ * Subdirectories are distributed across up to @n_threads threads, like
+ * glnx_shutil_rm_rf_at_parallel().
+ *
+ * Unless %GLNX_FILE_COPY_OVERWRITE is given, it's an error for @dest_path
+ * or anything inside it to exist already; if it is, existing directories
+ * are merged into and other files are replaced, including by directories.
+ * An existing directory where @src_path has something else is still an
+ * error.  On error, a partial copy may be left behind.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ * Since: UNRELEASED
+ */
+gboolean
+glnx_shutil_cp_a_at (int                   src_dfd,
+                     const char           *src_path,
+                     int                   dest_dfd,
+                     const char           *dest_path,
+                     GLnxFileCopyFlags     copyflags,
+                     guint                 n_threads,
+                     GCancellable         *cancellable,
+                     GError              **error)
+{
+  ShutilCopyContext ctx = { 0, };
+  glnx_autofd int src_root_dfd = -1;
+  ShutilCopyDir *root_dir;
+  struct stat stbuf;
+  gboolean ret;
+
+  src_dfd = glnx_dirfd_canonicalize (src_dfd);
+  dest_dfd = glnx_dirfd_canonicalize (dest_dfd);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  if (!glnx_fstatat (src_dfd, src_path, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+    return FALSE;
+
+  if (S_ISREG (stbuf.st_mode) || S_ISLNK (stbuf.st_mode))
+    return glnx_file_copy_at (src_dfd, src_path, &stbuf, dest_dfd, dest_path,
+                              copyflags, cancellable, error);
+  else if (!S_ISDIR (stbuf.st_mode))
+    return cp_a_copy_special (src_dfd, src_path, &stbuf, dest_dfd, dest_path,
+                              copyflags, cancellable, error);
+
+  if (!glnx_opendirat (src_dfd, src_path, FALSE, &src_root_dfd, error))
+    return FALSE;
+
+  root_dir = g_new0 (ShutilCopyDir, 1);
+  root_dir->dest_dfd = -1;
+  if (!glnx_fstat (src_root_dfd, &root_dir->src_stbuf, error) ||
+      !cp_a_mkdir_open (dest_dfd, dest_path, copyflags, &root_dir->dest_dfd, error))
+    {
+      shutil_copy_dir_free (root_dir);
+      return FALSE;
+    }
+
+  ctx.copyflags = copyflags;
+  ctx.dest_root_dfd = root_dir->dest_dfd;
+  g_mutex_init (&ctx.lock);
+  g_cond_init (&ctx.cond);
+  ctx.hardlinks = g_hash_table_new_full (shutil_copy_inode_hash, shutil_copy_inode_equal,
+                                         NULL, (GDestroyNotify) shutil_copy_hardlink_free);
+
+  /* The root node (and with it, dest_root_dfd) is freed last */
+  ret = shutil_tree_walk_run (&cp_a_ops, &ctx, &src_root_dfd, root_dir, n_threads,
+                              cancellable, error);
+
+  g_hash_table_unref (ctx.hardlinks);
+  g_mutex_clear (&ctx.lock);
+  g_cond_clear (&ctx.cond);
+
+  if (!ret)
+    return glnx_prefix_error (error, "Copying %s", src_path);
+
+  return TRUE;
+}
@@ -22,6 +22,7 @@
 #pragma once
 
 #include <glnx-dirfd.h>
+#include <glnx-fdio.h>
 
 G_BEGIN_DECLS
 
@@ -31,6 +32,13 @@ glnx_shutil_rm_rf_at (int                   dfd,
                       GCancellable         *cancellable,
                       GError              **error);
 
+gboolean
+glnx_shutil_rm_rf_at_parallel (int                   dfd,
+                               const char           *path,
+                               guint                 n_threads,
+                               GCancellable         *cancellable,
+                               GError              **error);
+
 gboolean
 glnx_shutil_mkdir_p_at (int                   dfd,
                         const char           *path,
@@ -46,4 +54,14 @@ glnx_shutil_mkdir_p_at_open (int            dfd,
                              GCancellable  *cancellable,
                              GError       **error);
 
+gboolean
+glnx_shutil_cp_a_at (int                   src_dfd,
+                     const char           *src_path,
+                     int                   dest_dfd,
+                     const char           *dest_path,
+                     GLnxFileCopyFlags     copyflags,
+                     guint                 n_threads,
+                     GCancellable         *cancellable,
+                     GError              **error);
+
 G_END_DECLS
@@ -0,0 +1,355 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include "libglnx-config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <glnx-backports.h>
+#include <glnx-local-alloc.h>
+#include <glnx-macros.h>
+
+#include <glnx-uring.h>
+
+#if GLNX_HAVE_IO_URING
+
+#if !defined(__NR_io_uring_setup) || !defined(__NR_io_uring_enter) || !defined(__NR_io_uring_register)
+#error "linux/io_uring.h is available, but the io_uring syscall numbers are not"
+#endif
+
+/* Enough to amortize the submission for a directory full of files, while
+ * keeping the per-thread memory use small. */
+#define GLNX_URING_ENTRIES 128
+
+struct _GLnxUring
+{
+  int fd;
+  pid_t pid;
+
+  void *sq_ptr;
+  size_t sq_ptr_size;
+  void *cq_ptr;
+  size_t cq_ptr_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* Number of SQEs prepared since the last submission */
+  unsigned n_pending;
+  unsigned sq_tail_local;
+
+  guint8 supported_ops[IORING_OP_LAST];
+};
+
+static void
+glnx_uring_free (GLnxUring *ring)
+{
+  if (ring == NULL)
+    return;
+
+  if (ring->sqes != NULL)
+    munmap (ring->sqes, ring->sqes_size);
+  if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr)
+    munmap (ring->cq_ptr, ring->cq_ptr_size);
+  if (ring->sq_ptr != NULL)
+    munmap (ring->sq_ptr, ring->sq_ptr_size);
+  glnx_close_fd (&ring->fd);
+  g_free (ring);
+}
+
+static void
+glnx_uring_probe_ops (GLnxUring *ring)
+{
+  gsize probe_size = sizeof (struct io_uring_probe) + IORING_OP_LAST * sizeof (struct io_uring_probe_op);
+  g_autofree struct io_uring_probe *probe = g_malloc0 (probe_size);
+
+  /* Before Linux 5.6 there is no way to probe, but those kernels don't
+   * support any of the operations we care about either. */
+  if (syscall (__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0)
+    return;
+
+  for (guint i = 0; i < probe->ops_len && i < IORING_OP_LAST; i++)
+    ring->supported_ops[i] = (probe->ops[i].flags & IO_URING_OP_SUPPORTED) != 0;
+}
+
+/* Returns NULL with errno set on failure */
+static GLnxUring *
+glnx_uring_new (void)
+{
+  struct io_uring_params params = { 0, };
+  GLnxUring *ring = g_new0 (GLnxUring, 1);
+
+  ring->fd = syscall (__NR_io_uring_setup, GLNX_URING_ENTRIES, &params);
+  if (ring->fd < 0)
+    goto fail;
+  ring->pid = getpid ();
+
+  ring->sq_ptr_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+  ring->cq_ptr_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring->sq_ptr_size = ring->cq_ptr_size = MAX (ring->sq_ptr_size, ring->cq_ptr_size);
+
+  ring->sq_ptr = mmap (NULL, ring->sq_ptr_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED)
+    {
+      ring->sq_ptr = NULL;
+      goto fail;
+    }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ptr = ring->sq_ptr;
+  else
+    {
+      ring->cq_ptr = mmap (NULL, ring->cq_ptr_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+      if (ring->cq_ptr == MAP_FAILED)
+        {
+          ring->cq_ptr = NULL;
+          goto fail;
+        }
+    }
+
+  ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    {
+      ring->sqes = NULL;
+      goto fail;
+    }
+
+  ring->sq_tail = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.tail);
+  ring->sq_array = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.array);
+  ring->sq_mask = *(unsigned *) ((char *) ring->sq_ptr + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->sq_tail_local = *ring->sq_tail;
+  ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + params.cq_off.head);
+  ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *) ((char *) ring->cq_ptr + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + params.cq_off.cqes);
+
+  glnx_uring_probe_ops (ring);
+
+  return ring;
+
+ fail:
+  {
+    int errsv = errno;
+    glnx_uring_free (ring);
+    errno = errsv;
+    return NULL;
+  }
+}
+
+static GPrivate uring_key = G_PRIVATE_INIT ((GDestroyNotify) glnx_uring_free);
+
+/*
+ * _glnx_uring_get:
+ * @opcode: An `IORING_OP_*` operation the caller is going to use
+ *
+ * Returns the calling thread's ring, creating it if necessary; or %NULL
+ * if io_uring is not available, for example because the kernel is too old
+ * or a seccomp filter denies it, or if it does not support @opcode.
+ */
+GLnxUring *
+_glnx_uring_get (guint8 opcode)
+{
+  static int have_io_uring = -1; /* -1 means unknown */
+  GLnxUring *ring;
+
+  if (have_io_uring == 0)
+    return NULL;
+
+  ring = g_private_get (&uring_key);
+
+  /* A ring inherited across fork() is shared with the parent */
+  if (ring != NULL && ring->pid != getpid ())
+    {
+      g_private_replace (&uring_key, NULL);
+      ring = NULL;
+    }
+
+  if (ring == NULL)
+    {
+      ring = glnx_uring_new ();
+      if (ring == NULL)
+        {
+          /* ENOSYS if the kernel doesn't have it, EPERM if it's disabled by
+           * sysctl or a seccomp filter. Anything else (e.g. EMFILE) may be
+           * transient, so we'll try again next time. */
+          if (G_IN_SET (errno, ENOSYS, EPERM, EACCES))
+            have_io_uring = 0;
+          return NULL;
+        }
+
+      have_io_uring = 1;
+      g_private_set (&uring_key, ring);
+    }
+
+  if (opcode >= IORING_OP_LAST || !ring->supported_ops[opcode])
+    return NULL;
+
+  return ring;
+}
+
+/*
+ * _glnx_uring_get_capacity:
+ *
+ * Returns the maximum number of operations that can be prepared with
+ * _glnx_uring_prep() before calling _glnx_uring_submit_and_wait().
+ */
+guint
+_glnx_uring_get_capacity (GLnxUring *ring)
+{
+  return ring->sq_entries;
+}
+
+/*
+ * _glnx_uring_prep:
+ *
+ * Returns a zeroed submission queue entry for @opcode, which is the n'th
+ * since the last submission; its result will be stored at index n of the
+ * array passed to _glnx_uring_submit_and_wait().  Must not be called more
+ * than _glnx_uring_get_capacity() times per batch.
+ */
+struct io_uring_sqe *
+_glnx_uring_prep (GLnxUring *ring,
+                  guint8     opcode)
+{
+  unsigned idx = ring->sq_tail_local & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+  g_assert_cmpuint (ring->n_pending, <, ring->sq_entries);
+
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->opcode = opcode;
+  sqe->user_data = ring->n_pending;
+  ring->sq_array[idx] = idx;
+  ring->sq_tail_local++;
+  ring->n_pending++;
+
+  return sqe;
+}
+
+/* Store the results of the completions that are ready in @results, and
+ * return how many there were */
+static unsigned
+glnx_uring_reap (GLnxUring *ring,
+                 int       *results)
+{
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE);
+  unsigned n = 0;
+
+  for (; head != tail; head++)
+    {
+      const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+
+      g_assert_cmpuint (cqe->user_data, <, ring->n_pending);
+      results[cqe->user_data] = cqe->res;
+      n++;
+    }
+  __atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+
+  return n;
+}
+
+/*
+ * _glnx_uring_submit_and_wait:
+ * @results: (array): Filled in with the result of each prepared operation
+ *
+ * Submits all prepared operations and waits for all of them to complete.
+ * Each element of @results is set to the (negative errno or non-negative)
+ * result of the corresponding operation.
+ *
+ * Returns: 0 on success, or -1 with errno set if the batch could not be
+ * submitted, in which case it's unknown which (if any) of the operations
+ * have been performed, and the caller should fall back to doing them
+ * synchronously.  Even then, this only returns once none of the
+ * operations are in flight any more, so the caller may reuse the buffers
+ * they refer to.  The ring is discarded in that case.
+ */
+int
+_glnx_uring_submit_and_wait (GLnxUring *ring,
+                             int       *results)
+{
+  unsigned to_submit = ring->n_pending;
+  unsigned n_completed = 0;
+
+  __atomic_store_n (ring->sq_tail, ring->sq_tail_local, __ATOMIC_RELEASE);
+
+  while (n_completed < ring->n_pending)
+    {
+      int r;
+
+      r = syscall (__NR_io_uring_enter, ring->fd, to_submit,
+                   ring->n_pending - n_completed, IORING_ENTER_GETEVENTS, NULL, 0);
+      if (r < 0)
+        {
+          int errsv = errno;
+          unsigned n_in_flight = ring->n_pending - to_submit - n_completed;
+
+          if (errsv == EINTR)
+            continue;
+
+          /* Tearing down a ring doesn't wait for the operations that were
+           * already submitted, and they point into the caller's buffers,
+           * so wait for them here.  There's no way to recover if that
+           * fails too. */
+          n_in_flight -= glnx_uring_reap (ring, results);
+          while (n_in_flight > 0)
+            {
+              if (syscall (__NR_io_uring_enter, ring->fd, 0, n_in_flight,
+                           IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                  !G_IN_SET (errno, EINTR, EAGAIN, EBUSY))
+                g_error ("%s: waiting for io_uring completions: %s",
+                         G_STRLOC, g_strerror (errno));
+              n_in_flight -= glnx_uring_reap (ring, results);
+            }
+
+          /* Operations that weren't submitted are dropped with the ring */
+          g_private_replace (&uring_key, NULL);
+          errno = errsv;
+          return -1;
+        }
+      to_submit -= MIN ((unsigned) r, to_submit);
+
+      n_completed += glnx_uring_reap (ring, results);
+    }
+
+  ring->n_pending = 0;
+
+  return 0;
+}
+
+/*
+ * _glnx_uring_discard:
+ *
+ * Drops the operations prepared since the last submission without
+ * submitting them, for callers that give up on a batch half way, so that
+ * the next user of the ring on this thread starts from scratch.
+ */
+void
+_glnx_uring_discard (GLnxUring *ring)
+{
+  ring->sq_tail_local = *ring->sq_tail;
+  ring->n_pending = 0;
+}
+
+#endif /* GLNX_HAVE_IO_URING */
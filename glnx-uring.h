@@ -0,0 +1,55 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include "libglnx-config.h"
+
+#include <glib.h>
+
+#if HAVE_DECL_IORING_OP_MKDIRAT && !defined(ENABLE_WRPSEUDO_COMPAT)
+#include <linux/io_uring.h>
+#define GLNX_HAVE_IO_URING 1
+#else
+#define GLNX_HAVE_IO_URING 0
+#endif
+
+G_BEGIN_DECLS
+
+/* Internal helpers for batching system calls through io_uring.
+ *
+ * This is deliberately minimal: a ring is used synchronously by a single
+ * thread, which prepares a batch of SQEs and then waits for all of them to
+ * complete.  It is not part of the public API.
+ */
+
+typedef struct _GLnxUring GLnxUring;
+
+#if GLNX_HAVE_IO_URING
+
+GLnxUring *_glnx_uring_get (guint8 opcode);
+
+guint _glnx_uring_get_capacity (GLnxUring *ring);
+
+struct io_uring_sqe *_glnx_uring_prep (GLnxUring *ring,
+                                       guint8     opcode);
+
+int _glnx_uring_submit_and_wait (GLnxUring *ring,
+                                 int       *results);
+
+void _glnx_uring_discard (GLnxUring *ring);
+
+#else
+
+static inline GLnxUring *
+_glnx_uring_get (guint8 opcode)
+{
+  return NULL;
+}
+
+#endif
+
+G_END_DECLS
@@ -34,7 +34,10 @@ G_BEGIN_DECLS
 #include <glnx-chase.h>
 #include <glnx-lockfile.h>
 #include <glnx-errors.h>
+#include <glnx-digest.h>
 #include <glnx-dirfd.h>
+#include <glnx-dirindex.h>
+#include <glnx-dirwatch.h>
 #include <glnx-shutil.h>
 #include <glnx-xattrs.h>
 #include <glnx-console.h>
@@ -20,6 +20,7 @@ AC_CHECK_DECLS([
 #include <linux/random.h>
 #include <sys/mman.h>
 ]])
+AC_CHECK_DECLS([IORING_OP_MKDIRAT], [], [], [[#include <linux/io_uring.h>]])
 dnl This defines HAVE_FOO to 1 if found, or leaves it undefined if not:
 dnl not the same!
 AC_CHECK_FUNCS([close_range])
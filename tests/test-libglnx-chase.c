@@ -17,6 +17,70 @@
 #define GLNX_CHASE_DEBUG_NO_OPENAT2 (1U << 31)
 #define GLNX_CHASE_DEBUG_NO_OPEN_TREE (1U << 30)
 
+/* Count allocations made while counting_allocations is set, by interposing
+ * the glibc allocator. Sanitizers bring their own allocator, so leave it
+ * alone there. */
+#if defined(__has_feature)
+# if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer)
+#  define NO_ALLOCATION_COUNTING 1
+# endif
+#endif
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && \
+    !defined(__SANITIZE_THREAD__) && !defined(NO_ALLOCATION_COUNTING)
+#define HAVE_ALLOCATION_COUNTING 1
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static gboolean counting_allocations;
+static guint n_allocations;
+
+static inline void
+count_allocation (void)
+{
+  if (__atomic_load_n (&counting_allocations, __ATOMIC_RELAXED))
+    __atomic_add_fetch (&n_allocations, 1, __ATOMIC_RELAXED);
+}
+
+void *
+malloc (size_t size)
+{
+  count_allocation ();
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb,
+        size_t size)
+{
+  count_allocation ();
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void   *ptr,
+         size_t  size)
+{
+  count_allocation ();
+  return __libc_realloc (ptr, size);
+}
+
+static void
+start_counting_allocations (void)
+{
+  __atomic_store_n (&n_allocations, 0, __ATOMIC_RELAXED);
+  __atomic_store_n (&counting_allocations, TRUE, __ATOMIC_RELAXED);
+}
+
+static guint
+stop_counting_allocations (void)
+{
+  __atomic_store_n (&counting_allocations, FALSE, __ATOMIC_RELAXED);
+  return __atomic_load_n (&n_allocations, __ATOMIC_RELAXED);
+}
+#endif
+
 const char *test_paths[] = {
   "file/baz",
   "file/baz/",
@@ -66,6 +130,36 @@ get_abspath (int         dfd,
   return g_strdup_printf ("%s/%s", abs, path);
 }
 
+/* Resolve @path twice through a context, so that the second time can
+ * use what the first one cached */
+static void
+check_chase_context (int             dfd,
+                     const char     *path,
+                     GlnxChaseFlags  flags,
+                     int             expected_ino)
+{
+  g_autoptr(GlnxChaseContext) ctx = glnx_chase_context_new (dfd);
+
+  for (guint i = 0; i < 2; i++)
+    {
+      g_autoptr(GError) error = NULL;
+      glnx_autofd int chase_fd = -1;
+
+      chase_fd = glnx_chase_context_chaseat (ctx, path,
+                                             flags | GLNX_CHASE_DEBUG_NO_OPENAT2,
+                                             &error);
+      if (expected_ino < 0)
+        {
+          g_assert_cmpint (chase_fd, <, 0);
+          g_assert_nonnull (error);
+          continue;
+        }
+      g_assert_no_error (error);
+      g_assert_cmpint (chase_fd, >=, 0);
+      g_assert_cmpint (get_ino (chase_fd), ==, expected_ino);
+    }
+}
+
 static void
 check_chase (int             dfd,
              const char     *path,
@@ -101,6 +195,8 @@ check_chase (int             dfd,
   g_assert_cmpint (chase_fd, >=, 0);
   g_assert_cmpint (get_ino (chase_fd), ==, expected_ino);
   g_clear_fd (&chase_fd, NULL);
+
+  check_chase_context (dfd, path, flags, expected_ino);
 }
 
 static void
@@ -136,6 +232,8 @@ check_chase_error (int             dfd,
   g_assert_cmpint (chase_fd, <, 0);
   g_assert_error (error, err_domain, err_code);
   g_clear_error (&error);
+
+  check_chase_context (dfd, path, flags, -1);
 }
 
 static void
@@ -586,6 +684,382 @@ test_chase_and_statxat_permissions (void)
   g_clear_fd (&chase_fd, NULL);
 }
 
+static void
+test_chase_context_invalidate (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GlnxChaseContext) ctx = NULL;
+  glnx_autofd int dfd = -1;
+  glnx_autofd int chase_fd = -1;
+  /* Without any RESOLVE_ flags, NO_AUTOMOUNT takes a shortcut which
+   * doesn't use the cache */
+  const GlnxChaseFlags flags = GLNX_CHASE_NO_AUTOMOUNT | GLNX_CHASE_RESOLVE_NO_SYMLINKS;
+  int old_ino, new_ino;
+
+  g_assert_true (glnx_shutil_mkdir_p_at_open (AT_FDCWD, "ctx/a/b/c", 0755,
+                                              &dfd, NULL, &error));
+  g_assert_no_error (error);
+  old_ino = get_ino (dfd);
+  g_clear_fd (&dfd, NULL);
+
+  ctx = glnx_chase_context_new (AT_FDCWD);
+  chase_fd = glnx_chase_context_chaseat (ctx, "ctx/a/b/c", flags, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (get_ino (chase_fd), ==, old_ino);
+  g_clear_fd (&chase_fd, NULL);
+
+  /* Replace a cached directory; the new one must be found */
+  g_assert_cmpint (renameat (AT_FDCWD, "ctx/a/b", AT_FDCWD, "ctx/a/old-b"), ==, 0);
+  g_assert_true (glnx_shutil_mkdir_p_at_open (AT_FDCWD, "ctx/a/b/c", 0755,
+                                              &dfd, NULL, &error));
+  g_assert_no_error (error);
+  new_ino = get_ino (dfd);
+  g_assert_cmpint (new_ino, !=, old_ino);
+
+  chase_fd = glnx_chase_context_chaseat (ctx, "ctx/a/b/c", flags, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (get_ino (chase_fd), ==, new_ino);
+  g_clear_fd (&chase_fd, NULL);
+
+  /* A symlink in place of a cached directory is noticed too */
+  g_assert_cmpint (renameat (AT_FDCWD, "ctx/a/b", AT_FDCWD, "ctx/a/new-b"), ==, 0);
+  g_assert_cmpint (symlinkat ("old-b", AT_FDCWD, "ctx/a/b"), ==, 0);
+  chase_fd = glnx_chase_context_chaseat (ctx, "ctx/a/b/c", flags, &error);
+  g_assert_cmpint (chase_fd, <, 0);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_TOO_MANY_LINKS);
+  g_clear_error (&error);
+  chase_fd = glnx_chase_context_chaseat (ctx, "ctx/a/b/c",
+                                         GLNX_CHASE_NO_AUTOMOUNT, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (get_ino (chase_fd), ==, old_ino);
+}
+
+static void
+test_chase_context_escape (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GlnxChaseContext) ctx = NULL;
+  glnx_autofd int root_dfd = -1;
+  glnx_autofd int chase_fd = -1;
+  const GlnxChaseFlags flags = GLNX_CHASE_NO_AUTOMOUNT | GLNX_CHASE_RESOLVE_BENEATH;
+
+  g_assert_true (glnx_shutil_mkdir_p_at (AT_FDCWD, "escape/root/a/b/c", 0755, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_true (glnx_opendirat (AT_FDCWD, "escape/root", TRUE, &root_dfd, &error));
+  g_assert_no_error (error);
+
+  ctx = glnx_chase_context_new (root_dfd);
+  chase_fd = glnx_chase_context_chaseat (ctx, "a/b/c", flags, &error);
+  g_assert_no_error (error);
+  g_clear_fd (&chase_fd, NULL);
+
+  /* Move a cached directory out of the root, and make a symlink to it in
+   * place of its parent: the cache must not take us there */
+  g_assert_cmpint (renameat (AT_FDCWD, "escape/root/a/b", AT_FDCWD, "escape/b"), ==, 0);
+  g_assert_cmpint (renameat (AT_FDCWD, "escape/root/a", AT_FDCWD, "escape/old-a"), ==, 0);
+  g_assert_cmpint (symlinkat ("..", AT_FDCWD, "escape/root/a"), ==, 0);
+
+  chase_fd = glnx_chase_context_chaseat (ctx, "a/b/c", flags, &error);
+  g_assert_cmpint (chase_fd, <, 0);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_clear_error (&error);
+}
+
+static guint
+count_open_fds (void)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  g_autoptr(GError) error = NULL;
+  guint n = 0;
+
+  g_assert_true (glnx_dirfd_iterator_init_at (AT_FDCWD, "/proc/self/fd", TRUE,
+                                              &dfd_iter, &error));
+  g_assert_no_error (error);
+  while (TRUE)
+    {
+      struct dirent *dent;
+
+      g_assert_true (glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, NULL, &error));
+      g_assert_no_error (error);
+      if (dent == NULL)
+        break;
+      n++;
+    }
+
+  return n;
+}
+
+static void
+test_chase_context_fd_limit (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GlnxChaseContext) ctx = NULL;
+  const GlnxChaseFlags flags = GLNX_CHASE_NO_AUTOMOUNT | GLNX_CHASE_RESOLVE_NO_SYMLINKS;
+  guint n_fds_before;
+
+  ctx = glnx_chase_context_new (AT_FDCWD);
+  n_fds_before = count_open_fds ();
+
+  /* Many distinct directories must not pile up an open fd each */
+  for (guint i = 0; i < 1000; i++)
+    {
+      g_autofree char *path = g_strdup_printf ("fd-limit/%u/a", i);
+      glnx_autofd int chase_fd = -1;
+
+      g_assert_true (glnx_shutil_mkdir_p_at (AT_FDCWD, path, 0755, NULL, &error));
+      g_assert_no_error (error);
+      chase_fd = glnx_chase_context_chaseat (ctx, path, flags, &error);
+      g_assert_no_error (error);
+      g_assert_cmpint (chase_fd, >=, 0);
+    }
+
+  g_assert_cmpuint (count_open_fds (), <=, n_fds_before + 256);
+}
+
+static void
+test_chaseat_many (void)
+{
+  g_autoptr(GError) error = NULL;
+  const char *paths[] = {
+    "many/b/y",
+    "many/a/x",
+    "many/b",
+    "many/a/y",
+    "many/../many/a/x",
+  };
+  int fds[G_N_ELEMENTS (paths)];
+
+  for (gsize i = 0; i < G_N_ELEMENTS (paths); i++)
+    {
+      g_assert_true (glnx_shutil_mkdir_p_at (AT_FDCWD, paths[i], 0755, NULL, &error));
+      g_assert_no_error (error);
+    }
+
+  g_assert_true (glnx_chaseat_many (AT_FDCWD, paths, G_N_ELEMENTS (paths),
+                                    GLNX_CHASE_NO_AUTOMOUNT | GLNX_CHASE_RESOLVE_BENEATH,
+                                    fds, &error));
+  g_assert_no_error (error);
+  for (gsize i = 0; i < G_N_ELEMENTS (paths); i++)
+    {
+      g_assert_cmpint (get_ino (fds[i]), ==, path_get_ino (paths[i]));
+      g_clear_fd (&fds[i], NULL);
+    }
+
+  /* One failure fails the whole batch */
+  paths[2] = "many/nope";
+  g_assert_false (glnx_chaseat_many (AT_FDCWD, paths, G_N_ELEMENTS (paths),
+                                     GLNX_CHASE_NO_AUTOMOUNT, fds, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  for (gsize i = 0; i < G_N_ELEMENTS (paths); i++)
+    g_assert_cmpint (fds[i], ==, -1);
+}
+
+static void
+test_chase_resolve_cached (void)
+{
+  g_autoptr(GError) error = NULL;
+  glnx_autofd int chase_fd = -1;
+  guint64 hits, misses, new_hits, new_misses;
+
+  g_assert_true (glnx_shutil_mkdir_p_at (AT_FDCWD, "cached/a/b", 0755, NULL, &error));
+  g_assert_no_error (error);
+
+  /* The first lookup brings everything into the dcache, if it wasn't */
+  chase_fd = glnx_chaseat (AT_FDCWD, "cached/a/b", GLNX_CHASE_DEFAULT, &error);
+  g_assert_no_error (error);
+  g_clear_fd (&chase_fd, NULL);
+
+  glnx_chase_get_resolve_cached_stats (&hits, &misses);
+  chase_fd = glnx_chaseat (AT_FDCWD, "cached/a/b", GLNX_CHASE_DEFAULT, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (get_ino (chase_fd), ==, path_get_ino ("cached/a/b"));
+  glnx_chase_get_resolve_cached_stats (&new_hits, &new_misses);
+
+  if (new_hits == hits && new_misses == misses)
+    {
+      g_test_skip ("openat2 with RESOLVE_CACHED not supported");
+      return;
+    }
+
+  g_assert_cmpuint (new_hits, ==, hits + 1);
+  g_assert_cmpuint (new_misses, ==, misses);
+
+  /* The manual implementation doesn't count */
+  g_clear_fd (&chase_fd, NULL);
+  chase_fd = glnx_chaseat (AT_FDCWD, "cached/a/b", GLNX_CHASE_DEBUG_NO_OPENAT2, &error);
+  g_assert_no_error (error);
+  glnx_chase_get_resolve_cached_stats (&hits, &misses);
+  g_assert_cmpuint (hits, ==, new_hits);
+  g_assert_cmpuint (misses, ==, new_misses);
+}
+
+static void
+store_result_cb (GObject      *source,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+  GAsyncResult **result_out = user_data;
+
+  g_assert_null (*result_out);
+  *result_out = g_object_ref (result);
+}
+
+static GAsyncResult *
+wait_for_result (GAsyncResult **result_ptr)
+{
+  while (*result_ptr == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  return g_steal_pointer (result_ptr);
+}
+
+static void
+test_chase_async (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GAsyncResult) result = NULL;
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  GAsyncResult *pending = NULL;
+  glnx_autofd int dfd = -1;
+  glnx_autofd int chase_fd = -1;
+  struct glnx_statx st;
+
+  g_assert_true (glnx_shutil_mkdir_p_at_open (AT_FDCWD, "async/a/b", 0755,
+                                              &dfd, NULL, &error));
+  g_assert_no_error (error);
+  g_clear_fd (&dfd, NULL);
+  dfd = openat (AT_FDCWD, "async", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  g_assert_cmpint (dfd, >=, 0);
+
+  glnx_chaseat_async (dfd, "a/b", GLNX_CHASE_RESOLVE_BENEATH, NULL,
+                      store_result_cb, &pending);
+  /* dfd is dup'ed, so closing it doesn't disturb the lookup */
+  g_clear_fd (&dfd, NULL);
+  result = wait_for_result (&pending);
+  chase_fd = glnx_chaseat_finish (result, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (get_ino (chase_fd), ==, path_get_ino ("async/a/b"));
+  g_clear_fd (&chase_fd, NULL);
+  g_clear_object (&result);
+
+  glnx_chase_and_statxat_async (AT_FDCWD, "async/a", GLNX_CHASE_DEFAULT,
+                                GLNX_STATX_TYPE | GLNX_STATX_INO,
+                                cancellable, store_result_cb, &pending);
+  result = wait_for_result (&pending);
+  chase_fd = glnx_chase_and_statxat_finish (result, &st, &error);
+  g_assert_no_error (error);
+  g_assert_true (S_ISDIR (st.stx_mode));
+  g_assert_cmpint (st.stx_ino, ==, path_get_ino ("async/a"));
+  g_clear_fd (&chase_fd, NULL);
+  g_clear_object (&result);
+
+  glnx_chaseat_async (AT_FDCWD, "async/nope", GLNX_CHASE_DEFAULT, NULL,
+                      store_result_cb, &pending);
+  result = wait_for_result (&pending);
+  chase_fd = glnx_chaseat_finish (result, &error);
+  g_assert_cmpint (chase_fd, <, 0);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_clear_error (&error);
+  g_clear_object (&result);
+
+  g_cancellable_cancel (cancellable);
+  glnx_chaseat_async (AT_FDCWD, "async/a/b", GLNX_CHASE_DEFAULT, cancellable,
+                      store_result_cb, &pending);
+  result = wait_for_result (&pending);
+  chase_fd = glnx_chaseat_finish (result, &error);
+  g_assert_cmpint (chase_fd, <, 0);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+}
+
+#define DEEP_PATH_LEVELS 32
+
+static char *
+make_deep_path (void)
+{
+  g_autoptr(GError) error = NULL;
+  GString *path = g_string_new ("deep");
+
+  for (guint i = 0; i < DEEP_PATH_LEVELS; i++)
+    g_string_append_printf (path, "/d%u", i);
+
+  g_assert_true (glnx_shutil_mkdir_p_at (AT_FDCWD, path->str, 0755, NULL, &error));
+  g_assert_no_error (error);
+
+  return g_string_free (path, FALSE);
+}
+
+static void
+test_chase_no_allocations (void)
+{
+#ifdef HAVE_ALLOCATION_COUNTING
+  g_autoptr(GError) error = NULL;
+  g_autofree char *path = make_deep_path ();
+  const GlnxChaseFlags flags = GLNX_CHASE_RESOLVE_BENEATH | GLNX_CHASE_DEBUG_NO_OPENAT2;
+  glnx_autofd int dfd = -1;
+  glnx_autofd int chase_fd = -1;
+  guint allocations;
+
+  dfd = openat (AT_FDCWD, ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  g_assert_cmpint (dfd, >=, 0);
+
+  /* Warm up anything that's lazily initialized */
+  chase_fd = glnx_chaseat (dfd, path, flags, &error);
+  g_assert_no_error (error);
+  g_clear_fd (&chase_fd, NULL);
+
+  start_counting_allocations ();
+  chase_fd = glnx_chaseat (dfd, path, flags, &error);
+  allocations = stop_counting_allocations ();
+
+  g_assert_no_error (error);
+  g_assert_cmpint (get_ino (chase_fd), ==, path_get_ino (path));
+  g_assert_cmpuint (allocations, ==, 0);
+#else
+  g_test_skip ("Allocation counting not supported in this build");
+#endif
+}
+
+/* Run with `-m perf` */
+static void
+benchmark_chase_manual (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *path = NULL;
+  const GlnxChaseFlags flags = GLNX_CHASE_RESOLVE_BENEATH | GLNX_CHASE_DEBUG_NO_OPENAT2;
+  const guint iterations = 20000;
+  glnx_autofd int dfd = -1;
+  double elapsed;
+  guint allocations = 0;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Not running benchmarks (use -m perf)");
+      return;
+    }
+
+  path = make_deep_path ();
+  dfd = openat (AT_FDCWD, ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  g_assert_cmpint (dfd, >=, 0);
+
+#ifdef HAVE_ALLOCATION_COUNTING
+  start_counting_allocations ();
+#endif
+  g_test_timer_start ();
+  for (guint i = 0; i < iterations; i++)
+    {
+      glnx_autofd int chase_fd = glnx_chaseat (dfd, path, flags, &error);
+      g_assert_no_error (error);
+    }
+  elapsed = g_test_timer_elapsed ();
+#ifdef HAVE_ALLOCATION_COUNTING
+  allocations = stop_counting_allocations ();
+#endif
+
+  g_test_message ("%u levels: %.0f ns per resolution, %.2f allocations per call",
+                  DEEP_PATH_LEVELS, elapsed * 1e9 / iterations,
+                  (double) allocations / iterations);
+}
+
 int main (int argc, char **argv)
 {
   _GLNX_TEST_SCOPED_TEMP_DIR;
@@ -602,6 +1076,14 @@ int main (int argc, char **argv)
   g_test_add_func ("/chase-and-statxat-basic", test_chase_and_statxat_basic);
   g_test_add_func ("/chase-and-statxat-symlink", test_chase_and_statxat_symlink);
   g_test_add_func ("/chase-and-statxat-permissions", test_chase_and_statxat_permissions);
+  g_test_add_func ("/chase-context-invalidate", test_chase_context_invalidate);
+  g_test_add_func ("/chase-context-escape", test_chase_context_escape);
+  g_test_add_func ("/chase-context-fd-limit", test_chase_context_fd_limit);
+  g_test_add_func ("/chaseat-many", test_chaseat_many);
+  g_test_add_func ("/chase-resolve-cached", test_chase_resolve_cached);
+  g_test_add_func ("/chase-async", test_chase_async);
+  g_test_add_func ("/chase-no-allocations", test_chase_no_allocations);
+  g_test_add_func ("/chase-manual/benchmark", benchmark_chase_manual);
 
   ret = g_test_run();
 
@@ -0,0 +1,226 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ * SPDX-License-Identifier: LGPL-2.0-or-later
+ */
+
+#include "libglnx-config.h"
+#include "libglnx.h"
+#include <glib.h>
+#include <stdlib.h>
+#include <gio/gio.h>
+#include <string.h>
+
+#include "libglnx-testlib.h"
+
+/* Bit-at-a-time CRC-32C, to check the fast implementations against */
+static guint32
+reference_crc32c (const guint8 *buf,
+                  gsize         len)
+{
+  guint32 crc = 0xFFFFFFFF;
+
+  for (gsize i = 0; i < len; i++)
+    {
+      crc ^= buf[i];
+      for (guint j = 0; j < 8; j++)
+        crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+    }
+
+  return ~crc;
+}
+
+static void
+test_crc32c (void)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  guint8 buf[1024];
+  guint32 crc;
+
+  /* From RFC 3720, appendix B.4 */
+  memset (buf, 0, 32);
+  g_assert_cmphex (glnx_crc32c (0, buf, 32), ==, 0x8A9136AA);
+  memset (buf, 0xFF, 32);
+  g_assert_cmphex (glnx_crc32c (0, buf, 32), ==, 0x62A8AB43);
+  for (guint i = 0; i < 32; i++)
+    buf[i] = i;
+  g_assert_cmphex (glnx_crc32c (0, buf, 32), ==, 0x46DD794E);
+  g_assert_cmphex (glnx_crc32c (0, "123456789", 9), ==, 0xE3069283);
+  g_assert_cmphex (glnx_crc32c (0, "", 0), ==, 0);
+
+  for (guint i = 0; i < sizeof (buf); i++)
+    buf[i] = g_rand_int (rand);
+
+  /* All alignments and lengths, in one go and in two parts */
+  for (guint offset = 0; offset < 16; offset++)
+    for (guint len = 0; offset + len <= sizeof (buf); len += 1 + len / 4)
+      {
+        guint split = len / 3;
+
+        g_assert_cmphex (glnx_crc32c (0, buf + offset, len), ==,
+                         reference_crc32c (buf + offset, len));
+
+        crc = glnx_crc32c (0, buf + offset, split);
+        crc = glnx_crc32c (crc, buf + offset + split, len - split);
+        g_assert_cmphex (crc, ==, reference_crc32c (buf + offset, len));
+      }
+}
+
+static void
+test_digest (void)
+{
+  g_auto(GLnxDigest) digest = { 0, };
+  /* Clearing one that was never initialized is fine */
+  g_auto(GLnxDigest) never_initialized = { 0, };
+  guint8 sha256[GLNX_DIGEST_SHA256_LEN];
+  g_autofree char *hex = NULL;
+
+  glnx_digest_init (&digest, GLNX_DIGEST_SHA256 | GLNX_DIGEST_CRC32C);
+  glnx_digest_update (&digest, "1234", 4);
+  glnx_digest_update (&digest, "", 0);
+  glnx_digest_update (&digest, "56789", 5);
+  g_assert_cmpuint (glnx_digest_get_size (&digest), ==, 9);
+  g_assert_cmphex (glnx_digest_get_crc32c (&digest), ==, 0xE3069283);
+  g_assert_cmpstr (glnx_digest_get_sha256_string (&digest), ==,
+                   "15e2b0d3c33891ebb0f1ef609ec419420c20e320ce94c65fbc8c3312448eb225");
+
+  glnx_digest_get_sha256 (&digest, sha256);
+  hex = g_compute_checksum_for_data (G_CHECKSUM_SHA256, (const guint8 *) "123456789", 9);
+  for (guint i = 0; i < GLNX_DIGEST_SHA256_LEN; i++)
+    {
+      char byte[3];
+
+      g_snprintf (byte, sizeof (byte), "%02x", sha256[i]);
+      g_assert_cmpmem (byte, 2, hex + 2 * i, 2);
+    }
+
+  /* A digest can be reused after clearing */
+  glnx_digest_clear (&digest);
+  glnx_digest_init (&digest, GLNX_DIGEST_NONE);
+  glnx_digest_update (&digest, "abc", 3);
+  g_assert_cmpuint (glnx_digest_get_size (&digest), ==, 3);
+}
+
+static void
+test_fd_digest (void)
+{
+  _GLNX_TEST_SCOPED_TEMP_DIR;
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  g_auto(GLnxDigest) expected = { 0, };
+  g_auto(GLnxDigest) digest = { 0, };
+  g_autoptr(GBytes) copied = NULL;
+  /* Not a multiple of any buffer size */
+  const gsize size = 3 * 1024 * 1024 + 17;
+  g_autofree guint8 *buf = g_malloc (size);
+  glnx_autofd int src_fd = -1;
+  glnx_autofd int dest_fd = -1;
+
+  for (gsize i = 0; i < size; i++)
+    buf[i] = g_rand_int (rand);
+  if (!glnx_file_replace_contents_at (AT_FDCWD, "src", buf, size,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+
+  glnx_digest_init (&expected, GLNX_DIGEST_SHA256 | GLNX_DIGEST_CRC32C);
+  glnx_digest_update (&expected, buf, size);
+
+  if (!glnx_openat_rdonly (AT_FDCWD, "src", TRUE, &src_fd, error))
+    return;
+  glnx_digest_init (&digest, GLNX_DIGEST_SHA256 | GLNX_DIGEST_CRC32C);
+  if (!glnx_fd_readall_digest (src_fd, &digest, NULL, error))
+    return;
+  g_assert_cmpuint (glnx_digest_get_size (&digest), ==, size);
+  g_assert_cmphex (glnx_digest_get_crc32c (&digest), ==, glnx_digest_get_crc32c (&expected));
+  g_assert_cmpstr (glnx_digest_get_sha256_string (&digest), ==,
+                   glnx_digest_get_sha256_string (&expected));
+  glnx_digest_clear (&digest);
+
+  /* Copying */
+  if (lseek (src_fd, 0, SEEK_SET) < 0)
+    return (void) glnx_throw_errno_prefix (error, "lseek");
+  dest_fd = openat (AT_FDCWD, "dest", O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+  if (dest_fd < 0)
+    return (void) glnx_throw_errno_prefix (error, "openat");
+  glnx_digest_init (&digest, GLNX_DIGEST_SHA256 | GLNX_DIGEST_CRC32C);
+  if (!glnx_regfile_copy_bytes_digest (src_fd, dest_fd, -1, &digest, NULL, error))
+    return;
+  g_assert_cmpstr (glnx_digest_get_sha256_string (&digest), ==,
+                   glnx_digest_get_sha256_string (&expected));
+  g_clear_fd (&dest_fd, NULL);
+  glnx_digest_clear (&digest);
+
+  if (!glnx_openat_rdonly (AT_FDCWD, "dest", TRUE, &dest_fd, error))
+    return;
+  copied = glnx_fd_readall_bytes (dest_fd, NULL, error);
+  if (copied == NULL)
+    return;
+  g_clear_fd (&dest_fd, NULL);
+  g_assert_cmpmem (g_bytes_get_data (copied, NULL), g_bytes_get_size (copied), buf, size);
+  g_clear_pointer (&copied, g_bytes_unref);
+
+  /* Copying a prefix */
+  if (lseek (src_fd, 0, SEEK_SET) < 0)
+    return (void) glnx_throw_errno_prefix (error, "lseek");
+  dest_fd = openat (AT_FDCWD, "dest", O_WRONLY | O_TRUNC | O_CLOEXEC);
+  if (dest_fd < 0)
+    return (void) glnx_throw_errno_prefix (error, "openat");
+  glnx_digest_init (&digest, GLNX_DIGEST_CRC32C);
+  if (!glnx_regfile_copy_bytes_digest (src_fd, dest_fd, 1000, &digest, NULL, error))
+    return;
+  g_assert_cmpuint (glnx_digest_get_size (&digest), ==, 1000);
+  g_assert_cmphex (glnx_digest_get_crc32c (&digest), ==, glnx_crc32c (0, buf, 1000));
+  g_clear_fd (&dest_fd, NULL);
+  glnx_digest_clear (&digest);
+
+  /* Cancellation */
+  g_cancellable_cancel (cancellable);
+  glnx_digest_init (&digest, GLNX_DIGEST_CRC32C);
+  g_assert_false (glnx_fd_readall_digest (src_fd, &digest, cancellable, error));
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_clear_error (&local_error);
+}
+
+static void
+benchmark_crc32c (void)
+{
+  const gsize size = 64 * 1024 * 1024;
+  g_autofree guint8 *buf = NULL;
+  guint32 crc = 0;
+  double elapsed;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Not running benchmarks (use -m perf)");
+      return;
+    }
+
+  buf = g_malloc (size);
+  memset (buf, 0x5a, size);
+
+  g_test_timer_start ();
+  for (guint i = 0; i < 16; i++)
+    crc = glnx_crc32c (crc, buf, size);
+  elapsed = g_test_timer_elapsed ();
+
+  g_test_message ("CRC-32C: %.0f MiB/s (%08x)", 16 * 64 / elapsed, crc);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  int ret;
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/digest/crc32c", test_crc32c);
+  g_test_add_func ("/digest/crc32c/benchmark", benchmark_crc32c);
+  g_test_add_func ("/digest/update", test_digest);
+  g_test_add_func ("/digest/fd", test_fd_digest);
+
+  ret = g_test_run();
+
+  return ret;
+}
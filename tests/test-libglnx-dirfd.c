@@ -0,0 +1,350 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ * SPDX-License-Identifier: LGPL-2.0-or-later
+ */
+
+#include "libglnx-config.h"
+#include "libglnx.h"
+#include <glib.h>
+#include <stdlib.h>
+#include <gio/gio.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "libglnx-testlib.h"
+
+#define N_FILES 1000
+
+static gboolean
+create_files (int       dfd,
+              guint     n_files,
+              GError  **error)
+{
+  for (guint i = 0; i < n_files; i++)
+    {
+      glnx_autofd int fd = -1;
+      char name[32];
+
+      g_snprintf (name, sizeof (name), "file%u", i);
+      fd = openat (dfd, name, O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+      if (fd < 0)
+        return glnx_throw_errno_prefix (error, "openat(%s)", name);
+    }
+
+  if (!glnx_ensure_dir (dfd, "subdir", 0755, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+static guint
+count_batched (GLnxDirFdIterator  *dfd_iter,
+               gsize               buf_size,
+               GHashTable         *seen,
+               GError            **error)
+{
+  g_autofree char *buf = g_malloc (buf_size);
+  guint n_batches = 0;
+
+  while (TRUE)
+    {
+      GLnxDirent64 *dent;
+      gsize len;
+      gsize offset = 0;
+
+      if (!glnx_dirfd_iterator_next_batch (dfd_iter, buf, buf_size, &len, NULL, error))
+        return 0;
+      if (len == 0)
+        break;
+
+      n_batches++;
+      while ((dent = glnx_dirent64_batch_next (buf, len, &offset)) != NULL)
+        {
+          g_assert_cmpstr (dent->d_name, !=, ".");
+          g_assert_cmpstr (dent->d_name, !=, "..");
+          g_assert_cmpuint (dent->d_ino, !=, 0);
+          if (strcmp (dent->d_name, "subdir") == 0)
+            g_assert_cmpint (dent->d_type, ==, DT_DIR);
+          g_assert_true (g_hash_table_add (seen, g_strdup (dent->d_name)));
+        }
+    }
+
+  return n_batches;
+}
+
+static void
+test_dirfd_iterator_batch (void)
+{
+  _GLNX_TEST_SCOPED_TEMP_DIR;
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  g_autoptr(GHashTable) seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  glnx_autofd int dfd = -1;
+  guint n_small_batches, n_large_batches;
+  guint64 tiny_buf[1];
+  gsize len;
+
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, "dir", 0755, &dfd, NULL, error))
+    return;
+  if (!create_files (dfd, N_FILES, error))
+    return;
+
+  if (!glnx_dirfd_iterator_init_at (dfd, ".", FALSE, &dfd_iter, error))
+    return;
+
+  n_small_batches = count_batched (&dfd_iter, 4096, seen, error);
+  if (local_error)
+    return;
+  g_assert_cmpuint (g_hash_table_size (seen), ==, N_FILES + 1);
+
+  /* Rewinding works, and a larger buffer needs fewer calls */
+  glnx_dirfd_iterator_rewind (&dfd_iter);
+  g_hash_table_remove_all (seen);
+  n_large_batches = count_batched (&dfd_iter, 256 * 1024, seen, error);
+  if (local_error)
+    return;
+  g_assert_cmpuint (g_hash_table_size (seen), ==, N_FILES + 1);
+  g_assert_cmpuint (n_large_batches, <, n_small_batches);
+
+  /* A buffer too small for even one entry is an error */
+  glnx_dirfd_iterator_rewind (&dfd_iter);
+  g_assert_false (glnx_dirfd_iterator_next_batch (&dfd_iter, tiny_buf, sizeof (tiny_buf),
+                                                  &len, NULL, error));
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT);
+  g_clear_error (&local_error);
+}
+
+static void
+test_dirfd_iterator_batch_empty (void)
+{
+  _GLNX_TEST_SCOPED_TEMP_DIR;
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  guint64 buf[4096 / sizeof (guint64)];
+  gsize len, offset = 0;
+
+  if (!glnx_ensure_dir (AT_FDCWD, "empty", 0755, error))
+    return;
+  if (!glnx_dirfd_iterator_init_at (AT_FDCWD, "empty", FALSE, &dfd_iter, error))
+    return;
+
+  /* Only . and .., which are skipped */
+  if (!glnx_dirfd_iterator_next_batch (&dfd_iter, buf, sizeof (buf), &len, NULL, error))
+    return;
+  g_assert_cmpuint (len, >, 0);
+  g_assert_null (glnx_dirent64_batch_next (buf, len, &offset));
+  g_assert_cmpuint (offset, ==, len);
+
+  if (!glnx_dirfd_iterator_next_batch (&dfd_iter, buf, sizeof (buf), &len, NULL, error))
+    return;
+  g_assert_cmpuint (len, ==, 0);
+}
+
+static void
+test_dirfd_iterator_sort_by_inode (void)
+{
+  _GLNX_TEST_SCOPED_TEMP_DIR;
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  g_autoptr(GHashTable) seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  glnx_autofd int dfd = -1;
+
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, "dir", 0755, &dfd, NULL, error))
+    return;
+  if (!create_files (dfd, N_FILES, error))
+    return;
+
+  if (!glnx_dirfd_iterator_init_at (dfd, ".", FALSE, &dfd_iter, error))
+    return;
+  glnx_dirfd_iterator_set_flags (&dfd_iter, GLNX_DIRFD_ITERATOR_FLAGS_SORT_BY_INODE);
+
+  for (guint pass = 0; pass < 2; pass++)
+    {
+      ino_t prev_ino = 0;
+
+      g_hash_table_remove_all (seen);
+
+      while (TRUE)
+        {
+          struct dirent *dent;
+          struct stat stbuf;
+
+          if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, NULL, error))
+            return;
+          if (dent == NULL)
+            break;
+
+          g_assert_cmpuint (dent->d_ino, >=, prev_ino);
+          prev_ino = dent->d_ino;
+
+          if (!glnx_fstatat (dfd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+            return;
+          g_assert_cmpuint (dent->d_ino, ==, stbuf.st_ino);
+          g_assert_cmpint (dent->d_type, ==, IFTODT (stbuf.st_mode));
+          g_assert_true (g_hash_table_add (seen, g_strdup (dent->d_name)));
+        }
+
+      g_assert_cmpuint (g_hash_table_size (seen), ==, N_FILES + 1);
+
+      /* The second pass should see the same thing again */
+      glnx_dirfd_iterator_rewind (&dfd_iter);
+    }
+}
+
+#define N_TEMP_NAME_THREADS 8
+#define N_TEMP_NAMES 2000
+
+static gpointer
+gen_temp_names_thread (gpointer data)
+{
+  char **names = data;
+
+  for (guint i = 0; i < N_TEMP_NAMES; i++)
+    {
+      names[i] = g_strdup ("tmp.XXXXXX");
+      glnx_gen_temp_name (names[i]);
+    }
+
+  return NULL;
+}
+
+static void
+test_gen_temp_name (void)
+{
+  g_autoptr(GHashTable) seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  char *names[N_TEMP_NAME_THREADS][N_TEMP_NAMES];
+  GThread *threads[N_TEMP_NAME_THREADS];
+  char parent_name[] = "tmp.XXXXXX";
+  char child_name[] = "tmp.XXXXXX";
+  guint n_duplicates = 0;
+  int pipefd[2];
+  pid_t pid;
+
+  for (guint i = 0; i < N_TEMP_NAME_THREADS; i++)
+    threads[i] = g_thread_new ("gen-temp-name", gen_temp_names_thread, names[i]);
+  for (guint i = 0; i < N_TEMP_NAME_THREADS; i++)
+    g_thread_join (threads[i]);
+
+  for (guint i = 0; i < N_TEMP_NAME_THREADS; i++)
+    for (guint j = 0; j < N_TEMP_NAMES; j++)
+      {
+        g_assert_true (g_str_has_prefix (names[i][j], "tmp."));
+        g_assert_cmpuint (strlen (names[i][j]), ==, 10);
+        if (!g_hash_table_add (seen, names[i][j]))
+          n_duplicates++;
+      }
+
+  /* With 62^6 possible names, there is a chance of about 0.2% that two
+   * of them are the same anyway; but threads sharing (or repeating) their
+   * state would give thousands */
+  g_assert_cmpuint (n_duplicates, <=, 2);
+
+  /* A forked child continues with a copy of this thread's state, but
+   * mustn't come up with the same names */
+  g_assert_cmpint (pipe2 (pipefd, O_CLOEXEC), ==, 0);
+  pid = fork ();
+  g_assert_cmpint (pid, >=, 0);
+  if (pid == 0)
+    {
+      glnx_gen_temp_name (child_name);
+      if (write (pipefd[1], child_name, sizeof (child_name)) != sizeof (child_name))
+        _exit (1);
+      _exit (0);
+    }
+  glnx_gen_temp_name (parent_name);
+  g_assert_cmpint (read (pipefd[0], child_name, sizeof (child_name)), ==, sizeof (child_name));
+  g_assert_cmpint (waitpid (pid, NULL, 0), ==, pid);
+  g_assert_cmpstr (parent_name, !=, child_name);
+  glnx_close_fd (&pipefd[0]);
+  glnx_close_fd (&pipefd[1]);
+}
+
+#define N_BENCHMARK_WRITERS 64
+#define N_BENCHMARK_FILES 500
+
+typedef struct
+{
+  int dfd;
+  guint writer;
+} TempWriter;
+
+static gpointer
+temp_writer_thread (gpointer data)
+{
+  TempWriter *writer = data;
+  g_autoptr(GError) local_error = NULL;
+
+  for (guint i = 0; i < N_BENCHMARK_FILES; i++)
+    {
+      g_auto(GLnxTmpDir) tmpdir = { 0, };
+      char name[64];
+
+      /* Goes through a temporary name when O_TMPFILE is available */
+      g_snprintf (name, sizeof (name), "file-%u-%u", writer->writer, i);
+      if (!glnx_file_replace_contents_at (writer->dfd, name, (const guint8 *) name, -1,
+                                          GLNX_FILE_REPLACE_NODATASYNC, NULL, &local_error))
+        g_error ("%s", local_error->message);
+
+      if (!glnx_mkdtempat (writer->dfd, "dir.XXXXXX", 0700, &tmpdir, &local_error))
+        g_error ("%s", local_error->message);
+      /* Keep it, to fill the directory */
+      glnx_tmpdir_unset (&tmpdir);
+    }
+
+  return NULL;
+}
+
+static void
+benchmark_temp_name (void)
+{
+  _GLNX_TEST_SCOPED_TEMP_DIR;
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  TempWriter writers[N_BENCHMARK_WRITERS];
+  GThread *threads[N_BENCHMARK_WRITERS];
+  glnx_autofd int dfd = -1;
+  double elapsed;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Not running benchmarks (use -m perf)");
+      return;
+    }
+
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, "stress", 0755, &dfd, NULL, error))
+    return;
+
+  g_test_timer_start ();
+  for (guint i = 0; i < N_BENCHMARK_WRITERS; i++)
+    {
+      writers[i].dfd = dfd;
+      writers[i].writer = i;
+      threads[i] = g_thread_new ("temp-writer", temp_writer_thread, &writers[i]);
+    }
+  for (guint i = 0; i < N_BENCHMARK_WRITERS; i++)
+    g_thread_join (threads[i]);
+  elapsed = g_test_timer_elapsed ();
+
+  g_test_message ("%u writers: %.0f files and directories per second",
+                  N_BENCHMARK_WRITERS,
+                  2 * N_BENCHMARK_WRITERS * N_BENCHMARK_FILES / elapsed);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  int ret;
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/dirfd-iterator/batch", test_dirfd_iterator_batch);
+  g_test_add_func ("/dirfd-iterator/batch/empty", test_dirfd_iterator_batch_empty);
+  g_test_add_func ("/dirfd-iterator/sort-by-inode", test_dirfd_iterator_sort_by_inode);
+  g_test_add_func ("/gen-temp-name", test_gen_temp_name);
+  g_test_add_func ("/gen-temp-name/benchmark", benchmark_temp_name);
+
+  ret = g_test_run();
+
+  return ret;
+}
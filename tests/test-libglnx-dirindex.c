@@ -0,0 +1,253 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ * SPDX-License-Identifier: LGPL-2.0-or-later
+ */
+
+#include "libglnx-config.h"
+#include "libglnx.h"
+#include <glib.h>
+#include <stdlib.h>
+#include <gio/gio.h>
+#include <string.h>
+
+#include "libglnx-testlib.h"
+
+static gboolean
+create_files (int       dfd,
+              guint     n_files,
+              GError  **error)
+{
+  for (guint i = 0; i < n_files; i++)
+    {
+      char name[32];
+
+      g_snprintf (name, sizeof (name), "file%u", i);
+      if (!glnx_file_replace_contents_at (dfd, name, (const guint8 *) name, i % 13,
+                                          GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+assert_index_matches_dir (GLnxDirIndex *index,
+                          int           dfd)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  guint n_entries = 0;
+
+  if (!glnx_dirfd_iterator_init_at (dfd, ".", FALSE, &dfd_iter, error))
+    return;
+
+  while (TRUE)
+    {
+      const GLnxDirIndexEntry *entry;
+      struct dirent *dent;
+      struct stat stbuf;
+
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, NULL, error))
+        return;
+      if (dent == NULL)
+        break;
+
+      n_entries++;
+      entry = glnx_dir_index_lookup (index, dent->d_name);
+      g_assert_nonnull (entry);
+      g_assert_cmpstr (glnx_dir_index_entry_get_name (index, entry), ==, dent->d_name);
+
+      if (!glnx_fstatat (dfd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return;
+      g_assert_cmpuint (entry->ino, ==, stbuf.st_ino);
+      g_assert_cmpint (entry->d_type, ==, IFTODT (stbuf.st_mode));
+      g_assert_cmpuint (entry->mode, ==, stbuf.st_mode);
+      if (S_ISREG (stbuf.st_mode))
+        g_assert_cmpuint (entry->size, ==, stbuf.st_size);
+      g_assert_cmpint (entry->mtime_sec, ==, stbuf.st_mtim.tv_sec);
+      g_assert_cmpint (entry->mtime_nsec, ==, stbuf.st_mtim.tv_nsec);
+    }
+
+  g_assert_cmpuint (glnx_dir_index_get_n_entries (index), ==, n_entries);
+
+  for (guint i = 1; i < n_entries; i++)
+    {
+      const char *prev = glnx_dir_index_entry_get_name (index, glnx_dir_index_get_entry (index, i - 1));
+      const char *cur = glnx_dir_index_entry_get_name (index, glnx_dir_index_get_entry (index, i));
+
+      g_assert_cmpint (strcmp (prev, cur), <, 0);
+    }
+}
+
+static void
+test_dir_index_basic (void)
+{
+  _GLNX_TEST_SCOPED_TEMP_DIR;
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autoptr(GLnxDirIndex) index = NULL;
+  glnx_autofd int dfd = -1;
+
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, "dir", 0755, &dfd, NULL, error))
+    return;
+  if (!create_files (dfd, 100, error))
+    return;
+  if (!glnx_ensure_dir (dfd, "subdir", 0755, error))
+    return;
+  if (symlinkat ("file0", dfd, "link") < 0)
+    return (void) glnx_throw_errno_prefix (error, "symlinkat");
+
+  index = glnx_dir_index_new_at (AT_FDCWD, "dir", GLNX_DIR_INDEX_FLAGS_STAT, NULL, error);
+  if (index == NULL)
+    return;
+
+  assert_index_matches_dir (index, dfd);
+  g_assert_cmpint (glnx_dir_index_lookup (index, "link")->d_type, ==, DT_LNK);
+  g_assert_cmpint (glnx_dir_index_lookup (index, "subdir")->d_type, ==, DT_DIR);
+  g_assert_null (glnx_dir_index_lookup (index, "nosuchfile"));
+  g_assert_null (glnx_dir_index_lookup (index, ""));
+  g_clear_pointer (&index, glnx_dir_index_free);
+
+  /* Without stat data */
+  index = glnx_dir_index_new_at (dfd, ".", GLNX_DIR_INDEX_FLAGS_NONE, NULL, error);
+  if (index == NULL)
+    return;
+  g_assert_cmpuint (glnx_dir_index_get_n_entries (index), ==, 102);
+  g_assert_cmpuint (glnx_dir_index_lookup (index, "file42")->mode, ==, 0);
+}
+
+static void
+test_dir_index_refresh (void)
+{
+  _GLNX_TEST_SCOPED_TEMP_DIR;
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autoptr(GLnxDirIndex) index = NULL;
+  glnx_autofd int dfd = -1;
+  glnx_autofd int fd = -1;
+  gboolean changed = TRUE;
+
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, "dir", 0755, &dfd, NULL, error))
+    return;
+  if (!create_files (dfd, 10, error))
+    return;
+
+  index = glnx_dir_index_new_at (dfd, ".", GLNX_DIR_INDEX_FLAGS_STAT, NULL, error);
+  if (index == NULL)
+    return;
+
+  if (!glnx_dir_index_refresh_at (index, dfd, ".", &changed, NULL, error))
+    return;
+  g_assert_false (changed);
+  assert_index_matches_dir (index, dfd);
+
+  /* Grow a file in place, which doesn't touch the directory: when the
+   * directory is read again for another reason, its stat data is reused */
+  fd = openat (dfd, "file1", O_WRONLY | O_APPEND | O_CLOEXEC);
+  g_assert_cmpint (fd, >=, 0);
+  g_assert_cmpint (write (fd, "more", 4), ==, 4);
+  g_clear_fd (&fd, NULL);
+  g_assert_cmpuint (glnx_dir_index_lookup (index, "file1")->size, ==, 1);
+
+  if (!glnx_file_replace_contents_at (dfd, "new", (const guint8 *) "new", 3,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+  if (!glnx_unlinkat (dfd, "file2", 0, error))
+    return;
+
+  if (!glnx_dir_index_refresh_at (index, dfd, ".", &changed, NULL, error))
+    return;
+  g_assert_true (changed);
+  g_assert_cmpuint (glnx_dir_index_get_n_entries (index), ==, 10);
+  g_assert_null (glnx_dir_index_lookup (index, "file2"));
+  g_assert_cmpuint (glnx_dir_index_lookup (index, "new")->size, ==, 3);
+  g_assert_cmpuint (glnx_dir_index_lookup (index, "file1")->size, ==, 1);
+
+  /* Replacing a file gives it a new inode, so it does get stat'ed again */
+  if (!glnx_file_replace_contents_at (dfd, "file1", (const guint8 *) "replaced", 8,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+  if (!glnx_dir_index_refresh_at (index, dfd, ".", &changed, NULL, error))
+    return;
+  g_assert_true (changed);
+  assert_index_matches_dir (index, dfd);
+}
+
+static void
+test_dir_index_save_load (void)
+{
+  _GLNX_TEST_SCOPED_TEMP_DIR;
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autoptr(GLnxDirIndex) index = NULL;
+  g_autoptr(GLnxDirIndex) loaded = NULL;
+  glnx_autofd int dfd = -1;
+  gboolean changed = TRUE;
+  struct stat stbuf;
+
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, "dir", 0755, &dfd, NULL, error))
+    return;
+  /* Enough for the file to be mapped rather than read */
+  if (!create_files (dfd, 2000, error))
+    return;
+
+  index = glnx_dir_index_new_at (dfd, ".", GLNX_DIR_INDEX_FLAGS_STAT, NULL, error);
+  if (index == NULL)
+    return;
+  if (!glnx_dir_index_save_at (index, AT_FDCWD, "index", NULL, error))
+    return;
+  if (!glnx_fstatat (AT_FDCWD, "index", &stbuf, 0, error))
+    return;
+  g_assert_cmpint (stbuf.st_size, >, 64 * 1024);
+
+  loaded = glnx_dir_index_load_at (AT_FDCWD, "index", NULL, error);
+  if (loaded == NULL)
+    return;
+  g_assert_cmpuint (glnx_dir_index_get_n_entries (loaded), ==, glnx_dir_index_get_n_entries (index));
+  for (guint i = 0; i < glnx_dir_index_get_n_entries (index); i++)
+    {
+      const GLnxDirIndexEntry *a = glnx_dir_index_get_entry (index, i);
+      const GLnxDirIndexEntry *b = glnx_dir_index_get_entry (loaded, i);
+
+      g_assert_cmpmem (a, sizeof (*a), b, sizeof (*b));
+      g_assert_cmpstr (glnx_dir_index_entry_get_name (index, a), ==,
+                       glnx_dir_index_entry_get_name (loaded, b));
+    }
+
+  /* A loaded index can be refreshed like any other */
+  if (!glnx_unlinkat (dfd, "file1999", 0, error))
+    return;
+  if (!glnx_dir_index_refresh_at (loaded, dfd, ".", &changed, NULL, error))
+    return;
+  g_assert_true (changed);
+  assert_index_matches_dir (loaded, dfd);
+
+  /* Damaged files are rejected */
+  if (truncate ("index", stbuf.st_size - 1) < 0)
+    return (void) glnx_throw_errno_prefix (error, "truncate");
+  g_assert_null (glnx_dir_index_load_at (AT_FDCWD, "index", NULL, error));
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_clear_error (&local_error);
+
+  if (!glnx_file_replace_contents_at (AT_FDCWD, "index", (const guint8 *) "", 0,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+  g_assert_null (glnx_dir_index_load_at (AT_FDCWD, "index", NULL, error));
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_clear_error (&local_error);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  int ret;
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/dir-index/basic", test_dir_index_basic);
+  g_test_add_func ("/dir-index/refresh", test_dir_index_refresh);
+  g_test_add_func ("/dir-index/save-load", test_dir_index_save_load);
+
+  ret = g_test_run();
+
+  return ret;
+}
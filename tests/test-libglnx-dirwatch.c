@@ -0,0 +1,182 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ * SPDX-License-Identifier: LGPL-2.0-or-later
+ */
+
+#include "libglnx-config.h"
+#include "libglnx.h"
+#include <glib.h>
+#include <stdlib.h>
+#include <gio/gio.h>
+#include <string.h>
+
+#include "libglnx-testlib.h"
+
+typedef struct {
+  GLnxDirWatchChangeType type;
+  guint dir_id;
+  gboolean is_dir;
+  const char *name;
+} ExpectedChange;
+
+/* The kernel queues changes synchronously, so they can be read right away */
+static void
+assert_changes (GLnxDirWatch         *watch,
+                const ExpectedChange *expected,
+                guint                 n_expected)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autoptr(GArray) changes = NULL;
+
+  changes = glnx_dir_watch_read_changes (watch, error);
+  if (changes == NULL)
+    return;
+
+  g_assert_cmpuint (changes->len, ==, n_expected);
+  for (guint i = 0; i < n_expected; i++)
+    {
+      const GLnxDirWatchChange *change = &g_array_index (changes, GLnxDirWatchChange, i);
+
+      g_assert_cmpint (change->type, ==, expected[i].type);
+      g_assert_cmpuint (change->dir_id, ==, expected[i].dir_id);
+      g_assert_cmpint (change->is_dir, ==, expected[i].is_dir);
+      g_assert_cmpstr (change->name, ==, expected[i].name);
+    }
+}
+
+static void
+check_dir_watch (GLnxDirWatchFlags flags)
+{
+  _GLNX_TEST_SCOPED_TEMP_DIR;
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autoptr(GLnxDirWatch) watch = NULL;
+  glnx_autofd int dfd = -1;
+  glnx_autofd int fd = -1;
+  guint dir_id, other_id, id;
+
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, "dir", 0755, &dfd, NULL, error))
+    return;
+  if (!glnx_ensure_dir (AT_FDCWD, "other", 0755, error))
+    return;
+
+  watch = glnx_dir_watch_new (flags, error);
+  if (watch == NULL)
+    return;
+  if ((flags & GLNX_DIR_WATCH_FLAGS_INOTIFY) == 0 &&
+      !glnx_dir_watch_get_uses_fanotify (watch))
+    {
+      g_test_skip ("fanotify not available");
+      return;
+    }
+
+  if (!glnx_dir_watch_add (watch, AT_FDCWD, "dir", &dir_id, error))
+    return;
+  if (!glnx_dir_watch_add (watch, AT_FDCWD, "other", &other_id, error))
+    return;
+  g_assert_cmpuint (dir_id, !=, other_id);
+  if (!glnx_dir_watch_add (watch, dfd, ".", &id, error))
+    return;
+  g_assert_cmpuint (id, ==, dir_id);
+
+  assert_changes (watch, NULL, 0);
+
+  fd = openat (dfd, "a", O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return (void) glnx_throw_errno_prefix (error, "openat");
+  g_clear_fd (&fd, NULL);
+  if (!glnx_ensure_dir (dfd, "sub", 0755, error))
+    return;
+  {
+    const ExpectedChange expected[] = {
+      { GLNX_DIR_WATCH_CHANGE_CREATED, dir_id, FALSE, "a" },
+      { GLNX_DIR_WATCH_CHANGE_CREATED, dir_id, TRUE, "sub" },
+    };
+    assert_changes (watch, expected, G_N_ELEMENTS (expected));
+  }
+
+  /* Changes below a subdirectory aren't reported */
+  if (!glnx_file_replace_contents_at (dfd, "sub/b", (const guint8 *) "b", 1,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+  assert_changes (watch, NULL, 0);
+
+  if (!glnx_renameat (dfd, "a", dfd, "c", error))
+    return;
+  {
+    const ExpectedChange expected[] = {
+      { GLNX_DIR_WATCH_CHANGE_MOVED_FROM, dir_id, FALSE, "a" },
+      { GLNX_DIR_WATCH_CHANGE_MOVED_TO, dir_id, FALSE, "c" },
+    };
+    assert_changes (watch, expected, G_N_ELEMENTS (expected));
+  }
+
+  if (!glnx_renameat (dfd, "sub", AT_FDCWD, "other/sub", error))
+    return;
+  if (!glnx_unlinkat (dfd, "c", 0, error))
+    return;
+  {
+    const ExpectedChange expected[] = {
+      { GLNX_DIR_WATCH_CHANGE_MOVED_FROM, dir_id, TRUE, "sub" },
+      { GLNX_DIR_WATCH_CHANGE_MOVED_TO, other_id, TRUE, "sub" },
+      { GLNX_DIR_WATCH_CHANGE_DELETED, dir_id, FALSE, "c" },
+    };
+    assert_changes (watch, expected, G_N_ELEMENTS (expected));
+  }
+
+  g_clear_fd (&dfd, NULL);
+  if (!glnx_unlinkat (AT_FDCWD, "dir", AT_REMOVEDIR, error))
+    return;
+  {
+    const ExpectedChange expected[] = {
+      { GLNX_DIR_WATCH_CHANGE_DIR_GONE, dir_id, FALSE, NULL },
+    };
+    assert_changes (watch, expected, G_N_ELEMENTS (expected));
+  }
+
+  /* Only the other directory is left */
+  if (!glnx_shutil_rm_rf_at (AT_FDCWD, "other/sub", NULL, error))
+    return;
+  {
+    const ExpectedChange expected[] = {
+      { GLNX_DIR_WATCH_CHANGE_DELETED, other_id, TRUE, "sub" },
+    };
+    assert_changes (watch, expected, G_N_ELEMENTS (expected));
+  }
+
+  /* Only directories can be watched */
+  if (!glnx_file_replace_contents_at (AT_FDCWD, "file", (const guint8 *) "", 0,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+  g_assert_false (glnx_dir_watch_add (watch, AT_FDCWD, "file", &id, error));
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY);
+  g_clear_error (&local_error);
+}
+
+static void
+test_dir_watch_fanotify (void)
+{
+  check_dir_watch (GLNX_DIR_WATCH_FLAGS_NONE);
+}
+
+static void
+test_dir_watch_inotify (void)
+{
+  check_dir_watch (GLNX_DIR_WATCH_FLAGS_INOTIFY);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  int ret;
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/dir-watch/fanotify", test_dir_watch_fanotify);
+  g_test_add_func ("/dir-watch/inotify", test_dir_watch_inotify);
+
+  ret = g_test_run();
+
+  return ret;
+}
@@ -26,6 +26,9 @@
 #include <gio/gio.h>
 #include <err.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 
 #include "libglnx-testlib.h"
 
@@ -247,6 +250,55 @@ test_tmpfile (void)
     return;
 }
 
+static void
+test_tmpfile_replace (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  glnx_autofd int dfd = -1;
+  const char *targets[] = { "replace", "replace-dir/sub/replace" };
+
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, "replace-dir/sub", 0755, &dfd, NULL, error))
+    return;
+
+  for (guint i = 0; i < G_N_ELEMENTS (targets); i++)
+    {
+      /* Once creating it, and once replacing it */
+      for (guint j = 0; j < 2; j++)
+        {
+          g_auto(GLnxTmpfile) tmpf = { 0, };
+          g_autofree char *contents = NULL;
+          const char *expected = j == 0 ? "old" : "new";
+
+          if (!glnx_open_tmpfile_linkable_at (AT_FDCWD, ".", O_WRONLY | O_CLOEXEC, &tmpf, error))
+            return;
+          if (glnx_loop_write (tmpf.fd, expected, 3) < 0)
+            return (void) glnx_throw_errno_prefix (error, "write");
+          if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_REPLACE, AT_FDCWD, targets[i], error))
+            return;
+
+          contents = glnx_file_get_contents_utf8_at (AT_FDCWD, targets[i], NULL, NULL, error);
+          if (contents == NULL)
+            return;
+          g_assert_cmpstr (contents, ==, expected);
+        }
+    }
+
+  /* No temporary names are left behind */
+  if (!glnx_dirfd_iterator_init_take_fd (&dfd, &dfd_iter, error))
+    return;
+  while (TRUE)
+    {
+      struct dirent *dent;
+
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, NULL, error))
+        return;
+      if (dent == NULL)
+        break;
+      g_assert_cmpstr (dent->d_name, ==, "replace");
+    }
+}
+
 static void
 test_stdio_file (void)
 {
@@ -293,6 +345,66 @@ test_fstatat (void)
   g_assert_no_error (local_error);
 }
 
+static void
+test_statx_many (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  const guint n_files = 1000;
+  g_autoptr(GPtrArray) names = g_ptr_array_new_with_free_func (g_free);
+  g_autofree struct glnx_statx *bufs = NULL;
+  g_autofree int *errnos = NULL;
+  glnx_autofd int dfd = -1;
+
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, "statx-many", 0755, &dfd, NULL, error))
+    return;
+
+  for (guint i = 0; i < n_files; i++)
+    {
+      char *name = g_strdup_printf ("file%u", i);
+
+      if (!glnx_file_replace_contents_at (dfd, name, (const guint8 *) "0123456789abcdefg", i % 17,
+                                          GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+        return;
+      g_ptr_array_add (names, name);
+    }
+  g_ptr_array_add (names, g_strdup ("nosuchfile"));
+  g_ptr_array_add (names, g_strdup ("."));
+
+  bufs = g_new0 (struct glnx_statx, names->len);
+  errnos = g_new (int, names->len);
+  if (!glnx_statx_many (dfd, (const char * const *) names->pdata, names->len,
+                        AT_SYMLINK_NOFOLLOW, GLNX_STATX_TYPE | GLNX_STATX_INO | GLNX_STATX_SIZE,
+                        bufs, errnos, NULL, error))
+    return;
+
+  for (guint i = 0; i < n_files; i++)
+    {
+      struct stat stbuf;
+
+      if (!glnx_fstatat (dfd, names->pdata[i], &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return;
+
+      g_assert_cmpint (errnos[i], ==, 0);
+      g_assert_true (S_ISREG (bufs[i].stx_mode));
+      g_assert_cmpuint (bufs[i].stx_ino, ==, stbuf.st_ino);
+      g_assert_cmpuint (bufs[i].stx_size, ==, i % 17);
+    }
+  g_assert_cmpint (errnos[n_files], ==, ENOENT);
+  g_assert_cmpint (errnos[n_files + 1], ==, 0);
+  g_assert_true (S_ISDIR (bufs[n_files + 1].stx_mode));
+
+  /* Without @out_errnos, any failure fails the whole call */
+  g_assert_false (glnx_statx_many (dfd, (const char * const *) names->pdata, names->len,
+                                   AT_SYMLINK_NOFOLLOW, GLNX_STATX_TYPE,
+                                   bufs, NULL, NULL, error));
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_clear_error (&local_error);
+
+  /* Nothing to do is fine too */
+  if (!glnx_statx_many (dfd, NULL, 0, 0, GLNX_STATX_TYPE, NULL, NULL, NULL, error))
+    return;
+}
+
 static void
 test_filecopy (void)
 {
@@ -405,6 +517,1031 @@ test_filecopy_procfs (void)
     }
 }
 
+static void
+ignore_signal (G_GNUC_UNUSED int signum)
+{
+}
+
+static gpointer
+slow_pipe_reader (gpointer data)
+{
+  int fd = GPOINTER_TO_INT (data);
+
+  /* Let the writer fill the pipe and block first */
+  g_usleep (G_USEC_PER_SEC / 5);
+  return glnx_fd_readall_bytes (fd, NULL, NULL);
+}
+
+static void
+test_loop_writev (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  g_autoptr(GString) expected = g_string_new (NULL);
+  g_autoptr(GBytes) written = NULL;
+  g_autofree struct iovec *iov = NULL;
+  /* More than can be passed to writev() at once */
+  const int iovcnt = IOV_MAX + 100;
+  g_autofree char *big = g_malloc (256 * 1024);
+  struct sigaction sa = { 0, }, old_sa;
+  struct itimerval timer = { { 0, 0 }, { 0, 50000 } };
+  sigset_t mask, old_mask;
+  int pipefd[2];
+  GThread *reader;
+
+  iov = g_new (struct iovec, iovcnt);
+  for (int i = 0; i < iovcnt; i++)
+    {
+      static const char digits[] = "0123456789";
+
+      /* Including empty buffers */
+      iov[i].iov_base = (void *) digits;
+      iov[i].iov_len = i % 11;
+      g_string_append_len (expected, digits, i % 11);
+    }
+
+  if (!glnx_open_anonymous_tmpfile (O_RDWR | O_CLOEXEC, &tmpf, error))
+    return;
+  if (glnx_loop_writev (tmpf.fd, iov, iovcnt) < 0)
+    return (void) glnx_throw_errno_prefix (error, "writev");
+  if (lseek (tmpf.fd, 0, SEEK_SET) < 0)
+    return (void) glnx_throw_errno_prefix (error, "lseek");
+  written = glnx_fd_readall_bytes (tmpf.fd, NULL, error);
+  if (written == NULL)
+    return;
+  g_assert_cmpmem (g_bytes_get_data (written, NULL), g_bytes_get_size (written),
+                   expected->str, expected->len);
+  g_clear_pointer (&written, g_bytes_unref);
+
+  /* A signal interrupting writev() to a full pipe makes it return early,
+   * after only part of the data was written */
+  for (gsize i = 0; i < 256 * 1024; i++)
+    big[i] = i % 251;
+  iov[0].iov_base = (void *) "header";
+  iov[0].iov_len = 6;
+  iov[1].iov_base = big;
+  iov[1].iov_len = 256 * 1024;
+  iov[2].iov_base = (void *) "trailer";
+  iov[2].iov_len = 7;
+  g_string_truncate (expected, 0);
+  g_string_append (expected, "header");
+  g_string_append_len (expected, big, 256 * 1024);
+  g_string_append (expected, "trailer");
+
+  if (pipe2 (pipefd, O_CLOEXEC) < 0)
+    return (void) glnx_throw_errno_prefix (error, "pipe2");
+  (void) fcntl (pipefd[1], F_SETPIPE_SZ, 4096);
+
+  /* The signal must be delivered to this thread, not the reader */
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGALRM);
+  pthread_sigmask (SIG_BLOCK, &mask, &old_mask);
+  reader = g_thread_new ("reader", slow_pipe_reader, GINT_TO_POINTER (pipefd[0]));
+  pthread_sigmask (SIG_SETMASK, &old_mask, NULL);
+
+  /* No SA_RESTART */
+  sa.sa_handler = ignore_signal;
+  sigaction (SIGALRM, &sa, &old_sa);
+  setitimer (ITIMER_REAL, &timer, NULL);
+
+  if (glnx_loop_writev (pipefd[1], iov, 3) < 0)
+    return (void) glnx_throw_errno_prefix (error, "writev");
+  glnx_close_fd (&pipefd[1]);
+  sigaction (SIGALRM, &old_sa, NULL);
+
+  written = g_thread_join (reader);
+  glnx_close_fd (&pipefd[0]);
+  g_assert_nonnull (written);
+  g_assert_cmpmem (g_bytes_get_data (written, NULL), g_bytes_get_size (written),
+                   expected->str, expected->len);
+}
+
+static void
+test_replace_contents_iov (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autofree char *contents = NULL;
+  const struct iovec iov[] = {
+    { (void *) "header\n", 7 },
+    { NULL, 0 },
+    { (void *) "body\n", 5 },
+    { (void *) "trailer\n", 8 },
+  };
+  struct stat stbuf;
+
+  if (!glnx_file_replace_contents_at (AT_FDCWD, "iov", (const guint8 *) "old", -1,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+  if (!glnx_file_replace_contents_iov_at (AT_FDCWD, "iov", iov, G_N_ELEMENTS (iov),
+                                          GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+
+  contents = glnx_file_get_contents_utf8_at (AT_FDCWD, "iov", NULL, NULL, error);
+  if (contents == NULL)
+    return;
+  g_assert_cmpstr (contents, ==, "header\nbody\ntrailer\n");
+  if (!glnx_fstatat (AT_FDCWD, "iov", &stbuf, 0, error))
+    return;
+  g_assert_cmpint (stbuf.st_mode & 07777, ==, 0644);
+  g_clear_pointer (&contents, g_free);
+
+  /* No buffers at all make an empty file */
+  if (!glnx_file_replace_contents_iov_at (AT_FDCWD, "iov", NULL, 0,
+                                          GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+  contents = glnx_file_get_contents_utf8_at (AT_FDCWD, "iov", NULL, NULL, error);
+  if (contents == NULL)
+    return;
+  g_assert_cmpstr (contents, ==, "");
+}
+
+static void
+test_atomic_writer (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autoptr(GLnxAtomicWriter) writer = NULL;
+  g_autoptr(GString) expected = g_string_new (NULL);
+  g_autoptr(GBytes) contents = NULL;
+  g_autoptr(GInputStream) in = NULL;
+  g_autofree char *big = g_malloc (300 * 1024);
+  glnx_autofd int fd = -1;
+  GOutputStream *out;
+  struct stat stbuf;
+
+  if (!glnx_file_replace_contents_at (AT_FDCWD, "atomic", (const guint8 *) "old", -1,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+
+  /* Less than is preallocated */
+  writer = glnx_atomic_writer_new (AT_FDCWD, "atomic", 1024 * 1024, 0600, -1, -1,
+                                   GLNX_FILE_REPLACE_NODATASYNC, error);
+  if (writer == NULL)
+    return;
+
+  /* Both appends that are buffered and ones that aren't */
+  for (gsize i = 0; i < 300 * 1024; i++)
+    big[i] = i % 251;
+  for (guint i = 0; i < 1000; i++)
+    {
+      g_autofree char *line = g_strdup_printf ("line %u\n", i);
+
+      if (!glnx_atomic_writer_append (writer, line, strlen (line), NULL, error))
+        return;
+      g_string_append (expected, line);
+      if (i % 250 == 0)
+        {
+          if (!glnx_atomic_writer_append (writer, big, 300 * 1024, NULL, error))
+            return;
+          g_string_append_len (expected, big, 300 * 1024);
+        }
+    }
+
+  /* And through a stream, mixed with appends */
+  if (!glnx_atomic_writer_append (writer, "buffered\n", 9, NULL, error))
+    return;
+  g_string_append (expected, "buffered\n");
+  out = glnx_atomic_writer_get_output_stream (writer, error);
+  if (out == NULL)
+    return;
+  if (!g_output_stream_write_all (out, "written\n", 8, NULL, NULL, error))
+    return;
+  g_string_append (expected, "written\n");
+  if (!glnx_atomic_writer_append (writer, "appended\n", 9, NULL, error))
+    return;
+  g_string_append (expected, "appended\n");
+  in = g_memory_input_stream_new_from_data ("from a stream\n", -1, NULL);
+  if (g_output_stream_splice (out, in, G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET, NULL, error) < 0)
+    return;
+  g_string_append (expected, "from a stream\n");
+
+  /* Nothing is visible before committing */
+  {
+    g_autofree char *old = glnx_file_get_contents_utf8_at (AT_FDCWD, "atomic", NULL, NULL, error);
+
+    g_assert_cmpstr (old, ==, "old");
+  }
+
+  if (!glnx_atomic_writer_commit (writer, NULL, error))
+    return;
+  g_assert_cmpint (g_output_stream_write (out, "x", 1, NULL, &local_error), ==, -1);
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_CLOSED);
+  g_clear_error (&local_error);
+  g_clear_pointer (&writer, glnx_atomic_writer_free);
+
+  if (!glnx_openat_rdonly (AT_FDCWD, "atomic", TRUE, &fd, error))
+    return;
+  contents = glnx_fd_readall_bytes (fd, NULL, error);
+  if (contents == NULL)
+    return;
+  g_assert_cmpmem (g_bytes_get_data (contents, NULL), g_bytes_get_size (contents),
+                   expected->str, expected->len);
+  if (!glnx_fstat (fd, &stbuf, error))
+    return;
+  g_assert_cmpint (stbuf.st_mode & 07777, ==, 0600);
+
+  /* Without committing, the file is left alone */
+  writer = glnx_atomic_writer_new (AT_FDCWD, "atomic", 0, -1, -1, -1,
+                                   GLNX_FILE_REPLACE_NODATASYNC, error);
+  if (writer == NULL)
+    return;
+  if (!glnx_atomic_writer_append (writer, "discarded", 9, NULL, error))
+    return;
+  g_clear_pointer (&writer, glnx_atomic_writer_free);
+  g_clear_pointer (&contents, g_bytes_unref);
+  g_clear_fd (&fd, NULL);
+  if (!glnx_openat_rdonly (AT_FDCWD, "atomic", TRUE, &fd, error))
+    return;
+  if (!glnx_fstat (fd, &stbuf, error))
+    return;
+  g_assert_cmpint (stbuf.st_size, ==, expected->len);
+}
+
+static void
+test_atomic_writer_failed (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autoptr(GLnxAtomicWriter) writer = NULL;
+  g_autofree char *big = g_malloc0 (256 * 1024);
+  g_autofree char *contents = NULL;
+  struct rlimit old_limit, limit;
+  void (*old_handler) (int);
+  gboolean appended;
+
+  if (!glnx_file_replace_contents_at (AT_FDCWD, "atomic-failed", (const guint8 *) "old", -1,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+
+  writer = glnx_atomic_writer_new (AT_FDCWD, "atomic-failed", 0, -1, -1, -1,
+                                   GLNX_FILE_REPLACE_NODATASYNC, error);
+  if (writer == NULL)
+    return;
+
+  /* Make a large append fail partway through */
+  g_assert_cmpint (getrlimit (RLIMIT_FSIZE, &old_limit), ==, 0);
+  limit = old_limit;
+  limit.rlim_cur = 128 * 1024;
+  old_handler = signal (SIGXFSZ, SIG_IGN);
+  g_assert_cmpint (setrlimit (RLIMIT_FSIZE, &limit), ==, 0);
+  appended = glnx_atomic_writer_append (writer, big, 256 * 1024, NULL, &local_error);
+  g_assert_cmpint (setrlimit (RLIMIT_FSIZE, &old_limit), ==, 0);
+  signal (SIGXFSZ, old_handler);
+  g_assert_false (appended);
+  g_assert_nonnull (local_error);
+  g_clear_error (&local_error);
+
+  /* Everything fails from then on, even if it could be written now */
+  g_assert_false (glnx_atomic_writer_append (writer, "x", 1, NULL, &local_error));
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_clear_error (&local_error);
+  g_assert_false (glnx_atomic_writer_flush (writer, NULL, &local_error));
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_clear_error (&local_error);
+  g_assert_null (glnx_atomic_writer_get_output_stream (writer, &local_error));
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_clear_error (&local_error);
+  g_assert_false (glnx_atomic_writer_commit (writer, NULL, &local_error));
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_clear_error (&local_error);
+
+  contents = glnx_file_get_contents_utf8_at (AT_FDCWD, "atomic-failed", NULL, NULL, error);
+  g_assert_cmpstr (contents, ==, "old");
+}
+
+static void
+test_atomic_writer_stream_failed (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autoptr(GLnxAtomicWriter) writer = NULL;
+  g_autofree char *big = g_malloc0 (256 * 1024);
+  g_autofree char *contents = NULL;
+  struct rlimit old_limit, limit;
+  void (*old_handler) (int);
+  GOutputStream *out;
+  gboolean written;
+
+  if (!glnx_file_replace_contents_at (AT_FDCWD, "atomic-failed", (const guint8 *) "old", -1,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+
+  writer = glnx_atomic_writer_new (AT_FDCWD, "atomic-failed", 0, -1, -1, -1,
+                                   GLNX_FILE_REPLACE_NODATASYNC, error);
+  if (writer == NULL)
+    return;
+  out = glnx_atomic_writer_get_output_stream (writer, error);
+  if (out == NULL)
+    return;
+
+  /* Make a large write to the stream fail partway through */
+  g_assert_cmpint (getrlimit (RLIMIT_FSIZE, &old_limit), ==, 0);
+  limit = old_limit;
+  limit.rlim_cur = 128 * 1024;
+  old_handler = signal (SIGXFSZ, SIG_IGN);
+  g_assert_cmpint (setrlimit (RLIMIT_FSIZE, &limit), ==, 0);
+  written = g_output_stream_write_all (out, big, 256 * 1024, NULL, NULL, &local_error);
+  g_assert_cmpint (setrlimit (RLIMIT_FSIZE, &old_limit), ==, 0);
+  signal (SIGXFSZ, old_handler);
+  g_assert_false (written);
+  g_assert_nonnull (local_error);
+  g_clear_error (&local_error);
+
+  /* The writer knows, and doesn't install the truncated file */
+  g_assert_false (glnx_atomic_writer_append (writer, "x", 1, NULL, &local_error));
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_clear_error (&local_error);
+  g_assert_false (glnx_atomic_writer_commit (writer, NULL, &local_error));
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_clear_error (&local_error);
+
+  contents = glnx_file_get_contents_utf8_at (AT_FDCWD, "atomic-failed", NULL, NULL, error);
+  g_assert_cmpstr (contents, ==, "old");
+}
+
+static void
+test_fd_map_bytes (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  /* Below and above the size where it switches to mmap() */
+  static const gsize sizes[] = { 0, 1, 4097, 1024 * 1024 + 3 };
+
+  for (gsize i = 0; i < G_N_ELEMENTS (sizes); i++)
+    {
+      const gsize size = sizes[i];
+      g_autofree guint8 *data = g_malloc (size + 1);
+      glnx_autofd int fd = -1;
+      g_autoptr(GBytes) bytes = NULL;
+      g_autoptr(GBytes) read_bytes = NULL;
+
+      for (gsize j = 0; j < size; j++)
+        data[j] = (guint8) (j * 31 + j / 4096);
+
+      if (!glnx_file_replace_contents_at (AT_FDCWD, "map-bytes", data, size,
+                                          GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+        return;
+      if (!glnx_openat_rdonly (AT_FDCWD, "map-bytes", FALSE, &fd, error))
+        return;
+
+      /* The file offset doesn't matter */
+      if (size > 0 && lseek (fd, 1, SEEK_SET) != 1)
+        return (void) glnx_throw_errno_prefix (error, "lseek");
+
+      bytes = glnx_fd_map_bytes (fd, NULL, error);
+      if (bytes == NULL)
+        return;
+      g_assert_cmpmem (g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes),
+                       data, size);
+      g_assert_cmpint (lseek (fd, 0, SEEK_CUR), ==, size > 0 ? 1 : 0);
+
+      /* It also still works to read it normally, now without the cap on
+       * the size of each read */
+      if (lseek (fd, 0, SEEK_SET) != 0)
+        return (void) glnx_throw_errno_prefix (error, "lseek");
+      read_bytes = glnx_fd_readall_bytes (fd, NULL, error);
+      if (read_bytes == NULL)
+        return;
+      g_assert_true (g_bytes_equal (bytes, read_bytes));
+    }
+
+  /* Not a regular file */
+  {
+    g_autoptr(GBytes) bytes = NULL;
+    glnx_autofd int fd = -1;
+
+    if (!glnx_openat_rdonly (AT_FDCWD, "/dev/null", TRUE, &fd, error))
+      return;
+    bytes = glnx_fd_map_bytes (fd, NULL, error);
+    if (bytes == NULL)
+      return;
+    g_assert_cmpuint (g_bytes_get_size (bytes), ==, 0);
+  }
+}
+
+static void
+test_regfile_copy_bytes_buffered (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  static const gsize sizes[] = { 1, 100 * 1024, 20 * 1024 * 1024 + 7 };
+  static const gsize buffer_sizes[] = { 0, 4096 };
+
+  for (gsize i = 0; i < G_N_ELEMENTS (sizes); i++)
+    {
+      const gsize size = sizes[i];
+      g_autofree guint8 *data = g_malloc (size);
+
+      for (gsize j = 0; j < size; j++)
+        data[j] = (guint8) (j * 13 + j / 4096);
+
+      if (!glnx_file_replace_contents_at (AT_FDCWD, "buffered-src", data, size,
+                                          GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+        return;
+
+      for (gsize j = 0; j < G_N_ELEMENTS (buffer_sizes); j++)
+        {
+          glnx_autofd int src_fd = -1;
+          glnx_autofd int dest_fd = -1;
+          g_autoptr(GBytes) bytes = NULL;
+
+          if (!glnx_openat_rdonly (AT_FDCWD, "buffered-src", FALSE, &src_fd, error))
+            return;
+          dest_fd = openat (AT_FDCWD, "buffered-dest",
+                            O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0644);
+          if (dest_fd < 0)
+            return (void) glnx_throw_errno_prefix (error, "openat");
+
+          /* Starting from a non-zero offset with no limit skips reflinks,
+           * copy_file_range() and sendfile(), so this exercises the
+           * read()/write() fallback */
+          if (lseek (src_fd, 1, SEEK_SET) != 1)
+            return (void) glnx_throw_errno_prefix (error, "lseek");
+          if (glnx_regfile_copy_bytes_with_buffer_size (src_fd, dest_fd, -1,
+                                                        buffer_sizes[j]) < 0)
+            return (void) glnx_throw_errno_prefix (error, "copy");
+          g_assert_cmpint (lseek (src_fd, 0, SEEK_CUR), ==, size);
+
+          if (lseek (dest_fd, 0, SEEK_SET) != 0)
+            return (void) glnx_throw_errno_prefix (error, "lseek");
+          bytes = glnx_fd_readall_bytes (dest_fd, NULL, error);
+          if (bytes == NULL)
+            return;
+          g_assert_cmpmem (g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes),
+                           data + 1, size - 1);
+        }
+    }
+}
+
+static void
+test_filecopy_sparse (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  const gsize size = 16 * 1024 * 1024;
+  static const char data[] = "some data";
+  glnx_autofd int fd = -1;
+  g_autoptr(GBytes) bytes = NULL;
+  struct stat src_stbuf, dest_stbuf;
+  const guint8 *contents;
+
+  fd = openat (AT_FDCWD, "sparse", O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return (void) glnx_throw_errno_prefix (error, "openat");
+  if (TEMP_FAILURE_RETRY (pwrite (fd, data, sizeof (data), 0)) != sizeof (data))
+    return (void) glnx_throw_errno_prefix (error, "pwrite");
+  if (TEMP_FAILURE_RETRY (pwrite (fd, data, sizeof (data), size / 2)) != sizeof (data))
+    return (void) glnx_throw_errno_prefix (error, "pwrite");
+  /* Ends with a hole */
+  if (ftruncate (fd, size) < 0)
+    return (void) glnx_throw_errno_prefix (error, "ftruncate");
+  glnx_close_fd (&fd);
+
+  if (!glnx_file_copy_at (AT_FDCWD, "sparse", NULL, AT_FDCWD, "sparse-copy",
+                          GLNX_FILE_COPY_NOXATTRS | GLNX_FILE_COPY_SPARSE, NULL, error))
+    return;
+
+  if (!glnx_fstatat (AT_FDCWD, "sparse", &src_stbuf, 0, error))
+    return;
+  if (!glnx_fstatat (AT_FDCWD, "sparse-copy", &dest_stbuf, 0, error))
+    return;
+  g_assert_cmpint (dest_stbuf.st_size, ==, size);
+
+  if ((gsize) src_stbuf.st_blocks * 512 < size / 2)
+    g_assert_cmpint (dest_stbuf.st_blocks * 512, <, size / 2);
+  else
+    g_test_message ("Filesystem doesn't support holes");
+
+  if (!glnx_openat_rdonly (AT_FDCWD, "sparse-copy", FALSE, &fd, error))
+    return;
+  bytes = glnx_fd_readall_bytes (fd, NULL, error);
+  if (bytes == NULL)
+    return;
+  contents = g_bytes_get_data (bytes, NULL);
+  g_assert_cmpmem (contents, sizeof (data), data, sizeof (data));
+  g_assert_cmpmem (contents + size / 2, sizeof (data), data, sizeof (data));
+  for (gsize i = sizeof (data); i < size; i++)
+    {
+      if (i == size / 2)
+        i += sizeof (data);
+      if (contents[i] != 0)
+        g_error ("Unexpected non-zero byte at offset %" G_GSIZE_FORMAT, i);
+    }
+}
+
+static guint
+count_open_fds (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  guint n = 0;
+
+  if (!glnx_dirfd_iterator_init_at (AT_FDCWD, "/proc/self/fd", TRUE, &dfd_iter, error))
+    return 0;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, NULL, error))
+        return 0;
+      if (dent == NULL)
+        break;
+      n++;
+    }
+
+  return n;
+}
+
+static void
+test_dir_sync_set (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autoptr(GLnxDirSyncSet) dir_sync = glnx_dir_sync_set_new ();
+  glnx_autofd int dfd = -1;
+  guint n_fds;
+
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, "dir-sync/a", 0755, &dfd, NULL, error))
+    return;
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, "dir-sync/b", 0755, NULL, error))
+    return;
+
+  n_fds = count_open_fds ();
+
+  for (guint i = 0; i < 100; i++)
+    {
+      g_auto(GLnxTmpfile) tmpf = { 0, };
+      g_autofree char *name = g_strdup_printf ("file%u", i);
+      g_autofree char *path = g_strdup_printf ("dir-sync/a/%s", name);
+
+      if (!glnx_open_tmpfile_linkable_at (dfd, ".", O_WRONLY | O_CLOEXEC, &tmpf, error))
+        return;
+      /* The same directory, reached through different paths */
+      if (i % 2 == 0)
+        {
+          if (!glnx_link_tmpfile_at_with_dir_sync (&tmpf, GLNX_LINK_TMPFILE_REPLACE,
+                                                   dfd, name, dir_sync, error))
+            return;
+        }
+      else
+        {
+          if (!glnx_link_tmpfile_at_with_dir_sync (&tmpf, GLNX_LINK_TMPFILE_REPLACE,
+                                                   AT_FDCWD, path, dir_sync, error))
+            return;
+        }
+    }
+
+  /* One fd for the one directory */
+  g_assert_cmpuint (count_open_fds (), ==, n_fds + 1);
+
+  if (!glnx_renameat_with_dir_sync (dfd, "file0", AT_FDCWD, "dir-sync/b/file0",
+                                    dir_sync, error))
+    return;
+  g_assert_cmpuint (count_open_fds (), ==, n_fds + 2);
+
+  if (!glnx_dir_sync_set_flush (dir_sync, error))
+    return;
+  g_assert_cmpuint (count_open_fds (), ==, n_fds);
+
+  /* The set can be used again after flushing */
+  if (!glnx_dir_sync_set_add (dir_sync, AT_FDCWD, "dir-sync", error))
+    return;
+  g_assert_cmpuint (count_open_fds (), ==, n_fds + 1);
+  if (!glnx_dir_sync_set_flush (dir_sync, error))
+    return;
+
+  g_assert_false (glnx_dir_sync_set_add (dir_sync, AT_FDCWD, "dir-sync/nonexistent", error));
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_clear_error (&local_error);
+}
+
+static void
+test_replace_batch (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autoptr(GLnxReplaceBatch) batch = glnx_replace_batch_new ();
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  /* More than are staged at once */
+  const guint n_files = 1500;
+  glnx_autofd int dfd = -1;
+  struct stat stbuf;
+
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, "replace-batch/sub", 0755, &dfd, NULL, error))
+    return;
+  g_clear_fd (&dfd, NULL);
+  if (!glnx_opendirat (AT_FDCWD, "replace-batch", TRUE, &dfd, error))
+    return;
+  if (!glnx_file_replace_contents_at (dfd, "file0", (const guint8 *) "old", 3,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+
+  for (guint i = 0; i < n_files; i++)
+    {
+      g_autofree char *name = g_strdup_printf ("%sfile%u", i % 2 ? "sub/" : "", i);
+
+      if (!glnx_replace_batch_add_contents (batch, dfd, name, (const guint8 *) name, -1,
+                                            0600, -1, -1, NULL, error))
+        return;
+    }
+
+  /* A tmpfile written by the caller */
+  if (!glnx_open_tmpfile_linkable_at (dfd, ".", O_WRONLY | O_CLOEXEC, &tmpf, error))
+    return;
+  if (glnx_loop_write (tmpf.fd, "tmpfile", 7) < 0)
+    return (void) glnx_throw_errno_prefix (error, "write");
+  if (!glnx_replace_batch_add_tmpfile (batch, &tmpf, dfd, "tmpfile", NULL, error))
+    return;
+  g_assert_false (tmpf.initialized);
+
+  if (!glnx_replace_batch_commit (batch, NULL, error))
+    return;
+  /* Committing an empty batch does nothing */
+  if (!glnx_replace_batch_commit (batch, NULL, error))
+    return;
+
+  for (guint i = 0; i < n_files; i++)
+    {
+      g_autofree char *name = g_strdup_printf ("%sfile%u", i % 2 ? "sub/" : "", i);
+      g_autofree char *contents = glnx_file_get_contents_utf8_at (dfd, name, NULL, NULL, error);
+
+      if (contents == NULL)
+        return;
+      g_assert_cmpstr (contents, ==, name);
+      if (!glnx_fstatat (dfd, name, &stbuf, 0, error))
+        return;
+      g_assert_cmpint (stbuf.st_mode & 07777, ==, 0600);
+    }
+
+  {
+    g_autofree char *contents = glnx_file_get_contents_utf8_at (dfd, "tmpfile", NULL, NULL, error);
+
+    g_assert_cmpstr (contents, ==, "tmpfile");
+  }
+
+  /* Uncommitted files are discarded */
+  if (!glnx_replace_batch_add_contents (batch, dfd, "discarded", (const guint8 *) "", 0,
+                                        -1, -1, -1, NULL, error))
+    return;
+  g_clear_pointer (&batch, glnx_replace_batch_free);
+  if (!glnx_fstatat_allow_noent (dfd, "discarded", &stbuf, 0, error))
+    return;
+  g_assert_cmpint (errno, ==, ENOENT);
+}
+
+static void
+benchmark_replace_batch (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autoptr(GLnxReplaceBatch) batch = glnx_replace_batch_new ();
+  const guint n_files = 2000;
+  glnx_autofd int dfd = -1;
+  double single_time, batch_time;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Not running benchmarks (use -m perf)");
+      return;
+    }
+
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, "replace-batch-benchmark", 0755, &dfd, NULL, error))
+    return;
+
+  g_test_timer_start ();
+  for (guint i = 0; i < n_files; i++)
+    {
+      g_autofree char *name = g_strdup_printf ("file%u", i);
+
+      if (!glnx_file_replace_contents_at (dfd, name, (const guint8 *) name, -1,
+                                          GLNX_FILE_REPLACE_DATASYNC_NEW, NULL, error))
+        return;
+    }
+  single_time = g_test_timer_elapsed ();
+
+  g_test_timer_start ();
+  for (guint i = 0; i < n_files; i++)
+    {
+      g_autofree char *name = g_strdup_printf ("file%u", i);
+
+      if (!glnx_replace_batch_add_contents (batch, dfd, name, (const guint8 *) name, -1,
+                                            -1, -1, -1, NULL, error))
+        return;
+    }
+  if (!glnx_replace_batch_commit (batch, NULL, error))
+    return;
+  batch_time = g_test_timer_elapsed ();
+
+  g_test_message ("%u files: %.3fs one at a time, %.3fs batched",
+                  n_files, single_time, batch_time);
+}
+
+static void
+test_tmpfile_pool (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autoptr(GLnxTmpfilePool) pool = NULL;
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  glnx_autofd int dfd = -1;
+  struct stat stbuf;
+  ino_t linked_ino;
+  glnx_autofd int linked_fd = -1;
+
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, "tmpfile-pool", 0755, &dfd, NULL, error))
+    return;
+  pool = glnx_tmpfile_pool_new (AT_FDCWD, "tmpfile-pool", O_RDWR | O_CLOEXEC, 4, error);
+  if (pool == NULL)
+    return;
+
+  /* More files than the pool holds */
+  for (guint i = 0; i < 20; i++)
+    {
+      g_autofree char *name = g_strdup_printf ("file%u", i);
+
+      if (!glnx_tmpfile_pool_acquire (pool, &tmpf, error))
+        return;
+      if (glnx_loop_write (tmpf.fd, name, strlen (name)) < 0)
+        return (void) glnx_throw_errno_prefix (error, "write");
+      if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_NOREPLACE, dfd, name, error))
+        return;
+      /* Linked files must not be reused */
+      glnx_tmpfile_pool_release (pool, &tmpf);
+      g_assert_false (tmpf.initialized);
+    }
+
+  for (guint i = 0; i < 20; i++)
+    {
+      g_autofree char *name = g_strdup_printf ("file%u", i);
+      g_autofree char *contents = glnx_file_get_contents_utf8_at (dfd, name, NULL, NULL, error);
+
+      if (contents == NULL)
+        return;
+      g_assert_cmpstr (contents, ==, name);
+    }
+
+  /* Unlinked files are reused, but always come back empty */
+  for (guint i = 0; i < 20; i++)
+    {
+      if (!glnx_tmpfile_pool_acquire (pool, &tmpf, error))
+        return;
+      if (!glnx_fstat (tmpf.fd, &stbuf, error))
+        return;
+      g_assert_cmpint (stbuf.st_size, ==, 0);
+      g_assert_cmpint (stbuf.st_mode & 07777, ==, 0600);
+      g_assert_cmpint (lseek (tmpf.fd, 0, SEEK_CUR), ==, 0);
+
+      if (glnx_loop_write (tmpf.fd, "discarded", 9) < 0)
+        return (void) glnx_throw_errno_prefix (error, "write");
+      if (fchmod (tmpf.fd, 0644) < 0)
+        return (void) glnx_throw_errno_prefix (error, "fchmod");
+      glnx_tmpfile_pool_release (pool, &tmpf);
+    }
+
+  /* Files from elsewhere are just cleared */
+  if (!glnx_open_tmpfile_linkable_at (dfd, ".", O_WRONLY | O_CLOEXEC, &tmpf, error))
+    return;
+  glnx_tmpfile_pool_release (pool, &tmpf);
+  g_assert_false (tmpf.initialized);
+
+  /* A linked file whose name is gone again looks unused, but must not be
+   * reused either: whoever removed the name may still have it open */
+  if (!glnx_tmpfile_pool_acquire (pool, &tmpf, error))
+    return;
+  if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_NOREPLACE, dfd, "gone", error))
+    return;
+  if (!glnx_unlinkat (dfd, "gone", 0, error))
+    return;
+  if (!glnx_fstat (tmpf.fd, &stbuf, error))
+    return;
+  g_assert_cmpint (stbuf.st_nlink, ==, 0);
+  linked_ino = stbuf.st_ino;
+  /* Keep the inode alive, so that its number can't be reused */
+  linked_fd = fcntl (tmpf.fd, F_DUPFD_CLOEXEC, 3);
+  g_assert_cmpint (linked_fd, >=, 0);
+  glnx_tmpfile_pool_release (pool, &tmpf);
+  for (guint i = 0; i < 8; i++)
+    {
+      if (!glnx_tmpfile_pool_acquire (pool, &tmpf, error))
+        return;
+      if (!glnx_fstat (tmpf.fd, &stbuf, error))
+        return;
+      g_assert_cmpuint (stbuf.st_ino, !=, linked_ino);
+      glnx_tmpfile_clear (&tmpf);
+    }
+}
+
+static void
+benchmark_tmpfile_pool (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autoptr(GLnxTmpfilePool) pool = NULL;
+  const guint n_files = 20000;
+  glnx_autofd int dfd = -1;
+  double single_time, pool_time;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Not running benchmarks (use -m perf)");
+      return;
+    }
+
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, "tmpfile-pool-benchmark", 0755, &dfd, NULL, error))
+    return;
+  pool = glnx_tmpfile_pool_new (dfd, ".", O_WRONLY | O_CLOEXEC, 64, error);
+  if (pool == NULL)
+    return;
+
+  g_test_timer_start ();
+  for (guint i = 0; i < n_files; i++)
+    {
+      g_auto(GLnxTmpfile) tmpf = { 0, };
+      char name[32];
+
+      g_snprintf (name, sizeof (name), "single%u", i);
+      if (!glnx_open_tmpfile_linkable_at (dfd, ".", O_WRONLY | O_CLOEXEC, &tmpf, error))
+        return;
+      if (glnx_loop_write (tmpf.fd, name, strlen (name)) < 0)
+        return (void) glnx_throw_errno_prefix (error, "write");
+      if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_NOREPLACE, dfd, name, error))
+        return;
+    }
+  single_time = g_test_timer_elapsed ();
+
+  g_test_timer_start ();
+  for (guint i = 0; i < n_files; i++)
+    {
+      g_auto(GLnxTmpfile) tmpf = { 0, };
+      char name[32];
+
+      g_snprintf (name, sizeof (name), "pooled%u", i);
+      if (!glnx_tmpfile_pool_acquire (pool, &tmpf, error))
+        return;
+      if (glnx_loop_write (tmpf.fd, name, strlen (name)) < 0)
+        return (void) glnx_throw_errno_prefix (error, "write");
+      if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_NOREPLACE, dfd, name, error))
+        return;
+      glnx_tmpfile_pool_release (pool, &tmpf);
+    }
+  pool_time = g_test_timer_elapsed ();
+
+  g_test_message ("%u files: %.3fs opening each, %.3fs pooled",
+                  n_files, single_time, pool_time);
+}
+
+/* Check that the digest of a copy matches the copied data */
+static void
+assert_copy_digest (const char        *src,
+                    const char        *dest,
+                    GLnxFileCopyFlags  copyflags)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_auto(GLnxDigest) digest = { 0, };
+  g_auto(GLnxDigest) expected = { 0, };
+  glnx_autofd int fd = -1;
+
+  glnx_digest_init (&digest, GLNX_DIGEST_SHA256 | GLNX_DIGEST_CRC32C);
+  if (!glnx_file_copy_at_with_digest (AT_FDCWD, src, NULL, AT_FDCWD, dest,
+                                      copyflags | GLNX_FILE_COPY_NOXATTRS,
+                                      &digest, NULL, error))
+    return;
+
+  if (!glnx_openat_rdonly (AT_FDCWD, dest, FALSE, &fd, error))
+    return;
+  glnx_digest_init (&expected, GLNX_DIGEST_SHA256 | GLNX_DIGEST_CRC32C);
+  if (!glnx_fd_readall_digest (fd, &expected, NULL, error))
+    return;
+
+  g_assert_cmpuint (glnx_digest_get_size (&digest), ==, glnx_digest_get_size (&expected));
+  g_assert_cmphex (glnx_digest_get_crc32c (&digest), ==, glnx_digest_get_crc32c (&expected));
+  g_assert_cmpstr (glnx_digest_get_sha256_string (&digest), ==,
+                   glnx_digest_get_sha256_string (&expected));
+}
+
+static void
+test_filecopy_digest (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  const gsize size = 20 * 1024 * 1024 + 3;
+  g_autofree guint8 *buf = g_malloc (size);
+
+  for (gsize i = 0; i < size; i++)
+    buf[i] = g_rand_int (rand);
+  if (!glnx_file_replace_contents_at (AT_FDCWD, "digest-src", buf, size,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+
+  /* Whatever the kernel can do for this filesystem */
+  assert_copy_digest ("digest-src", "digest-copy", 0);
+  assert_copy_digest ("digest-src", "digest-copy-sparse", GLNX_FILE_COPY_SPARSE);
+
+  /* procfs files have a size of 0, so they are always read and written
+   * through userspace */
+  assert_copy_digest ("/proc/self/status", "digest-copy-status", 0);
+}
+
+typedef struct
+{
+  guint64 last;
+  guint64 total;
+  guint n_calls;
+  GCancellable *cancel_after_first;
+} ChunkedProgress;
+
+static void
+chunked_progress_cb (guint64  bytes_copied,
+                     guint64  total_bytes,
+                     gpointer user_data)
+{
+  ChunkedProgress *progress = user_data;
+
+  g_assert_cmpuint (bytes_copied, >=, progress->last);
+  g_assert_cmpuint (bytes_copied, <=, total_bytes);
+  progress->last = bytes_copied;
+  progress->total = total_bytes;
+  progress->n_calls++;
+
+  if (progress->cancel_after_first != NULL)
+    g_cancellable_cancel (progress->cancel_after_first);
+}
+
+static void
+test_filecopy_chunked (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  static const guint thread_counts[] = { 1, 4, 0 };
+  const gsize size = 4 * 1024 * 1024 + 123;
+  g_autofree guint8 *data = g_malloc (size);
+  glnx_autofd int src_fd = -1;
+
+  for (gsize i = 0; i < size; i++)
+    data[i] = (guint8) (i * 7 + i / 4096);
+
+  if (!glnx_file_replace_contents_at (AT_FDCWD, "chunked-src", data, size,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+  if (!glnx_openat_rdonly (AT_FDCWD, "chunked-src", FALSE, &src_fd, error))
+    return;
+
+  for (gsize i = 0; i < G_N_ELEMENTS (thread_counts); i++)
+    {
+      ChunkedProgress progress = { 0, };
+      glnx_autofd int dest_fd = -1;
+      glnx_autofd int check_fd = -1;
+      g_autoptr(GBytes) bytes = NULL;
+
+      /* Longer than the source, to check that it is truncated */
+      if (!glnx_file_replace_contents_at (AT_FDCWD, "chunked-dest", data, size,
+                                          GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+        return;
+      if (TEMP_FAILURE_RETRY (truncate ("chunked-dest", size + 4096)) < 0)
+        return (void) glnx_throw_errno_prefix (error, "truncate");
+      dest_fd = openat (AT_FDCWD, "chunked-dest", O_WRONLY | O_CLOEXEC);
+      if (dest_fd < 0)
+        return (void) glnx_throw_errno_prefix (error, "openat");
+
+      if (!glnx_regfile_copy_bytes_chunked (src_fd, dest_fd, 256 * 1024, thread_counts[i],
+                                            chunked_progress_cb, &progress, NULL, error))
+        return;
+
+      g_assert_cmpuint (progress.n_calls, >, 0);
+      g_assert_cmpuint (progress.last, ==, size);
+      g_assert_cmpuint (progress.total, ==, size);
+      /* File offsets are untouched */
+      g_assert_cmpint (lseek (src_fd, 0, SEEK_CUR), ==, 0);
+      g_assert_cmpint (lseek (dest_fd, 0, SEEK_CUR), ==, 0);
+
+      if (!glnx_openat_rdonly (AT_FDCWD, "chunked-dest", FALSE, &check_fd, error))
+        return;
+      bytes = glnx_fd_readall_bytes (check_fd, NULL, error);
+      if (bytes == NULL)
+        return;
+      g_assert_cmpmem (g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes),
+                       data, size);
+    }
+}
+
+static void
+test_filecopy_chunked_cancelled (void)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  ChunkedProgress progress = { 0, };
+  const gsize size = 1024 * 1024;
+  g_autofree guint8 *data = g_malloc0 (size);
+  glnx_autofd int src_fd = -1;
+  glnx_autofd int dest_fd = -1;
+
+  if (!glnx_file_replace_contents_at (AT_FDCWD, "chunked-cancel-src", data, size,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+  if (!glnx_openat_rdonly (AT_FDCWD, "chunked-cancel-src", FALSE, &src_fd, error))
+    return;
+  dest_fd = openat (AT_FDCWD, "chunked-cancel-dest", O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+  if (dest_fd < 0)
+    return (void) glnx_throw_errno_prefix (error, "openat");
+
+  progress.cancel_after_first = cancellable;
+  g_assert_false (glnx_regfile_copy_bytes_chunked (src_fd, dest_fd, 4096, 1,
+                                                   chunked_progress_cb, &progress,
+                                                   cancellable, error));
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_clear_error (&local_error);
+  g_assert_cmpuint (progress.n_calls, ==, 1);
+}
+
 static void
 test_name_to_handle_at (void)
 {
@@ -672,14 +1809,32 @@ int main (int argc, char **argv)
   g_test_add_func ("/close", test_close);
   g_test_add_func ("/close/ebadf", test_close_ebadf);
   g_test_add_func ("/tmpfile", test_tmpfile);
+  g_test_add_func ("/tmpfile/replace", test_tmpfile_replace);
   g_test_add_func ("/stdio-file", test_stdio_file);
   g_test_add_func ("/filecopy", test_filecopy);
   g_test_add_func ("/filecopy-procfs", test_filecopy_procfs);
+  g_test_add_func ("/filecopy/buffered", test_regfile_copy_bytes_buffered);
+  g_test_add_func ("/filecopy/chunked", test_filecopy_chunked);
+  g_test_add_func ("/filecopy/chunked/cancelled", test_filecopy_chunked_cancelled);
+  g_test_add_func ("/filecopy/sparse", test_filecopy_sparse);
+  g_test_add_func ("/filecopy/digest", test_filecopy_digest);
   g_test_add_func ("/renameat2-noreplace", test_renameat2_noreplace);
   g_test_add_func ("/renameat2-exchange", test_renameat2_exchange);
   g_test_add_func ("/fstat", test_fstatat);
+  g_test_add_func ("/statx-many", test_statx_many);
   g_test_add_func ("/name-to-handle-at", test_name_to_handle_at);
   g_test_add_func ("/fd-reopen", test_fd_reopen);
+  g_test_add_func ("/fd-map-bytes", test_fd_map_bytes);
+  g_test_add_func ("/replace-batch", test_replace_batch);
+  g_test_add_func ("/replace-batch/benchmark", benchmark_replace_batch);
+  g_test_add_func ("/dir-sync-set", test_dir_sync_set);
+  g_test_add_func ("/tmpfile-pool", test_tmpfile_pool);
+  g_test_add_func ("/tmpfile-pool/benchmark", benchmark_tmpfile_pool);
+  g_test_add_func ("/loop-writev", test_loop_writev);
+  g_test_add_func ("/replace-contents-iov", test_replace_contents_iov);
+  g_test_add_func ("/atomic-writer", test_atomic_writer);
+  g_test_add_func ("/atomic-writer/failed", test_atomic_writer_failed);
+  g_test_add_func ("/atomic-writer/stream-failed", test_atomic_writer_stream_failed);
 
   ret = g_test_run();
 
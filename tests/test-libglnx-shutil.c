@@ -87,6 +87,531 @@ test_mkdir_p_enoent (void)
   g_clear_error (&local_error);
 }
 
+static void
+test_mkdir_p_deep (void)
+{
+  _GLNX_TEST_SCOPED_TEMP_DIR;
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  struct stat stbuf;
+
+  if (!glnx_ensure_dir (AT_FDCWD, "a", 0755, error))
+    return;
+
+  /* Some of the parents exist already, some don't */
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, "a//b/c/./d/e/f/", 0755, NULL, error))
+    return;
+  if (!glnx_fstatat (AT_FDCWD, "a/b/c/d/e/f", &stbuf, AT_SYMLINK_NOFOLLOW, error))
+    return;
+  g_assert_true (S_ISDIR (stbuf.st_mode));
+
+  /* Existing directories are fine */
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, "a/b/c/d/e/f", 0755, NULL, error))
+    return;
+
+  /* The error is about the parent that couldn't be created, not about
+   * the missing directories below it */
+  if (symlinkat ("nowhere", AT_FDCWD, "a/dangling") < 0)
+    return (void) glnx_throw_errno_prefix (error, "symlinkat");
+  g_assert_false (glnx_shutil_mkdir_p_at (AT_FDCWD, "a/dangling/x/y/z", 0755, NULL, error));
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_assert_nonnull (strstr (local_error->message, "mkdir(a/dangling/x)"));
+  g_clear_error (&local_error);
+}
+
+static void
+test_rm_rf_many_files (void)
+{
+  _GLNX_TEST_SCOPED_TEMP_DIR;
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  glnx_autofd int dfd = -1;
+  struct stat stbuf;
+
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, "tree/sub", 0755, &dfd, NULL, error))
+    return;
+
+  /* Enough to need more than one batch when using io_uring */
+  for (guint i = 0; i < 1000; i++)
+    {
+      char name[32];
+      glnx_autofd int fd = -1;
+
+      g_snprintf (name, sizeof (name), "file%u", i);
+      fd = openat (dfd, name, O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+      if (fd < 0)
+        return (void) glnx_throw_errno_prefix (error, "openat(%s)", name);
+    }
+
+  if (!glnx_shutil_rm_rf_at (AT_FDCWD, "tree", NULL, error))
+    return;
+  g_assert_cmpint (fstatat (AT_FDCWD, "tree", &stbuf, AT_SYMLINK_NOFOLLOW), ==, -1);
+  g_assert_cmpint (errno, ==, ENOENT);
+}
+
+static gpointer
+cancel_thread (gpointer data)
+{
+  g_cancellable_cancel (data);
+  return NULL;
+}
+
+static guint
+count_entries (int         dfd,
+               const char *path)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  guint n = 0;
+
+  if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &dfd_iter, NULL))
+    return 0;
+  while (TRUE)
+    {
+      struct dirent *dent;
+
+      g_assert_true (glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, NULL, NULL));
+      if (dent == NULL)
+        break;
+      n++;
+    }
+
+  return n;
+}
+
+static void
+test_rm_rf_cancelled (void)
+{
+  _GLNX_TEST_SCOPED_TEMP_DIR;
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+
+  /* Cancelling right away sometimes lands while the first batch of
+   * unlinkat()s is being collected; those must not be left behind on this
+   * thread's ring, where the next user would submit them */
+  for (guint attempt = 0; attempt < 20; attempt++)
+    {
+      g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+      glnx_autofd int dfd = -1;
+      GThread *thread;
+      guint n_left;
+
+      if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, "tree", 0755, &dfd, NULL, error))
+        return;
+      for (guint i = 0; i < 300; i++)
+        {
+          char name[32];
+          glnx_autofd int fd = -1;
+
+          g_snprintf (name, sizeof (name), "file%u", i);
+          fd = openat (dfd, name, O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+          if (fd < 0)
+            return (void) glnx_throw_errno_prefix (error, "openat(%s)", name);
+        }
+
+      thread = g_thread_new ("cancel", cancel_thread, cancellable);
+      if (!glnx_shutil_rm_rf_at (AT_FDCWD, "tree", cancellable, &local_error))
+        {
+          g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+          g_clear_error (&local_error);
+        }
+      g_thread_join (thread);
+      n_left = count_entries (AT_FDCWD, "tree");
+
+      /* Use the ring on this thread again; nothing else may be removed */
+      if (!glnx_shutil_mkdir_p_at (AT_FDCWD, "other/a/b/c", 0755, NULL, error))
+        return;
+      g_assert_cmpuint (count_entries (AT_FDCWD, "tree"), ==, n_left);
+
+      if (!glnx_shutil_rm_rf_at (AT_FDCWD, "other", NULL, error))
+        return;
+      if (!glnx_shutil_rm_rf_at (AT_FDCWD, "tree", NULL, error))
+        return;
+    }
+}
+
+/* Create a tree of @depth levels with @width subdirectories and @n_files
+ * regular files in each directory. */
+static gboolean
+create_tree (int       dfd,
+             guint     depth,
+             guint     width,
+             guint     n_files,
+             GError  **error)
+{
+  for (guint i = 0; i < n_files; i++)
+    {
+      char name[32];
+
+      g_snprintf (name, sizeof (name), "file%u", i);
+      if (!glnx_file_replace_contents_at (dfd, name, (const guint8 *) "x", 1,
+                                          GLNX_FILE_REPLACE_NODATASYNC,
+                                          NULL, error))
+        return FALSE;
+    }
+
+  if (depth == 0)
+    return TRUE;
+
+  for (guint i = 0; i < width; i++)
+    {
+      glnx_autofd int subdfd = -1;
+      char name[32];
+
+      g_snprintf (name, sizeof (name), "dir%u", i);
+      if (!glnx_ensure_dir (dfd, name, 0755, error))
+        return FALSE;
+      if (!glnx_opendirat (dfd, name, FALSE, &subdfd, error))
+        return FALSE;
+      if (!create_tree (subdfd, depth - 1, width, n_files, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+test_rm_rf_parallel (void)
+{
+  _GLNX_TEST_SCOPED_TEMP_DIR;
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  glnx_autofd int dfd = -1;
+  struct stat stbuf;
+
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, "tree/a/b", 0755, NULL, error))
+    return;
+  if (!glnx_opendirat (AT_FDCWD, "tree", FALSE, &dfd, error))
+    return;
+  if (!create_tree (dfd, 3, 4, 3, error))
+    return;
+
+  /* Symlinks to directories must be removed, not followed */
+  if (!glnx_ensure_dir (AT_FDCWD, "outside", 0755, error))
+    return;
+  if (!glnx_file_replace_contents_at (AT_FDCWD, "outside/keep", (const guint8 *) "", 0,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+  if (symlinkat ("../../../outside", dfd, "a/b/link") < 0)
+    return (void) glnx_throw_errno_prefix (error, "symlinkat");
+
+  if (!glnx_shutil_rm_rf_at_parallel (AT_FDCWD, "tree", 4, NULL, error))
+    return;
+
+  g_assert_cmpint (fstatat (AT_FDCWD, "tree", &stbuf, AT_SYMLINK_NOFOLLOW), ==, -1);
+  g_assert_cmpint (errno, ==, ENOENT);
+  if (!glnx_fstatat (AT_FDCWD, "outside/keep", &stbuf, 0, error))
+    return;
+
+  /* Non-directories and nonexistent paths behave as in the serial version */
+  if (symlinkat ("outside", AT_FDCWD, "link") < 0)
+    return (void) glnx_throw_errno_prefix (error, "symlinkat");
+  if (!glnx_shutil_rm_rf_at_parallel (AT_FDCWD, "link", 4, NULL, error))
+    return;
+  if (!glnx_fstatat (AT_FDCWD, "outside/keep", &stbuf, 0, error))
+    return;
+  if (!glnx_shutil_rm_rf_at_parallel (AT_FDCWD, "nonexistent", 0, NULL, error))
+    return;
+}
+
+static void
+test_rm_rf_parallel_cancelled (void)
+{
+  _GLNX_TEST_SCOPED_TEMP_DIR;
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  glnx_autofd int dfd = -1;
+
+  if (!glnx_ensure_dir (AT_FDCWD, "tree", 0755, error))
+    return;
+  if (!glnx_opendirat (AT_FDCWD, "tree", FALSE, &dfd, error))
+    return;
+  if (!create_tree (dfd, 2, 3, 1, error))
+    return;
+
+  g_cancellable_cancel (cancellable);
+  glnx_shutil_rm_rf_at_parallel (AT_FDCWD, "tree", 4, cancellable, error);
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_clear_error (&local_error);
+
+  if (!glnx_shutil_rm_rf_at_parallel (AT_FDCWD, "tree", 4, NULL, error))
+    return;
+}
+
+static void
+benchmark_rm_rf_one (const char *desc,
+                     guint       depth,
+                     guint       width,
+                     guint       n_files,
+                     guint       n_threads)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  glnx_autofd int dfd = -1;
+  double elapsed;
+
+  if (!glnx_ensure_dir (AT_FDCWD, "tree", 0755, error))
+    return;
+  if (!glnx_opendirat (AT_FDCWD, "tree", FALSE, &dfd, error))
+    return;
+  if (!create_tree (dfd, depth, width, n_files, error))
+    return;
+
+  g_test_timer_start ();
+  if (n_threads == 1)
+    {
+      if (!glnx_shutil_rm_rf_at (AT_FDCWD, "tree", NULL, error))
+        return;
+    }
+  else
+    {
+      if (!glnx_shutil_rm_rf_at_parallel (AT_FDCWD, "tree", n_threads, NULL, error))
+        return;
+    }
+  elapsed = g_test_timer_elapsed ();
+
+  g_test_message ("%s tree, %u thread(s): %.3f s", desc, n_threads, elapsed);
+}
+
+/* Run with `-m perf`; set TMPDIR to choose the filesystem being measured. */
+static void
+benchmark_rm_rf_parallel (void)
+{
+  _GLNX_TEST_SCOPED_TEMP_DIR;
+  static const guint thread_counts[] = { 1, 2, 4, 8, 0 };
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Not running benchmarks (use -m perf)");
+      return;
+    }
+
+  for (gsize i = 0; i < G_N_ELEMENTS (thread_counts); i++)
+    {
+      /* Wide: 2 levels of 64 subdirectories with 16 files each */
+      benchmark_rm_rf_one ("wide", 2, 64, 16, thread_counts[i]);
+      /* Deep: 12 levels of binary fan-out with 4 files each */
+      benchmark_rm_rf_one ("deep", 12, 2, 4, thread_counts[i]);
+    }
+}
+
+static void
+assert_same_metadata (int          src_dfd,
+                      int          dest_dfd,
+                      const char  *path)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  struct stat src_stbuf, dest_stbuf;
+
+  if (!glnx_fstatat (src_dfd, path, &src_stbuf, AT_SYMLINK_NOFOLLOW, error))
+    return;
+  if (!glnx_fstatat (dest_dfd, path, &dest_stbuf, AT_SYMLINK_NOFOLLOW, error))
+    return;
+
+  g_assert_cmpuint (src_stbuf.st_mode, ==, dest_stbuf.st_mode);
+  g_assert_cmpuint (src_stbuf.st_uid, ==, dest_stbuf.st_uid);
+  g_assert_cmpuint (src_stbuf.st_gid, ==, dest_stbuf.st_gid);
+  if (!S_ISLNK (src_stbuf.st_mode))
+    g_assert_cmpint (src_stbuf.st_mtime, ==, dest_stbuf.st_mtime);
+  if (S_ISREG (src_stbuf.st_mode))
+    g_assert_cmpint (src_stbuf.st_size, ==, dest_stbuf.st_size);
+}
+
+static void
+test_cp_a (void)
+{
+  _GLNX_TEST_SCOPED_TEMP_DIR;
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  static const char * const paths[] = {
+    ".", "file0", "dir0", "dir0/file1", "dir1/dir2", "ro", "ro/secret",
+    "link", "fifo", "a/hardlink", "b/hardlink",
+  };
+  glnx_autofd int src_dfd = -1;
+  glnx_autofd int dest_dfd = -1;
+  struct timespec ts[2] = { { 1000000000, 0 }, { 1000000000, 0 } };
+  struct stat a_stbuf, b_stbuf;
+  g_autofree char *target = NULL;
+  g_autofree char *contents = NULL;
+  gboolean have_xattrs;
+
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, "src", 0755, &src_dfd, NULL, error))
+    return;
+  if (!create_tree (src_dfd, 3, 3, 2, error))
+    return;
+  if (!glnx_shutil_mkdir_p_at (src_dfd, "a", 0755, NULL, error))
+    return;
+  if (!glnx_shutil_mkdir_p_at (src_dfd, "b", 0755, NULL, error))
+    return;
+  if (!glnx_file_replace_contents_at (src_dfd, "a/hardlink", (const guint8 *) "linked", -1,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+  if (linkat (src_dfd, "a/hardlink", src_dfd, "b/hardlink", 0) < 0)
+    return (void) glnx_throw_errno_prefix (error, "linkat");
+  if (symlinkat ("dir0/file1", src_dfd, "link") < 0)
+    return (void) glnx_throw_errno_prefix (error, "symlinkat");
+  if (mkfifoat (src_dfd, "fifo", 0640) < 0)
+    return (void) glnx_throw_errno_prefix (error, "mkfifoat");
+  if (!glnx_ensure_dir (src_dfd, "ro", 0755, error))
+    return;
+  if (!glnx_file_replace_contents_with_perms_at (src_dfd, "ro/secret", (const guint8 *) "s", 1,
+                                                 0400, (uid_t) -1, (gid_t) -1,
+                                                 GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+  if (utimensat (src_dfd, "dir0/file1", ts, 0) < 0)
+    return (void) glnx_throw_errno_prefix (error, "utimensat");
+  if (utimensat (src_dfd, "dir0", ts, 0) < 0)
+    return (void) glnx_throw_errno_prefix (error, "utimensat");
+
+  have_xattrs = fsetxattr (src_dfd, "user.test", "value", 5, 0) == 0;
+
+  /* A read-only directory must still be populated */
+  if (fchmodat (src_dfd, "ro", 0555, 0) < 0)
+    return (void) glnx_throw_errno_prefix (error, "fchmodat");
+
+  if (!glnx_shutil_cp_a_at (AT_FDCWD, "src", AT_FDCWD, "dest",
+                            GLNX_FILE_COPY_NOCHOWN, 4, NULL, error))
+    return;
+  if (!glnx_opendirat (AT_FDCWD, "dest", FALSE, &dest_dfd, error))
+    return;
+
+  for (gsize i = 0; i < G_N_ELEMENTS (paths); i++)
+    assert_same_metadata (src_dfd, dest_dfd, paths[i]);
+  assert_same_metadata (src_dfd, dest_dfd, "dir2/dir1/dir0/file1");
+
+  target = glnx_readlinkat_malloc (dest_dfd, "link", NULL, error);
+  if (target == NULL)
+    return;
+  g_assert_cmpstr (target, ==, "dir0/file1");
+
+  contents = glnx_file_get_contents_utf8_at (dest_dfd, "ro/secret", NULL, NULL, error);
+  if (contents == NULL)
+    return;
+  g_assert_cmpstr (contents, ==, "s");
+
+  /* Hard links are preserved */
+  if (!glnx_fstatat (dest_dfd, "a/hardlink", &a_stbuf, 0, error))
+    return;
+  if (!glnx_fstatat (dest_dfd, "b/hardlink", &b_stbuf, 0, error))
+    return;
+  g_assert_cmpuint (a_stbuf.st_ino, ==, b_stbuf.st_ino);
+  g_assert_cmpuint (a_stbuf.st_nlink, ==, 2);
+
+  if (have_xattrs)
+    {
+      char value[16];
+      ssize_t len = fgetxattr (dest_dfd, "user.test", value, sizeof (value));
+
+      g_assert_cmpint (len, ==, 5);
+      g_assert_cmpmem (value, len, "value", 5);
+    }
+
+  /* Single files can be copied too */
+  if (!glnx_shutil_cp_a_at (src_dfd, "file0", dest_dfd, "file0-copy",
+                            GLNX_FILE_COPY_NOCHOWN, 0, NULL, error))
+    return;
+  if (!glnx_fstatat (dest_dfd, "file0-copy", &a_stbuf, 0, error))
+    return;
+  g_assert_cmpint (a_stbuf.st_size, ==, 1);
+
+  if (fchmodat (src_dfd, "ro", 0755, 0) < 0)
+    return (void) glnx_throw_errno_prefix (error, "fchmodat");
+  if (fchmodat (dest_dfd, "ro", 0755, 0) < 0)
+    return (void) glnx_throw_errno_prefix (error, "fchmodat");
+}
+
+static void
+test_cp_a_exists (void)
+{
+  _GLNX_TEST_SCOPED_TEMP_DIR;
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  g_autofree char *contents = NULL;
+  glnx_autofd int src_dfd = -1;
+
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, "src", 0755, &src_dfd, NULL, error))
+    return;
+  if (!create_tree (src_dfd, 1, 2, 2, error))
+    return;
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, "dest/dir0", 0755, NULL, error))
+    return;
+  if (!glnx_file_replace_contents_at (AT_FDCWD, "dest/dir0/file1", (const guint8 *) "old", -1,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+
+  /* Non-directories in the way of directories are replaced too */
+  if (!glnx_file_replace_contents_at (AT_FDCWD, "dest/dir1", (const guint8 *) "old", -1,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return;
+
+  g_assert_false (glnx_shutil_cp_a_at (AT_FDCWD, "src", AT_FDCWD, "dest",
+                                       GLNX_FILE_COPY_NOCHOWN, 2, NULL, error));
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_EXISTS);
+  g_clear_error (&local_error);
+
+  if (!glnx_shutil_cp_a_at (AT_FDCWD, "src", AT_FDCWD, "dest",
+                            GLNX_FILE_COPY_NOCHOWN | GLNX_FILE_COPY_OVERWRITE,
+                            2, NULL, error))
+    return;
+  contents = glnx_file_get_contents_utf8_at (AT_FDCWD, "dest/dir0/file1", NULL, NULL, error);
+  if (contents == NULL)
+    return;
+  g_assert_cmpstr (contents, ==, "x");
+  g_clear_pointer (&contents, g_free);
+  contents = glnx_file_get_contents_utf8_at (AT_FDCWD, "dest/dir1/file1", NULL, NULL, error);
+  if (contents == NULL)
+    return;
+  g_assert_cmpstr (contents, ==, "x");
+}
+
+static void
+benchmark_cp_a_one (const char *desc,
+                    guint       depth,
+                    guint       width,
+                    guint       n_files,
+                    guint       n_threads)
+{
+  _GLNX_TEST_DECLARE_ERROR(local_error, error);
+  glnx_autofd int dfd = -1;
+  double elapsed;
+
+  if (!glnx_ensure_dir (AT_FDCWD, "tree", 0755, error))
+    return;
+  if (!glnx_opendirat (AT_FDCWD, "tree", FALSE, &dfd, error))
+    return;
+  if (!create_tree (dfd, depth, width, n_files, error))
+    return;
+
+  g_test_timer_start ();
+  if (!glnx_shutil_cp_a_at (AT_FDCWD, "tree", AT_FDCWD, "copy",
+                            GLNX_FILE_COPY_NOCHOWN, n_threads, NULL, error))
+    return;
+  elapsed = g_test_timer_elapsed ();
+
+  g_test_message ("cp -a %s tree, %u thread(s): %.3f s", desc, n_threads, elapsed);
+
+  if (!glnx_shutil_rm_rf_at (AT_FDCWD, "tree", NULL, error))
+    return;
+  if (!glnx_shutil_rm_rf_at (AT_FDCWD, "copy", NULL, error))
+    return;
+}
+
+/* Run with `-m perf`; set TMPDIR to choose the filesystem being measured,
+ * e.g. a tmpfs, or a btrfs image mounted via a loop device to measure
+ * reflinks. */
+static void
+benchmark_cp_a (void)
+{
+  _GLNX_TEST_SCOPED_TEMP_DIR;
+  static const guint thread_counts[] = { 1, 2, 4, 8, 0 };
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Not running benchmarks (use -m perf)");
+      return;
+    }
+
+  for (gsize i = 0; i < G_N_ELEMENTS (thread_counts); i++)
+    {
+      /* Same shapes as the rm -rf benchmark, but smaller, since every
+       * file is also read */
+      benchmark_cp_a_one ("wide", 2, 32, 8, thread_counts[i]);
+      benchmark_cp_a_one ("deep", 10, 2, 2, thread_counts[i]);
+    }
+}
+
 int
 main (int    argc,
       char **argv)
@@ -95,8 +620,17 @@ main (int    argc,
 
   g_test_init (&argc, &argv, NULL);
 
+  g_test_add_func ("/cp-a", test_cp_a);
+  g_test_add_func ("/cp-a/exists", test_cp_a_exists);
+  g_test_add_func ("/cp-a/benchmark", benchmark_cp_a);
+  g_test_add_func ("/mkdir-p/deep", test_mkdir_p_deep);
   g_test_add_func ("/mkdir-p/enoent", test_mkdir_p_enoent);
   g_test_add_func ("/mkdir-p/parent-unsuitable", test_mkdir_p_parent_unsuitable);
+  g_test_add_func ("/rm-rf/many-files", test_rm_rf_many_files);
+  g_test_add_func ("/rm-rf/cancelled", test_rm_rf_cancelled);
+  g_test_add_func ("/rm-rf/parallel", test_rm_rf_parallel);
+  g_test_add_func ("/rm-rf/parallel/cancelled", test_rm_rf_parallel_cancelled);
+  g_test_add_func ("/rm-rf/parallel/benchmark", benchmark_rm_rf_parallel);
 
   ret = g_test_run();
 